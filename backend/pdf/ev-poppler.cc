@@ -21,8 +21,12 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <gtk/gtk.h>
 #include <poppler.h>
 #include <poppler-document.h>
@@ -36,6 +40,7 @@
 #endif
 #include <cairo-script.h>
 #include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
 
 #include "ev-poppler.h"
 #include "ev-file-exporter.h"
@@ -56,6 +61,7 @@
 #include "ev-transition-effect.h"
 #include "ev-attachment.h"
 #include "ev-image.h"
+#include "ev-debug.h"
 
 #include <libxml/tree.h>
 #include <libxml/parser.h>
@@ -104,6 +110,16 @@ struct _PdfDocument
 	gchar *password;
 	gboolean forms_modified;
 	gboolean annots_modified;
+	/* The document was changed since it was loaded, its file no
+	 * longer shows what it does even once the changes are saved */
+	gboolean diverged;
+
+	/* The file the document was loaded from, its size then, and
+	 * its size and modification time after the last save */
+	gchar   *filename;
+	goffset  original_size;
+	goffset  file_size;
+	gint64   file_mtime;
 
 	PopplerFontInfo *font_info;
 	PopplerFontsIter *fonts_iter;
@@ -113,6 +129,9 @@ struct _PdfDocument
 	PdfPrintContext *print_ctx;
 
 	GHashTable *annots;
+	/* Annotation changes queued by an open transaction */
+	guint       annots_transaction_depth;
+	GPtrArray  *annot_ops;
 };
 
 static void pdf_document_security_iface_init             (EvDocumentSecurityInterface    *iface);
@@ -188,6 +207,11 @@ pdf_document_dispose (GObject *object)
 		pdf_document->annots = NULL;
 	}
 
+	if (pdf_document->annot_ops) {
+		g_ptr_array_free (pdf_document->annot_ops, TRUE);
+		pdf_document->annot_ops = NULL;
+	}
+
 	if (pdf_document->document) {
 		g_object_unref (pdf_document->document);
 	}
@@ -200,6 +224,8 @@ pdf_document_dispose (GObject *object)
 		poppler_fonts_iter_free (pdf_document->fonts_iter);
 	}
 
+	g_clear_pointer (&pdf_document->filename, g_free);
+
 	G_OBJECT_CLASS (pdf_document_parent_class)->dispose (object);
 }
 
@@ -236,6 +262,18 @@ convert_error (GError  *poppler_error,
 }
 
 
+/* Copies of the document opened again from its file only render what
+ * @pdf_document does until it's changed */
+static void
+pdf_document_diverge (PdfDocument *pdf_document)
+{
+	if (pdf_document->diverged)
+		return;
+
+	pdf_document->diverged = TRUE;
+	ev_document_reset_render_instances (EV_DOCUMENT (pdf_document));
+}
+
 /* EvDocument */
 static gboolean
 pdf_document_save (EvDocument  *document,
@@ -264,6 +302,270 @@ pdf_document_save (EvDocument  *document,
 	return retval;
 }
 
+/* Incremental saving
+ *
+ * poppler saves the changes to a document as an update appended to a
+ * copy of the original file. The copy is written to a temporary file
+ * next to the original one, checked and renamed over it, so that the
+ * file is never left half written, and poppler keeps reading the one
+ * it loaded. Every save holds all the changes since the document was
+ * loaded.
+ */
+
+/* The blocks compared at the start and the end of the original content */
+#define UPDATE_READ_SIZE (64 * 1024)
+/* The end of the file searched for startxref */
+#define UPDATE_TAIL_SIZE 1024
+
+static gboolean
+read_all_at (int     fd,
+	     guint8 *data,
+	     gsize   length,
+	     goffset offset)
+{
+	while (length > 0) {
+		gssize n_read = pread (fd, data, length, offset);
+
+		if (n_read == -1 && errno == EINTR)
+			continue;
+		if (n_read <= 0)
+			return FALSE;
+		data += n_read;
+		length -= n_read;
+		offset += n_read;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+pdf_update_copies_range (int     fd,
+			 int     original_fd,
+			 goffset offset,
+			 gsize   length)
+{
+	guint8  *buffer;
+	guint8  *original;
+	gboolean matches;
+
+	buffer = (guint8 *) g_malloc (length);
+	original = (guint8 *) g_malloc (length);
+	matches = read_all_at (fd, buffer, length, offset) &&
+		read_all_at (original_fd, original, length, offset) &&
+		memcmp (buffer, original, length) == 0;
+	g_free (buffer);
+	g_free (original);
+
+	return matches;
+}
+
+/* Whether the saved file starts with the original one, followed by an
+ * update: otherwise poppler rewrote the document. poppler copies the
+ * original file as is for an update, while a rewrite starts with a
+ * new header and ends the original content differently, so only the
+ * first and last blocks are compared rather than the whole file. */
+static gboolean
+pdf_update_copies_original (int     fd,
+			    int     original_fd,
+			    goffset original_size)
+{
+	gsize length = MIN (UPDATE_READ_SIZE, original_size);
+
+	return pdf_update_copies_range (fd, original_fd, 0, length) &&
+		pdf_update_copies_range (fd, original_fd, original_size - length, length);
+}
+
+static const gchar *
+find_last (const gchar *data,
+	   gsize        length,
+	   const gchar *text)
+{
+	gsize text_len = strlen (text);
+	gsize i;
+
+	for (i = length; i >= text_len; i--) {
+		if (memcmp (data + i - text_len, text, text_len) == 0)
+			return data + i - text_len;
+	}
+
+	return NULL;
+}
+
+/* Whether the startxref of the update points to its cross reference
+ * section or stream, that is whether poppler got the offsets right */
+static gboolean
+pdf_update_has_valid_xref (int     fd,
+			   goffset original_size,
+			   goffset size)
+{
+	gchar        tail[UPDATE_TAIL_SIZE + 1];
+	gchar        xref[32 + 1];
+	gsize        tail_size = MIN (size - original_size, UPDATE_TAIL_SIZE);
+	const gchar *p;
+	gchar       *end;
+	gint64       xref_offset;
+
+	if (!read_all_at (fd, (guint8 *) tail, tail_size, size - tail_size))
+		return FALSE;
+	tail[tail_size] = '\0';
+
+	p = find_last (tail, tail_size, "startxref");
+	if (!p || !find_last (p, tail + tail_size - p, "%%EOF"))
+		return FALSE;
+
+	p += strlen ("startxref");
+	while (g_ascii_isspace (*p))
+		p++;
+	xref_offset = g_ascii_strtoll (p, &end, 10);
+	if (end == p || xref_offset < original_size || xref_offset >= size)
+		return FALSE;
+
+	memset (xref, 0, sizeof (xref));
+	if (!read_all_at (fd, (guint8 *) xref, MIN (size - xref_offset, 32), xref_offset))
+		return FALSE;
+
+	if (g_str_has_prefix (xref, "xref"))
+		return TRUE;
+
+	/* A cross reference stream: "<number> <generation> obj" */
+	p = xref;
+	while (g_ascii_isdigit (*p))
+		p++;
+	if (p == xref || *p++ != ' ')
+		return FALSE;
+	while (g_ascii_isdigit (*p))
+		p++;
+
+	return g_str_has_prefix (p, " obj");
+}
+
+static gboolean
+pdf_document_save_incremental (EvDocument            *document,
+			       const char            *uri,
+			       GFileProgressCallback  progress_callback,
+			       gpointer               progress_data,
+			       GError               **error)
+{
+	PdfDocument *pdf_document = PDF_DOCUMENT (document);
+	GStatBuf     st;
+	GError      *poppler_error = NULL;
+	gchar       *filename;
+	gchar       *dir;
+	gchar       *basename;
+	gchar       *tmp_name;
+	gchar       *tmp_filename;
+	gchar       *tmp_uri;
+	gboolean     retval;
+	int          fd;
+	int          tmp_fd;
+
+	filename = g_filename_from_uri (uri, NULL, NULL);
+	retval = filename && pdf_document->filename &&
+		strcmp (filename, pdf_document->filename) == 0;
+	g_free (filename);
+	if (!retval) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "Only the file the document was loaded from can be updated");
+		return FALSE;
+	}
+
+	/* Renaming over a link would replace the link */
+	if (g_file_test (pdf_document->filename, G_FILE_TEST_IS_SYMLINK)) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "The file is a symbolic link");
+		return FALSE;
+	}
+
+	fd = g_open (pdf_document->filename, O_RDONLY, 0);
+	if (fd == -1) {
+		int errsv = errno;
+
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     _("Failed to save document: %s"), g_strerror (errsv));
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 ||
+	    st.st_size != pdf_document->file_size ||
+	    st.st_mtime != pdf_document->file_mtime) {
+		close (fd);
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "The file changed since the document was loaded");
+		return FALSE;
+	}
+
+	if (st.st_nlink > 1) {
+		close (fd);
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "The file has other hard links");
+		return FALSE;
+	}
+
+	if (!pdf_document->forms_modified && !pdf_document->annots_modified) {
+		close (fd);
+		return TRUE;
+	}
+
+	dir = g_path_get_dirname (pdf_document->filename);
+	basename = g_path_get_basename (pdf_document->filename);
+	tmp_name = g_strdup_printf (".%s.XXXXXX", basename);
+	tmp_filename = g_build_filename (dir, tmp_name, NULL);
+	g_free (tmp_name);
+	g_free (basename);
+	g_free (dir);
+
+	tmp_fd = g_mkstemp_full (tmp_filename, O_RDWR, st.st_mode & 0777);
+	if (tmp_fd == -1) {
+		/* The directory may not be writable, the file may */
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "Failed to create a file next to the document");
+		g_free (tmp_filename);
+		close (fd);
+		return FALSE;
+	}
+	fchmod (tmp_fd, st.st_mode & 07777);
+
+	tmp_uri = g_filename_to_uri (tmp_filename, NULL, error);
+	retval = tmp_uri &&
+		poppler_document_save (pdf_document->document, tmp_uri, &poppler_error);
+	g_free (tmp_uri);
+
+	if (!retval) {
+		if (poppler_error)
+			convert_error (poppler_error, error);
+	} else if (fstat (tmp_fd, &st) == -1 ||
+		   st.st_size <= pdf_document->original_size ||
+		   !pdf_update_copies_original (tmp_fd, fd, pdf_document->original_size) ||
+		   !pdf_update_has_valid_xref (tmp_fd, pdf_document->original_size, st.st_size)) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "The document can't be updated incrementally");
+		retval = FALSE;
+	} else if (fsync (tmp_fd) != 0 ||
+		   g_rename (tmp_filename, pdf_document->filename) != 0) {
+		int errsv = errno;
+
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     _("Failed to save document: %s"), g_strerror (errsv));
+		retval = FALSE;
+	}
+
+	if (retval) {
+		pdf_document->file_size = st.st_size;
+		pdf_document->file_mtime = st.st_mtime;
+		pdf_document->forms_modified = FALSE;
+		pdf_document->annots_modified = FALSE;
+		if (progress_callback)
+			progress_callback (st.st_size, st.st_size, progress_data);
+	} else {
+		g_unlink (tmp_filename);
+	}
+	g_free (tmp_filename);
+	close (tmp_fd);
+	close (fd);
+
+	return retval;
+}
+
 static gboolean
 pdf_document_load (EvDocument   *document,
 		   const char   *uri,
@@ -271,6 +573,7 @@ pdf_document_load (EvDocument   *document,
 {
 	GError *poppler_error = NULL;
 	PdfDocument *pdf_document = PDF_DOCUMENT (document);
+	GStatBuf st;
 
 	pdf_document->document =
 		poppler_document_new_from_file (uri, pdf_document->password, &poppler_error);
@@ -280,6 +583,17 @@ pdf_document_load (EvDocument   *document,
 		return FALSE;
 	}
 
+	/* Remember the file to append changes to it when saving */
+	g_free (pdf_document->filename);
+	pdf_document->filename = g_filename_from_uri (uri, NULL, NULL);
+	if (pdf_document->filename && g_stat (pdf_document->filename, &st) == 0) {
+		pdf_document->original_size = st.st_size;
+		pdf_document->file_size = st.st_size;
+		pdf_document->file_mtime = st.st_mtime;
+	} else {
+		g_clear_pointer (&pdf_document->filename, g_free);
+	}
+
 	return TRUE;
 }
 
@@ -331,6 +645,53 @@ pdf_document_load_gfile (EvDocument          *document,
         return TRUE;
 }
 
+/* Opens the file of @document again, for a worker thread to render
+ * from while the others use @document. Only the poppler document is
+ * loaded: rendering needs neither the page cache nor synctex. */
+static EvDocument *
+pdf_document_open_render_instance (EvDocument *document)
+{
+	PdfDocument *pdf_document = PDF_DOCUMENT (document);
+	EvDocument  *instance = NULL;
+	GStatBuf     st;
+	gchar       *filename = NULL;
+	gchar       *password = NULL;
+	goffset      original_size = 0;
+	gint64       file_mtime = 0;
+	gchar       *uri = NULL;
+
+	/* Saving and editing change them from the main thread */
+	ev_document_lock (document);
+	if (!pdf_document->diverged && pdf_document->filename) {
+		filename = g_strdup (pdf_document->filename);
+		password = g_strdup (pdf_document->password);
+		original_size = pdf_document->original_size;
+		file_mtime = pdf_document->file_mtime;
+	}
+	ev_document_unlock (document);
+
+	/* Nor when the file was replaced since */
+	if (filename &&
+	    g_stat (filename, &st) == 0 &&
+	    st.st_size == original_size &&
+	    st.st_mtime == file_mtime)
+		uri = g_filename_to_uri (filename, NULL, NULL);
+
+	if (uri) {
+		instance = EV_DOCUMENT (g_object_new (PDF_TYPE_DOCUMENT, NULL));
+		PDF_DOCUMENT (instance)->password = password;
+		password = NULL;
+		if (!pdf_document_load (instance, uri, NULL))
+			g_clear_object (&instance);
+	}
+
+	g_free (uri);
+	g_free (password);
+	g_free (filename);
+
+	return instance;
+}
+
 static int
 pdf_document_get_n_pages (EvDocument *document)
 {
@@ -390,9 +751,16 @@ pdf_page_render (PopplerPage     *page,
 	double page_width, page_height;
 	double xscale, yscale;
 
-	surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
-					      width, height);
-	cr = cairo_create (surface);
+	if (ev_render_context_has_clip (rc)) {
+		surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+						      rc->clip_width, rc->clip_height);
+		cr = cairo_create (surface);
+		cairo_translate (cr, -rc->clip_x, -rc->clip_y);
+	} else {
+		surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+						      width, height);
+		cr = cairo_create (surface);
+	}
 
 	switch (rc->rotation) {
 	        case 90:
@@ -453,10 +821,8 @@ make_thumbnail_for_page (PopplerPage     *poppler_page,
 	GdkPixbuf *pixbuf;
 	cairo_surface_t *surface;
 
-	ev_document_fc_mutex_lock ();
 	surface = pdf_page_render (poppler_page, width, height, rc);
-	ev_document_fc_mutex_unlock ();
-	
+
 	pixbuf = ev_document_misc_pixbuf_from_surface (surface);
 	cairo_surface_destroy (surface);
 
@@ -549,9 +915,7 @@ pdf_document_get_thumbnail_surface (EvDocument      *document,
 		}
 	}
 
-	ev_document_fc_mutex_lock ();
 	surface = pdf_page_render (poppler_page, width, height, rc);
-	ev_document_fc_mutex_unlock ();
 
 	return surface;
 }
@@ -977,6 +1341,7 @@ pdf_document_class_init (PdfDocumentClass *klass)
 	g_object_class->dispose = pdf_document_dispose;
 
 	ev_document_class->save = pdf_document_save;
+	ev_document_class->save_incremental = pdf_document_save_incremental;
 	ev_document_class->load = pdf_document_load;
         ev_document_class->load_stream = pdf_document_load_stream;
         ev_document_class->load_gfile = pdf_document_load_gfile;
@@ -990,14 +1355,23 @@ pdf_document_class_init (PdfDocumentClass *klass)
 	ev_document_class->get_info = pdf_document_get_info;
 	ev_document_class->get_backend_info = pdf_document_get_backend_info;
 	ev_document_class->support_synctex = pdf_document_support_synctex;
+	ev_document_class->open_render_instance = pdf_document_open_render_instance;
+	/* poppler serializes its own fontconfig lookups, so that pages
+	 * can be rendered from several copies of a document at once */
+	ev_document_class->uses_fontconfig = FALSE;
 }
 
 /* EvDocumentSecurity */
 static gboolean
 pdf_document_has_document_security (EvDocumentSecurity *document_security)
 {
-	/* FIXME: do we really need to have this? */
-	return FALSE;
+	PdfDocument *pdf_document = PDF_DOCUMENT (document_security);
+
+	/* poppler doesn't tell whether a document is encrypted, but
+	 * it needed a password or it restricts what can be done */
+	return pdf_document->password != NULL ||
+		(pdf_document->document &&
+		 poppler_document_get_permissions (pdf_document->document) != POPPLER_PERMISSIONS_FULL);
 }
 
 static void
@@ -2564,6 +2938,7 @@ pdf_document_forms_form_field_text_set_text (EvDocumentForms *document,
 	
 	poppler_form_field_text_set_text (poppler_field, text);
 	PDF_DOCUMENT (document)->forms_modified = TRUE;
+	pdf_document_diverge (PDF_DOCUMENT (document));
 }
 
 static void
@@ -2579,6 +2954,7 @@ pdf_document_forms_form_field_button_set_state (EvDocumentForms *document,
 	
 	poppler_form_field_button_set_state (poppler_field, state);
 	PDF_DOCUMENT (document)->forms_modified = TRUE;
+	pdf_document_diverge (PDF_DOCUMENT (document));
 }
 
 static gboolean
@@ -2660,6 +3036,7 @@ pdf_document_forms_form_field_choice_select_item (EvDocumentForms *document,
 
 	poppler_form_field_choice_select_item (poppler_field, index);
 	PDF_DOCUMENT (document)->forms_modified = TRUE;
+	pdf_document_diverge (PDF_DOCUMENT (document));
 }
 
 static void
@@ -2675,6 +3052,7 @@ pdf_document_forms_form_field_choice_toggle_item (EvDocumentForms *document,
 
 	poppler_form_field_choice_toggle_item (poppler_field, index);
 	PDF_DOCUMENT (document)->forms_modified = TRUE;
+	pdf_document_diverge (PDF_DOCUMENT (document));
 }
 
 static void
@@ -2689,6 +3067,7 @@ pdf_document_forms_form_field_choice_unselect_all (EvDocumentForms *document,
 	
 	poppler_form_field_choice_unselect_all (poppler_field);
 	PDF_DOCUMENT (document)->forms_modified = TRUE;
+	pdf_document_diverge (PDF_DOCUMENT (document));
 }
 
 static void
@@ -2704,6 +3083,7 @@ pdf_document_forms_form_field_choice_set_text (EvDocumentForms *document,
 	
 	poppler_form_field_choice_set_text (poppler_field, text);
 	PDF_DOCUMENT (document)->forms_modified = TRUE;
+	pdf_document_diverge (PDF_DOCUMENT (document));
 }
 
 static gchar *
@@ -2890,10 +3270,12 @@ ev_annot_from_poppler_annot (PopplerAnnot *poppler_annot,
 			PopplerAnnotInk *a_ink = POPPLER_ANNOT_INK(poppler_annot);
 			PopplerAnnotPaths *paths = poppler_annot_ink_get_ink_list(a_ink);
             PopplerAnnotBorder *border = poppler_annot_get_border(poppler_annot);
-            double height, i, j;
+            double height;
+            guint i, j;
 
             poppler_page_get_size (POPPLER_PAGE (page->backend_page), NULL, &height);
-			GArray *arr_paths = g_array_new(0, 0, sizeof(GArray*));
+			GArray *points = g_array_new(FALSE, FALSE, sizeof(EvPoint));
+			GArray *stroke_lengths = g_array_new(FALSE, FALSE, sizeof(guint));
 
 			/* Transfer Poppler data structures to EvAnnotationInk */
 			/* Ignore the colour and operator parameters for now */
@@ -2903,30 +3285,28 @@ ev_annot_from_poppler_annot (PopplerAnnot *poppler_annot,
                 i++) {
 
                 PopplerAnnotPath *path = poppler_annot_paths_get(paths, i);
-                GArray *arr_path = g_array_new(0, 0, sizeof(double));
+                guint n_points = poppler_annot_path_get_length(path);
 
-                for (j=0; j < poppler_annot_path_get_length(path); j++) {
-                    double x, y;
+                for (j=0; j < n_points; j++) {
+                    EvPoint point;
 
-                    poppler_annot_path_get(path, j, &x, &y);
-                    y = height - y;
+                    poppler_annot_path_get(path, j, &point.x, &point.y);
+                    point.y = height - point.y;
 
-                    g_array_append_val(arr_path, x);
-                    g_array_append_val(arr_path, y);
+                    g_array_append_val(points, point);
                 }
 
-                g_array_append_val(arr_paths, arr_path);
+                g_array_append_val(stroke_lengths, n_points);
             }
 
-            ev_annotation_ink_set_paths(ev_ink, arr_paths); // adds ref
+			ev_annotation_ink_set_points(ev_ink,
+						     (const EvPoint *) points->data, points->len,
+						     (const guint *) stroke_lengths->data, stroke_lengths->len);
 			ev_annotation_ink_set_operator(ev_ink, EV_ANNOTATION_INK_OPERATOR_OVER); // this is not necessary. we need to interpret the stream to get this value
 			ev_annotation_ink_set_width(ev_ink, poppler_annot_border_get_width(border) );
 
-			/* Remove one reference from the paths... */
-			for (int i=0; i<arr_paths->len; i++) {
-				g_array_unref(g_array_index(arr_paths, GArray*, i));
-			}
-			g_array_unref(arr_paths);
+			g_array_free(points, TRUE);
+			g_array_free(stroke_lengths, TRUE);
 		}
 			break;
 	        case POPPLER_ANNOT_LINK:
@@ -3066,6 +3446,51 @@ annot_set_unique_name (EvAnnotation *annot)
 	g_free (name);
 }
 
+typedef enum {
+	PDF_ANNOT_OP_NONE,
+	PDF_ANNOT_OP_ADD,
+	PDF_ANNOT_OP_SAVE,
+	PDF_ANNOT_OP_REMOVE
+} PdfAnnotOpType;
+
+typedef struct {
+	PdfAnnotOpType        type;
+	EvAnnotation         *annot;
+	EvRectangle           rect;
+	EvAnnotationsSaveMask mask;
+} PdfAnnotOp;
+
+static void
+pdf_annot_op_free (PdfAnnotOp *op)
+{
+	g_object_unref (op->annot);
+	g_slice_free (PdfAnnotOp, op);
+}
+
+/* Returns TRUE when the change was queued by an open transaction */
+static gboolean
+pdf_document_queue_annot_op (PdfDocument          *pdf_document,
+			     PdfAnnotOpType        type,
+			     EvAnnotation         *annot,
+			     EvRectangle          *rect,
+			     EvAnnotationsSaveMask mask)
+{
+	PdfAnnotOp *op;
+
+	if (pdf_document->annots_transaction_depth == 0)
+		return FALSE;
+
+	op = g_slice_new (PdfAnnotOp);
+	op->type = type;
+	op->annot = EV_ANNOTATION (g_object_ref (annot));
+	if (rect)
+		op->rect = *rect;
+	op->mask = mask;
+	g_ptr_array_add (pdf_document->annot_ops, op);
+
+	return TRUE;
+}
+
 static EvMappingList *
 pdf_document_annotations_get_annotations (EvDocumentAnnotations *document_annotations,
 					  EvPage                *page)
@@ -3162,8 +3587,12 @@ pdf_document_annotations_remove_annotation (EvDocumentAnnotations *document_anno
         EvMapping     *annot_mapping;
         GList         *list;
 
-        poppler_annot = POPPLER_ANNOT (g_object_get_data (G_OBJECT (annot), "poppler-annot"));
         pdf_document = PDF_DOCUMENT (document_annotations);
+        if (pdf_document_queue_annot_op (pdf_document, PDF_ANNOT_OP_REMOVE, annot, NULL,
+                                         EV_ANNOTATIONS_SAVE_NONE))
+                return;
+
+        poppler_annot = POPPLER_ANNOT (g_object_get_data (G_OBJECT (annot), "poppler-annot"));
         page = ev_annotation_get_page (annot);
         poppler_page = POPPLER_PAGE (page->backend_page);
 
@@ -3180,6 +3609,7 @@ pdf_document_annotations_remove_annotation (EvDocumentAnnotations *document_anno
         }
 
         pdf_document->annots_modified = TRUE;
+        pdf_document_diverge (pdf_document);
 }
 
 /**
@@ -3192,24 +3622,579 @@ static cairo_status_t write_to_string(void *drawing_void, const unsigned char *d
     return CAIRO_STATUS_SUCCESS;
 }
 
+/* Ink appearance streams
+ *
+ * Each stroke is fitted with cubic Bézier curves, following Schneider's
+ * "An Algorithm for Automatically Fitting Digitized Curves" (Graphics
+ * Gems, 1990), and numbers are written with no more digits than
+ * needed. The /InkList keeps the captured points.
+ */
+
+/* Distance, in points, the curves may stray from the captured points */
+#define INK_FIT_TOLERANCE  0.25
+#define INK_FIT_ITERATIONS 4
+/* Rough size of the path operators of a captured point, to size the
+ * stream up front */
+#define INK_BYTES_PER_POINT 16
+
+/* Writes @value followed by a space, rounded to @decimals (at most 3)
+ * digits after the point and without trailing zeros. Unlike printf's
+ * %f, this doesn't depend on the locale. */
 static void
-pdf_document_annotations_add_annotation (EvDocumentAnnotations *document_annotations,
-					 EvAnnotation          *annot,
-					 EvRectangle           *rect)
+ink_stream_append_number (GString *stream,
+                          gdouble  value,
+                          gint     decimals)
+{
+    static const gint64 scales[] = { 1, 10, 100, 1000 };
+    gint64 scale = scales[decimals];
+    gint64 scaled = (gint64) floor (value * scale + 0.5);
+    gint64 fraction;
+
+    if (scaled < 0) {
+        g_string_append_c (stream, '-');
+        scaled = -scaled;
+    }
+
+    g_string_append_printf (stream, "%" G_GINT64_FORMAT, scaled / scale);
+
+    fraction = scaled % scale;
+    if (fraction != 0) {
+        g_string_append_c (stream, '.');
+        while (fraction != 0) {
+            scale /= 10;
+            g_string_append_c (stream, '0' + fraction / scale);
+            fraction %= scale;
+        }
+    }
+
+    g_string_append_c (stream, ' ');
+}
+
+/* Length of @value written with "%f" */
+static gsize
+ink_fixed_number_length (gdouble value)
+{
+    gsize  length = 7; /* point and six decimals */
+    gint64 whole = (gint64) fabs (value);
+
+    if (value < 0)
+        length++;
+    do {
+        length++;
+        whole /= 10;
+    } while (whole != 0);
+
+    return length;
+}
+
+static void
+ink_stream_append_point (GString       *stream,
+                         const EvPoint *point)
+{
+    ink_stream_append_number (stream, point->x, 2);
+    ink_stream_append_number (stream, point->y, 2);
+}
+
+static EvPoint
+ink_point_sub (EvPoint a,
+               EvPoint b)
+{
+    EvPoint p = { a.x - b.x, a.y - b.y };
+    return p;
+}
+
+static EvPoint
+ink_point_scale (EvPoint v,
+                 gdouble s)
+{
+    EvPoint p = { v.x * s, v.y * s };
+    return p;
+}
+
+static gdouble
+ink_point_dot (EvPoint a,
+               EvPoint b)
+{
+    return a.x * b.x + a.y * b.y;
+}
+
+static EvPoint
+ink_point_normalize (EvPoint v)
+{
+    gdouble length = hypot (v.x, v.y);
+
+    if (length > 0)
+        return ink_point_scale (v, 1 / length);
+    return v;
+}
+
+/* Evaluates the Bézier curve of @degree with control points @bezier
+ * at @t, with de Casteljau's algorithm */
+static EvPoint
+ink_bezier_point (const EvPoint *bezier,
+                  gint           degree,
+                  gdouble        t)
+{
+    EvPoint tmp[4];
+
+    for (gint i = 0; i <= degree; i++)
+        tmp[i] = bezier[i];
+
+    for (gint i = 1; i <= degree; i++) {
+        for (gint j = 0; j <= degree - i; j++) {
+            tmp[j].x = (1 - t) * tmp[j].x + t * tmp[j + 1].x;
+            tmp[j].y = (1 - t) * tmp[j].y + t * tmp[j + 1].y;
+        }
+    }
+
+    return tmp[0];
+}
+
+static void
+ink_chord_length_parameterize (const EvPoint *points,
+                               gint           first,
+                               gint           last,
+                               gdouble       *u)
+{
+    u[0] = 0;
+    for (gint i = first + 1; i <= last; i++)
+        u[i - first] = u[i - first - 1] + hypot (points[i].x - points[i - 1].x,
+                                                 points[i].y - points[i - 1].y);
+    for (gint i = first + 1; i <= last; i++)
+        u[i - first] /= u[last - first];
+}
+
+/* Least squares fit of a cubic through @points[@first] and
+ * @points[@last], leaving them along the tangents @t1 and @t2 */
+static void
+ink_generate_bezier (const EvPoint *points,
+                     gint           first,
+                     gint           last,
+                     const gdouble *u,
+                     EvPoint        t1,
+                     EvPoint        t2,
+                     EvPoint       *bezier)
+{
+    EvPoint p0 = points[first], p3 = points[last];
+    gdouble c[2][2] = { { 0, 0 }, { 0, 0 } };
+    gdouble x[2] = { 0, 0 };
+    gdouble det_c0_c1, alpha1 = 0, alpha2 = 0;
+    gdouble segment_length, epsilon;
+
+    for (gint i = first; i <= last; i++) {
+        gdouble t = u[i - first], mt = 1 - t;
+        gdouble b0 = mt * mt * mt, b1 = 3 * t * mt * mt;
+        gdouble b2 = 3 * t * t * mt, b3 = t * t * t;
+        EvPoint a1 = ink_point_scale (t1, b1);
+        EvPoint a2 = ink_point_scale (t2, b2);
+        EvPoint tmp;
+
+        c[0][0] += ink_point_dot (a1, a1);
+        c[0][1] += ink_point_dot (a1, a2);
+        c[1][1] += ink_point_dot (a2, a2);
+
+        tmp.x = points[i].x - (p0.x * (b0 + b1) + p3.x * (b2 + b3));
+        tmp.y = points[i].y - (p0.y * (b0 + b1) + p3.y * (b2 + b3));
+        x[0] += ink_point_dot (a1, tmp);
+        x[1] += ink_point_dot (a2, tmp);
+    }
+    c[1][0] = c[0][1];
+
+    det_c0_c1 = c[0][0] * c[1][1] - c[1][0] * c[0][1];
+    if (det_c0_c1 != 0) {
+        alpha1 = (x[0] * c[1][1] - x[1] * c[0][1]) / det_c0_c1;
+        alpha2 = (c[0][0] * x[1] - c[1][0] * x[0]) / det_c0_c1;
+    }
+
+    /* Fall back to a third of the chord when the fit is degenerate */
+    segment_length = hypot (p3.x - p0.x, p3.y - p0.y);
+    epsilon = 1e-6 * segment_length;
+    if (alpha1 < epsilon || alpha2 < epsilon)
+        alpha1 = alpha2 = segment_length / 3;
+
+    bezier[0] = p0;
+    bezier[1].x = p0.x + t1.x * alpha1;
+    bezier[1].y = p0.y + t1.y * alpha1;
+    bezier[2].x = p3.x + t2.x * alpha2;
+    bezier[2].y = p3.y + t2.y * alpha2;
+    bezier[3] = p3;
+}
+
+/* Returns the largest squared distance from the points to @bezier,
+ * and in @split the point where it happens */
+static gdouble
+ink_compute_max_error (const EvPoint *points,
+                       gint           first,
+                       gint           last,
+                       const EvPoint *bezier,
+                       const gdouble *u,
+                       gint          *split)
+{
+    gdouble max_distance = 0;
+
+    *split = (first + last + 1) / 2;
+    for (gint i = first + 1; i < last; i++) {
+        EvPoint v = ink_point_sub (ink_bezier_point (bezier, 3, u[i - first]), points[i]);
+        gdouble distance = ink_point_dot (v, v);
+
+        if (distance >= max_distance) {
+            max_distance = distance;
+            *split = i;
+        }
+    }
+
+    return max_distance;
+}
+
+/* One Newton-Raphson step towards the parameters of the points of
+ * @bezier closest to @points */
+static void
+ink_reparameterize (const EvPoint *points,
+                    gint           first,
+                    gint           last,
+                    const EvPoint *bezier,
+                    gdouble       *u)
+{
+    EvPoint q1[3], q2[2];
+
+    for (gint i = 0; i < 3; i++)
+        q1[i] = ink_point_scale (ink_point_sub (bezier[i + 1], bezier[i]), 3);
+    for (gint i = 0; i < 2; i++)
+        q2[i] = ink_point_scale (ink_point_sub (q1[i + 1], q1[i]), 2);
+
+    for (gint i = first; i <= last; i++) {
+        gdouble t = u[i - first];
+        EvPoint d = ink_point_sub (ink_bezier_point (bezier, 3, t), points[i]);
+        EvPoint d1 = ink_bezier_point (q1, 2, t);
+        EvPoint d2 = ink_bezier_point (q2, 1, t);
+        gdouble denominator = ink_point_dot (d1, d1) + ink_point_dot (d, d2);
+
+        if (denominator != 0)
+            u[i - first] = t - ink_point_dot (d, d1) / denominator;
+    }
+}
+
+static void
+ink_stream_append_curve (GString       *stream,
+                         const EvPoint *bezier)
+{
+    ink_stream_append_point (stream, &bezier[1]);
+    ink_stream_append_point (stream, &bezier[2]);
+    ink_stream_append_point (stream, &bezier[3]);
+    g_string_append (stream, "c ");
+}
+
+/* Fits @points[@first..@last] with curves within the squared distance
+ * @tolerance, splitting them where the fit is worst until it is good
+ * enough. @u is scratch space for as many parameters as points. */
+static void
+ink_stream_fit_cubic (GString       *stream,
+                      const EvPoint *points,
+                      gint           first,
+                      gint           last,
+                      EvPoint        t1,
+                      EvPoint        t2,
+                      gdouble        tolerance,
+                      gdouble       *u)
+{
+    EvPoint bezier[4];
+    EvPoint center;
+    gdouble error;
+    gint    split;
+
+    if (last - first == 1) {
+        ink_stream_append_point (stream, &points[last]);
+        g_string_append (stream, "l ");
+        return;
+    }
+
+    ink_chord_length_parameterize (points, first, last, u);
+    ink_generate_bezier (points, first, last, u, t1, t2, bezier);
+    error = ink_compute_max_error (points, first, last, bezier, u, &split);
+    if (error < tolerance) {
+        ink_stream_append_curve (stream, bezier);
+        return;
+    }
+
+    /* Close enough that better parameters may be all it takes */
+    if (error < 4 * tolerance) {
+        for (gint i = 0; i < INK_FIT_ITERATIONS; i++) {
+            ink_reparameterize (points, first, last, bezier, u);
+            ink_generate_bezier (points, first, last, u, t1, t2, bezier);
+            error = ink_compute_max_error (points, first, last, bezier, u, &split);
+            if (error < tolerance) {
+                ink_stream_append_curve (stream, bezier);
+                return;
+            }
+        }
+    }
+
+    center = ink_point_normalize (ink_point_sub (points[split - 1], points[split + 1]));
+    if (center.x == 0 && center.y == 0)
+        center = ink_point_normalize (ink_point_sub (points[split - 1], points[split]));
+
+    ink_stream_fit_cubic (stream, points, first, split, t1, center, tolerance, u);
+    ink_stream_fit_cubic (stream, points, split, last,
+                          ink_point_scale (center, -1), t2, tolerance, u);
+}
+
+/* Appends the path of a stroke of @n_points @points, which may be
+ * modified, and returns the length the points would have taken as
+ * line segments with six decimals */
+static gsize
+ink_stream_append_stroke (GString *stream,
+                          EvPoint *points,
+                          guint    n_points,
+                          gdouble *u)
+{
+    gsize fixed_length = 0;
+    guint n = 0;
+
+    if (n_points == 0)
+        return 0;
+
+    for (guint i = 0; i < n_points; i++)
+        fixed_length += ink_fixed_number_length (points[i].x) +
+                        ink_fixed_number_length (points[i].y) + 3;
+
+    /* Repeated points have no tangent to fit along */
+    for (guint i = 0; i < n_points; i++) {
+        if (n > 0 && points[i].x == points[n - 1].x && points[i].y == points[n - 1].y)
+            continue;
+        points[n++] = points[i];
+    }
+
+    ink_stream_append_point (stream, &points[0]);
+    g_string_append (stream, "m ");
+
+    if (n > 1) {
+        ink_stream_fit_cubic (stream, points, 0, n - 1,
+                              ink_point_normalize (ink_point_sub (points[1], points[0])),
+                              ink_point_normalize (ink_point_sub (points[n - 2], points[n - 1])),
+                              INK_FIT_TOLERANCE * INK_FIT_TOLERANCE, u);
+    }
+
+    return fixed_length;
+}
+
+/* Sets the ink list and the normal appearance stream of
+ * @poppler_annot from the strokes of @ink */
+static void
+pdf_document_annotations_set_ink_paths (PopplerAnnot    *poppler_annot,
+                                        EvAnnotationInk *ink,
+                                        gdouble          height)
+{
+        double             width;
+        GdkColor        gdk_color;
+        guint           n_strokes;
+        PopplerColor    poppler_color;
+        PopplerAnnotPaths *poppler_paths;
+        PopplerRectangle   bbox = { /* incredibly large values... */
+            1e100,
+            1e100,
+            -1e100,
+            -1e100
+        };
+
+        // Steps:
+        // 1. Find bounding box
+        // 2. Convert from EV coordinates to Poppler coordinates
+        // 3. Construct the appearance stream
+       
+        // read old values
+        ev_annotation_ink_get_width(ink, &width);
+        ev_annotation_get_color(EV_ANNOTATION(ink), &gdk_color);
+        n_strokes = ev_annotation_ink_get_n_strokes(ink);
+
+        // 1. Find bounding box
+        {
+            guint n_points;
+            const EvPoint *points = ev_annotation_ink_get_points(ink, &n_points);
+
+            for (guint j=0; j<n_points; j++) {
+                double x = points[j].x, y = points[j].y;
+
+                // update bounding box
+                bbox.x1 = MIN(bbox.x1, x - width);
+                bbox.x2 = MAX(bbox.x2, x + width);
+                bbox.y1 = MIN(bbox.y1, height - y - width);
+                bbox.y2 = MAX(bbox.y2, height - y + width);
+            }
+        }
+
+        // 2. convert values
+        {
+            poppler_color.red = gdk_color.red;
+            poppler_color.green = gdk_color.green;
+            poppler_color.blue = gdk_color.blue;
+
+            guint max_points = 0;
+
+            for (guint i=0; i<n_strokes; i++) {
+                guint n_points;
+
+                ev_annotation_ink_get_stroke (ink, i, &n_points);
+                max_points = MAX (max_points, n_points);
+            }
+
+            /* One scratch buffer, reused for every stroke */
+            PopplerPoint *points = new PopplerPoint[MAX (max_points, 1)];
+
+            poppler_paths = poppler_annot_paths_new (n_strokes);
+            for (guint i=0; i<n_strokes; i++) {
+                guint n_points;
+                const EvPoint *stroke = ev_annotation_ink_get_stroke (ink, i, &n_points);
+
+                for (guint j=0; j<n_points; j++) {
+                    points[j].x = stroke[j].x;
+                    points[j].y = height - stroke[j].y;
+                }
+                poppler_annot_paths_set (poppler_paths,
+                        i, poppler_annot_path_new (points, n_points));
+            }
+
+            delete[] points;
+
+            poppler_annot_ink_set_ink_list (POPPLER_ANNOT_INK(poppler_annot), poppler_paths);
+        }
+
+        { // 3. Construct a PDF stream
+            guint n_points;
+            gsize fixed_length = 0;
+
+            ev_annotation_ink_get_points (ink, &n_points);
+
+            GString *appStream = g_string_sized_new (128 + n_points * INK_BYTES_PER_POINT);
+
+            // Draw on the surface
+            // save state
+            g_string_append(appStream, "q \n");
+
+            // set color:
+            ink_stream_append_number (appStream, poppler_color.red / 65535.0, 3);
+            ink_stream_append_number (appStream, poppler_color.green / 65535.0, 3);
+            ink_stream_append_number (appStream, poppler_color.blue / 65535.0, 3);
+            g_string_append (appStream, "RG \n");
+            // set line width:
+            ink_stream_append_number (appStream, width, 2);
+            g_string_append (appStream, "w \n");
+            // set dash, line cap, line join styles, miter limit
+            g_string_append(appStream, "0 J 0 j [] 0 d 10 M \n");
+
+            // set blend mode
+            // FIXME: set Opacity
+            g_string_append(appStream, "/GS1 gs \n");
+
+            // draw path
+            {
+                guint max_points = 0;
+
+                for (guint i=0; i<n_strokes; i++) {
+                    guint n_stroke_points;
+
+                    ev_annotation_ink_get_stroke (ink, i, &n_stroke_points);
+                    max_points = MAX (max_points, n_stroke_points);
+                }
+
+                /* Scratch buffers, reused for every stroke */
+                EvPoint *points = g_new (EvPoint, MAX (max_points, 1));
+                gdouble *u = g_new (gdouble, MAX (max_points, 1));
+                gsize    path_start = appStream->len;
+
+                for (guint i=0; i<n_strokes; i++) {
+                    guint n_stroke_points;
+                    const EvPoint *stroke = ev_annotation_ink_get_stroke (ink, i, &n_stroke_points);
+
+                    for (guint j=0; j<n_stroke_points; j++) {
+                        points[j].x = stroke[j].x - bbox.x1;
+                        points[j].y = height - stroke[j].y - bbox.y1;
+                    }
+                    fixed_length += ink_stream_append_stroke (appStream, points, n_stroke_points, u);
+                }
+
+                g_free (points);
+                g_free (u);
+
+                ev_debug_message (DEBUG_INK, "appearance stream path of %u points: %" G_GSIZE_FORMAT
+                                  " bytes instead of %" G_GSIZE_FORMAT " (%.1f%% saved)",
+                                  n_points, appStream->len - path_start, fixed_length,
+                                  fixed_length ? 100.0 - 100.0 * (appStream->len - path_start) / fixed_length : 0.0);
+            }
+            // stroke(), restore()
+            g_string_append(appStream, "S Q \n");
+            //
+            // TODO: Need to be able to access and manipulate the dictionary associated
+            // with the stream.
+            //
+            // Then you create a graphics state for that blend mode
+            // Then you reference the graphics state
+            
+            // Create the graphics dictionary
+            // Anyone reading this? Anyone reading this?
+            // C++ was invented for a reason. For example, RAII
+            // Pity some idiots are violently opposed to what they don't
+            // know or understand (FUD). I'll murder the idiot who prevented
+            // me from using RAII here. See the stupidity yet?
+            PopplerObject *resources = poppler_object_new();
+            PopplerObject *gstate = poppler_object_new();
+            PopplerObject *brush1 = poppler_object_new();
+            PopplerObject *blendname = poppler_object_new();
+            PopplerXRef* xref = poppler_annot_get_xref(poppler_annot);
+            EvAnnotationInkOperator op = EV_ANNOTATION_INK_OPERATOR_OVER;
+
+            poppler_object_init_dict_xref(resources, xref);
+            poppler_object_init_dict_xref(gstate, xref);
+            poppler_object_init_dict_xref(brush1, xref);
+
+            ev_annotation_ink_get_operator(ink, &op);
+            switch (op) {
+                case EV_ANNOTATION_INK_OPERATOR_MULTIPLY:
+                    poppler_object_init_name(blendname, "Multiply");
+                    break;
+                case EV_ANNOTATION_INK_OPERATOR_LIGHTEN:
+                    poppler_object_init_name(blendname, "Lighten");
+                    break;
+                case EV_ANNOTATION_INK_OPERATOR_DARKEN:
+                    poppler_object_init_name(blendname, "Darken");
+                    break;
+                    // FIXME: other operators
+                default:
+                    poppler_object_init_name(blendname, "Normal");
+                    break;
+            }
+            poppler_object_dict_set(brush1, "BM", blendname);
+            poppler_object_dict_set(gstate, "GS1", brush1);
+            poppler_object_dict_set(resources, "ExtGState", gstate);
+
+            poppler_annot_set_appearance (poppler_annot, POPPLER_ANNOT_APPEARANCE_NORMAL,
+                                        NULL, appStream->str, resources, &bbox);
+
+            
+            //poppler_object_free(blendname);
+            //poppler_object_free(brush1);
+            //poppler_object_free(gstate);
+            //poppler_object_free(resources);
+
+            g_string_free(appStream, TRUE);
+        } /* end: appearance */
+}
+
+/* Creates the poppler annotation for @annot and adds it to its page,
+ * returning its mapping on the page */
+static EvMapping *
+pdf_document_annotations_attach_annotation (PdfDocument  *pdf_document,
+					    EvAnnotation *annot,
+					    EvRectangle  *rect)
 {
 	PopplerAnnot    *poppler_annot;
-	PdfDocument     *pdf_document;
 	EvPage          *page;
 	PopplerPage     *poppler_page;
-	GList           *list = NULL;
-	EvMappingList   *mapping_list;
 	EvMapping       *annot_mapping;
 	PopplerRectangle poppler_rect;
 	gdouble          height;
 	PopplerColor     poppler_color;
 	GdkColor         color;
 
-	pdf_document = PDF_DOCUMENT (document_annotations);
 	page = ev_annotation_get_page (annot);
 	poppler_page = POPPLER_PAGE (page->backend_page);
 
@@ -3240,187 +4225,22 @@ pdf_document_annotations_add_annotation (EvDocumentAnnotations *document_annotat
 			break;
         case EV_ANNOTATION_TYPE_INK: {
             EvAnnotationInk *ink = EV_ANNOTATION_INK(annot);
-            double             width;
-            gdouble         height;
-            GdkColor        gdk_color;
-            GArray          *paths;
-            PopplerColor    poppler_color;
-            PopplerAnnotPaths *poppler_paths;
-            PopplerRectangle   bbox = { /* incredibly large values... */
-                1e100,
-                1e100,
-                -1e100,
-                -1e100
-            };
-
-            // Steps:
-            // 1. Find bounding box
-            // 2. Convert from EV coordinates to Poppler coordinates
-            // 3. Construct the appearance stream
-           
-            // read old values
-            ev_annotation_ink_get_width(ink, &width);
-            ev_annotation_get_color(EV_ANNOTATION(ink), &gdk_color);
-            ev_annotation_ink_get_paths(ink, &paths);
-            poppler_page_get_size (POPPLER_PAGE (page->backend_page), NULL, &height);
+            double           width;
 
-            // 1. Find bounding box
-            {
-                for (int i=0; i<paths->len; i++) {
-                    GArray *path = g_array_index(paths, GArray*, i);
-
-                    for (int j=0; j<path->len; j += 2) {
-                        double x, y;
-
-                        x = g_array_index(path, double, j);
-                        y = g_array_index(path, double, j+1);
-
-                        // update bounding box
-                        bbox.x1 = MIN(bbox.x1, x - width);
-                        bbox.x2 = MAX(bbox.x2, x + width);
-                        bbox.y1 = MIN(bbox.y1, height - y - width);
-                        bbox.y2 = MAX(bbox.y2, height - y + width);
-                    }
-                }
-            }
+            ev_annotation_ink_get_width(ink, &width);
+            ev_annotation_get_color(annot, &color);
+            poppler_color.red = color.red;
+            poppler_color.green = color.green;
+            poppler_color.blue = color.blue;
 
-            // 2. convert values
+            poppler_annot = poppler_annot_ink_new (pdf_document->document, &poppler_rect);
+            poppler_annot_set_color (poppler_annot, &poppler_color);
             {
-                poppler_color.red = gdk_color.red;
-                poppler_color.green = gdk_color.green;
-                poppler_color.blue = gdk_color.blue;
-
-                poppler_paths = poppler_annot_paths_new (paths->len);
-                for (int i=0; i<paths->len; i++) {
-                    GArray *path = g_array_index (paths, GArray*, i);
-                    PopplerPoint *points = new PopplerPoint[path->len/2];
-
-                    // or use a memcpy...
-    //                memcpy (points, path->data, sizeof(double) * path->len);
-                    for (int j=0; j<path->len; j+=2) {
-                        points[j / 2].x = g_array_index (path, double, j);
-                        points[j / 2].y = height - g_array_index (path, double, j+1);
-                    }
-                    poppler_annot_paths_set (poppler_paths,
-                            i, poppler_annot_path_new (points, path->len/2));
-
-                    delete[] points;
-                }
-
-                // set values
-                poppler_annot = poppler_annot_ink_new (pdf_document->document, &poppler_rect);
-                poppler_annot_set_color (poppler_annot, &poppler_color);
-                {
-                    PopplerAnnotBorder *border = (PopplerAnnotBorder*)poppler_annot_border_bs_new();
-                    poppler_annot_border_set_width (border, width);
-                    poppler_annot_set_border(POPPLER_ANNOT(poppler_annot), border);
-                }
-                poppler_annot_ink_set_ink_list (POPPLER_ANNOT_INK(poppler_annot), poppler_paths);
+                PopplerAnnotBorder *border = (PopplerAnnotBorder*)poppler_annot_border_bs_new();
+                poppler_annot_border_set_width (border, width);
+                poppler_annot_set_border(POPPLER_ANNOT(poppler_annot), border);
             }
-
-            { // 3. Construct a PDF stream
-                GString *appStream = g_string_new(0);
-
-                // Draw on the surface
-                // save state
-                g_string_append(appStream, "q \n");
-
-                // set color:
-                g_string_append_printf(appStream, "%f %f %f RG \n", 
-                                      poppler_color.red / 65535.0,
-                                      poppler_color.green / 65535.0,
-                                      poppler_color.blue / 65535.0 /*,
-                                      0.5,
-                                      0.5*/);
-                // set line width:
-                g_string_append_printf(appStream, "%f w \n",
-                                      width);
-                // set dash, line cap, line join styles, miter limit
-                g_string_append(appStream, "0 J 0 j [] 0 d 10 M \n");
-
-                // set blend mode
-                // FIXME: set Opacity
-                g_string_append(appStream, "/GS1 gs \n");
-
-                // draw path
-                for (int i=0; i < poppler_annot_paths_get_length(poppler_paths); i++) {
-                    PopplerAnnotPath *p = poppler_annot_paths_get(poppler_paths, i);
-
-                    for (int j=0; j < poppler_annot_path_get_length(p); j++) {
-                        double x, y;
-
-                        poppler_annot_path_get(p, j, &x, &y);
-
-                        x = x - bbox.x1;
-                        y = y - bbox.y1;
-
-                        if (j == 0) {
-                            // move_to(x, y)
-                            g_string_append_printf(appStream, "%f %f m ", x, y);
-                        }
-                        else {
-                            // line_to(x, y)
-                            g_string_append_printf(appStream, "%f %f l ", x, y);
-                        }
-                    }
-                }
-                // stroke(), restore()
-                g_string_append(appStream, "S Q \n");
-                //
-                // TODO: Need to be able to access and manipulate the dictionary associated
-                // with the stream.
-                //
-                // Then you create a graphics state for that blend mode
-                // Then you reference the graphics state
-                
-                // Create the graphics dictionary
-                // Anyone reading this? Anyone reading this?
-                // C++ was invented for a reason. For example, RAII
-                // Pity some idiots are violently opposed to what they don't
-                // know or understand (FUD). I'll murder the idiot who prevented
-                // me from using RAII here. See the stupidity yet?
-                PopplerObject *resources = poppler_object_new();
-                PopplerObject *gstate = poppler_object_new();
-                PopplerObject *brush1 = poppler_object_new();
-                PopplerObject *blendname = poppler_object_new();
-                PopplerXRef* xref = poppler_annot_get_xref(poppler_annot);
-                EvAnnotationInkOperator op = EV_ANNOTATION_INK_OPERATOR_OVER;
-
-                poppler_object_init_dict_xref(resources, xref);
-                poppler_object_init_dict_xref(gstate, xref);
-                poppler_object_init_dict_xref(brush1, xref);
-
-                ev_annotation_ink_get_operator(ink, &op);
-                switch (op) {
-                    case EV_ANNOTATION_INK_OPERATOR_MULTIPLY:
-                        poppler_object_init_name(blendname, "Multiply");
-                        break;
-                    case EV_ANNOTATION_INK_OPERATOR_LIGHTEN:
-                        poppler_object_init_name(blendname, "Lighten");
-                        break;
-                    case EV_ANNOTATION_INK_OPERATOR_DARKEN:
-                        poppler_object_init_name(blendname, "Darken");
-                        break;
-                        // FIXME: other operators
-                    default:
-                        poppler_object_init_name(blendname, "Normal");
-                        break;
-                }
-                poppler_object_dict_set(brush1, "BM", blendname);
-                poppler_object_dict_set(gstate, "GS1", brush1);
-                poppler_object_dict_set(resources, "ExtGState", gstate);
-
-                poppler_annot_set_appearance (poppler_annot, POPPLER_ANNOT_APPEARANCE_NORMAL,
-                                            NULL, appStream->str, resources, &bbox);
-
-                
-                //poppler_object_free(blendname);
-                //poppler_object_free(brush1);
-                //poppler_object_free(gstate);
-                //poppler_object_free(resources);
-
-                g_string_free(appStream, TRUE);
-            } /* end: appearance */
+            pdf_document_annotations_set_ink_paths (poppler_annot, ink, height);
             }
             break;
 		default:
@@ -3461,9 +4281,25 @@ pdf_document_annotations_add_annotation (EvDocumentAnnotations *document_annotat
 				poppler_annot,
 				(GDestroyNotify) g_object_unref);
 
+	annot_set_unique_name (annot);
+
+	pdf_document->annots_modified = TRUE;
+	pdf_document_diverge (pdf_document);
+
+	return annot_mapping;
+}
+
+/* Appends @mappings to the annotations of page @page_index */
+static void
+pdf_document_annotations_insert_mappings (PdfDocument *pdf_document,
+					  gint         page_index,
+					  GList       *mappings)
+{
+	EvMappingList *mapping_list;
+
 	if (pdf_document->annots) {
 		mapping_list = (EvMappingList *)g_hash_table_lookup (pdf_document->annots,
-								     GINT_TO_POINTER (page->index));
+								     GINT_TO_POINTER (page_index));
 	} else {
 		pdf_document->annots = g_hash_table_new_full (g_direct_hash,
 							      g_direct_equal,
@@ -3472,20 +4308,32 @@ pdf_document_annotations_add_annotation (EvDocumentAnnotations *document_annotat
 		mapping_list = NULL;
 	}
 
-	annot_set_unique_name (annot);
-
 	if (mapping_list) {
-		list = ev_mapping_list_get_list (mapping_list);
-		list = g_list_append (list, annot_mapping);
+		g_list_concat (ev_mapping_list_get_list (mapping_list), mappings);
 	} else {
-		list = g_list_append (list, annot_mapping);
-		mapping_list = ev_mapping_list_new (page->index, list, (GDestroyNotify)g_object_unref);
+		mapping_list = ev_mapping_list_new (page_index, mappings, (GDestroyNotify)g_object_unref);
 		g_hash_table_insert (pdf_document->annots,
-				     GINT_TO_POINTER (page->index),
+				     GINT_TO_POINTER (page_index),
 				     ev_mapping_list_ref (mapping_list));
 	}
+}
 
-	pdf_document->annots_modified = TRUE;
+static void
+pdf_document_annotations_add_annotation (EvDocumentAnnotations *document_annotations,
+					 EvAnnotation          *annot,
+					 EvRectangle           *rect)
+{
+	PdfDocument *pdf_document = PDF_DOCUMENT (document_annotations);
+	EvMapping   *annot_mapping;
+
+	if (pdf_document_queue_annot_op (pdf_document, PDF_ANNOT_OP_ADD, annot, rect,
+					 EV_ANNOTATIONS_SAVE_NONE))
+		return;
+
+	annot_mapping = pdf_document_annotations_attach_annotation (pdf_document, annot, rect);
+	pdf_document_annotations_insert_mappings (pdf_document,
+						  ev_annotation_get_page_index (annot),
+						  g_list_prepend (NULL, annot_mapping));
 }
 
 /* FIXME: We could probably add this to poppler */
@@ -3536,6 +4384,10 @@ pdf_document_annotations_save_annotation (EvDocumentAnnotations *document_annota
 {
 	PopplerAnnot *poppler_annot;
 
+	if (pdf_document_queue_annot_op (PDF_DOCUMENT (document_annotations),
+					 PDF_ANNOT_OP_SAVE, annot, NULL, mask))
+		return;
+
 	poppler_annot = POPPLER_ANNOT (g_object_get_data (G_OBJECT (annot), "poppler-annot"));
 	if (!poppler_annot)
 		return;
@@ -3629,7 +4481,137 @@ pdf_document_annotations_save_annotation (EvDocumentAnnotations *document_annota
 		}
 	}
 
+	if (EV_IS_ANNOTATION_INK (annot) && (mask & EV_ANNOTATIONS_SAVE_INK_PATHS)) {
+		gdouble height;
+
+		poppler_page_get_size (POPPLER_PAGE (ev_annotation_get_page (annot)->backend_page),
+				       NULL, &height);
+		pdf_document_annotations_set_ink_paths (poppler_annot,
+							EV_ANNOTATION_INK (annot),
+							height);
+	}
+
 	PDF_DOCUMENT (document_annotations)->annots_modified = TRUE;
+	pdf_document_diverge (PDF_DOCUMENT (document_annotations));
+}
+
+static void
+pdf_document_annotations_begin_transaction (EvDocumentAnnotations *document_annotations)
+{
+	PdfDocument *pdf_document = PDF_DOCUMENT (document_annotations);
+
+	if (pdf_document->annots_transaction_depth++ == 0 && !pdf_document->annot_ops)
+		pdf_document->annot_ops = g_ptr_array_new_with_free_func ((GDestroyNotify)pdf_annot_op_free);
+}
+
+/* Folds the queued changes of each annotation into its first one, so
+ * that an annotation added and removed in the same transaction never
+ * reaches poppler, and one added or saved several times is only
+ * written once, with its final state */
+static void
+pdf_document_annotations_merge_ops (GPtrArray *ops)
+{
+	GHashTable *first_ops;
+	guint       i;
+
+	first_ops = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (i = 0; i < ops->len; i++) {
+		PdfAnnotOp *op = (PdfAnnotOp *) g_ptr_array_index (ops, i);
+		PdfAnnotOp *first;
+
+		first = (PdfAnnotOp *) g_hash_table_lookup (first_ops, op->annot);
+		if (!first) {
+			g_hash_table_insert (first_ops, op->annot, op);
+			continue;
+		}
+
+		switch (op->type) {
+		case PDF_ANNOT_OP_SAVE:
+			if (first->type == PDF_ANNOT_OP_SAVE)
+				first->mask = (EvAnnotationsSaveMask) (first->mask | op->mask);
+			break;
+		case PDF_ANNOT_OP_REMOVE:
+			if (first->type == PDF_ANNOT_OP_ADD) {
+				first->type = PDF_ANNOT_OP_NONE;
+				g_hash_table_remove (first_ops, op->annot);
+			} else {
+				first->type = PDF_ANNOT_OP_REMOVE;
+			}
+			break;
+		default:
+			/* Added again after being removed */
+			if (first->type == PDF_ANNOT_OP_REMOVE) {
+				g_hash_table_insert (first_ops, op->annot, op);
+				continue;
+			}
+			break;
+		}
+
+		op->type = PDF_ANNOT_OP_NONE;
+	}
+	g_hash_table_destroy (first_ops);
+}
+
+static void
+pdf_document_annotations_commit_transaction (EvDocumentAnnotations *document_annotations)
+{
+	PdfDocument *pdf_document = PDF_DOCUMENT (document_annotations);
+	GHashTable  *added;
+	GPtrArray   *ops;
+	guint        i;
+
+	g_return_if_fail (pdf_document->annots_transaction_depth > 0);
+
+	if (--pdf_document->annots_transaction_depth > 0)
+		return;
+
+	ops = pdf_document->annot_ops;
+	pdf_document->annot_ops = NULL;
+	pdf_document_annotations_merge_ops (ops);
+
+	/* New annotations are added to the mapping of their page in one go */
+	added = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (i = 0; i < ops->len; i++) {
+		PdfAnnotOp *op = (PdfAnnotOp *) g_ptr_array_index (ops, i);
+		gpointer    page_index = GINT_TO_POINTER (ev_annotation_get_page_index (op->annot));
+		GList      *mappings;
+
+		switch (op->type) {
+		case PDF_ANNOT_OP_ADD:
+			mappings = (GList *) g_hash_table_lookup (added, page_index);
+			mappings = g_list_prepend (mappings,
+						   pdf_document_annotations_attach_annotation (pdf_document,
+											       op->annot,
+											       &op->rect));
+			g_hash_table_insert (added, page_index, mappings);
+			break;
+		case PDF_ANNOT_OP_SAVE:
+			pdf_document_annotations_save_annotation (document_annotations,
+								  op->annot, op->mask);
+			break;
+		case PDF_ANNOT_OP_REMOVE:
+			pdf_document_annotations_remove_annotation (document_annotations,
+								    op->annot);
+			break;
+		case PDF_ANNOT_OP_NONE:
+			break;
+		}
+	}
+
+	if (g_hash_table_size (added) > 0) {
+		GHashTableIter iter;
+		gpointer       page_index, mappings;
+
+		g_hash_table_iter_init (&iter, added);
+		while (g_hash_table_iter_next (&iter, &page_index, &mappings)) {
+			pdf_document_annotations_insert_mappings (pdf_document,
+								  GPOINTER_TO_INT (page_index),
+								  g_list_reverse ((GList *) mappings));
+		}
+	}
+
+	g_hash_table_destroy (added);
+	g_ptr_array_free (ops, TRUE);
 }
 
 static void
@@ -3640,6 +4622,8 @@ pdf_document_document_annotations_iface_init (EvDocumentAnnotationsInterface *if
 	iface->add_annotation = pdf_document_annotations_add_annotation;
 	iface->save_annotation = pdf_document_annotations_save_annotation;
 	iface->remove_annotation = pdf_document_annotations_remove_annotation;
+	iface->begin_transaction = pdf_document_annotations_begin_transaction;
+	iface->commit_transaction = pdf_document_annotations_commit_transaction;
 }
 
 /* Attachments */
@@ -3861,6 +4845,7 @@ pdf_document_layers_show_layer (EvDocumentLayers *document,
 
 	poppler_layer = POPPLER_LAYER (g_object_get_data (G_OBJECT (layer), "poppler-layer"));
 	poppler_layer_show (poppler_layer);
+	pdf_document_diverge (PDF_DOCUMENT (document));
 }
 
 static void
@@ -3871,6 +4856,7 @@ pdf_document_layers_hide_layer (EvDocumentLayers *document,
 
 	poppler_layer = POPPLER_LAYER (g_object_get_data (G_OBJECT (layer), "poppler-layer"));
 	poppler_layer_hide (poppler_layer);
+	pdf_document_diverge (PDF_DOCUMENT (document));
 }
 
 static gboolean
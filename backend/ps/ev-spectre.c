@@ -357,6 +357,7 @@ ps_document_class_init (PSDocumentClass *klass)
 	ev_document_class->get_info = ps_document_get_info;
 	ev_document_class->get_backend_info = ps_document_get_backend_info;
 	ev_document_class->render = ps_document_render;
+	ev_document_class->uses_fontconfig = TRUE;
 }
 
 /* EvFileExporterIface */
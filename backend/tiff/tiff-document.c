@@ -60,21 +60,34 @@ EV_BACKEND_REGISTER_WITH_CODE (TiffDocument, tiff_document,
 							   tiff_document_document_file_exporter_iface_init);
 			 });
 
+/* The handlers are global to libtiff, while documents are used from
+ * several threads: the first push saves them, the last pop restores them */
+static GMutex           handlers_mutex;
+static guint            handlers_depth = 0;
 static TIFFErrorHandler orig_error_handler = NULL;
 static TIFFErrorHandler orig_warning_handler = NULL;
 
 static void
 push_handlers (void)
 {
-	orig_error_handler = TIFFSetErrorHandler (NULL);
-	orig_warning_handler = TIFFSetWarningHandler (NULL);
+	g_mutex_lock (&handlers_mutex);
+	if (handlers_depth++ == 0) {
+		orig_error_handler = TIFFSetErrorHandler (NULL);
+		orig_warning_handler = TIFFSetWarningHandler (NULL);
+	}
+	g_mutex_unlock (&handlers_mutex);
 }
 
 static void
 pop_handlers (void)
 {
-	TIFFSetErrorHandler (orig_error_handler);
-	TIFFSetWarningHandler (orig_warning_handler);
+	g_mutex_lock (&handlers_mutex);
+	g_assert (handlers_depth > 0);
+	if (--handlers_depth == 0) {
+		TIFFSetErrorHandler (orig_error_handler);
+		TIFFSetWarningHandler (orig_warning_handler);
+	}
+	g_mutex_unlock (&handlers_mutex);
 }
 
 static gboolean
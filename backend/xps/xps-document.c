@@ -268,6 +268,7 @@ xps_document_class_init (XPSDocumentClass *klass)
 	ev_document_class->get_info = xps_document_get_info;
 	ev_document_class->get_backend_info = xps_document_get_backend_info;
 	ev_document_class->render = xps_document_render;
+	ev_document_class->uses_fontconfig = TRUE;
 }
 
 /* EvDocumentLinks */
@@ -28,6 +28,7 @@
 #include <libview/ev-view.h>
 #include <libview/ev-view-type-builtins.h>
 #include <libview/ev-stock-icons.h>
+#include <libview/ev-text-index.h>
 
 #undef __EV_EVINCE_VIEW_H_INSIDE__
 
@@ -21,6 +21,7 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <cairo.h>
 
 #include "ev-annotation.h"
@@ -93,10 +94,19 @@ struct _EvAnnotationInk {
 	EvAnnotationInkOperator operator;
 	GArray *widths; /* array of doubles */
 	double width;	/* int for single width -- incompatible with widths. Either must be set to 0 */
-	GArray *paths;	/* array of paths */
+
+	/* All strokes packed in a single buffer: stroke i is made of
+	 * points[stroke_offsets[i]] .. points[stroke_offsets[i + 1] - 1] */
+	GArray *points;		/* array of EvPoint */
+	GArray *stroke_offsets;	/* array of guint, n_strokes + 1 */
+	GArray *stroke_ids;	/* array of guint, increasing, one per stroke */
+	guint   next_stroke_id;
+	GArray *paths;	/* array of paths, built on demand by get_paths */
 
     /* for determining hit */
-    EvMappingTree *quadtree;
+    EvRectangle    bbox;	/* of the points, without the line width */
+    EvMappingTree *quadtree;	/* built on the first hit test that needs it */
+    EvRectangle    quadtree_extents;
 };
 struct _EvAnnotationInkClass {
 	EvAnnotationClass parent_class;
@@ -105,6 +115,7 @@ struct _EvAnnotationInkClass {
 static void ev_annotation_markup_default_init           (EvAnnotationMarkupInterface *iface);
 static void ev_annotation_text_markup_iface_init        (EvAnnotationMarkupInterface *iface);
 static void ev_annotation_ink_markup_iface_init        (EvAnnotationMarkupInterface *iface);
+static void ev_annotation_ink_invalidate_quadtree      (EvAnnotationInk *annot);
 static void ev_annotation_attachment_markup_iface_init  (EvAnnotationMarkupInterface *iface);
 static void ev_annotation_text_markup_markup_iface_init (EvAnnotationMarkupInterface *iface);
 
@@ -1472,25 +1483,43 @@ ev_annotation_ink_init (EvAnnotationInk *annot)
 	EV_ANNOTATION (annot)->type = EV_ANNOTATION_TYPE_INK;
     annot->widths = NULL;
     annot->paths = NULL;
+    annot->points = g_array_new (FALSE, FALSE, sizeof (EvPoint));
+    annot->stroke_offsets = g_array_new (FALSE, FALSE, sizeof (guint));
+    annot->stroke_ids = g_array_new (FALSE, FALSE, sizeof (guint));
     annot->quadtree = NULL;
 }
 
+static void
+ev_annotation_ink_free_paths (EvAnnotationInk *annot)
+{
+    int i;
+
+    if (!annot->paths)
+        return;
+
+    for (i=0; i<annot->paths->len; i++) {
+        g_array_unref(g_array_index(annot->paths, GArray*, i));
+    }
+    g_array_unref(annot->paths);
+    annot->paths = NULL;
+}
+
 static void
 ev_annotation_ink_finalize (GObject *object)
 {
 	EvAnnotationInk *annot = EV_ANNOTATION_INK (object);
-    int i;
 
 	if (annot->widths) {
 		g_array_unref (annot->widths);
 		annot->widths = NULL;
 	}
-	if (annot->paths) {
-        for (i=0; i<annot->paths->len; i++) {
-            g_array_unref(g_array_index(annot->paths, GArray*, i));
-        }
-        g_array_unref(annot->paths);
-		annot->paths = NULL;
+	ev_annotation_ink_free_paths (annot);
+	g_array_unref (annot->points);
+	g_array_unref (annot->stroke_offsets);
+	g_array_unref (annot->stroke_ids);
+	if (annot->quadtree) {
+		ev_mapping_tree_unref (annot->quadtree);
+		annot->quadtree = NULL;
 	}
 
 	G_OBJECT_CLASS (ev_annotation_ink_parent_class)->finalize (object);
@@ -1543,6 +1572,7 @@ ev_annotation_ink_set_widths (	EvAnnotationInk *annot,
 	}
 	annot->widths = widths;
 	g_array_ref(widths);
+	ev_annotation_ink_invalidate_quadtree (annot);
 }
 
 
@@ -1566,6 +1596,7 @@ ev_annotation_ink_set_width (	EvAnnotationInk *annot,
 		g_array_unref(annot->widths);
 		annot->widths = NULL;
 	}
+	ev_annotation_ink_invalidate_quadtree (annot);
 }
 
 
@@ -1590,11 +1621,56 @@ static gdouble squared_distance(gdouble x, gdouble y)
     return x*x + y*y;
 }
 
+/* Quadtree items are segments, identified by the id of their stroke
+ * and the index of their end point within the stroke. Stroke ids do
+ * not change when other strokes are added or removed, so the tree can
+ * be updated in place. The index is never 0, nor is the item. Both
+ * have half the bits of a pointer, so on 32 bits platforms ids and
+ * stroke lengths can't go over INK_SEGMENT_MAX. */
+#define INK_SEGMENT_BITS        (GLIB_SIZEOF_VOID_P * 4)
+#define INK_SEGMENT_MAX         (((gsize)1 << INK_SEGMENT_BITS) - 1)
+#define INK_SEGMENT_ITEM(id, j) GSIZE_TO_POINTER (((gsize)(id) << INK_SEGMENT_BITS) | (j))
+#define INK_SEGMENT_STROKE(a)   (GPOINTER_TO_SIZE (a) >> INK_SEGMENT_BITS)
+#define INK_SEGMENT_POINT(a)    (GPOINTER_TO_SIZE (a) & (((gsize)1 << INK_SEGMENT_BITS) - 1))
+
+/* Index of the stroke with the given id */
+static guint
+ev_annotation_ink_find_stroke (EvAnnotationInk *annot,
+                               guint            id)
+{
+    guint lo = 0, hi = annot->stroke_ids->len;
+
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+
+        if (g_array_index (annot->stroke_ids, guint, mid) < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* End point of a segment item; the start point is the one before */
+static const EvPoint *
+ev_annotation_ink_segment_end (EvAnnotationInk *annot,
+                               gpointer         item)
+{
+    guint stroke = ev_annotation_ink_find_stroke (annot, INK_SEGMENT_STROKE (item));
+    guint first = g_array_index (annot->stroke_offsets, guint, stroke);
+
+    return &g_array_index (annot->points, EvPoint, first + INK_SEGMENT_POINT (item));
+}
+
 static gboolean
 is_on_line(gpointer a, gdouble x, gdouble y, gpointer data)
 {
     EvAnnotationInk *annot = EV_ANNOTATION_INK(data);
-    EvRectangle *rect = (EvRectangle*) a;
+    const EvPoint *end = ev_annotation_ink_segment_end (annot, a);
+    const EvPoint *start = end - 1;
+    EvRectangle line = { start->x, start->y, end->x, end->y };
+    EvRectangle *rect = &line;
 
     gdouble halfwidth = annot->width * 0.5 * 3;
     gdouble halfwidthsq = halfwidth * halfwidth;
@@ -1640,109 +1716,747 @@ is_on_line(gpointer a, gdouble x, gdouble y, gpointer data)
     return FALSE;
 }
 
+/**
+ * ev_annotation_ink_get_paths:
+ * @annot: an #EvAnnotationInk
+ * @paths: (out) (transfer none): return location for an array of
+ *   paths, each one an array of interleaved x, y coordinates
+ *
+ * Compatibility accessor that unpacks the strokes into one #GArray
+ * per stroke. The arrays are built on first use and kept until the
+ * strokes change; prefer ev_annotation_ink_get_stroke().
+ */
 gboolean
 ev_annotation_ink_get_paths(	EvAnnotationInk *annot,
 				GArray **paths)
 {
-    *paths = annot->paths;   
+    guint i, n_strokes;
+
+    if (!annot->paths) {
+        n_strokes = ev_annotation_ink_get_n_strokes (annot);
+        annot->paths = g_array_sized_new (FALSE, FALSE, sizeof (GArray*), n_strokes);
+
+        for (i = 0; i < n_strokes; i++) {
+            const EvPoint *points;
+            guint          n_points;
+            GArray        *path;
+
+            points = ev_annotation_ink_get_stroke (annot, i, &n_points);
+            path = g_array_sized_new (FALSE, FALSE, sizeof (gdouble), 2 * n_points);
+            /* EvPoint is a pair of doubles, so it already has the
+             * interleaved layout */
+            g_array_append_vals (path, points, 2 * n_points);
+            g_array_append_val (annot->paths, path);
+        }
+    }
+
+    *paths = annot->paths;
     return TRUE;
 }
 
+/**
+ * ev_annotation_ink_get_n_strokes:
+ * @annot: an #EvAnnotationInk
+ *
+ * Returns: the number of strokes in @annot
+ */
+guint
+ev_annotation_ink_get_n_strokes (EvAnnotationInk *annot)
+{
+    g_return_val_if_fail (EV_IS_ANNOTATION_INK (annot), 0);
+
+    return annot->stroke_offsets->len > 0 ? annot->stroke_offsets->len - 1 : 0;
+}
+
+/**
+ * ev_annotation_ink_get_points:
+ * @annot: an #EvAnnotationInk
+ * @n_points: (out): return location for the number of points
+ *
+ * Returns: (transfer none) (array length=n_points): the points of
+ *   all the strokes of @annot, one stroke after another
+ */
+const EvPoint *
+ev_annotation_ink_get_points (EvAnnotationInk *annot,
+                              guint           *n_points)
+{
+    g_return_val_if_fail (EV_IS_ANNOTATION_INK (annot), NULL);
+
+    *n_points = annot->points->len;
+    return (const EvPoint *) annot->points->data;
+}
+
+/**
+ * ev_annotation_ink_get_stroke:
+ * @annot: an #EvAnnotationInk
+ * @stroke: the index of the stroke
+ * @n_points: (out): return location for the number of points
+ *
+ * Returns: (transfer none) (array length=n_points): the points of
+ *   stroke @stroke, valid until the strokes of @annot change
+ */
+const EvPoint *
+ev_annotation_ink_get_stroke (EvAnnotationInk *annot,
+                              guint            stroke,
+                              guint           *n_points)
+{
+    guint first, last;
+
+    g_return_val_if_fail (EV_IS_ANNOTATION_INK (annot), NULL);
+    g_return_val_if_fail (stroke < ev_annotation_ink_get_n_strokes (annot), NULL);
+
+    first = g_array_index (annot->stroke_offsets, guint, stroke);
+    last = g_array_index (annot->stroke_offsets, guint, stroke + 1);
+
+    *n_points = last - first;
+    return &g_array_index (annot->points, EvPoint, first);
+}
+
+static void
+ev_annotation_ink_invalidate_quadtree (EvAnnotationInk *annot)
+{
+    if (annot->quadtree) {
+        ev_mapping_tree_unref (annot->quadtree);
+        annot->quadtree = NULL;
+    }
+}
+
+static void
+ev_annotation_ink_compute_bbox (EvAnnotationInk *annot)
+{
+    const EvPoint *points = (const EvPoint *) annot->points->data;
+    guint i;
+
+    if (annot->points->len == 0) {
+        annot->bbox.x1 = annot->bbox.y1 = annot->bbox.x2 = annot->bbox.y2 = 0;
+        return;
+    }
+
+    annot->bbox.x1 = annot->bbox.x2 = points[0].x;
+    annot->bbox.y1 = annot->bbox.y2 = points[0].y;
+    for (i = 1; i < annot->points->len; i++) {
+        annot->bbox.x1 = MIN (annot->bbox.x1, points[i].x);
+        annot->bbox.y1 = MIN (annot->bbox.y1, points[i].y);
+        annot->bbox.x2 = MAX (annot->bbox.x2, points[i].x);
+        annot->bbox.y2 = MAX (annot->bbox.y2, points[i].y);
+    }
+}
+
+/* Called whenever all the points change. The quadtree is dropped and
+ * only built again by ev_annotation_ink_is_hit() */
+static void
+ev_annotation_ink_update_bbox (EvAnnotationInk *annot)
+{
+    guint i;
+
+    ev_annotation_ink_invalidate_quadtree (annot);
+    ev_annotation_ink_compute_bbox (annot);
+
+    g_array_set_size (annot->stroke_ids, 0);
+    for (i = 0; i < ev_annotation_ink_get_n_strokes (annot); i++)
+        g_array_append_val (annot->stroke_ids, i);
+    annot->next_stroke_id = i;
+}
+
+static void
+ev_annotation_ink_segment_extents (EvAnnotationInk *annot,
+                                   const EvPoint   *p,
+                                   const EvPoint   *q,
+                                   EvRectangle     *rect)
+{
+    gdouble half_width = annot->width / 2;
+
+    rect->x1 = MIN(q->x, p->x) - half_width;
+    rect->x2 = MAX(q->x, p->x) + half_width;
+    rect->y1 = MIN(q->y, p->y) - half_width;
+    rect->y2 = MAX(q->y, p->y) + half_width;
+}
+
+/* Build the hit-testing data from the packed strokes */
+static void
+ev_annotation_ink_update_quadtree (EvAnnotationInk *annot)
+{
+    const EvPoint *points = (const EvPoint *) annot->points->data;
+    guint  n_strokes = ev_annotation_ink_get_n_strokes (annot);
+    guint  i, j;
+
+    gdouble half_width = annot->width / 2;
+
+    /* Leave room around the strokes, so that the tree survives
+     * strokes appended next to the existing ones */
+    EvRectangle extents;
+    gdouble margin_x = (annot->bbox.x2 - annot->bbox.x1) / 4 + half_width;
+    gdouble margin_y = (annot->bbox.y2 - annot->bbox.y1) / 4 + half_width;
+    extents.x1 = annot->bbox.x1 - margin_x;
+    extents.y1 = annot->bbox.y1 - margin_y;
+    extents.x2 = annot->bbox.x2 + margin_x;
+    extents.y2 = annot->bbox.y2 + margin_y;
+
+    EvMappingTreeEntry *entries = g_new (EvMappingTreeEntry, MAX (annot->points->len, 1));
+    guint n_entries = 0;
+
+    for (i = 0; i < n_strokes; i++) {
+        guint first = g_array_index (annot->stroke_offsets, guint, i);
+        guint last = g_array_index (annot->stroke_offsets, guint, i + 1);
+        guint id = g_array_index (annot->stroke_ids, guint, i);
+
+        for (j = first + 1; j < last; j++) {
+            ev_annotation_ink_segment_extents (annot, &points[j - 1], &points[j],
+                                               &entries[n_entries].extents);
+            entries[n_entries].item = INK_SEGMENT_ITEM (id, j - first);
+            entries[n_entries].z = 0;
+            n_entries++;
+        }
+    }
+
+    annot->quadtree_extents = extents;
+    annot->quadtree = ev_mapping_tree_new_bulk (0, extents,
+                                                entries, n_entries,
+                                                is_on_line, annot,
+                                                NULL);
+    g_free (entries);
+}
+
+/**
+ * ev_annotation_ink_set_points:
+ * @annot: an #EvAnnotationInk
+ * @points: (array length=n_points): the points of all the strokes,
+ *   one stroke after another
+ * @n_points: the number of points
+ * @stroke_lengths: (array length=n_strokes): the number of points of
+ *   each stroke
+ * @n_strokes: the number of strokes
+ *
+ * Replaces the strokes of @annot. The points are copied into a single
+ * buffer owned by @annot.
+ */
+void
+ev_annotation_ink_set_points (EvAnnotationInk *annot,
+                              const EvPoint   *points,
+                              guint            n_points,
+                              const guint     *stroke_lengths,
+                              guint            n_strokes)
+{
+    guint i, offset = 0;
+
+    g_return_if_fail (EV_IS_ANNOTATION_INK (annot));
+    g_return_if_fail (n_points == 0 || points != NULL);
+    g_return_if_fail (n_strokes == 0 || stroke_lengths != NULL);
+
+    g_return_if_fail (n_strokes == 0 || n_strokes - 1 <= INK_SEGMENT_MAX);
+    for (i = 0; i < n_strokes; i++) {
+        g_return_if_fail (stroke_lengths[i] == 0 || stroke_lengths[i] - 1 <= INK_SEGMENT_MAX);
+        offset += stroke_lengths[i];
+    }
+    g_return_if_fail (offset == n_points);
+
+    ev_annotation_ink_free_paths (annot);
+
+    g_array_set_size (annot->points, 0);
+    g_array_append_vals (annot->points, points, n_points);
+
+    offset = 0;
+    g_array_set_size (annot->stroke_offsets, 0);
+    g_array_append_val (annot->stroke_offsets, offset);
+    for (i = 0; i < n_strokes; i++) {
+        offset += stroke_lengths[i];
+        g_array_append_val (annot->stroke_offsets, offset);
+    }
+
+    ev_annotation_ink_update_bbox (annot);
+}
+
+/**
+ * ev_annotation_ink_set_paths:
+ * @annot: an #EvAnnotationInk
+ * @paths: an array of paths, each one an array of interleaved x, y
+ *   coordinates
+ *
+ * Compatibility setter: the coordinates are copied into the packed
+ * storage of @annot and @paths is not referenced.
+ */
 void
 ev_annotation_ink_set_paths(	EvAnnotationInk *annot,
 				GArray *paths)
 {
-	int i;
-    
-    // Copy the path into the array 
-    if (annot->paths) {
-        for (i=0; i<annot->paths->len; i++) {
-            g_array_unref(g_array_index(annot->paths, GArray*, i));
+    guint i;
+
+    ev_annotation_ink_free_paths (annot);
+
+    g_array_set_size (annot->points, 0);
+    g_array_set_size (annot->stroke_offsets, 0);
+    g_array_append_val (annot->stroke_offsets, annot->points->len);
+
+    for (i = 0; i < paths->len; i++) {
+        GArray *path = g_array_index (paths, GArray*, i);
+
+        g_array_append_vals (annot->points, path->data, path->len / 2);
+        g_array_append_val (annot->stroke_offsets, annot->points->len);
+    }
+
+    ev_annotation_ink_update_bbox (annot);
+}
+
+/**
+ * ev_annotation_ink_append_path:
+ * @annot: an #EvAnnotationInk
+ * @points: (array length=n_points): the points of the new stroke
+ * @n_points: the number of points
+ *
+ * Adds a stroke after the existing ones. If the hit-testing data was
+ * already built, only the segments of the new stroke are inserted.
+ */
+void
+ev_annotation_ink_append_path (EvAnnotationInk *annot,
+                               const EvPoint   *points,
+                               guint            n_points)
+{
+    g_return_if_fail (EV_IS_ANNOTATION_INK (annot));
+
+    ev_annotation_ink_insert_path (annot, annot->next_stroke_id, points, n_points);
+}
+
+/**
+ * ev_annotation_ink_insert_path:
+ * @annot: an #EvAnnotationInk
+ * @id: the id of the new stroke, not used by any stroke of @annot
+ * @points: (array length=n_points): the points of the new stroke
+ * @n_points: the number of points
+ *
+ * Adds a stroke with the given id. Strokes are kept in the order of
+ * their ids, so a stroke removed with ev_annotation_ink_remove_path()
+ * goes back to its place when inserted again with its old id. If the
+ * hit-testing data was already built, only the segments of the new
+ * stroke are inserted.
+ */
+void
+ev_annotation_ink_insert_path (EvAnnotationInk *annot,
+                               guint            id,
+                               const EvPoint   *points,
+                               guint            n_points)
+{
+    guint stroke, first, j;
+
+    g_return_if_fail (EV_IS_ANNOTATION_INK (annot));
+    g_return_if_fail (ev_annotation_ink_get_stroke_index (annot, id) == -1);
+    /* Or the segment items would wrap, see INK_SEGMENT_ITEM */
+    g_return_if_fail (id <= INK_SEGMENT_MAX);
+    g_return_if_fail (n_points == 0 || n_points - 1 <= INK_SEGMENT_MAX);
+
+    ev_annotation_ink_free_paths (annot);
+
+    if (annot->stroke_offsets->len == 0)
+        g_array_append_val (annot->stroke_offsets, annot->points->len);
+
+    stroke = ev_annotation_ink_find_stroke (annot, id);
+    first = g_array_index (annot->stroke_offsets, guint, stroke);
+
+    g_array_insert_vals (annot->points, first, points, n_points);
+    g_array_insert_val (annot->stroke_offsets, stroke + 1, first);
+    for (j = stroke + 1; j < annot->stroke_offsets->len; j++)
+        g_array_index (annot->stroke_offsets, guint, j) += n_points;
+    g_array_insert_val (annot->stroke_ids, stroke, id);
+    annot->next_stroke_id = MAX (annot->next_stroke_id, id + 1);
+
+    if (annot->points->len == n_points) {
+        ev_annotation_ink_compute_bbox (annot);
+    } else {
+        for (j = 0; j < n_points; j++) {
+            annot->bbox.x1 = MIN (annot->bbox.x1, points[j].x);
+            annot->bbox.y1 = MIN (annot->bbox.y1, points[j].y);
+            annot->bbox.x2 = MAX (annot->bbox.x2, points[j].x);
+            annot->bbox.y2 = MAX (annot->bbox.y2, points[j].y);
         }
-        g_array_unref(annot->paths);
     }
 
-	annot->paths = paths;
+    if (!annot->quadtree)
+        return;
 
-	for (i=0; i<paths->len; i++) {
-		g_array_ref(g_array_index(paths, GArray*, i));
-	}
-	g_array_ref(paths);
+    for (j = 1; j < n_points; j++) {
+        EvRectangle rect;
 
-    // Find the extents of the annotation
-    gboolean first_time = TRUE;
-    gdouble min_x = 0, max_x = 1, min_y = 1, max_y = 1;
-    gdouble half_width = annot->width / 2;
-	for (i=0; i<paths->len; i++) {
-        GArray *path = g_array_index(paths, GArray*, i);
-        int j;
-        for (j=0; j<path->len; j+=2) {
-            if (first_time) {
-                max_x = min_x = g_array_index(path, gdouble, j);
-                max_y = min_y = g_array_index(path, gdouble, j + 1);
-                first_time = FALSE;
-            }
-            
-            min_x = MIN(min_x, g_array_index(path, gdouble, j));
-            min_y = MIN(min_y, g_array_index(path, gdouble, j + 1));
-            max_x = MAX(max_x, g_array_index(path, gdouble, j));
-            max_y = MAX(max_y, g_array_index(path, gdouble, j + 1));
+        ev_annotation_ink_segment_extents (annot, &points[j - 1], &points[j], &rect);
+
+        /* Out of the space of the tree: it is built again, with
+         * room for the new extents, on the next hit test */
+        if (rect.x1 < annot->quadtree_extents.x1 || rect.x2 > annot->quadtree_extents.x2 ||
+            rect.y1 < annot->quadtree_extents.y1 || rect.y2 > annot->quadtree_extents.y2 ||
+            ev_mapping_tree_add (annot->quadtree, INK_SEGMENT_ITEM (id, j), rect,
+                                 is_on_line, annot) < 0) {
+            ev_annotation_ink_invalidate_quadtree (annot);
+            return;
         }
-	}
+    }
+}
+
+/**
+ * ev_annotation_ink_get_stroke_id:
+ * @annot: an #EvAnnotationInk
+ * @stroke: the index of a stroke
+ *
+ * Returns: the id of stroke @stroke, which doesn't change when other
+ *   strokes are added or removed
+ */
+guint
+ev_annotation_ink_get_stroke_id (EvAnnotationInk *annot,
+                                 guint            stroke)
+{
+    g_return_val_if_fail (EV_IS_ANNOTATION_INK (annot), 0);
+    g_return_val_if_fail (stroke < ev_annotation_ink_get_n_strokes (annot), 0);
 
+    return g_array_index (annot->stroke_ids, guint, stroke);
+}
+
+/**
+ * ev_annotation_ink_get_stroke_index:
+ * @annot: an #EvAnnotationInk
+ * @id: a stroke id
+ *
+ * Returns: the index of the stroke with id @id, or -1 if @annot has
+ *   no such stroke
+ */
+gint
+ev_annotation_ink_get_stroke_index (EvAnnotationInk *annot,
+                                    guint            id)
+{
+    guint stroke;
+
+    g_return_val_if_fail (EV_IS_ANNOTATION_INK (annot), -1);
+
+    stroke = ev_annotation_ink_find_stroke (annot, id);
+    if (stroke < annot->stroke_ids->len && g_array_index (annot->stroke_ids, guint, stroke) == id)
+        return stroke;
+
+    return -1;
+}
+
+/**
+ * ev_annotation_ink_remove_path:
+ * @annot: an #EvAnnotationInk
+ * @stroke: the index of the stroke to remove
+ *
+ * Removes a stroke; the following strokes move down one index. If the
+ * hit-testing data was already built, only the segments of the
+ * removed stroke are taken out of it.
+ */
+void
+ev_annotation_ink_remove_path (EvAnnotationInk *annot,
+                               guint            stroke)
+{
+    guint first, last, j;
+
+    g_return_if_fail (EV_IS_ANNOTATION_INK (annot));
+    g_return_if_fail (stroke < ev_annotation_ink_get_n_strokes (annot));
+
+    ev_annotation_ink_free_paths (annot);
+
+    first = g_array_index (annot->stroke_offsets, guint, stroke);
+    last = g_array_index (annot->stroke_offsets, guint, stroke + 1);
 
-    // Copy the path into the quadtree data structure
     if (annot->quadtree) {
-        ev_mapping_tree_unref(annot->quadtree);
+        guint id = g_array_index (annot->stroke_ids, guint, stroke);
+
+        for (j = 1; j < last - first; j++)
+            ev_mapping_tree_remove (annot->quadtree, INK_SEGMENT_ITEM (id, j));
     }
-    EvRectangle extents;
-    extents.x1 = min_x - half_width;
-    extents.y1 = min_y - half_width;
-    extents.x2 = max_x + half_width;
-    extents.y2 = max_y + half_width;
-    annot->quadtree = ev_mapping_tree_new(0, extents, g_free);
-
-	for (i=0; i<paths->len; i++) {
-        GArray *path = g_array_index(annot->paths, GArray*, i);
-        int j;
-        gdouble xp, yp;
-        for (j=0; j<path->len; j += 2) {
-            gdouble x, y;
-            x = g_array_index(path, gdouble, j);
-            y = g_array_index(path, gdouble, j + 1);
-
-            if (j > 0) {
-                EvRectangle rect;
-                EvRectangle *line = g_malloc(sizeof(EvRectangle));
-
-                rect.x1 = MIN(x, xp) - half_width;
-                rect.x2 = MAX(x, xp) + half_width;
-                rect.y1 = MIN(y, yp) - half_width;
-                rect.y2 = MAX(y, yp) + half_width;
-
-                line->x1 = xp;
-                line->x2 = x;
-                line->y1 = yp;
-                line->y2 = y;
-
-                ev_mapping_tree_add(annot->quadtree,
-                            line, rect,
-                            is_on_line, annot);
+
+    g_array_remove_range (annot->points, first, last - first);
+    g_array_remove_index (annot->stroke_offsets, stroke + 1);
+    for (j = stroke + 1; j < annot->stroke_offsets->len; j++)
+        g_array_index (annot->stroke_offsets, guint, j) -= last - first;
+    g_array_remove_index (annot->stroke_ids, stroke);
+
+    /* The tree extents are kept: the bounding box only shrinks */
+    ev_annotation_ink_compute_bbox (annot);
+}
+
+/* Squared distance from (x, y) to the segment (x1, y1) - (x2, y2) */
+static gdouble
+squared_distance_to_segment (gdouble x,  gdouble y,
+                             gdouble x1, gdouble y1,
+                             gdouble x2, gdouble y2)
+{
+    gdouble dx = x2 - x1;
+    gdouble dy = y2 - y1;
+    gdouble sq_length = squared_distance (dx, dy);
+    gdouble t;
+
+    if (sq_length == 0)
+        return squared_distance (x - x1, y - y1);
+
+    t = ((x - x1) * dx + (y - y1) * dy) / sq_length;
+    t = CLAMP (t, 0, 1);
+
+    return squared_distance (x - (x1 + t * dx), y - (y1 + t * dy));
+}
+
+/**
+ * ev_annotation_ink_simplify_path:
+ * @points: (array length=n_points): the points of a stroke
+ * @n_points: the number of points
+ * @tolerance: the maximum distance a removed point may lie from the
+ *   simplified path
+ *
+ * Simplifies a stroke in place with the Douglas-Peucker algorithm.
+ * The kept points are moved to the start of @points and the first and
+ * last points are always kept. A @tolerance of 0 or less leaves the
+ * stroke untouched.
+ *
+ * Returns: the number of points kept
+ */
+guint
+ev_annotation_ink_simplify_path (EvPoint *points,
+                                 guint    n_points,
+                                 gdouble  tolerance)
+{
+    gdouble   sq_tolerance = tolerance * tolerance;
+    gboolean *keep;
+    guint    *stack;
+    guint     n_stack = 0;
+    guint     i, n_kept;
+
+    if (n_points <= 2 || tolerance <= 0)
+        return n_points;
+
+    /* Ranges on the stack never overlap, so there are at most
+     * n_points of them at any time */
+    keep = g_new0 (gboolean, n_points);
+    stack = g_new (guint, 2 * n_points);
+
+    keep[0] = keep[n_points - 1] = TRUE;
+    stack[n_stack++] = 0;
+    stack[n_stack++] = n_points - 1;
+
+    while (n_stack > 0) {
+        guint   last = stack[--n_stack];
+        guint   first = stack[--n_stack];
+        guint   farthest = first;
+        gdouble max_sq_distance = 0;
+
+        for (i = first + 1; i < last; i++) {
+            gdouble d = squared_distance_to_segment (points[i].x, points[i].y,
+                                                     points[first].x, points[first].y,
+                                                     points[last].x, points[last].y);
+            if (d > max_sq_distance) {
+                max_sq_distance = d;
+                farthest = i;
             }
+        }
+
+        if (max_sq_distance <= sq_tolerance)
+            continue;
 
-            xp = x; yp = y;
+        keep[farthest] = TRUE;
+        if (farthest - first > 1) {
+            stack[n_stack++] = first;
+            stack[n_stack++] = farthest;
         }
-	}
+        if (last - farthest > 1) {
+            stack[n_stack++] = farthest;
+            stack[n_stack++] = last;
+        }
+    }
+
+    for (i = 0, n_kept = 0; i < n_points; i++) {
+        if (!keep[i])
+            continue;
+
+        points[n_kept++] = points[i];
+    }
+
+    g_free (stack);
+    g_free (keep);
+
+    return n_kept;
 }
 
 gboolean
 ev_annotation_ink_is_hit (EvAnnotationInk *annot, gdouble x, gdouble y)
 {
-    gpointer hit_item = ev_mapping_tree_get(annot->quadtree, x, y);
+    gdouble half_width = annot->width / 2;
+    gpointer hit_item;
+
+    /* Nothing outside the tree extents can hit; most annotations of a
+     * page never get past this, so their tree is never built */
+    if (annot->points->len == 0 ||
+        x < annot->bbox.x1 - half_width || x > annot->bbox.x2 + half_width ||
+        y < annot->bbox.y1 - half_width || y > annot->bbox.y2 + half_width)
+        return FALSE;
+
+    if (!annot->quadtree)
+        ev_annotation_ink_update_quadtree (annot);
+
+    hit_item = ev_mapping_tree_get(annot->quadtree, x, y);
 
     return (hit_item != 0);
 }
 
+struct EraseQuery {
+    EvAnnotationInk *annot;
+    gdouble          x, y;
+    gdouble          reach;
+};
+
+static gboolean
+segment_in_reach (gpointer item, gpointer data)
+{
+    struct EraseQuery *query = data;
+    const EvPoint *end = ev_annotation_ink_segment_end (query->annot, item);
+    const EvPoint *start = end - 1;
+
+    return squared_distance_to_segment (query->x, query->y,
+                                        start->x, start->y,
+                                        end->x, end->y) <= query->reach * query->reach;
+}
+
+static gint
+compare_segment_items (gconstpointer a, gconstpointer b)
+{
+    gsize ia = GPOINTER_TO_SIZE (*(gpointer *) a);
+    gsize ib = GPOINTER_TO_SIZE (*(gpointer *) b);
+
+    return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/**
+ * ev_annotation_ink_erase:
+ * @annot: an #EvAnnotationInk
+ * @x: X coordinate of the eraser
+ * @y: Y coordinate of the eraser
+ * @radius: radius of the eraser
+ *
+ * Removes the segments of @annot that pass within @radius of (x, y),
+ * splitting the strokes they belong to. Only the touched strokes are
+ * rewritten, and the hit-testing data is updated in place; the pieces
+ * of a split stroke are moved after the other strokes.
+ *
+ * Returns: %TRUE if anything was erased
+ */
+gboolean
+ev_annotation_ink_erase (EvAnnotationInk *annot,
+                         gdouble          x,
+                         gdouble          y,
+                         gdouble          radius)
+{
+    return ev_annotation_ink_erase_full (annot, x, y, radius, NULL, NULL);
+}
+
+/**
+ * ev_annotation_ink_erase_full:
+ * @annot: an #EvAnnotationInk
+ * @x: X coordinate of the eraser
+ * @y: Y coordinate of the eraser
+ * @radius: radius of the eraser
+ * @func: (scope call) (allow-none): called for every stroke removed
+ *   and every piece of it added back
+ * @user_data: data for @func
+ *
+ * Like ev_annotation_ink_erase(), telling @func how the strokes
+ * changed, so that the change can be undone.
+ *
+ * Returns: %TRUE if anything was erased
+ */
+gboolean
+ev_annotation_ink_erase_full (EvAnnotationInk         *annot,
+                              gdouble                  x,
+                              gdouble                  y,
+                              gdouble                  radius,
+                              EvAnnotationInkEraseFunc func,
+                              gpointer                 user_data)
+{
+    struct EraseQuery query;
+    EvRectangle region;
+    GList *hits, *l;
+    gpointer *items;
+    guint n_items, i;
+
+    g_return_val_if_fail (EV_IS_ANNOTATION_INK (annot), FALSE);
+
+    query.annot = annot;
+    query.x = x;
+    query.y = y;
+    query.reach = radius + annot->width / 2;
+
+    region.x1 = x - query.reach;
+    region.y1 = y - query.reach;
+    region.x2 = x + query.reach;
+    region.y2 = y + query.reach;
+
+    if (annot->points->len == 0 ||
+        region.x2 < annot->bbox.x1 || region.x1 > annot->bbox.x2 ||
+        region.y2 < annot->bbox.y1 || region.y1 > annot->bbox.y2)
+        return FALSE;
+
+    if (!annot->quadtree)
+        ev_annotation_ink_update_quadtree (annot);
+
+    hits = ev_mapping_tree_get_in_rect (annot->quadtree, &region,
+                                        segment_in_reach, &query);
+    if (!hits)
+        return FALSE;
+
+    /* Sorting the items groups the segments by stroke */
+    n_items = g_list_length (hits);
+    items = g_new (gpointer, n_items);
+    for (l = hits, i = 0; l; l = l->next, i++)
+        items[i] = l->data;
+    g_list_free (hits);
+    qsort (items, n_items, sizeof (gpointer), compare_segment_items);
+
+    /* Every piece takes a new id, at most one more per hit stroke
+     * than there are hit segments */
+    if (INK_SEGMENT_MAX - annot->next_stroke_id < 2 * (gsize) n_items) {
+        g_warning ("Ink stroke ids exhausted, nothing erased");
+        g_free (items);
+        return FALSE;
+    }
+
+    for (i = 0; i < n_items; ) {
+        guint id = INK_SEGMENT_STROKE (items[i]);
+        guint stroke = ev_annotation_ink_find_stroke (annot, id);
+        const EvPoint *points;
+        GBytes *copy;
+        gboolean *erased;
+        guint n_points, j, run_start = 0;
+
+        points = ev_annotation_ink_get_stroke (annot, stroke, &n_points);
+        copy = g_bytes_new (points, n_points * sizeof (EvPoint));
+        points = g_bytes_get_data (copy, NULL);
+        erased = g_new0 (gboolean, n_points + 1);
+        for (; i < n_items && INK_SEGMENT_STROKE (items[i]) == id; i++)
+            erased[INK_SEGMENT_POINT (items[i])] = TRUE;
+
+        if (func)
+            func (annot, id, copy, FALSE, user_data);
+        ev_annotation_ink_remove_path (annot, stroke);
+
+        /* Segment j joins points j - 1 and j */
+        for (j = 1; j <= n_points; j++) {
+            if (j < n_points && !erased[j])
+                continue;
+            if (j - run_start >= 2) {
+                ev_annotation_ink_append_path (annot, &points[run_start], j - run_start);
+                if (func) {
+                    GBytes *piece;
+
+                    piece = g_bytes_new_from_bytes (copy, run_start * sizeof (EvPoint),
+                                                    (j - run_start) * sizeof (EvPoint));
+                    func (annot, annot->next_stroke_id - 1, piece, TRUE, user_data);
+                    g_bytes_unref (piece);
+                }
+            }
+            run_start = j;
+        }
+
+        g_free (erased);
+        g_bytes_unref (copy);
+    }
+
+    g_free (items);
+
+    return TRUE;
+}
+
 static void
 ev_annotation_ink_get_property (GObject    *object,
 				 guint       prop_id,
@@ -1757,8 +2471,12 @@ ev_annotation_ink_get_property (GObject    *object,
 	}
 
 	switch (prop_id) {
-	case PROP_INK_PATHS:
-		g_value_set_pointer (value, annot->paths);
+	case PROP_INK_PATHS: {
+		GArray *paths;
+
+		ev_annotation_ink_get_paths (annot, &paths);
+		g_value_set_pointer (value, paths);
+		}
 		break;
 	case PROP_INK_WIDTH:
 		g_value_set_double (value, annot->width);
@@ -140,6 +140,23 @@ typedef struct {
     EvAnnotationInkOperator ink_operator;
 } EvAnnotationBrush;
 
+/**
+ * EvAnnotationInkEraseFunc:
+ * @annot: the #EvAnnotationInk being erased
+ * @stroke_id: the id of the stroke
+ * @points: the points of the stroke, as #EvPoint
+ * @added: %FALSE for a stroke removed, %TRUE for a piece of it added back
+ * @user_data: the data passed to ev_annotation_ink_erase_full()
+ *
+ * Told about the strokes rewritten by ev_annotation_ink_erase_full().
+ * The pieces of a split stroke share the buffer of its points.
+ */
+typedef void (* EvAnnotationInkEraseFunc) (EvAnnotationInk *annot,
+                                           guint            stroke_id,
+                                           GBytes          *points,
+                                           gboolean         added,
+                                           gpointer         user_data);
+
 /* EvAnnotation */
 GType                ev_annotation_get_type                  (void) G_GNUC_CONST;
 EvAnnotationType     ev_annotation_get_annotation_type       (EvAnnotation           *annot);
@@ -227,6 +244,16 @@ gboolean                   ev_annotation_text_markup_set_markup_type (EvAnnotati
 GType                ev_annotation_ink_get_type             (void) G_GNUC_CONST;
 EvAnnotation        *ev_annotation_ink_new                  (EvPage                 *page);
 gboolean            ev_annotation_ink_is_hit               (EvAnnotationInk *annot, gdouble x, gdouble y);
+gboolean            ev_annotation_ink_erase                (EvAnnotationInk *annot,
+                                                            gdouble          x,
+                                                            gdouble          y,
+                                                            gdouble          radius);
+gboolean            ev_annotation_ink_erase_full           (EvAnnotationInk         *annot,
+                                                            gdouble                  x,
+                                                            gdouble                  y,
+                                                            gdouble                  radius,
+                                                            EvAnnotationInkEraseFunc func,
+                                                            gpointer                 user_data);
 void                ev_annotation_ink_set_widths            (EvAnnotationInk *annot,
                                                				GArray *widths );
 
@@ -242,6 +269,33 @@ void                ev_annotation_ink_set_paths             (EvAnnotationInk *an
                                                				GArray *paths);
 gboolean            ev_annotation_ink_get_paths             (EvAnnotationInk *annot,
                                                             GArray **paths);
+void                ev_annotation_ink_set_points            (EvAnnotationInk *annot,
+                                                            const EvPoint   *points,
+                                                            guint            n_points,
+                                                            const guint     *stroke_lengths,
+                                                            guint            n_strokes);
+const EvPoint      *ev_annotation_ink_get_points            (EvAnnotationInk *annot,
+                                                            guint           *n_points);
+guint               ev_annotation_ink_get_n_strokes         (EvAnnotationInk *annot);
+void                ev_annotation_ink_append_path           (EvAnnotationInk *annot,
+                                                            const EvPoint   *points,
+                                                            guint            n_points);
+void                ev_annotation_ink_remove_path           (EvAnnotationInk *annot,
+                                                            guint            stroke);
+void                ev_annotation_ink_insert_path           (EvAnnotationInk *annot,
+                                                            guint            id,
+                                                            const EvPoint   *points,
+                                                            guint            n_points);
+guint               ev_annotation_ink_get_stroke_id         (EvAnnotationInk *annot,
+                                                            guint            stroke);
+gint                ev_annotation_ink_get_stroke_index      (EvAnnotationInk *annot,
+                                                            guint            id);
+const EvPoint      *ev_annotation_ink_get_stroke            (EvAnnotationInk *annot,
+                                                            guint            stroke,
+                                                            guint           *n_points);
+guint               ev_annotation_ink_simplify_path         (EvPoint         *points,
+                                                            guint            n_points,
+                                                            gdouble          tolerance);
 G_END_DECLS
 
 #endif /* EV_ANNOTATION_H */
@@ -53,7 +53,8 @@ debug_init (void)
 {
         const GDebugKey keys[] = {
                 { "jobs",    EV_DEBUG_JOBS         },
-                { "borders", EV_DEBUG_SHOW_BORDERS }
+                { "borders", EV_DEBUG_SHOW_BORDERS },
+                { "ink",     EV_DEBUG_INK          }
         };
         const GDebugKey border_keys[] = {
                 { "chars",      EV_DEBUG_BORDER_CHARS      },
@@ -73,7 +73,8 @@ G_BEGIN_DECLS
 typedef enum {
 	EV_NO_DEBUG           = 0,
 	EV_DEBUG_JOBS         = 1 << 0,
-        EV_DEBUG_SHOW_BORDERS = 1 << 1
+        EV_DEBUG_SHOW_BORDERS = 1 << 1,
+        EV_DEBUG_INK          = 1 << 2
 } EvDebugSection;
 
 typedef enum {
@@ -88,6 +89,7 @@ typedef enum {
 } EvDebugBorders;
 
 #define DEBUG_JOBS      EV_DEBUG_JOBS,    __FILE__, __LINE__, G_STRFUNC
+#define DEBUG_INK       EV_DEBUG_INK,     __FILE__, __LINE__, G_STRFUNC
 
 /*
  * Set an environmental var of the same name to turn on
@@ -91,3 +91,43 @@ ev_document_annotations_can_remove_annotation (EvDocumentAnnotations *document_a
 
 	return iface->remove_annotation != NULL;
 }
+
+/**
+ * ev_document_annotations_begin_transaction:
+ * @document_annots: an #EvDocumentAnnotations
+ *
+ * Starts a batch of annotation changes. Until the matching
+ * ev_document_annotations_commit_transaction(), the backend may only
+ * queue the annotations passed to ev_document_annotations_add_annotation(),
+ * ev_document_annotations_save_annotation() and
+ * ev_document_annotations_remove_annotation(), and apply them all at
+ * once when committing. Transactions can be nested; the changes are
+ * applied when the outermost one is committed.
+ *
+ * The document lock should be held from the beginning of the
+ * transaction until it's committed.
+ */
+void
+ev_document_annotations_begin_transaction (EvDocumentAnnotations *document_annots)
+{
+	EvDocumentAnnotationsInterface *iface = EV_DOCUMENT_ANNOTATIONS_GET_IFACE (document_annots);
+
+	if (iface->begin_transaction)
+		iface->begin_transaction (document_annots);
+}
+
+/**
+ * ev_document_annotations_commit_transaction:
+ * @document_annots: an #EvDocumentAnnotations
+ *
+ * Applies the annotation changes made since the matching
+ * ev_document_annotations_begin_transaction().
+ */
+void
+ev_document_annotations_commit_transaction (EvDocumentAnnotations *document_annots)
+{
+	EvDocumentAnnotationsInterface *iface = EV_DOCUMENT_ANNOTATIONS_GET_IFACE (document_annots);
+
+	if (iface->commit_transaction)
+		iface->commit_transaction (document_annots);
+}
@@ -61,8 +61,11 @@ typedef enum {
         /* Text Markup Annotations */
         EV_ANNOTATIONS_SAVE_TEXT_MARKUP_TYPE = 1 << 9,
 
+	/* Ink Annotations */
+	EV_ANNOTATIONS_SAVE_INK_PATHS        = 1 << 10,
+
 	/* Save all */
-	EV_ANNOTATIONS_SAVE_ALL              = (1 << 10) - 1
+	EV_ANNOTATIONS_SAVE_ALL              = (1 << 11) - 1
 } EvAnnotationsSaveMask;
 
 typedef struct _EvDocumentAnnotations          EvDocumentAnnotations;
@@ -84,6 +87,8 @@ struct _EvDocumentAnnotationsInterface
 						 EvAnnotationsSaveMask  mask);
 	void	       (* remove_annotation)    (EvDocumentAnnotations *document_annots,
 						 EvAnnotation          *annot);
+	void           (* begin_transaction)    (EvDocumentAnnotations *document_annots);
+	void           (* commit_transaction)   (EvDocumentAnnotations *document_annots);
 };
 
 GType          ev_document_annotations_get_type             (void) G_GNUC_CONST;
@@ -101,6 +106,8 @@ void           ev_document_annotations_save_annotation      (EvDocumentAnnotatio
 							     EvAnnotationsSaveMask  mask);
 gboolean       ev_document_annotations_can_add_annotation    (EvDocumentAnnotations *document_annots);
 gboolean       ev_document_annotations_can_remove_annotation (EvDocumentAnnotations *document_annots);
+void           ev_document_annotations_begin_transaction     (EvDocumentAnnotations *document_annots);
+void           ev_document_annotations_commit_transaction    (EvDocumentAnnotations *document_annots);
 
 G_END_DECLS
 
@@ -240,7 +240,11 @@ _ev_document_factory_init (void)
         g_free (dir);
 }
 #else
-        ev_backends_dir = g_strdup (EV_BACKENDSDIR);
+        /* Tests run with the backends of the build tree */
+        if (g_getenv ("EV_BACKENDS_DIR"))
+                ev_backends_dir = g_strdup (g_getenv ("EV_BACKENDS_DIR"));
+        else
+                ev_backends_dir = g_strdup (EV_BACKENDSDIR);
 #endif
 
         ev_backends_list = _ev_backend_info_load_from_dir (ev_backends_dir);
@@ -57,6 +57,14 @@ struct _EvDocumentPrivate
 	EvDocumentInfo *info;
 
 	synctex_scanner_t synctex_scanner;
+
+	/* Copies of the document opened again by the backend, one
+	 * per thread rendering from them, protected by instances_mutex */
+	GMutex          instances_mutex;
+	GHashTable     *render_instances;
+	guint           instances_age;
+
+	GMutex          mutex;
 };
 
 static gint            _ev_document_get_n_pages     (EvDocument *document);
@@ -132,6 +140,14 @@ ev_document_finalize (GObject *object)
 		document->priv->synctex_scanner = NULL;
 	}
 
+	if (document->priv->render_instances) {
+		g_hash_table_destroy (document->priv->render_instances);
+		document->priv->render_instances = NULL;
+	}
+
+	g_mutex_clear (&document->priv->mutex);
+	g_mutex_clear (&document->priv->instances_mutex);
+
 	G_OBJECT_CLASS (ev_document_parent_class)->finalize (object);
 }
 
@@ -139,6 +155,8 @@ static void
 ev_document_init (EvDocument *document)
 {
 	document->priv = EV_DOCUMENT_GET_PRIVATE (document);
+	g_mutex_init (&document->priv->mutex);
+	g_mutex_init (&document->priv->instances_mutex);
 
 	/* Assume all pages are the same size until proven otherwise */
 	document->priv->uniform = TRUE;
@@ -158,6 +176,117 @@ ev_document_class_init (EvDocumentClass *klass)
 	g_object_class->finalize = ev_document_finalize;
 }
 
+/**
+ * ev_document_lock:
+ * @document: an #EvDocument
+ *
+ * Acquires the lock serializing access to @document. Every document
+ * has its own lock, so a slow operation on one document does not
+ * block the others.
+ */
+void
+ev_document_lock (EvDocument *document)
+{
+	g_return_if_fail (EV_IS_DOCUMENT (document));
+
+	g_mutex_lock (&document->priv->mutex);
+}
+
+/**
+ * ev_document_unlock:
+ * @document: an #EvDocument
+ *
+ * Releases the lock acquired with ev_document_lock() or
+ * ev_document_trylock().
+ */
+void
+ev_document_unlock (EvDocument *document)
+{
+	g_return_if_fail (EV_IS_DOCUMENT (document));
+
+	g_mutex_unlock (&document->priv->mutex);
+}
+
+/**
+ * ev_document_trylock:
+ * @document: an #EvDocument
+ *
+ * Tries to acquire the lock of @document without blocking.
+ *
+ * Returns: %TRUE if the lock was acquired
+ */
+gboolean
+ev_document_trylock (EvDocument *document)
+{
+	g_return_val_if_fail (EV_IS_DOCUMENT (document), FALSE);
+
+	return g_mutex_trylock (&document->priv->mutex);
+}
+
+static gboolean
+ev_document_uses_fontconfig (EvDocument *document)
+{
+	return EV_DOCUMENT_GET_CLASS (document)->uses_fontconfig;
+}
+
+/**
+ * ev_document_fc_lock:
+ * @document: an #EvDocument
+ *
+ * Acquires the global fontconfig mutex if the backend of @document
+ * uses fontconfig, otherwise does nothing. When the document lock is
+ * also needed, it must be taken first.
+ */
+void
+ev_document_fc_lock (EvDocument *document)
+{
+	g_return_if_fail (EV_IS_DOCUMENT (document));
+
+	if (ev_document_uses_fontconfig (document))
+		g_mutex_lock (&ev_fc_mutex);
+}
+
+/**
+ * ev_document_fc_unlock:
+ * @document: an #EvDocument
+ *
+ * Releases the mutex acquired with ev_document_fc_lock() or
+ * ev_document_fc_trylock().
+ */
+void
+ev_document_fc_unlock (EvDocument *document)
+{
+	g_return_if_fail (EV_IS_DOCUMENT (document));
+
+	if (ev_document_uses_fontconfig (document))
+		g_mutex_unlock (&ev_fc_mutex);
+}
+
+/**
+ * ev_document_fc_trylock:
+ * @document: an #EvDocument
+ *
+ * Like ev_document_fc_lock(), but does not block.
+ *
+ * Returns: %TRUE if the mutex was acquired or is not needed
+ */
+gboolean
+ev_document_fc_trylock (EvDocument *document)
+{
+	g_return_val_if_fail (EV_IS_DOCUMENT (document), FALSE);
+
+	if (!ev_document_uses_fontconfig (document))
+		return TRUE;
+
+	return g_mutex_trylock (&ev_fc_mutex);
+}
+
+GMutex *
+ev_document_get_doc_mutex (void)
+{
+	return &ev_doc_mutex;
+}
+
 void
 ev_document_doc_mutex_lock (void)
 {
@@ -176,6 +305,12 @@ ev_document_doc_mutex_trylock (void)
 	return g_mutex_trylock (&ev_doc_mutex);
 }
 
+GMutex *
+ev_document_get_fc_mutex (void)
+{
+	return &ev_fc_mutex;
+}
+
 void
 ev_document_fc_mutex_lock (void)
 {
@@ -445,6 +580,161 @@ ev_document_save (EvDocument  *document,
 	return klass->save (document, uri, error);
 }
 
+/**
+ * ev_document_save_incremental:
+ * @document: a #EvDocument
+ * @uri: the target URI
+ * @progress_callback: (allow-none) (scope call): function to report
+ *   progress to, possibly from another thread, or %NULL
+ * @progress_data: user data for @progress_callback
+ * @error: a #GError location to store an error, or %NULL
+ *
+ * Saves the changes made to @document as an update after the
+ * content of @uri, which must be the file @document was loaded from,
+ * instead of writing the whole document again. Fails with
+ * %G_IO_ERROR_NOT_SUPPORTED when the backend can't do it for
+ * @document or @uri, in which case ev_document_save() should be
+ * used instead.
+ *
+ * Returns: %TRUE on success, or %FALSE on error with @error filled in
+ */
+gboolean
+ev_document_save_incremental (EvDocument            *document,
+			      const char            *uri,
+			      GFileProgressCallback  progress_callback,
+			      gpointer               progress_data,
+			      GError               **error)
+{
+	EvDocumentClass *klass = EV_DOCUMENT_GET_CLASS (document);
+
+	g_return_val_if_fail (EV_IS_DOCUMENT (document), FALSE);
+
+	if (!klass->save_incremental) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "Incremental saving is not supported");
+		return FALSE;
+	}
+
+	return klass->save_incremental (document, uri,
+					progress_callback, progress_data,
+					error);
+}
+
+/**
+ * ev_document_get_render_instance:
+ * @document: a #EvDocument
+ *
+ * Gets the copy of @document opened for the calling thread by
+ * ev_document_open_render_instance(), so that it can render pages
+ * while other threads use @document, each holding the lock of its
+ * own copy. Without one, because it wasn't opened yet, the backend
+ * can't, or can't anymore as @document differs from its file, gives
+ * @document itself. This never blocks on opening a copy.
+ *
+ * Returns: (transfer full): the #EvDocument to render from
+ */
+EvDocument *
+ev_document_get_render_instance (EvDocument *document)
+{
+	EvDocumentPrivate *priv;
+	EvDocument        *instance = NULL;
+
+	g_return_val_if_fail (EV_IS_DOCUMENT (document), NULL);
+
+	priv = document->priv;
+	g_mutex_lock (&priv->instances_mutex);
+	if (priv->render_instances)
+		instance = g_hash_table_lookup (priv->render_instances, g_thread_self ());
+	if (instance)
+		g_object_ref (instance);
+	g_mutex_unlock (&priv->instances_mutex);
+
+	return instance ? instance : g_object_ref (document);
+}
+
+/**
+ * ev_document_open_render_instance:
+ * @document: a #EvDocument
+ *
+ * Opens a copy of @document for the calling thread, to be returned by
+ * ev_document_get_render_instance(), if the backend can and there is
+ * none yet. This blocks while the backend opens the file again, so it
+ * should be called from a low priority thread job.
+ *
+ * Returns: %TRUE if the calling thread has a copy of @document
+ */
+gboolean
+ev_document_open_render_instance (EvDocument *document)
+{
+	EvDocumentClass   *klass;
+	EvDocumentPrivate *priv;
+	EvDocument        *instance;
+	GThread           *self = g_thread_self ();
+	gboolean           opened;
+	guint              age;
+
+	g_return_val_if_fail (EV_IS_DOCUMENT (document), FALSE);
+
+	klass = EV_DOCUMENT_GET_CLASS (document);
+	if (!klass->open_render_instance)
+		return FALSE;
+
+	priv = document->priv;
+	g_mutex_lock (&priv->instances_mutex);
+	opened = priv->render_instances &&
+		g_hash_table_contains (priv->render_instances, self);
+	age = priv->instances_age;
+	g_mutex_unlock (&priv->instances_mutex);
+
+	if (opened)
+		return TRUE;
+
+	instance = klass->open_render_instance (document);
+	if (!instance)
+		return FALSE;
+
+	g_mutex_lock (&priv->instances_mutex);
+	/* The document changed while the copy was being opened */
+	if (age != priv->instances_age) {
+		g_mutex_unlock (&priv->instances_mutex);
+		g_object_unref (instance);
+
+		return FALSE;
+	}
+
+	if (!priv->render_instances)
+		priv->render_instances = g_hash_table_new_full (g_direct_hash,
+								g_direct_equal,
+								NULL,
+								g_object_unref);
+	g_hash_table_replace (priv->render_instances, self, instance);
+	g_mutex_unlock (&priv->instances_mutex);
+
+	return TRUE;
+}
+
+/**
+ * ev_document_reset_render_instances:
+ * @document: a #EvDocument
+ *
+ * Drops the copies of @document given by
+ * ev_document_get_render_instance(). Backends call it when @document
+ * changes in a way its copies don't show, like an annotation edit.
+ */
+void
+ev_document_reset_render_instances (EvDocument *document)
+{
+	EvDocumentPrivate *priv;
+
+	g_return_if_fail (EV_IS_DOCUMENT (document));
+
+	priv = document->priv;
+	g_mutex_lock (&priv->instances_mutex);
+	priv->instances_age++;
+	g_clear_pointer (&priv->render_instances, g_hash_table_destroy);
+	g_mutex_unlock (&priv->instances_mutex);
+}
+
 /**
  * ev_document_get_page:
  * @document: a #EvDocument
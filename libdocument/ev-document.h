@@ -36,6 +36,7 @@
 #include "ev-document-info.h"
 #include "ev-page.h"
 #include "ev-render-context.h"
+#include "ev-macros.h"
 
 G_BEGIN_DECLS
 
@@ -130,15 +131,40 @@ struct _EvDocumentClass
 						     GError             **error);
 	cairo_surface_t * (* get_thumbnail_surface) (EvDocument          *document,
 						     EvRenderContext     *rc);
+        gboolean          (* save_incremental)      (EvDocument          *document,
+						     const char          *uri,
+						     GFileProgressCallback progress_callback,
+						     gpointer             progress_data,
+						     GError             **error);
+	EvDocument      * (* open_render_instance)  (EvDocument          *document);
+
+	/* Whether rendering goes through fontconfig, which is
+	 * not thread safe and has to be serialized across documents
+	 */
+	gboolean          uses_fontconfig;
 };
 
 GType            ev_document_get_type             (void) G_GNUC_CONST;
 GQuark           ev_document_error_quark          (void);
 
-/* Document mutex */
+/* Document lock */
+void             ev_document_lock                 (EvDocument      *document);
+void             ev_document_unlock               (EvDocument      *document);
+gboolean         ev_document_trylock              (EvDocument      *document);
+
+/* FontConfig lock, only taken for backends that use fontconfig */
+void             ev_document_fc_lock              (EvDocument      *document);
+void             ev_document_fc_unlock            (EvDocument      *document);
+gboolean         ev_document_fc_trylock           (EvDocument      *document);
+
+/* Global document mutex */
+EV_DEPRECATED_FOR(ev_document_lock)
 GMutex          *ev_document_get_doc_mutex        (void);
+EV_DEPRECATED_FOR(ev_document_lock)
 void             ev_document_doc_mutex_lock       (void);
+EV_DEPRECATED_FOR(ev_document_unlock)
 void             ev_document_doc_mutex_unlock     (void);
+EV_DEPRECATED_FOR(ev_document_trylock)
 gboolean         ev_document_doc_mutex_trylock    (void);
 
 /* FontConfig mutex */
@@ -166,6 +192,14 @@ gboolean         ev_document_load_gfile           (EvDocument         *document,
 gboolean         ev_document_save                 (EvDocument      *document,
 						   const char      *uri,
 						   GError         **error);
+gboolean         ev_document_save_incremental     (EvDocument      *document,
+						   const char      *uri,
+						   GFileProgressCallback progress_callback,
+						   gpointer         progress_data,
+						   GError         **error);
+EvDocument      *ev_document_get_render_instance  (EvDocument      *document);
+gboolean         ev_document_open_render_instance (EvDocument      *document);
+void             ev_document_reset_render_instances (EvDocument    *document);
 gint             ev_document_get_n_pages          (EvDocument      *document);
 EvPage          *ev_document_get_page             (EvDocument      *document,
 						   gint             index);
@@ -126,11 +126,11 @@ ev_mapping_list_get_all (EvMappingList *mapping_list,
 		    (y >= mapping->area.y1) &&
 		    (x <= mapping->area.x2) &&
 		    (y <= mapping->area.y2)) {
-			return_list = g_list_append(return_list, mapping);
+			return_list = g_list_prepend(return_list, mapping);
 		}
 	}
 
-	return return_list;
+	return g_list_reverse(return_list);
 }
 
 
@@ -23,6 +23,7 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * SECTION: ev-mapping-tree
@@ -34,6 +35,11 @@
  * half the line width.
  *
  */
+#define MAX_DEPTH           29
+#define SMALLEST_QT_UNIT    (1.0 / (1<<28))
+#define EXPANSION           0.999
+#define MIN_CELL_SLOTS      16
+
 struct _EvMappingTree {
 	guint          page;
 	//GList         *list;
@@ -42,16 +48,43 @@ struct _EvMappingTree {
     EvRectangle    extents;
 
     /* private indexing fields... */
-    GHashTable      *cell_index;
-    GList           *items;
-    GArray          *depth_mask;
-    GHashTable      *reverse_index;
+    struct CellSlot *cells;         /* open addressing, cell key -> first pair */
+    guint            cells_mask;    /* number of slots - 1 */
+    guint            n_cells;
+    GArray          *pairs;         /* struct ItemHitFunctionPair */
+    gint             free_pair;     /* first removed pair, or -1 */
+    guint            n_items;
+    gboolean         depth_mask[MAX_DEPTH];
+    GHashTable      *reverse_index; /* item -> pair + 1, built on first removal */
+
+    EvMappingTreeStats stats;
+};
+/* A slot of the cell table; empty slots have a negative key. A cell
+ * whose items were all removed keeps its slot with no pairs. */
+struct CellSlot {
+    int64_t                     coords;
+    gint                        head;
 };
+/* Pairs of a cell are chained through their indices in the pairs
+ * array. Removed pairs have a NULL item and are chained in the free
+ * list. */
 struct ItemHitFunctionPair {
     EvMappingTreeHitFunction    hit_func;
     gpointer                    item;
     gpointer                    data; /* data to pass to hit_func */
-    GList                       *link;
+    int64_t                     coords;
+    EvRectangle                 extents;
+    guint                       z;
+    gint                        next;
+};
+
+/* A point query either stops at the first hit, or looks at all of
+ * them for the one with the greatest z in [z_min, z_max] */
+struct PointQuery {
+    gdouble                     x, y;
+    gboolean                    topmost;
+    guint                       z_min, z_max;
+    struct ItemHitFunctionPair *best;
 };
 static EvPoint
 ev_mapping_tree_normalize_coordinates(EvMappingTree *mapping_tree,
@@ -59,13 +92,8 @@ ev_mapping_tree_normalize_coordinates(EvMappingTree *mapping_tree,
 static gboolean
 ev_mapping_tree_in_extents(EvMappingTree *mapping_tree,
                 gdouble x, gdouble y);
-static void
-destroy_pair(gpointer a, gpointer b);
 
 
-#define MAX_DEPTH           29
-#define SMALLEST_QT_UNIT    (1.0 / (1<<28))
-#define EXPANSION           0.999
 
 G_DEFINE_BOXED_TYPE (EvMappingTree, ev_mapping_tree, ev_mapping_tree_ref, ev_mapping_tree_unref)
 
@@ -92,19 +120,132 @@ make_cell_coordinates(int depth, int x, int y)
     return key;
 }
 
-static GList *
-generate_valid_cells(EvMappingTree *tree, double x, double y)
+static guint
+hash_cell_coordinates(int64_t coords)
 {
-    GList *list = NULL;
-    int cx, cy, i;
+    guint64 h = (guint64)coords;
+
+    /* 64 bit finalizer from MurmurHash3 */
+    h ^= h >> 33;
+    h *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+
+    return (guint)h;
+}
+
+/* Returns the slot of the cell, or the empty slot where it belongs */
+static struct CellSlot *
+lookup_cell_slot(EvMappingTree *tree, int64_t coords)
+{
+    guint i = hash_cell_coordinates(coords) & tree->cells_mask;
+
+    while (tree->cells[i].coords >= 0 && tree->cells[i].coords != coords)
+        i = (i + 1) & tree->cells_mask;
+
+    return &tree->cells[i];
+}
+
+static void
+resize_cells(EvMappingTree *tree, guint n_slots)
+{
+    struct CellSlot *old_cells = tree->cells;
+    guint old_n_slots = old_cells ? tree->cells_mask + 1 : 0;
+    guint i;
+
+    tree->cells = g_new(struct CellSlot, n_slots);
+    tree->cells_mask = n_slots - 1;
+    tree->n_cells = 0;
+    for (i = 0; i < n_slots; i++)
+        tree->cells[i].coords = -1;
+
+    /* empty cells are dropped */
+    for (i = 0; i < old_n_slots; i++) {
+        if (old_cells[i].coords >= 0 && old_cells[i].head >= 0) {
+            *lookup_cell_slot(tree, old_cells[i].coords) = old_cells[i];
+            tree->n_cells++;
+        }
+    }
+
+    g_free(old_cells);
+}
+
+/* Returns the slot of the cell, creating the cell if needed. The
+ * table is kept at most half full so probe sequences stay short. */
+static struct CellSlot *
+insert_cell_slot(EvMappingTree *tree, int64_t coords)
+{
+    struct CellSlot *slot = lookup_cell_slot(tree, coords);
+
+    if (slot->coords >= 0)
+        return slot;
+
+    if (2 * (tree->n_cells + 1) > tree->cells_mask + 1) {
+        resize_cells(tree, 2 * (tree->cells_mask + 1));
+        slot = lookup_cell_slot(tree, coords);
+    }
+
+    slot->coords = coords;
+    slot->head = -1;
+    tree->n_cells++;
+
+    return slot;
+}
+
+/* Walk the pairs of a cell, if it exists. Returns TRUE when the
+ * query is answered */
+static gboolean
+query_cell(EvMappingTree *tree, int depth, int cx, int cy, struct PointQuery *query)
+{
+    struct CellSlot *slot = lookup_cell_slot(tree, make_cell_coordinates(depth, cx, cy));
+    gint p;
+
+    if (slot->coords < 0)
+        return FALSE;
+
+    tree->stats.n_cells_visited++;
+
+    for (p = slot->head; p >= 0; ) {
+        struct ItemHitFunctionPair *pair =
+            &g_array_index(tree->pairs, struct ItemHitFunctionPair, p);
+
+        p = pair->next;
+
+        if (query->topmost) {
+            if (pair->z < query->z_min || pair->z > query->z_max)
+                continue;
+            /* only a higher item can change the answer */
+            if (query->best && pair->z <= query->best->z)
+                continue;
+        }
 
+        tree->stats.n_hits_evaluated++;
+        if (!pair->hit_func(pair->item, query->x, query->y, pair->data))
+            continue;
+
+        query->best = pair;
+        if (!query->topmost)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Look for a hit in every cell that can hold normalized point
+ * (nx, ny). Nothing is allocated: at each depth there are at most
+ * 4 candidate cells, which are probed directly. */
+static void
+query_valid_cells(EvMappingTree *tree, double nx, double ny, struct PointQuery *query)
+{
+    int cx, cy, i;
 
     /* every point can be the target of up to 4 cells, but we have
      * 9 conditions to test*/
     for (i=0; i<MAX_DEPTH; i++) {
         
         /* no known elements here */
-        if (!g_array_index(tree->depth_mask, gboolean, i)) {
+        if (!tree->depth_mask[i]) {
             continue;
         }
 
@@ -116,15 +257,15 @@ generate_valid_cells(EvMappingTree *tree, double x, double y)
         int cell_size = 1 << i;
         int maxX, maxY;
 
-        cx = ((int)x) / cell_size;
-        cy = ((int)y) / cell_size;
+        cx = ((int)nx) / cell_size;
+        cy = ((int)ny) / cell_size;
 
         maxX = (1 << (MAX_DEPTH - 1)) / cell_size;
         maxY = (1 << (MAX_DEPTH - 1)) / cell_size;
 
         /* Compute the possibly overlapping cells */
-        double rx = x - cx * cell_size;
-        double ry = y - cy * cell_size;
+        double rx = nx - cx * cell_size;
+        double ry = ny - cy * cell_size;
 
         if ( cx > 0 && rx / (cell_size * 0.5) <= EXPANSION ) {
             ov_left = TRUE;
@@ -140,48 +281,43 @@ generate_valid_cells(EvMappingTree *tree, double x, double y)
             ov_upper = TRUE;
         }
 
-        /* Add the cell and the overlapping cells to the list */
-        int64_t coords;
-       
-#define TEST_AND_ADD_COORDS(X,Y) \
-        coords = make_cell_coordinates(i, X, Y); \
-        if (g_hash_table_contains(tree->cell_index, &coords)) { \
-            list = g_list_prepend(list, g_hash_table_lookup(tree->cell_index, &coords)); \
+        /* Test the cell and the overlapping cells */
+#define TEST_COORDS(X,Y) \
+        if (query_cell(tree, i, X, Y, query)) { \
+            return; \
         }
 
-        TEST_AND_ADD_COORDS(cx, cy);
+        TEST_COORDS(cx, cy);
         if (ov_left) {
-            TEST_AND_ADD_COORDS(cx - 1, cy)
+            TEST_COORDS(cx - 1, cy)
 
             if (ov_upper) {
-                TEST_AND_ADD_COORDS(cx - 1, cy + 1)
+                TEST_COORDS(cx - 1, cy + 1)
             }
             else if (ov_lower) {
-                TEST_AND_ADD_COORDS(cx - 1, cy - 1)
+                TEST_COORDS(cx - 1, cy - 1)
             }
         }
         else if (ov_right) {
-            TEST_AND_ADD_COORDS(cx + 1, cy)
+            TEST_COORDS(cx + 1, cy)
 
             if (ov_upper) {
-                TEST_AND_ADD_COORDS(cx + 1, cy + 1)
+                TEST_COORDS(cx + 1, cy + 1)
             }
             else if (ov_lower) {
-                TEST_AND_ADD_COORDS(cx + 1, cy - 1)
+                TEST_COORDS(cx + 1, cy - 1)
             }
         }
 
         if (ov_upper) {
-            TEST_AND_ADD_COORDS(cx, cy + 1)
+            TEST_COORDS(cx, cy + 1)
         }
         else if (ov_lower) {
-            TEST_AND_ADD_COORDS(cx, cy - 1)
+            TEST_COORDS(cx, cy - 1)
         }
 
     }
-#undef TEST_AND_ADD_COORDS
-
-    return list;
+#undef TEST_COORDS
 }
 
 /**
@@ -233,15 +369,27 @@ ev_mapping_tree_in_extents(EvMappingTree *mapping_tree,
  * @mapping_tree: an #EvMappingTree
  * @n: the position to retrieve
  *
- * Returns: (transfer none): the #Evmapping at position @n in @mapping_tree
+ * Returns: (transfer none): the item at position @n in @mapping_tree
  */
 EvMapping *
 ev_mapping_tree_nth (EvMappingTree *mapping_tree,
                      guint          n)
 {
+        guint i;
+
         g_return_val_if_fail (mapping_tree != NULL, NULL);
 
-        return (EvMapping *)g_list_nth_data (mapping_tree->items, n);
+        for (i = 0; i < mapping_tree->pairs->len; i++) {
+                struct ItemHitFunctionPair *pair;
+
+                pair = &g_array_index (mapping_tree->pairs, struct ItemHitFunctionPair, i);
+                if (!pair->item)
+                        continue;
+                if (n-- == 0)
+                        return (EvMapping *)pair->item;
+        }
+
+        return NULL;
 }
 
 /**
@@ -268,6 +416,10 @@ ev_mapping_tree_get (EvMappingTree *mapping_tree,
     EvPoint normalized = ev_mapping_tree_normalize_coordinates(mapping_tree,
                             x,y);
 
+    struct PointQuery query = { x, y, FALSE, 0, 0, NULL };
+
+    mapping_tree->stats.n_queries++;
+
     /* for each depth,
      *
      * find the possibly valid cells
@@ -276,22 +428,334 @@ ev_mapping_tree_get (EvMappingTree *mapping_tree,
      *
      *
      * */
-    GList *list = generate_valid_cells(mapping_tree, normalized.x, normalized.y);
+    query_valid_cells(mapping_tree, normalized.x, normalized.y, &query);
+
+    return query.best ? query.best->item : NULL;
+}
+
+/**
+ * ev_mapping_tree_get_topmost:
+ * @mapping_tree: an #EvMappingTree
+ * @x: X coordinate
+ * @y: Y coordinate
+ * @z_min: lowest z of the items to consider
+ * @z_max: highest z of the items to consider
+ *
+ * Like ev_mapping_tree_get(), but among all the items at (x, y) whose z
+ * is in [@z_min, @z_max], returns the one with the greatest z. Hit
+ * functions of items that cannot be above the current answer are not
+ * evaluated.
+ *
+ * Returns: (transfer none): the topmost item at (x, y), or %NULL
+ */
+gpointer
+ev_mapping_tree_get_topmost (EvMappingTree *mapping_tree,
+                             gdouble        x,
+                             gdouble        y,
+                             guint          z_min,
+                             guint          z_max)
+{
+    struct PointQuery query = { x, y, TRUE, z_min, z_max, NULL };
+    EvPoint normalized;
+
+    g_return_val_if_fail (mapping_tree != NULL, NULL);
+
+    if (!ev_mapping_tree_in_extents(mapping_tree, x, y))
+        return NULL;
+
+    normalized = ev_mapping_tree_normalize_coordinates(mapping_tree, x, y);
+    mapping_tree->stats.n_queries++;
+    query_valid_cells(mapping_tree, normalized.x, normalized.y, &query);
+
+    return query.best ? query.best->item : NULL;
+}
+
+static gboolean
+rectangles_intersect(const EvRectangle *a, const EvRectangle *b)
+{
+    return a->x1 <= b->x2 && b->x1 <= a->x2 &&
+           a->y1 <= b->y2 && b->y1 <= a->y2;
+}
+
+static gboolean
+point_in_rect(const EvPoint *p, const EvRectangle *rect)
+{
+    return rect->x1 <= p->x && p->x <= rect->x2 &&
+           rect->y1 <= p->y && p->y <= rect->y2;
+}
+
+/* Even-odd rule */
+static gboolean
+point_in_polygon(gdouble x, gdouble y, const EvPoint *points, guint n_points)
+{
+    gboolean inside = FALSE;
+    guint i, j;
+
+    for (i = 0, j = n_points - 1; i < n_points; j = i++) {
+        if ((points[i].y > y) != (points[j].y > y) &&
+            x < (points[j].x - points[i].x) * (y - points[i].y) /
+                (points[j].y - points[i].y) + points[i].x)
+            inside = !inside;
+    }
+
+    return inside;
+}
+
+/* Liang-Barsky clipping of segment ab against @rect */
+static gboolean
+segment_intersects_rect(const EvPoint *a, const EvPoint *b, const EvRectangle *rect)
+{
+    gdouble t0 = 0, t1 = 1;
+    gdouble dx = b->x - a->x, dy = b->y - a->y;
+    gdouble p[4] = { -dx, dx, -dy, dy };
+    gdouble q[4] = { a->x - rect->x1, rect->x2 - a->x, a->y - rect->y1, rect->y2 - a->y };
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0)
+                return FALSE;
+        } else {
+            gdouble t = q[i] / p[i];
+
+            if (p[i] < 0)
+                t0 = MAX(t0, t);
+            else
+                t1 = MIN(t1, t);
+            if (t0 > t1)
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+polygon_intersects_rect(const EvPoint *points, guint n_points, const EvRectangle *rect)
+{
+    guint i, j;
+
+    for (i = 0, j = n_points - 1; i < n_points; j = i++) {
+        if (point_in_rect(&points[i], rect) ||
+            segment_intersects_rect(&points[j], &points[i], rect))
+            return TRUE;
+    }
+
+    /* the rectangle may lie wholly inside the polygon */
+    return point_in_polygon(rect->x1, rect->y1, points, n_points);
+}
+
+struct RegionQuery {
+    EvRectangle                 bounds;
+    const EvPoint              *polygon;   /* or NULL for a rectangle */
+    guint                       n_points;
+    EvMappingTreeFilterFunction filter_func;
+    gpointer                    data;
+};
+
+/* Collect the items of a cell chain whose extents meet the region */
+static GList *
+query_cell_chain(EvMappingTree *tree, gint head, const struct RegionQuery *query,
+                 GList *items)
+{
+    gint p;
+
+    tree->stats.n_cells_visited++;
+
+    for (p = head; p >= 0; ) {
+        struct ItemHitFunctionPair *pair =
+            &g_array_index(tree->pairs, struct ItemHitFunctionPair, p);
 
-    for ( ; list != NULL; list = list->next ) {
-        // each "cell" is also a list
-        GList *cell = list->data;
+        p = pair->next;
 
-        for ( ; cell != NULL; cell = cell->next ) {
-            struct ItemHitFunctionPair *pair = cell->data;
+        if (!rectangles_intersect(&pair->extents, &query->bounds))
+            continue;
+        if (query->polygon &&
+            !polygon_intersects_rect(query->polygon, query->n_points, &pair->extents))
+            continue;
+        if (query->filter_func) {
+            tree->stats.n_hits_evaluated++;
+            if (!query->filter_func(pair->item, query->data))
+                continue;
+        }
+        items = g_list_prepend(items, pair->item);
+    }
+
+    return items;
+}
+
+static GList *
+query_region(EvMappingTree *tree, struct RegionQuery *query)
+{
+    EvPoint n1, n2;
+    GList *items = NULL;
+    guint64 n_candidates = 0;
+    int depth, cx, cy;
+    int cx1[MAX_DEPTH], cy1[MAX_DEPTH], cx2[MAX_DEPTH], cy2[MAX_DEPTH];
+
+    query->bounds.x1 = MAX(query->bounds.x1, tree->extents.x1);
+    query->bounds.y1 = MAX(query->bounds.y1, tree->extents.y1);
+    query->bounds.x2 = MIN(query->bounds.x2, tree->extents.x2);
+    query->bounds.y2 = MIN(query->bounds.y2, tree->extents.y2);
+    if (query->bounds.x1 > query->bounds.x2 || query->bounds.y1 > query->bounds.y2)
+        return NULL;
+
+    tree->stats.n_queries++;
+
+    n1 = ev_mapping_tree_normalize_coordinates(tree, query->bounds.x1, query->bounds.y1);
+    n2 = ev_mapping_tree_normalize_coordinates(tree, query->bounds.x2, query->bounds.y2);
+
+    /* Items of a cell may stick out of it by up to half a cell, so
+     * one more cell on every side can hold candidates */
+    for (depth = 0; depth < MAX_DEPTH; depth++) {
+        int cell_size = 1 << depth;
+        int max_cell = (1 << (MAX_DEPTH - 1)) / cell_size;
+
+        if (!tree->depth_mask[depth])
+            continue;
+
+        cx1[depth] = MAX(0, (int)(n1.x / cell_size) - 1);
+        cy1[depth] = MAX(0, (int)(n1.y / cell_size) - 1);
+        cx2[depth] = MIN(max_cell, (int)(n2.x / cell_size) + 1);
+        cy2[depth] = MIN(max_cell, (int)(n2.y / cell_size) + 1);
+
+        n_candidates += (guint64)(cx2[depth] - cx1[depth] + 1) *
+                        (cy2[depth] - cy1[depth] + 1);
+    }
+
+    /* Large regions: cheaper to go through the cells that exist */
+    if (n_candidates > tree->n_cells) {
+        guint i;
+
+        for (i = 0; i <= tree->cells_mask; i++) {
+            struct CellSlot *slot = &tree->cells[i];
+
+            if (slot->coords >= 0 && slot->head >= 0)
+                items = query_cell_chain(tree, slot->head, query, items);
+        }
 
-            if (pair->hit_func(pair->item, x, y, pair->data)) {
-                return pair->item;
+        return g_list_reverse(items);
+    }
+
+    for (depth = 0; depth < MAX_DEPTH; depth++) {
+        if (!tree->depth_mask[depth])
+            continue;
+
+        for (cx = cx1[depth]; cx <= cx2[depth]; cx++) {
+            for (cy = cy1[depth]; cy <= cy2[depth]; cy++) {
+                struct CellSlot *slot;
+
+                slot = lookup_cell_slot(tree, make_cell_coordinates(depth, cx, cy));
+                if (slot->coords >= 0 && slot->head >= 0)
+                    items = query_cell_chain(tree, slot->head, query, items);
             }
         }
     }
 
-	return NULL;
+    return g_list_reverse(items);
+}
+
+/**
+ * ev_mapping_tree_get_in_rect:
+ * @mapping_tree: an #EvMappingTree
+ * @rect: the region to look in
+ * @filter_func: (allow-none): exact test for the candidate items
+ * @data: data to pass to @filter_func
+ *
+ * Finds all the items whose extents intersect @rect. When @filter_func
+ * is given, only the candidates it accepts are returned, so it can
+ * test against the real shape of the item.
+ *
+ * Returns: (transfer container) (element-type gpointer): the items
+ */
+GList *
+ev_mapping_tree_get_in_rect (EvMappingTree              *mapping_tree,
+                             const EvRectangle          *rect,
+                             EvMappingTreeFilterFunction filter_func,
+                             gpointer                    data)
+{
+    struct RegionQuery query;
+
+    g_return_val_if_fail (mapping_tree != NULL, NULL);
+    g_return_val_if_fail (rect != NULL, NULL);
+
+    query.bounds = *rect;
+    query.polygon = NULL;
+    query.n_points = 0;
+    query.filter_func = filter_func;
+    query.data = data;
+
+    return query_region (mapping_tree, &query);
+}
+
+/**
+ * ev_mapping_tree_get_in_polygon:
+ * @mapping_tree: an #EvMappingTree
+ * @points: (array length=n_points): the vertices of a closed polygon
+ * @n_points: the number of vertices
+ * @filter_func: (allow-none): exact test for the candidate items
+ * @data: data to pass to @filter_func
+ *
+ * Like ev_mapping_tree_get_in_rect(), for a lasso: finds all the items
+ * whose extents intersect the polygon. The polygon may be concave or
+ * self-intersecting; its inside follows the even-odd rule.
+ *
+ * Returns: (transfer container) (element-type gpointer): the items
+ */
+GList *
+ev_mapping_tree_get_in_polygon (EvMappingTree              *mapping_tree,
+                                const EvPoint              *points,
+                                guint                       n_points,
+                                EvMappingTreeFilterFunction filter_func,
+                                gpointer                    data)
+{
+    struct RegionQuery query;
+    guint i;
+
+    g_return_val_if_fail (mapping_tree != NULL, NULL);
+
+    if (n_points < 3)
+        return NULL;
+
+    query.bounds.x1 = query.bounds.x2 = points[0].x;
+    query.bounds.y1 = query.bounds.y2 = points[0].y;
+    for (i = 1; i < n_points; i++) {
+        query.bounds.x1 = MIN(query.bounds.x1, points[i].x);
+        query.bounds.y1 = MIN(query.bounds.y1, points[i].y);
+        query.bounds.x2 = MAX(query.bounds.x2, points[i].x);
+        query.bounds.y2 = MAX(query.bounds.y2, points[i].y);
+    }
+    query.polygon = points;
+    query.n_points = n_points;
+    query.filter_func = filter_func;
+    query.data = data;
+
+    return query_region (mapping_tree, &query);
+}
+
+/**
+ * ev_mapping_tree_get_stats:
+ * @mapping_tree: an #EvMappingTree
+ * @stats: (out): return location for the query counters
+ *
+ * Gets the number of queries, cells visited and hit functions
+ * evaluated since the tree was created or the counters were reset.
+ */
+void
+ev_mapping_tree_get_stats (EvMappingTree      *mapping_tree,
+                           EvMappingTreeStats *stats)
+{
+    g_return_if_fail (mapping_tree != NULL);
+
+    *stats = mapping_tree->stats;
+}
+
+void
+ev_mapping_tree_reset_stats (EvMappingTree *mapping_tree)
+{
+    g_return_if_fail (mapping_tree != NULL);
+
+    memset (&mapping_tree->stats, 0, sizeof (EvMappingTreeStats));
 }
 
 /**
@@ -316,12 +780,24 @@ ev_mapping_tree_get (EvMappingTree *mapping_tree,
 //	return NULL;
 //}
 
-static gint
-compare_item(gconstpointer a, gconstpointer bs)
+/* Trees built in bulk have no reverse index until something is
+ * removed from them */
+static void
+ensure_reverse_index (EvMappingTree *mapping_tree)
 {
-    struct ItemHitFunctionPair *b = (struct ItemHitFunctionPair*) bs;   
-    return (a < b->item)?-1:
-           (a > b->item)?1:0;
+    guint i;
+
+    if (mapping_tree->reverse_index)
+        return;
+
+    mapping_tree->reverse_index = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (i = 0; i < mapping_tree->pairs->len; i++) {
+        struct ItemHitFunctionPair *pair =
+            &g_array_index(mapping_tree->pairs, struct ItemHitFunctionPair, i);
+
+        if (pair->item)
+            g_hash_table_insert(mapping_tree->reverse_index, pair->item, GINT_TO_POINTER(i + 1));
+    }
 }
 
 /**
@@ -335,28 +811,33 @@ void
 ev_mapping_tree_remove (EvMappingTree *mapping_tree,
 			gpointer item)
 {
+    struct ItemHitFunctionPair *pair;
+    gint p, *link;
+
     // Reverse index and cell
-    int64_t coords = *(int64_t*)g_hash_table_lookup(mapping_tree->reverse_index, item);
-    GList *cell = g_hash_table_lookup(mapping_tree->cell_index, &coords);
-    GList *llink = g_list_find_custom(cell, item, compare_item);
-    struct ItemHitFunctionPair *pair = llink->data;
+    ensure_reverse_index(mapping_tree);
+    p = GPOINTER_TO_INT(g_hash_table_lookup(mapping_tree->reverse_index, item)) - 1;
+    if (p < 0)
+        return;
+    pair = &g_array_index(mapping_tree->pairs, struct ItemHitFunctionPair, p);
 
     // remove from reverse index
     g_hash_table_remove(mapping_tree->reverse_index, item);
-    // *coords automatically freed
-    
-    // remove from items
-    mapping_tree->items = g_list_remove_link(mapping_tree->items, pair->link);
 
     // remove from cell
-    g_hash_table_replace(mapping_tree->cell_index,
-                        &coords,
-                        g_list_remove_link(cell, llink));
-    g_list_free(llink);
-
-    // destroy the pair item
-    destroy_pair(pair, mapping_tree);
-    
+    for (link = &lookup_cell_slot(mapping_tree, pair->coords)->head;
+         *link != p;
+         link = &g_array_index(mapping_tree->pairs, struct ItemHitFunctionPair, *link).next);
+    *link = pair->next;
+
+    // destroy the item and recycle the pair
+    if (mapping_tree->data_destroy_func)
+        mapping_tree->data_destroy_func(pair->item);
+    pair->item = NULL;
+    pair->next = mapping_tree->free_pair;
+    mapping_tree->free_pair = p;
+    mapping_tree->n_items--;
+
     // We leave the depth_mask as it is (it is only an approximation optimization)
 }
 
@@ -371,14 +852,14 @@ ev_mapping_tree_length (EvMappingTree *mapping_tree)
 {
         g_return_val_if_fail (mapping_tree != NULL, 0);
 
-        return g_list_length (mapping_tree->items);
+        return mapping_tree->n_items;
 }
 
 /**
  * ev_mapping_tree_new:
  * @page: page index for this mapping
- * @list: (element-type EvMapping): a #GTree of data for the page
- * @data_destroy_func: function to free a list element
+ * @extents: the area covered by the items that will be added
+ * @data_destroy_func: (allow-none): function to free an item
  *
  * Returns: an #EvMappingTree
  */
@@ -389,8 +870,6 @@ ev_mapping_tree_new (guint          page,
 {
 	EvMappingTree *mapping_tree;
 
-	g_return_val_if_fail (data_destroy_func != NULL, NULL);
-
 	mapping_tree = g_slice_new (EvMappingTree);
 	mapping_tree->page = page;
 	mapping_tree->data_destroy_func = data_destroy_func;
@@ -399,44 +878,34 @@ ev_mapping_tree_new (guint          page,
 
 
     /* Build the tree data structure */
-    mapping_tree->cell_index = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                    NULL, NULL);
-    mapping_tree->reverse_index = g_hash_table_new_full(g_direct_hash, g_direct_equal,
-                    NULL, g_free);
-    mapping_tree->items = NULL;
-    mapping_tree->depth_mask = g_array_sized_new(0, 0, sizeof(gboolean), MAX_DEPTH);
-
-
-    gboolean f = FALSE;
-    int i;
-    for (i=0; i<MAX_DEPTH; i++) {
-        g_array_append_val(mapping_tree->depth_mask, f);
-    }
+    mapping_tree->cells = NULL;
+    resize_cells(mapping_tree, MIN_CELL_SLOTS);
+    mapping_tree->reverse_index = NULL;
+    mapping_tree->pairs = g_array_new(FALSE, FALSE, sizeof(struct ItemHitFunctionPair));
+    mapping_tree->free_pair = -1;
+    mapping_tree->n_items = 0;
+    memset(mapping_tree->depth_mask, 0, sizeof(mapping_tree->depth_mask));
+    memset(&mapping_tree->stats, 0, sizeof(EvMappingTreeStats));
 
 	return mapping_tree;
 }
 
 /**
- * 
- *  Do the following things:
+ *  Find the smallest cell that holds the extents:
  *
  *  - Measure the extents, find the correct cell
- *  - Update the depth mask
+ *  - Return its key and depth, or -1 if it does not fit
  *
  * */
-int64_t
-ev_mapping_tree_add(EvMappingTree *tree,
-                    gpointer item,
-                    EvRectangle extents,
-                    EvMappingTreeHitFunction hit_func,
-                    gpointer data)
+static int64_t
+find_cell(EvMappingTree *tree,
+          EvRectangle   *extents,
+          int           *r_depth)
 {
-    struct ItemHitFunctionPair *pair;
-
     // compute the minimum possible size
     EvPoint n1, n2;
-    n1 = ev_mapping_tree_normalize_coordinates(tree, extents.x1, extents.y1);
-    n2 = ev_mapping_tree_normalize_coordinates(tree, extents.x2, extents.y2);
+    n1 = ev_mapping_tree_normalize_coordinates(tree, extents->x1, extents->y1);
+    n2 = ev_mapping_tree_normalize_coordinates(tree, extents->x2, extents->y2);
 
     // first guess of cell size
     double span = MAX( fabs(n1.x - n2.x), fabs(n1.y - n2.y) );
@@ -473,27 +942,8 @@ ev_mapping_tree_add(EvMappingTree *tree,
             ( abs(cy1 - cy2) == 1 && MAX(ry1, ry2) < 2*margin ) )) {
 
             // correct cell!
-            int cx = MIN(cx1, cx2);
-            int cy = MIN(cy1, cy2);
-            int64_t *coords = g_malloc(sizeof(int64_t));
-            
-            *coords = make_cell_coordinates(depth, cx, cy);
-
-            // create the item
-            pair = g_malloc(sizeof(struct ItemHitFunctionPair));
-            pair->hit_func = hit_func;
-            pair->item = item;
-            pair->data = data;
-
-            // append the item
-            tree->items = g_list_prepend(tree->items, pair);
-            pair->link = tree->items;
-            GList *old_list = g_hash_table_lookup(tree->cell_index, coords);
-            GList *new_list = g_list_prepend(old_list, pair);
-            g_hash_table_replace(tree->cell_index, coords, new_list);
-            g_hash_table_replace(tree->reverse_index, pair->item, coords);
-            g_array_index(tree->depth_mask, gboolean, depth) = TRUE;
-            return *coords;
+            *r_depth = depth;
+            return make_cell_coordinates(depth, MIN(cx1, cx2), MIN(cy1, cy2));
         }
 
         cell_size *= 2;
@@ -503,30 +953,176 @@ ev_mapping_tree_add(EvMappingTree *tree,
     return -1;
 }
 
-EvMappingTree *
-ev_mapping_tree_ref (EvMappingTree *mapping_tree)
+/**
+ * 
+ *  Do the following things:
+ *
+ *  - Find the correct cell
+ *  - Chain a new pair at the head of the cell
+ *  - Update the depth mask
+ *
+ * */
+int64_t
+ev_mapping_tree_add(EvMappingTree *tree,
+                    gpointer item,
+                    EvRectangle extents,
+                    EvMappingTreeHitFunction hit_func,
+                    gpointer data)
 {
-	g_return_val_if_fail (mapping_tree != NULL, NULL);
-	g_return_val_if_fail (mapping_tree->ref_count > 0, mapping_tree);
+    return ev_mapping_tree_add_with_z(tree, item, extents, hit_func, data, 0);
+}
 
-	g_atomic_int_add (&mapping_tree->ref_count, 1);
+/**
+ * ev_mapping_tree_add_with_z:
+ *
+ * Like ev_mapping_tree_add(), for an item stacked at @z; see
+ * ev_mapping_tree_get_topmost().
+ * */
+int64_t
+ev_mapping_tree_add_with_z(EvMappingTree *tree,
+                           gpointer item,
+                           EvRectangle extents,
+                           EvMappingTreeHitFunction hit_func,
+                           gpointer data,
+                           guint z)
+{
+    struct ItemHitFunctionPair *pair;
+    struct CellSlot *slot;
+    int64_t coords;
+    gint p;
+    int depth;
+
+    coords = find_cell(tree, &extents, &depth);
+    if (coords < 0)
+        return -1;
+
+    // create the item, reusing a removed pair if possible
+    if (tree->free_pair >= 0) {
+        p = tree->free_pair;
+        tree->free_pair = g_array_index(tree->pairs, struct ItemHitFunctionPair, p).next;
+    } else {
+        p = tree->pairs->len;
+        g_array_set_size(tree->pairs, p + 1);
+    }
+    slot = insert_cell_slot(tree, coords);
+
+    pair = &g_array_index(tree->pairs, struct ItemHitFunctionPair, p);
+    pair->hit_func = hit_func;
+    pair->item = item;
+    pair->data = data;
+    pair->coords = coords;
+    pair->extents = extents;
+    pair->z = z;
+    pair->next = slot->head;
+
+    // append the item
+    slot->head = p;
+    if (tree->reverse_index)
+        g_hash_table_replace(tree->reverse_index, item, GINT_TO_POINTER(p + 1));
+    tree->depth_mask[depth] = TRUE;
+    tree->n_items++;
+
+    return coords;
+}
 
-	return mapping_tree;
+struct SortEntry {
+    int64_t coords;
+    guint   index;
+};
+
+static gint
+compare_sort_entries(gconstpointer a, gconstpointer b)
+{
+    const struct SortEntry *ea = a, *eb = b;
+
+    if (ea->coords != eb->coords)
+        return ea->coords < eb->coords ? -1 : 1;
+    /* keep the input order within a cell */
+    return ea->index < eb->index ? -1 : ea->index > eb->index ? 1 : 0;
 }
 
-static void
-destroy_pair(gpointer a, gpointer b)
+/**
+ * ev_mapping_tree_new_bulk:
+ * @page: page index for this mapping
+ * @extents: the area covered by all the entries
+ * @entries: (array length=n_entries): the items and their extents
+ * @n_entries: the number of entries
+ * @hit_func: the exact hit test shared by all the entries
+ * @data: data to pass to @hit_func
+ * @data_destroy_func: (allow-none): function to free an item
+ *
+ * Builds a tree from all its items at once. The entries are sorted by
+ * cell and laid out in a single allocation, so each cell is one
+ * contiguous run; no per-item allocation or hashing is done. The
+ * resulting tree behaves like one filled with ev_mapping_tree_add().
+ *
+ * Returns: an #EvMappingTree
+ */
+EvMappingTree *
+ev_mapping_tree_new_bulk (guint                     page,
+                          EvRectangle               extents,
+                          const EvMappingTreeEntry *entries,
+                          guint                     n_entries,
+                          EvMappingTreeHitFunction  hit_func,
+                          gpointer                  data,
+                          GDestroyNotify            data_destroy_func)
 {
-    struct ItemHitFunctionPair *pair = (struct ItemHitFunctionPair*) a;
-    EvMappingTree *tree = (EvMappingTree*)b;
-    tree->data_destroy_func(pair->item);
-    g_free(pair);
+    EvMappingTree    *tree;
+    struct SortEntry *sorted;
+    guint             i, n_sorted = 0;
+
+    tree = ev_mapping_tree_new(page, extents, data_destroy_func);
+    if (n_entries == 0)
+        return tree;
+
+    sorted = g_new(struct SortEntry, n_entries);
+    for (i = 0; i < n_entries; i++) {
+        EvRectangle rect = entries[i].extents;
+        int depth;
+
+        sorted[n_sorted].coords = find_cell(tree, &rect, &depth);
+        if (sorted[n_sorted].coords < 0)
+            continue;
+        sorted[n_sorted].index = i;
+        tree->depth_mask[depth] = TRUE;
+        n_sorted++;
+    }
+
+    qsort(sorted, n_sorted, sizeof(struct SortEntry), compare_sort_entries);
+
+    g_array_set_size(tree->pairs, n_sorted);
+    for (i = 0; i < n_sorted; i++) {
+        struct ItemHitFunctionPair *pair =
+            &g_array_index(tree->pairs, struct ItemHitFunctionPair, i);
+        gboolean last_in_cell = i + 1 == n_sorted || sorted[i + 1].coords != sorted[i].coords;
+
+        pair->hit_func = hit_func;
+        pair->item = entries[sorted[i].index].item;
+        pair->data = data;
+        pair->coords = sorted[i].coords;
+        pair->extents = entries[sorted[i].index].extents;
+        pair->z = entries[sorted[i].index].z;
+        pair->next = last_in_cell ? -1 : (gint)(i + 1);
+
+        if (i == 0 || sorted[i - 1].coords != sorted[i].coords)
+            insert_cell_slot(tree, pair->coords)->head = i;
+    }
+    tree->n_items = n_sorted;
+
+    g_free(sorted);
+
+    return tree;
 }
 
-static void
-destroy_cell(gpointer key, gpointer value, gpointer data)
+EvMappingTree *
+ev_mapping_tree_ref (EvMappingTree *mapping_tree)
 {
-    g_list_free(value);
+	g_return_val_if_fail (mapping_tree != NULL, NULL);
+	g_return_val_if_fail (mapping_tree->ref_count > 0, mapping_tree);
+
+	g_atomic_int_add (&mapping_tree->ref_count, 1);
+
+	return mapping_tree;
 }
 
 void
@@ -536,13 +1132,22 @@ ev_mapping_tree_unref (EvMappingTree *mapping_tree)
 	g_return_if_fail (mapping_tree->ref_count > 0);
 
 	if (g_atomic_int_add (&mapping_tree->ref_count, -1) - 1 == 0) {
+        guint i;
+
         /* Free the quadtree items */
-        g_hash_table_foreach(mapping_tree->cell_index, destroy_cell, NULL);
-        g_hash_table_destroy(mapping_tree->cell_index);
-        g_hash_table_destroy(mapping_tree->reverse_index);
-        g_list_foreach(mapping_tree->items, destroy_pair, mapping_tree);
-        g_list_free(mapping_tree->items);
-        g_array_free(mapping_tree->depth_mask, TRUE);
+        if (mapping_tree->data_destroy_func) {
+            for (i = 0; i < mapping_tree->pairs->len; i++) {
+                struct ItemHitFunctionPair *pair =
+                    &g_array_index(mapping_tree->pairs, struct ItemHitFunctionPair, i);
+
+                if (pair->item)
+                    mapping_tree->data_destroy_func(pair->item);
+            }
+        }
+        g_free(mapping_tree->cells);
+        if (mapping_tree->reverse_index)
+            g_hash_table_destroy(mapping_tree->reverse_index);
+        g_array_free(mapping_tree->pairs, TRUE);
         
 		g_slice_free (EvMappingTree, mapping_tree);
 	}
@@ -52,6 +52,11 @@ void           ev_mapping_tree_remove      (EvMappingTree *mapping_tree,
 gpointer      ev_mapping_tree_get         (EvMappingTree *mapping_tree,
 					    gdouble        x,
 					    gdouble        y);
+gpointer      ev_mapping_tree_get_topmost (EvMappingTree *mapping_tree,
+					    gdouble        x,
+					    gdouble        y,
+					    guint          z_min,
+					    guint          z_max);
 //gpointer       ev_mapping_tree_get_data    (EvMappingTree *mapping_tree,
 //					    gdouble        x,
 //					    gdouble        y);
@@ -66,6 +71,48 @@ ev_mapping_tree_add(EvMappingTree *tree,
                     EvRectangle extents,
                     EvMappingTreeHitFunction hit_func,
                     gpointer data);
+int64_t
+ev_mapping_tree_add_with_z(EvMappingTree *tree,
+                           gpointer item,
+                           EvRectangle extents,
+                           EvMappingTreeHitFunction hit_func,
+                           gpointer data,
+                           guint z);
+
+typedef gboolean (*EvMappingTreeFilterFunction)(gpointer item, gpointer data);
+GList         *ev_mapping_tree_get_in_rect    (EvMappingTree              *mapping_tree,
+                                               const EvRectangle          *rect,
+                                               EvMappingTreeFilterFunction filter_func,
+                                               gpointer                    data);
+GList         *ev_mapping_tree_get_in_polygon (EvMappingTree              *mapping_tree,
+                                               const EvPoint              *points,
+                                               guint                       n_points,
+                                               EvMappingTreeFilterFunction filter_func,
+                                               gpointer                    data);
+
+typedef struct {
+    gpointer    item;
+    EvRectangle extents;
+    guint       z;
+} EvMappingTreeEntry;
+
+typedef struct {
+    guint64     n_queries;
+    guint64     n_cells_visited;
+    guint64     n_hits_evaluated;
+} EvMappingTreeStats;
+
+void           ev_mapping_tree_get_stats   (EvMappingTree      *mapping_tree,
+                                            EvMappingTreeStats *stats);
+void           ev_mapping_tree_reset_stats (EvMappingTree      *mapping_tree);
+
+EvMappingTree *ev_mapping_tree_new_bulk    (guint                     page,
+                                            EvRectangle               extents,
+                                            const EvMappingTreeEntry *entries,
+                                            guint                     n_entries,
+                                            EvMappingTreeHitFunction  hit_func,
+                                            gpointer                  data,
+                                            GDestroyNotify            data_destroy_func);
 G_END_DECLS
 
 #endif /* EV_MAPPING_TREE_H */
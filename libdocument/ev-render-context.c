@@ -68,6 +68,8 @@ ev_render_context_new (EvPage *page,
 	rc->scale = scale;
 	rc->target_width = -1;
 	rc->target_height = -1;
+	rc->clip_width = -1;
+	rc->clip_height = -1;
 
 	return rc;
 }
@@ -113,6 +115,29 @@ ev_render_context_set_target_size (EvRenderContext *rc,
 	rc->target_height = target_height;
 }
 
+void
+ev_render_context_set_clip (EvRenderContext *rc,
+			    int              x,
+			    int              y,
+			    int              width,
+			    int              height)
+{
+	g_return_if_fail (rc != NULL);
+
+	rc->clip_x = x;
+	rc->clip_y = y;
+	rc->clip_width = width;
+	rc->clip_height = height;
+}
+
+gboolean
+ev_render_context_has_clip (EvRenderContext *rc)
+{
+	g_return_val_if_fail (rc != NULL, FALSE);
+
+	return rc->clip_width >= 0 && rc->clip_height >= 0;
+}
+
 void
 ev_render_context_compute_scaled_size (EvRenderContext *rc,
 				       double		width_points,
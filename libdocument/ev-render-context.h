@@ -52,6 +52,14 @@ struct _EvRenderContext
 	gdouble scale;
 	gint	target_width;
 	gint	target_height;
+
+	/* Area of the transformed page to render, in pixels. Backends
+	 * that honour it return a surface of just that size; a negative
+	 * clip_width means the whole page. */
+	gint	clip_x;
+	gint	clip_y;
+	gint	clip_width;
+	gint	clip_height;
 };
 
 
@@ -68,6 +76,12 @@ void             ev_render_context_set_scale       (EvRenderContext *rc,
 void             ev_render_context_set_target_size (EvRenderContext *rc,
                                                     int              target_width,
                                                     int              target_height);
+void             ev_render_context_set_clip        (EvRenderContext *rc,
+                                                    int              x,
+                                                    int              y,
+                                                    int              width,
+                                                    int              height);
+gboolean         ev_render_context_has_clip        (EvRenderContext *rc);
 void             ev_render_context_compute_scaled_size      (EvRenderContext *rc,
                                                              double           width_points,
                                                              double           height_points,
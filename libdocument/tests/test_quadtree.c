@@ -5,6 +5,7 @@
 
 #include <glib.h>
 #include <stdio.h>
+#include <string.h>
 
 
 int main(void);
@@ -68,6 +69,101 @@ is_on_line(gpointer a, gdouble x, gdouble y, gpointer data)
     return FALSE;
 }
 
+/* Collects the strokes told about by ev_annotation_ink_erase_full() */
+struct ErasedStroke {
+    guint    id;
+    GBytes  *points;
+    gboolean added;
+};
+
+static void
+record_stroke(EvAnnotationInk *annot, guint stroke_id, GBytes *points,
+              gboolean added, gpointer user_data)
+{
+    GArray *strokes = user_data;
+    struct ErasedStroke stroke = { stroke_id, g_bytes_ref(points), added };
+
+    g_array_append_val(strokes, stroke);
+}
+
+/* Erasing the middle of a stroke then undoing it, by removing the
+ * pieces and inserting the stroke again under its old id, gives back
+ * the same points, strokes and hit-testing */
+static void
+test_ink_erase_undo(void)
+{
+    const EvPoint points[] = {
+        { 0, 10 }, { 10, 10 }, { 20, 10 }, { 30, 10 }, { 40, 10 },
+        { 50, 0 }, { 50, 20 }
+    };
+    const guint lengths[] = { 5, 2 };
+    EvPage *page = ev_page_new(0);
+    EvAnnotationInk *ink = EV_ANNOTATION_INK(ev_annotation_ink_new(page));
+    GArray *strokes = g_array_new(FALSE, FALSE, sizeof(struct ErasedStroke));
+    guint ids[G_N_ELEMENTS(lengths)];
+    const EvPoint *restored;
+    guint n_points, i;
+    gint j;
+
+    ev_annotation_ink_set_width(ink, 2);
+    ev_annotation_ink_set_points(ink, points, G_N_ELEMENTS(points),
+                                 lengths, G_N_ELEMENTS(lengths));
+    for (i = 0; i < G_N_ELEMENTS(lengths); i++)
+        ids[i] = ev_annotation_ink_get_stroke_id(ink, i);
+
+    /* Builds the hit-testing data, so that undoing updates it in place */
+    g_assert(ev_annotation_ink_is_hit(ink, 20, 10));
+    g_assert(ev_annotation_ink_is_hit(ink, 50, 10));
+
+    g_assert(ev_annotation_ink_erase_full(ink, 20, 10, 1, record_stroke, strokes));
+    g_assert(!ev_annotation_ink_is_hit(ink, 20, 10));
+    g_assert(ev_annotation_ink_is_hit(ink, 5, 10));
+    g_assert(ev_annotation_ink_is_hit(ink, 35, 10));
+    g_assert(ev_annotation_ink_get_n_strokes(ink) == 3);
+
+    /* The first stroke is removed, then its two ends added back */
+    g_assert(strokes->len == 3);
+    g_assert(!g_array_index(strokes, struct ErasedStroke, 0).added);
+    g_assert(g_array_index(strokes, struct ErasedStroke, 0).id == ids[0]);
+    g_assert(g_array_index(strokes, struct ErasedStroke, 1).added);
+    g_assert(g_array_index(strokes, struct ErasedStroke, 2).added);
+
+    for (i = strokes->len; i-- > 0; ) {
+        struct ErasedStroke *stroke = &g_array_index(strokes, struct ErasedStroke, i);
+        gsize size;
+        const EvPoint *data = g_bytes_get_data(stroke->points, &size);
+
+        if (stroke->added) {
+            j = ev_annotation_ink_get_stroke_index(ink, stroke->id);
+            g_assert(j >= 0);
+            ev_annotation_ink_remove_path(ink, j);
+        } else {
+            ev_annotation_ink_insert_path(ink, stroke->id, data, size / sizeof(EvPoint));
+        }
+        g_bytes_unref(stroke->points);
+    }
+
+    restored = ev_annotation_ink_get_points(ink, &n_points);
+    g_assert(n_points == G_N_ELEMENTS(points));
+    g_assert(memcmp(restored, points, sizeof(points)) == 0);
+
+    g_assert(ev_annotation_ink_get_n_strokes(ink) == G_N_ELEMENTS(lengths));
+    for (i = 0; i < G_N_ELEMENTS(lengths); i++) {
+        ev_annotation_ink_get_stroke(ink, i, &n_points);
+        g_assert(n_points == lengths[i]);
+        g_assert(ev_annotation_ink_get_stroke_id(ink, i) == ids[i]);
+    }
+
+    g_assert(ev_annotation_ink_is_hit(ink, 20, 10));
+    g_assert(ev_annotation_ink_is_hit(ink, 5, 10));
+    g_assert(ev_annotation_ink_is_hit(ink, 50, 10));
+    g_assert(!ev_annotation_ink_is_hit(ink, 20, 15));
+
+    g_array_free(strokes, TRUE);
+    g_object_unref(ink);
+    g_object_unref(page);
+}
+
 int main() {
 
     EvRectangle rect, l1, l2, l3;
@@ -107,6 +203,82 @@ int main() {
         g_assert(!ev_mapping_tree_get(tree, -0.53, 1.2));
     }
 
+    {
+        EvMappingTreeStats stats;
+
+        ev_mapping_tree_reset_stats(tree);
+        g_assert(!ev_mapping_tree_get(tree, -0.53, 1.2));
+        ev_mapping_tree_get_stats(tree, &stats);
+        g_assert(stats.n_queries == 1);
+        g_assert(stats.n_cells_visited == 1);
+        g_assert(stats.n_hits_evaluated == 2);
+    }
+
+    {
+        EvRectangle region;
+        EvPoint lasso[3] = { { -0.7, 0.9 }, { -0.55, 0.9 }, { -0.6, 1.2 } };
+        GList *items;
+
+        region.x1 = -0.6;
+        region.x2 = -0.55;
+        region.y1 = 0.9;
+        region.y2 = 1.1;
+        items = ev_mapping_tree_get_in_rect(tree, &region, NULL, NULL);
+        g_assert(g_list_length(items) == 1 && items->data == &l2);
+        g_list_free(items);
+
+        region.x1 = -0.4;
+        region.x2 = -0.3;
+        items = ev_mapping_tree_get_in_rect(tree, &region, NULL, NULL);
+        g_assert(g_list_length(items) == 2);
+        g_list_free(items);
+
+        region.x1 = 0.1;
+        region.x2 = 0.5;
+        g_assert(!ev_mapping_tree_get_in_rect(tree, &region, NULL, NULL));
+
+        items = ev_mapping_tree_get_in_polygon(tree, lasso, 3, NULL, NULL);
+        g_assert(g_list_length(items) == 1 && items->data == &l2);
+        g_list_free(items);
+    }
+
+    {
+        /* The same segments loaded in bulk answer the same queries */
+        EvMappingTreeEntry entries[2];
+        EvMappingTree *bulk;
+
+        entries[0].item = &l1;
+        entries[0].extents = l1;
+        entries[0].z = 1;
+        entries[1].item = &l2;
+        entries[1].extents = l2;
+        entries[1].z = 2;
+        bulk = ev_mapping_tree_new_bulk(1, rect, entries, 2, is_on_line, NULL, do_nothing);
+
+        g_assert(ev_mapping_tree_length(bulk) == 2);
+        g_assert(ev_mapping_tree_get_topmost(bulk, -0.4, 1, 0, 2) == &l2);
+        g_assert(ev_mapping_tree_get_topmost(bulk, -0.4, 1, 0, 1) == &l1);
+        g_assert(!ev_mapping_tree_get_topmost(bulk, -0.4, 1, 3, 4));
+        g_assert(ev_mapping_tree_get(bulk, -0.73, 1));
+        g_assert(ev_mapping_tree_get(bulk, -0.53, 1));
+        g_assert(ev_mapping_tree_get(bulk, -0.53, 1.05));
+        g_assert(!ev_mapping_tree_get(bulk, -0.53, 1.2));
+
+        ev_mapping_tree_remove(bulk, &l2);
+        g_assert(ev_mapping_tree_length(bulk) == 1);
+        g_assert(ev_mapping_tree_get(bulk, -0.53, 1) == &l1);
+
+        ev_mapping_tree_remove(bulk, &l1);
+        g_assert(ev_mapping_tree_length(bulk) == 0);
+        g_assert(!ev_mapping_tree_get(bulk, -0.53, 1));
+
+        ev_mapping_tree_unref(bulk);
+    }
+
+    ev_mapping_tree_unref(tree);
+
+    test_ink_erase_undo();
+
     return 0;
 }
 
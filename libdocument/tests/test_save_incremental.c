@@ -0,0 +1,168 @@
+#include "evince-document.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+int main(void);
+
+/* A one page document, with its cross reference table */
+static GString *
+build_pdf(void)
+{
+    const gchar *objects[] = {
+        "<< /Type /Catalog /Pages 2 0 R >>",
+        "<< /Type /Pages /Kids [3 0 R] /Count 1 >>",
+        "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 200 200] >>"
+    };
+    gsize offsets[G_N_ELEMENTS(objects)];
+    gsize xref;
+    guint i;
+    GString *pdf = g_string_new("%PDF-1.4\n");
+
+    for (i = 0; i < G_N_ELEMENTS(objects); i++) {
+        offsets[i] = pdf->len;
+        g_string_append_printf(pdf, "%u 0 obj\n%s\nendobj\n", i + 1, objects[i]);
+    }
+
+    xref = pdf->len;
+    g_string_append_printf(pdf, "xref\n0 %u\n0000000000 65535 f \n", i + 1);
+    for (i = 0; i < G_N_ELEMENTS(objects); i++)
+        g_string_append_printf(pdf, "%010" G_GSIZE_FORMAT " 00000 n \n", offsets[i]);
+    g_string_append_printf(pdf, "trailer\n<< /Size %u /Root 1 0 R >>\nstartxref\n%" G_GSIZE_FORMAT "\n%%%%EOF\n",
+                           i + 1, xref);
+
+    return pdf;
+}
+
+/* Whether the last startxref points past the original content, at a
+ * cross reference table or stream */
+static gboolean
+has_valid_xref(const gchar *data, gsize length, gsize original_length)
+{
+    const gchar *startxref = NULL;
+    const gchar *p;
+    gchar *end;
+    guint64 offset;
+
+    for (p = data + original_length; p + strlen("startxref") <= data + length; p++) {
+        if (memcmp(p, "startxref", strlen("startxref")) == 0)
+            startxref = p;
+    }
+    if (!startxref)
+        return FALSE;
+
+    offset = g_ascii_strtoull(startxref + strlen("startxref"), &end, 10);
+    if (offset < original_length || offset >= length || !strstr(end, "%%EOF"))
+        return FALSE;
+
+    p = data + offset;
+    if (strncmp(p, "xref", 4) == 0)
+        return TRUE;
+
+    while (g_ascii_isdigit(*p))
+        p++;
+    if (*p++ != ' ')
+        return FALSE;
+    while (g_ascii_isdigit(*p))
+        p++;
+
+    return strncmp(p, " obj", 4) == 0;
+}
+
+static void
+add_annotation(EvDocument *document, const gchar *contents)
+{
+    EvPage *page = ev_document_get_page(document, 0);
+    EvAnnotation *annot = ev_annotation_text_new(page);
+    EvRectangle rect = { 10, 10, 30, 30 };
+
+    ev_annotation_set_contents(annot, contents);
+    ev_document_annotations_add_annotation(EV_DOCUMENT_ANNOTATIONS(document), annot, &rect);
+    g_object_unref(annot);
+    g_object_unref(page);
+}
+
+/* Reopens the saved file and checks it's the original file followed
+ * by an update poppler can read */
+static void
+check_saved(const gchar *filename, GString *original, guint n_annots)
+{
+    gchar *data;
+    gsize length;
+    gchar *uri;
+    EvDocument *document;
+    EvPage *page;
+    EvMappingList *annots;
+    GError *error = NULL;
+
+    g_assert(g_file_get_contents(filename, &data, &length, NULL));
+    g_assert(length > original->len);
+    g_assert(memcmp(data, original->str, original->len) == 0);
+    g_assert(has_valid_xref(data, length, original->len));
+    g_free(data);
+
+    uri = g_filename_to_uri(filename, NULL, NULL);
+    document = ev_document_factory_get_document(uri, &error);
+    g_assert_no_error(error);
+    g_assert(ev_document_get_n_pages(document) == 1);
+
+    page = ev_document_get_page(document, 0);
+    annots = ev_document_annotations_get_annotations(EV_DOCUMENT_ANNOTATIONS(document), page);
+    g_assert(annots && ev_mapping_list_length(annots) == n_annots);
+    ev_mapping_list_unref(annots);
+    g_object_unref(page);
+    g_object_unref(document);
+    g_free(uri);
+}
+
+int main(void)
+{
+    GString *pdf;
+    gchar *dir;
+    gchar *filename;
+    gchar *uri;
+    EvDocument *document;
+    GError *error = NULL;
+
+    g_setenv("EV_BACKENDS_DIR", TEST_BACKENDS_DIR, FALSE);
+    if (!ev_init()) {
+        fprintf(stderr, "No backends found, skipping\n");
+        return 0;
+    }
+
+    dir = g_dir_make_tmp("test-save-incremental-XXXXXX", NULL);
+    g_assert(dir);
+    filename = g_build_filename(dir, "document.pdf", NULL);
+    uri = g_filename_to_uri(filename, NULL, NULL);
+
+    pdf = build_pdf();
+    g_assert(g_file_set_contents(filename, pdf->str, pdf->len, NULL));
+
+    document = ev_document_factory_get_document(uri, &error);
+    g_assert_no_error(error);
+
+    add_annotation(document, "first");
+    g_assert(ev_document_save_incremental(document, uri, NULL, NULL, &error));
+    g_assert_no_error(error);
+    check_saved(filename, pdf, 1);
+
+    /* The second save holds both changes, after the original content */
+    add_annotation(document, "second");
+    g_assert(ev_document_save_incremental(document, uri, NULL, NULL, &error));
+    g_assert_no_error(error);
+    check_saved(filename, pdf, 2);
+
+    g_object_unref(document);
+    g_unlink(filename);
+    g_rmdir(dir);
+    g_string_free(pdf, TRUE);
+    g_free(uri);
+    g_free(filename);
+    g_free(dir);
+
+    ev_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+/* ev-annotation-history.c
+ *  this file is part of evince, a gnome document viewer
+ *
+ * Copyright (C) 2026 The Evince authors
+ *
+ * Evince is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Evince is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include "ev-annotation-history.h"
+
+/* The undo and redo stacks of the annotation edits of a view. Each
+ * entry is one user action, such as an eraser drag, made of the deltas
+ * it applied in order. A delta only keeps a reference to the annotation
+ * it changed and what changed in it: adding or removing a whole
+ * annotation, adding or removing one stroke of an ink annotation, or
+ * some of its properties. Undoing an action reverts its deltas in
+ * reverse order, so it costs as much as the action itself, however
+ * long the history is.
+ */
+
+/* Beyond this, the oldest actions are forgotten */
+#define MAX_ACTIONS 1000
+
+struct _EvAnnotationHistory {
+	GQueue     undo_stack;	/* GPtrArray of EvAnnotationDelta */
+	GQueue     redo_stack;
+	GPtrArray *action;	/* being recorded, or NULL */
+	guint      action_depth;
+};
+
+EvAnnotationState *
+ev_annotation_state_new (EvAnnotation *annot)
+{
+	EvAnnotationState *state;
+
+	state = g_slice_new0 (EvAnnotationState);
+	ev_annotation_get_rgba (annot, &state->rgba);
+
+	if (EV_IS_ANNOTATION_MARKUP (annot)) {
+		EvAnnotationMarkup *markup = EV_ANNOTATION_MARKUP (annot);
+
+		state->label = g_strdup (ev_annotation_markup_get_label (markup));
+		state->opacity = ev_annotation_markup_get_opacity (markup);
+		state->popup_is_open = ev_annotation_markup_get_popup_is_open (markup);
+	}
+
+	if (EV_IS_ANNOTATION_TEXT (annot))
+		state->icon = ev_annotation_text_get_icon (EV_ANNOTATION_TEXT (annot));
+
+	if (EV_IS_ANNOTATION_TEXT_MARKUP (annot))
+		state->markup_type = ev_annotation_text_markup_get_markup_type (EV_ANNOTATION_TEXT_MARKUP (annot));
+
+	return state;
+}
+
+void
+ev_annotation_state_free (EvAnnotationState *state)
+{
+	g_free (state->label);
+	g_slice_free (EvAnnotationState, state);
+}
+
+/* Sets the properties of @annot in @mask back to @state, and returns
+ * the ones that changed, to be saved to the document */
+EvAnnotationsSaveMask
+ev_annotation_state_apply (EvAnnotationState    *state,
+			   EvAnnotation         *annot,
+			   EvAnnotationsSaveMask mask)
+{
+	EvAnnotationsSaveMask changed = EV_ANNOTATIONS_SAVE_NONE;
+
+	if ((mask & EV_ANNOTATIONS_SAVE_COLOR) &&
+	    ev_annotation_set_rgba (annot, &state->rgba))
+		changed |= EV_ANNOTATIONS_SAVE_COLOR;
+
+	if (EV_IS_ANNOTATION_MARKUP (annot)) {
+		EvAnnotationMarkup *markup = EV_ANNOTATION_MARKUP (annot);
+
+		if ((mask & EV_ANNOTATIONS_SAVE_LABEL) &&
+		    ev_annotation_markup_set_label (markup, state->label))
+			changed |= EV_ANNOTATIONS_SAVE_LABEL;
+		if ((mask & EV_ANNOTATIONS_SAVE_OPACITY) &&
+		    ev_annotation_markup_set_opacity (markup, state->opacity))
+			changed |= EV_ANNOTATIONS_SAVE_OPACITY;
+		if ((mask & EV_ANNOTATIONS_SAVE_POPUP_IS_OPEN) &&
+		    ev_annotation_markup_set_popup_is_open (markup, state->popup_is_open))
+			changed |= EV_ANNOTATIONS_SAVE_POPUP_IS_OPEN;
+	}
+
+	if (EV_IS_ANNOTATION_TEXT (annot) && (mask & EV_ANNOTATIONS_SAVE_TEXT_ICON) &&
+	    ev_annotation_text_set_icon (EV_ANNOTATION_TEXT (annot), state->icon))
+		changed |= EV_ANNOTATIONS_SAVE_TEXT_ICON;
+
+	if (EV_IS_ANNOTATION_TEXT_MARKUP (annot) && (mask & EV_ANNOTATIONS_SAVE_TEXT_MARKUP_TYPE) &&
+	    ev_annotation_text_markup_set_markup_type (EV_ANNOTATION_TEXT_MARKUP (annot),
+						       state->markup_type))
+		changed |= EV_ANNOTATIONS_SAVE_TEXT_MARKUP_TYPE;
+
+	return changed;
+}
+
+static void
+ev_annotation_delta_free (EvAnnotationDelta *delta)
+{
+	g_object_unref (delta->annot);
+	if (delta->points)
+		g_bytes_unref (delta->points);
+	if (delta->old_state)
+		ev_annotation_state_free (delta->old_state);
+	if (delta->new_state)
+		ev_annotation_state_free (delta->new_state);
+	g_slice_free (EvAnnotationDelta, delta);
+}
+
+static GPtrArray *
+action_new (void)
+{
+	return g_ptr_array_new_with_free_func ((GDestroyNotify)ev_annotation_delta_free);
+}
+
+static void
+clear_stack (GQueue *stack)
+{
+	GPtrArray *action;
+
+	while ((action = g_queue_pop_head (stack)))
+		g_ptr_array_unref (action);
+}
+
+EvAnnotationHistory *
+ev_annotation_history_new (void)
+{
+	EvAnnotationHistory *history;
+
+	history = g_slice_new0 (EvAnnotationHistory);
+	g_queue_init (&history->undo_stack);
+	g_queue_init (&history->redo_stack);
+
+	return history;
+}
+
+void
+ev_annotation_history_clear (EvAnnotationHistory *history)
+{
+	clear_stack (&history->undo_stack);
+	clear_stack (&history->redo_stack);
+	g_clear_pointer (&history->action, g_ptr_array_unref);
+	history->action_depth = 0;
+}
+
+void
+ev_annotation_history_free (EvAnnotationHistory *history)
+{
+	ev_annotation_history_clear (history);
+	g_slice_free (EvAnnotationHistory, history);
+}
+
+/* Groups the deltas recorded until the matching
+ * ev_annotation_history_end_action() into one undo step */
+void
+ev_annotation_history_begin_action (EvAnnotationHistory *history)
+{
+	if (history->action_depth++ == 0)
+		history->action = action_new ();
+}
+
+void
+ev_annotation_history_end_action (EvAnnotationHistory *history)
+{
+	g_return_if_fail (history->action_depth > 0);
+
+	if (--history->action_depth > 0)
+		return;
+
+	if (history->action->len == 0) {
+		g_clear_pointer (&history->action, g_ptr_array_unref);
+		return;
+	}
+
+	/* A new edit makes the undone ones unreachable */
+	clear_stack (&history->redo_stack);
+
+	g_queue_push_tail (&history->undo_stack, history->action);
+	history->action = NULL;
+
+	if (g_queue_get_length (&history->undo_stack) > MAX_ACTIONS)
+		g_ptr_array_unref (g_queue_pop_head (&history->undo_stack));
+}
+
+static EvAnnotationDelta *
+ev_annotation_history_record (EvAnnotationHistory  *history,
+			      EvAnnotationDeltaType type,
+			      EvAnnotation         *annot)
+{
+	EvAnnotationDelta *delta;
+
+	delta = g_slice_new0 (EvAnnotationDelta);
+	delta->type = type;
+	delta->annot = g_object_ref (annot);
+
+	ev_annotation_history_begin_action (history);
+	g_ptr_array_add (history->action, delta);
+
+	return delta;
+}
+
+void
+ev_annotation_history_add_annot (EvAnnotationHistory *history,
+				 EvAnnotation        *annot,
+				 const EvRectangle   *area)
+{
+	EvAnnotationDelta *delta;
+
+	delta = ev_annotation_history_record (history, EV_ANNOTATION_DELTA_ADD, annot);
+	delta->area = *area;
+	ev_annotation_history_end_action (history);
+}
+
+void
+ev_annotation_history_remove_annot (EvAnnotationHistory *history,
+				    EvAnnotation        *annot,
+				    const EvRectangle   *area)
+{
+	EvAnnotationDelta *delta;
+
+	delta = ev_annotation_history_record (history, EV_ANNOTATION_DELTA_REMOVE, annot);
+	delta->area = *area;
+	ev_annotation_history_end_action (history);
+}
+
+/* Records a stroke of @annot removed, or added, with @points. The
+ * points are referenced, not copied. */
+void
+ev_annotation_history_change_stroke (EvAnnotationHistory *history,
+				     EvAnnotationInk     *annot,
+				     guint                stroke_id,
+				     GBytes              *points,
+				     gboolean             added)
+{
+	EvAnnotationDelta *delta;
+	const EvPoint     *p;
+	gsize              size;
+	gdouble            width;
+	guint              i;
+
+	delta = ev_annotation_history_record (history,
+					      added ? EV_ANNOTATION_DELTA_STROKE_ADD : EV_ANNOTATION_DELTA_STROKE_REMOVE,
+					      EV_ANNOTATION (annot));
+	delta->stroke_id = stroke_id;
+	delta->points = g_bytes_ref (points);
+
+	p = g_bytes_get_data (points, &size);
+	ev_annotation_ink_get_width (annot, &width);
+	delta->area.x1 = delta->area.y1 = G_MAXDOUBLE;
+	delta->area.x2 = delta->area.y2 = -G_MAXDOUBLE;
+	for (i = 0; i < size / sizeof (EvPoint); i++) {
+		delta->area.x1 = MIN (delta->area.x1, p[i].x - width);
+		delta->area.y1 = MIN (delta->area.y1, p[i].y - width);
+		delta->area.x2 = MAX (delta->area.x2, p[i].x + width);
+		delta->area.y2 = MAX (delta->area.y2, p[i].y + width);
+	}
+
+	ev_annotation_history_end_action (history);
+}
+
+/* Records the properties of @annot in @mask changed from @old_state
+ * to @new_state, which are owned by @history from now on */
+void
+ev_annotation_history_change_properties (EvAnnotationHistory  *history,
+					 EvAnnotation         *annot,
+					 const EvRectangle    *area,
+					 EvAnnotationsSaveMask mask,
+					 EvAnnotationState    *old_state,
+					 EvAnnotationState    *new_state)
+{
+	EvAnnotationDelta *delta;
+
+	delta = ev_annotation_history_record (history, EV_ANNOTATION_DELTA_PROPERTIES, annot);
+	delta->area = *area;
+	delta->mask = mask;
+	delta->old_state = old_state;
+	delta->new_state = new_state;
+	ev_annotation_history_end_action (history);
+}
+
+gboolean
+ev_annotation_history_can_undo (EvAnnotationHistory *history)
+{
+	return !g_queue_is_empty (&history->undo_stack);
+}
+
+gboolean
+ev_annotation_history_can_redo (EvAnnotationHistory *history)
+{
+	return !g_queue_is_empty (&history->redo_stack);
+}
+
+/* Returns the last action, moved to the redo stack, or NULL. Its
+ * deltas have to be reverted from the last one. */
+GPtrArray *
+ev_annotation_history_undo (EvAnnotationHistory *history)
+{
+	GPtrArray *action;
+
+	g_return_val_if_fail (history->action_depth == 0, NULL);
+
+	action = g_queue_pop_tail (&history->undo_stack);
+	if (action)
+		g_queue_push_tail (&history->redo_stack, action);
+
+	return action;
+}
+
+/* Returns the last undone action, moved back to the undo stack, or
+ * NULL. Its deltas have to be applied again from the first one. */
+GPtrArray *
+ev_annotation_history_redo (EvAnnotationHistory *history)
+{
+	GPtrArray *action;
+
+	g_return_val_if_fail (history->action_depth == 0, NULL);
+
+	action = g_queue_pop_tail (&history->redo_stack);
+	if (action)
+		g_queue_push_tail (&history->undo_stack, action);
+
+	return action;
+}
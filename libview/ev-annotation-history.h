@@ -0,0 +1,107 @@
+/* ev-annotation-history.h
+ *  this file is part of evince, a gnome document viewer
+ *
+ * Copyright (C) 2026 The Evince authors
+ *
+ * Evince is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Evince is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#if !defined (__EV_EVINCE_VIEW_H_INSIDE__) && !defined (EVINCE_COMPILATION)
+#error "Only <evince-view.h> can be included directly."
+#endif
+
+#ifndef EV_ANNOTATION_HISTORY_H
+#define EV_ANNOTATION_HISTORY_H
+
+#include <glib.h>
+#include <gdk/gdk.h>
+#include <evince-document.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+	EV_ANNOTATION_DELTA_ADD,
+	EV_ANNOTATION_DELTA_REMOVE,
+	EV_ANNOTATION_DELTA_STROKE_ADD,
+	EV_ANNOTATION_DELTA_STROKE_REMOVE,
+	EV_ANNOTATION_DELTA_PROPERTIES
+} EvAnnotationDeltaType;
+
+/* The properties of an annotation that the user can edit */
+typedef struct {
+	GdkRGBA                    rgba;
+	gchar                     *label;
+	gdouble                    opacity;
+	gboolean                   popup_is_open;
+	EvAnnotationTextIcon       icon;
+	EvAnnotationTextMarkupType markup_type;
+} EvAnnotationState;
+
+typedef struct {
+	EvAnnotationDeltaType type;
+	EvAnnotation         *annot;
+
+	/* What the delta changes on the page, in document units */
+	EvRectangle           area;
+
+	/* STROKE_ADD and STROKE_REMOVE: the stroke, its points shared
+	 * with the other pieces of the stroke it was split from */
+	guint                 stroke_id;
+	GBytes               *points;
+
+	/* PROPERTIES */
+	EvAnnotationsSaveMask mask;
+	EvAnnotationState    *old_state;
+	EvAnnotationState    *new_state;
+} EvAnnotationDelta;
+
+typedef struct _EvAnnotationHistory EvAnnotationHistory;
+
+EvAnnotationHistory *ev_annotation_history_new              (void);
+void                 ev_annotation_history_free             (EvAnnotationHistory  *history);
+void                 ev_annotation_history_clear            (EvAnnotationHistory  *history);
+void                 ev_annotation_history_begin_action     (EvAnnotationHistory  *history);
+void                 ev_annotation_history_end_action       (EvAnnotationHistory  *history);
+void                 ev_annotation_history_add_annot        (EvAnnotationHistory  *history,
+							     EvAnnotation         *annot,
+							     const EvRectangle    *area);
+void                 ev_annotation_history_remove_annot     (EvAnnotationHistory  *history,
+							     EvAnnotation         *annot,
+							     const EvRectangle    *area);
+void                 ev_annotation_history_change_stroke    (EvAnnotationHistory  *history,
+							     EvAnnotationInk      *annot,
+							     guint                 stroke_id,
+							     GBytes               *points,
+							     gboolean              added);
+void                 ev_annotation_history_change_properties(EvAnnotationHistory  *history,
+							     EvAnnotation         *annot,
+							     const EvRectangle    *area,
+							     EvAnnotationsSaveMask mask,
+							     EvAnnotationState    *old_state,
+							     EvAnnotationState    *new_state);
+gboolean             ev_annotation_history_can_undo         (EvAnnotationHistory  *history);
+gboolean             ev_annotation_history_can_redo         (EvAnnotationHistory  *history);
+GPtrArray           *ev_annotation_history_undo             (EvAnnotationHistory  *history);
+GPtrArray           *ev_annotation_history_redo             (EvAnnotationHistory  *history);
+
+EvAnnotationState   *ev_annotation_state_new                (EvAnnotation         *annot);
+void                 ev_annotation_state_free               (EvAnnotationState    *state);
+EvAnnotationsSaveMask ev_annotation_state_apply             (EvAnnotationState    *state,
+							     EvAnnotation         *annot,
+							     EvAnnotationsSaveMask mask);
+
+G_END_DECLS
+
+#endif /* EV_ANNOTATION_HISTORY_H */
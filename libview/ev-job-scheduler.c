@@ -30,7 +30,8 @@ typedef struct _EvSchedulerJob {
 G_LOCK_DEFINE_STATIC(job_list);
 static GSList *job_list = NULL;
 
-static volatile EvJob *running_job = NULL;
+/* Default size of the worker pool, when it's not set explicitly */
+#define DEFAULT_MAX_THREADS 4
 
 static gpointer ev_job_thread_proxy               (gpointer        data);
 static void     ev_scheduler_thread_job_cancelled (EvSchedulerJob *job,
@@ -44,6 +45,12 @@ static GQueue queue_none = G_QUEUE_INIT;
 static GCond job_queue_cond;
 static GMutex job_queue_mutex;
 
+/* Worker pool, protected by job_queue_mutex */
+static guint   n_threads = 0;       /* wanted, 0 until configured */
+static guint   n_workers = 0;       /* running */
+static guint   n_background_jobs = 0; /* being run, below urgent priority */
+static GSList *running_jobs = NULL;
+
 static GQueue *job_queue[EV_JOB_N_PRIORITIES] = {
 	&queue_urgent,
 	&queue_high,
@@ -72,6 +79,12 @@ ev_job_queue_get_next_unlocked (void)
 	EvSchedulerJob *job = NULL;
 	
 	for (i = EV_JOB_PRIORITY_URGENT; i < EV_JOB_N_PRIORITIES; i++) {
+		/* Thumbnails, preloading and the like never take the
+		 * last worker, so the visible pages don't wait for them */
+		if (i > EV_JOB_PRIORITY_URGENT && n_threads > 1 &&
+		    n_background_jobs >= n_threads - 1)
+			break;
+
 		job = (EvSchedulerJob *) g_queue_pop_head (job_queue[i]);
 		if (job)
 			break;
@@ -82,10 +95,31 @@ ev_job_queue_get_next_unlocked (void)
 	return job;
 }
 
+static void
+ev_job_scheduler_spawn_workers_unlocked (void)
+{
+	while (n_workers < n_threads) {
+		g_thread_unref (g_thread_new ("EvJobScheduler", ev_job_thread_proxy, NULL));
+		n_workers++;
+	}
+}
+
+static guint
+ev_job_scheduler_get_default_n_threads (void)
+{
+	return CLAMP (g_get_num_processors (), 1, DEFAULT_MAX_THREADS);
+}
+
 static gpointer
 ev_job_scheduler_init (gpointer data)
 {
-	g_thread_new ("EvJobScheduler", ev_job_thread_proxy, NULL);
+	g_mutex_lock (&job_queue_mutex);
+
+	if (n_threads == 0)
+		n_threads = ev_job_scheduler_get_default_n_threads ();
+	ev_job_scheduler_spawn_workers_unlocked ();
+
+	g_mutex_unlock (&job_queue_mutex);
 
 	return NULL;
 }
@@ -169,23 +203,18 @@ ev_scheduler_thread_job_cancelled (EvSchedulerJob *job,
 	}
 }
 
-static void
+/* Returns whether the job has more to do. It then goes back to the
+ * end of its queue, so that a long job doesn't keep its worker from
+ * the jobs queued meanwhile. */
+static gboolean
 ev_job_thread (EvJob *job)
 {
-	gboolean result;
-
 	ev_debug_message (DEBUG_JOBS, "%s", EV_GET_TYPE_NAME (job));
 
-	do {
-		if (g_cancellable_is_cancelled (job->cancellable))
-			result = FALSE;
-		else {
-                        g_atomic_pointer_set (&running_job, job);
-			result = ev_job_run (job);
-                }
-	} while (result);
+	if (g_cancellable_is_cancelled (job->cancellable))
+		return FALSE;
 
-        g_atomic_pointer_set (&running_job, NULL);
+	return ev_job_run (job);
 }
 
 static gboolean
@@ -204,18 +233,50 @@ ev_job_thread_proxy (gpointer data)
 {
 	while (TRUE) {
 		EvSchedulerJob *job;
+		gboolean        background;
+		gboolean        requeue;
 
 		g_mutex_lock (&job_queue_mutex);
+
+		/* The pool was made smaller */
+		if (n_workers > n_threads) {
+			n_workers--;
+			g_mutex_unlock (&job_queue_mutex);
+			break;
+		}
+
 		job = ev_job_queue_get_next_unlocked ();
 		if (!job) {
 			g_cond_wait (&job_queue_cond, &job_queue_mutex);
 			g_mutex_unlock (&job_queue_mutex);
 			continue;
 		}
+
+		background = job->priority != EV_JOB_PRIORITY_URGENT;
+		if (background)
+			n_background_jobs++;
+		running_jobs = g_slist_prepend (running_jobs, job->job);
 		g_mutex_unlock (&job_queue_mutex);
 		
-		ev_job_thread (job->job);
-		ev_scheduler_job_destroy (job);
+		requeue = ev_job_thread (job->job);
+
+		g_mutex_lock (&job_queue_mutex);
+		running_jobs = g_slist_remove (running_jobs, job->job);
+		if (background) {
+			n_background_jobs--;
+			/* A job held back for the reserved worker can go now */
+			g_cond_broadcast (&job_queue_cond);
+		}
+		/* If it was cancelled meanwhile, it's destroyed the next
+		 * time it's picked, without being run */
+		if (requeue) {
+			g_queue_push_tail (job_queue[job->priority], job);
+			g_cond_broadcast (&job_queue_cond);
+		}
+		g_mutex_unlock (&job_queue_mutex);
+
+		if (!requeue)
+			ev_scheduler_job_destroy (job);
 	}
 
 	return NULL;
@@ -300,6 +361,7 @@ ev_job_scheduler_update_job (EvJob         *job,
 					  EV_GET_TYPE_NAME (job), s_job->priority, priority);
 			g_queue_delete_link (job_queue[s_job->priority], list);
 			g_queue_push_tail (job_queue[priority], s_job);
+			s_job->priority = priority;
 			g_cond_broadcast (&job_queue_cond);
 		}
 		
@@ -310,10 +372,78 @@ ev_job_scheduler_update_job (EvJob         *job,
 /**
  * ev_job_scheduler_get_running_thread_job:
  *
+ * Returns the thread job started most recently among those still
+ * running. Use ev_job_scheduler_is_job_running() to check for a
+ * given job, as several can run at once.
+ *
  * Returns: (transfer none): an #EvJob
  */
 EvJob *
 ev_job_scheduler_get_running_thread_job (void)
 {
-        return g_atomic_pointer_get (&running_job);
+	EvJob *job;
+
+	g_mutex_lock (&job_queue_mutex);
+	job = running_jobs ? running_jobs->data : NULL;
+	g_mutex_unlock (&job_queue_mutex);
+
+        return job;
+}
+
+/**
+ * ev_job_scheduler_is_job_running:
+ * @job: an #EvJob
+ *
+ * Returns: whether @job is being run by one of the worker threads
+ */
+gboolean
+ev_job_scheduler_is_job_running (EvJob *job)
+{
+	gboolean running;
+
+	g_mutex_lock (&job_queue_mutex);
+	running = g_slist_find (running_jobs, job) != NULL;
+	g_mutex_unlock (&job_queue_mutex);
+
+	return running;
+}
+
+/**
+ * ev_job_scheduler_set_n_threads:
+ * @threads: number of worker threads, or 0 for the default
+ *
+ * Sets how many thread jobs can run at the same time. One of the
+ * workers is kept for %EV_JOB_PRIORITY_URGENT jobs when there are
+ * several. By default there is one per processor, up to four.
+ */
+void
+ev_job_scheduler_set_n_threads (guint threads)
+{
+	g_mutex_lock (&job_queue_mutex);
+
+	n_threads = threads > 0 ? threads : ev_job_scheduler_get_default_n_threads ();
+	/* Otherwise they're started with the first job */
+	if (n_workers > 0)
+		ev_job_scheduler_spawn_workers_unlocked ();
+	g_cond_broadcast (&job_queue_cond);
+
+	g_mutex_unlock (&job_queue_mutex);
+}
+
+/**
+ * ev_job_scheduler_get_n_threads:
+ *
+ * Returns: the number of worker threads, or 0 if it hasn't been
+ * decided yet
+ */
+guint
+ev_job_scheduler_get_n_threads (void)
+{
+	guint threads;
+
+	g_mutex_lock (&job_queue_mutex);
+	threads = n_threads;
+	g_mutex_unlock (&job_queue_mutex);
+
+	return threads;
 }
@@ -43,6 +43,9 @@ void   ev_job_scheduler_push_job               (EvJob        *job,
 void   ev_job_scheduler_update_job             (EvJob        *job,
                                                 EvJobPriority priority);
 EvJob *ev_job_scheduler_get_running_thread_job (void);
+gboolean ev_job_scheduler_is_job_running       (EvJob        *job);
+void   ev_job_scheduler_set_n_threads          (guint         threads);
+guint  ev_job_scheduler_get_n_threads          (void);
 
 G_END_DECLS
 
@@ -21,6 +21,7 @@
 #include <config.h>
 
 #include "ev-jobs.h"
+#include "ev-job-scheduler.h"
 #include "ev-document-links.h"
 #include "ev-document-images.h"
 #include "ev-document-forms.h"
@@ -39,6 +40,7 @@
 #include "ev-debug.h"
 
 #include <errno.h>
+#include <string.h>
 #include <glib/gstdio.h>
 #include <glib/gi18n-lib.h>
 #include <unistd.h>
@@ -63,6 +65,8 @@ static void ev_job_save_init              (EvJobSave             *job);
 static void ev_job_save_class_init        (EvJobSaveClass        *class);
 static void ev_job_find_init              (EvJobFind             *job);
 static void ev_job_find_class_init        (EvJobFindClass        *class);
+static void ev_job_text_index_init        (EvJobTextIndex        *job);
+static void ev_job_text_index_class_init  (EvJobTextIndexClass   *class);
 static void ev_job_layers_init            (EvJobLayers           *job);
 static void ev_job_layers_class_init      (EvJobLayersClass      *class);
 static void ev_job_export_init            (EvJobExport           *job);
@@ -81,6 +85,11 @@ enum {
 	FONTS_LAST_SIGNAL
 };
 
+enum {
+	SAVE_UPDATED,
+	SAVE_LAST_SIGNAL
+};
+
 enum {
 	FIND_UPDATED,
 	FIND_LAST_SIGNAL
@@ -88,6 +97,7 @@ enum {
 
 static guint job_signals[LAST_SIGNAL] = { 0 };
 static guint job_fonts_signals[FONTS_LAST_SIGNAL] = { 0 };
+static guint job_save_signals[SAVE_LAST_SIGNAL] = { 0 };
 static guint job_find_signals[FIND_LAST_SIGNAL] = { 0 };
 
 G_DEFINE_ABSTRACT_TYPE (EvJob, ev_job, G_TYPE_OBJECT)
@@ -103,6 +113,8 @@ G_DEFINE_TYPE (EvJobLoadStream, ev_job_load_stream, EV_TYPE_JOB)
 G_DEFINE_TYPE (EvJobLoadGFile, ev_job_load_gfile, EV_TYPE_JOB)
 G_DEFINE_TYPE (EvJobSave, ev_job_save, EV_TYPE_JOB)
 G_DEFINE_TYPE (EvJobFind, ev_job_find, EV_TYPE_JOB)
+G_DEFINE_TYPE (EvJobTextIndex, ev_job_text_index, EV_TYPE_JOB)
+G_DEFINE_TYPE (EvJobRenderInstance, ev_job_render_instance, EV_TYPE_JOB)
 G_DEFINE_TYPE (EvJobLayers, ev_job_layers, EV_TYPE_JOB)
 G_DEFINE_TYPE (EvJobExport, ev_job_export, EV_TYPE_JOB)
 G_DEFINE_TYPE (EvJobPrint, ev_job_print, EV_TYPE_JOB)
@@ -384,9 +396,9 @@ ev_job_links_run (EvJob *job)
 	ev_debug_message (DEBUG_JOBS, NULL);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 	
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (job->document);
 	job_links->model = ev_document_links_get_links_model (EV_DOCUMENT_LINKS (job->document));
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (job->document);
 
 	gtk_tree_model_foreach (job_links->model, (GtkTreeModelForeachFunc)fill_page_labels, job);
 
@@ -467,10 +479,10 @@ ev_job_attachments_run (EvJob *job)
 	ev_debug_message (DEBUG_JOBS, NULL);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (job->document);
 	job_attachments->attachments =
 		ev_document_attachments_get_attachments (EV_DOCUMENT_ATTACHMENTS (job->document));
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (job->document);
 
 	ev_job_succeeded (job);
 
@@ -534,7 +546,7 @@ ev_job_annots_run (EvJob *job)
 	ev_debug_message (DEBUG_JOBS, NULL);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (job->document);
 	for (i = 0; i < ev_document_get_n_pages (job->document); i++) {
 		EvMappingList *mapping_list;
 		EvPage        *page;
@@ -547,7 +559,7 @@ ev_job_annots_run (EvJob *job)
 		if (mapping_list)
 			job_annots->annots = g_list_prepend (job_annots->annots, mapping_list);
 	}
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (job->document);
 
 	job_annots->annots = g_list_reverse (job_annots->annots);
 
@@ -617,38 +629,53 @@ static gboolean
 ev_job_render_run (EvJob *job)
 {
 	EvJobRender     *job_render = EV_JOB_RENDER (job);
+	EvDocument      *document;
 	EvPage          *ev_page;
 	EvRenderContext *rc;
 
 	ev_debug_message (DEBUG_JOBS, "page: %d (%p)", job_render->page, job);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 	
-	ev_document_doc_mutex_lock ();
+	/* A copy of the document for this worker, when the backend can
+	 * open one, so that other jobs on the document don't wait */
+	document = ev_document_get_render_instance (job->document);
+	ev_document_lock (document);
 
 	ev_profiler_start (EV_PROFILE_JOBS, "Rendering page %d", job_render->page);
 		
-	ev_document_fc_mutex_lock ();
+	ev_document_fc_lock (document);
 
-	ev_page = ev_document_get_page (job->document, job_render->page);
+	ev_page = ev_document_get_page (document, job_render->page);
 	rc = ev_render_context_new (ev_page, job_render->rotation, job_render->scale);
 	ev_render_context_set_target_size (rc,
 					   job_render->target_width, job_render->target_height);
+	if (job_render->include_clip)
+		ev_render_context_set_clip (rc,
+					    job_render->clip.x, job_render->clip.y,
+					    job_render->clip.width, job_render->clip.height);
 	g_object_unref (ev_page);
 
-	job_render->surface = ev_document_render (job->document, rc);
+	job_render->surface = ev_document_render (document, rc);
+
+	/* Backends that can't render part of a page return all of it */
+	if (job_render->include_clip && job_render->surface &&
+	    (cairo_image_surface_get_width (job_render->surface) != job_render->clip.width ||
+	     cairo_image_surface_get_height (job_render->surface) != job_render->clip.height))
+		job_render->include_clip = FALSE;
 	/* If job was cancelled during the page rendering,
 	 * we return now, so that the thread is finished ASAP
 	 */
 	if (g_cancellable_is_cancelled (job->cancellable)) {
-		ev_document_fc_mutex_unlock ();
-		ev_document_doc_mutex_unlock ();
+		ev_document_fc_unlock (document);
+		ev_document_unlock (document);
+		g_object_unref (document);
 		g_object_unref (rc);
 
 		return FALSE;
 	}
 
-	if (job_render->include_selection && EV_IS_SELECTION (job->document)) {
-		ev_selection_render_selection (EV_SELECTION (job->document),
+	if (job_render->include_selection && EV_IS_SELECTION (document)) {
+		ev_selection_render_selection (EV_SELECTION (document),
 					       rc,
 					       &(job_render->selection),
 					       &(job_render->selection_points),
@@ -656,7 +683,7 @@ ev_job_render_run (EvJob *job)
 					       job_render->selection_style,
 					       &(job_render->text), &(job_render->base));
 		job_render->selection_region =
-			ev_selection_get_selection_region (EV_SELECTION (job->document),
+			ev_selection_get_selection_region (EV_SELECTION (document),
 							   rc,
 							   job_render->selection_style,
 							   &(job_render->selection_points));
@@ -664,9 +691,10 @@ ev_job_render_run (EvJob *job)
 
 	g_object_unref (rc);
 
-	ev_document_fc_mutex_unlock ();
-	ev_document_doc_mutex_unlock ();
-	
+	ev_document_fc_unlock (document);
+	ev_document_unlock (document);
+	g_object_unref (document);
+
 	ev_job_succeeded (job);
 	
 	return FALSE;
@@ -721,6 +749,16 @@ ev_job_render_set_selection_info (EvJobRender     *job,
 	job->base = *base;
 }
 
+/* Render only @clip, in target pixels, so that the result can be
+ * patched into the surface of an earlier render of the same page */
+void
+ev_job_render_set_clip (EvJobRender           *job,
+			cairo_rectangle_int_t *clip)
+{
+	job->include_clip = TRUE;
+	job->clip = *clip;
+}
+
 /* EvJobPageData */
 static void
 ev_job_page_data_init (EvJobPageData *job)
@@ -733,20 +771,36 @@ ev_job_page_data_run (EvJob *job)
 {
 	EvJobPageData *job_pd = EV_JOB_PAGE_DATA (job);
 	EvPage        *ev_page;
+	EvTextIndex   *index = NULL;
 
 	ev_debug_message (DEBUG_JOBS, "page: %d (%p)", job_pd->page, job);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 
-	ev_document_doc_mutex_lock ();
+	/* Text and layout come from the text index once it's ready */
+	if (EV_IS_DOCUMENT_TEXT (job->document)) {
+		index = ev_text_index_get_for_document (job->document);
+		if (!ev_text_index_is_ready (index))
+			index = NULL;
+	}
+
+	ev_document_lock (job->document);
 	ev_page = ev_document_get_page (job->document, job_pd->page);
 
 	if ((job_pd->flags & EV_PAGE_DATA_INCLUDE_TEXT_MAPPING) && EV_IS_DOCUMENT_TEXT (job->document))
 		job_pd->text_mapping =
 			ev_document_text_get_text_mapping (EV_DOCUMENT_TEXT (job->document), ev_page);
-	if ((job_pd->flags & EV_PAGE_DATA_INCLUDE_TEXT) && EV_IS_DOCUMENT_TEXT (job->document))
+	if ((job_pd->flags & EV_PAGE_DATA_INCLUDE_TEXT) && index)
+		job_pd->text = g_strdup (ev_text_index_get_text (index, job_pd->page));
+	else if ((job_pd->flags & EV_PAGE_DATA_INCLUDE_TEXT) && EV_IS_DOCUMENT_TEXT (job->document))
 		job_pd->text =
 			ev_document_text_get_text (EV_DOCUMENT_TEXT (job->document), ev_page);
-	if ((job_pd->flags & EV_PAGE_DATA_INCLUDE_TEXT_LAYOUT) && EV_IS_DOCUMENT_TEXT (job->document))
+	if ((job_pd->flags & EV_PAGE_DATA_INCLUDE_TEXT_LAYOUT) && index) {
+		const EvRectangle *areas;
+
+		ev_text_index_get_text_layout (index, job_pd->page, &areas,
+					       &(job_pd->text_layout_length));
+		job_pd->text_layout = g_memdup (areas, job_pd->text_layout_length * sizeof (EvRectangle));
+	} else if ((job_pd->flags & EV_PAGE_DATA_INCLUDE_TEXT_LAYOUT) && EV_IS_DOCUMENT_TEXT (job->document))
 		ev_document_text_get_text_layout (EV_DOCUMENT_TEXT (job->document),
 						  ev_page,
 						  &(job_pd->text_layout),
@@ -778,7 +832,7 @@ ev_job_page_data_run (EvJob *job)
 			ev_document_annotations_get_annotations (EV_DOCUMENT_ANNOTATIONS (job->document),
 								 ev_page);
 	g_object_unref (ev_page);
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (job->document);
 
 	ev_job_succeeded (job);
 
@@ -839,6 +893,7 @@ static gboolean
 ev_job_thumbnail_run (EvJob *job)
 {
 	EvJobThumbnail  *job_thumb = EV_JOB_THUMBNAIL (job);
+	EvDocument      *document;
 	EvRenderContext *rc;
 	GdkPixbuf       *pixbuf = NULL;
 	EvPage          *page;
@@ -846,20 +901,22 @@ ev_job_thumbnail_run (EvJob *job)
 	ev_debug_message (DEBUG_JOBS, "%d (%p)", job_thumb->page, job);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 	
-	ev_document_doc_mutex_lock ();
+	document = ev_document_get_render_instance (job->document);
+	ev_document_lock (document);
 
-	page = ev_document_get_page (job->document, job_thumb->page);
+	page = ev_document_get_page (document, job_thumb->page);
 	rc = ev_render_context_new (page, job_thumb->rotation, job_thumb->scale);
 	ev_render_context_set_target_size (rc,
 					   job_thumb->target_width, job_thumb->target_height);
 	g_object_unref (page);
 
         if (job_thumb->format == EV_JOB_THUMBNAIL_PIXBUF)
-                pixbuf = ev_document_get_thumbnail (job->document, rc);
+                pixbuf = ev_document_get_thumbnail (document, rc);
         else
-                job_thumb->thumbnail_surface = ev_document_get_thumbnail_surface (job->document, rc);
+                job_thumb->thumbnail_surface = ev_document_get_thumbnail_surface (document, rc);
 	g_object_unref (rc);
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (document);
+	g_object_unref (document);
 
         /* EV_JOB_THUMBNAIL_SURFACE is not compatible with has_frame = TRUE */
         if (job_thumb->format == EV_JOB_THUMBNAIL_PIXBUF && pixbuf) {
@@ -969,11 +1026,13 @@ ev_job_fonts_run (EvJob *job)
 	ev_debug_message (DEBUG_JOBS, NULL);
 	
 	/* Do not block the main loop */
-	if (!ev_document_doc_mutex_trylock ())
+	if (!ev_document_trylock (job->document))
 		return TRUE;
 	
-	if (!ev_document_fc_mutex_trylock ())
+	if (!ev_document_fc_trylock (job->document)) {
+		ev_document_unlock (job->document);
 		return TRUE;
+	}
 
 #ifdef EV_ENABLE_DEBUG
 	/* We use the #ifdef in this case because of the if */
@@ -985,8 +1044,8 @@ ev_job_fonts_run (EvJob *job)
 	g_signal_emit (job_fonts, job_fonts_signals[FONTS_UPDATED], 0,
 		       ev_document_fonts_get_progress (fonts));
 
-	ev_document_fc_mutex_unlock ();
-	ev_document_doc_mutex_unlock ();
+	ev_document_fc_unlock (job->document);
+	ev_document_unlock (job->document);
 
 	if (job_fonts->scan_completed)
 		ev_job_succeeded (job);
@@ -1457,6 +1516,73 @@ ev_job_save_dispose (GObject *object)
 	(* G_OBJECT_CLASS (ev_job_save_parent_class)->dispose) (object);
 }
 
+static gboolean
+emit_save_updated (EvJobSave *job)
+{
+	g_atomic_int_set (&job->update_pending, FALSE);
+
+	if (!EV_JOB (job)->cancelled)
+		g_signal_emit (job, job_save_signals[SAVE_UPDATED], 0,
+			       ev_job_save_get_progress (job));
+
+	return FALSE;
+}
+
+/* Called from the thread of the backend writing the document */
+static void
+ev_job_save_progress_cb (goffset    current_bytes,
+			 goffset    total_bytes,
+			 EvJobSave *job)
+{
+	if (total_bytes <= 0)
+		return;
+
+	g_atomic_int_set (&job->progress, (gint) (current_bytes * 1000 / total_bytes));
+	if (g_atomic_int_compare_and_exchange (&job->update_pending, FALSE, TRUE)) {
+		g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+				 (GSourceFunc)emit_save_updated,
+				 g_object_ref (job),
+				 (GDestroyNotify)g_object_unref);
+	}
+}
+
+/* Appends the changes to the file the document was loaded from,
+ * when saving over it. Returns FALSE when the document has to be
+ * saved whole instead. */
+static gboolean
+ev_job_save_incremental (EvJobSave *job_save)
+{
+	EvJob    *job = EV_JOB (job_save);
+	GError   *error = NULL;
+	gboolean  retval;
+
+	if (g_strcmp0 (job_save->uri, job_save->document_uri) != 0 ||
+	    g_object_get_data (G_OBJECT (job->document), "uri-uncompressed"))
+		return FALSE;
+
+	ev_document_lock (job->document);
+	retval = ev_document_save_incremental (job->document, job_save->uri,
+					       (GFileProgressCallback)ev_job_save_progress_cb,
+					       job_save, &error);
+	ev_document_unlock (job->document);
+
+	if (retval) {
+		ev_job_succeeded (job);
+		return TRUE;
+	}
+
+	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+		ev_debug_message (DEBUG_JOBS, "%s", error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+
+	ev_job_failed_from_error (job, error);
+	g_error_free (error);
+
+	return TRUE;
+}
+
 static gboolean
 ev_job_save_run (EvJob *job)
 {
@@ -1469,6 +1595,9 @@ ev_job_save_run (EvJob *job)
 	ev_debug_message (DEBUG_JOBS, "uri: %s, document_uri: %s", job_save->uri, job_save->document_uri);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 
+	if (ev_job_save_incremental (job_save))
+		return FALSE;
+
         fd = ev_mkstemp ("saveacopy.XXXXXX", &tmp_filename, &error);
         if (fd == -1) {
                 ev_job_failed_from_error (job, error);
@@ -1478,7 +1607,7 @@ ev_job_save_run (EvJob *job)
 	}
 	close (fd);
 
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (job->document);
 
 	/* Save document to temp filename */
 	local_uri = g_filename_to_uri (tmp_filename, NULL, &error);
@@ -1486,7 +1615,7 @@ ev_job_save_run (EvJob *job)
                 ev_document_save (job->document, local_uri, &error);
         }
 
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (job->document);
 
 	if (error) {
 		g_free (local_uri);
@@ -1561,6 +1690,16 @@ ev_job_save_class_init (EvJobSaveClass *class)
 
 	oclass->dispose = ev_job_save_dispose;
 	job_class->run = ev_job_save_run;
+
+	job_save_signals[SAVE_UPDATED] =
+		g_signal_new ("updated",
+			      EV_TYPE_JOB_SAVE,
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (EvJobSaveClass, updated),
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__DOUBLE,
+			      G_TYPE_NONE,
+			      1, G_TYPE_DOUBLE);
 }
 
 EvJob *
@@ -1581,11 +1720,31 @@ ev_job_save_new (EvDocument  *document,
 	return EV_JOB (job);
 }
 
+/**
+ * ev_job_save_get_progress:
+ * @job: an #EvJobSave
+ *
+ * Only saves that append the changes to the original file report
+ * their progress, through the #EvJobSave::updated signal.
+ *
+ * Returns: the fraction of the document written so far
+ */
+gdouble
+ev_job_save_get_progress (EvJobSave *job)
+{
+	g_return_val_if_fail (EV_IS_JOB_SAVE (job), 0.0);
+
+	if (ev_job_is_finished (EV_JOB (job)))
+		return 1.0;
+
+	return g_atomic_int_get (&job->progress) / 1000.0;
+}
+
 /* EvJobFind */
 static void
 ev_job_find_init (EvJobFind *job)
 {
-	EV_JOB (job)->run_mode = EV_JOB_RUN_MAIN_LOOP;
+	EV_JOB (job)->run_mode = EV_JOB_RUN_THREAD;
 }
 
 static void
@@ -1611,51 +1770,198 @@ ev_job_find_dispose (GObject *object)
 		g_free (job->pages);
 		job->pages = NULL;
 	}
+
+	if (job->index) {
+		g_object_unref (job->index);
+		job->index = NULL;
+	}
+
+	g_clear_pointer (&job->skip_pages, g_free);
+	g_clear_pointer (&job->searched, g_free);
 	
 	(* G_OBJECT_CLASS (ev_job_find_parent_class)->dispose) (object);
 }
 
+/* Reports, in search order, the pages searched since the last update */
 static gboolean
-ev_job_find_run (EvJob *job)
+emit_find_updated (EvJobFind *job)
 {
-	EvJobFind      *job_find = EV_JOB_FIND (job);
-	EvDocumentFind *find = EV_DOCUMENT_FIND (job->document);
-	EvPage         *ev_page;
-	GList          *matches;
+	g_atomic_int_set (&job->update_pending, FALSE);
 
-	ev_debug_message (DEBUG_JOBS, NULL);
-	
-	/* Do not block the main loop */
-	if (!ev_document_doc_mutex_trylock ())
-		return TRUE;
-	
-#ifdef EV_ENABLE_DEBUG
-	/* We use the #ifdef in this case because of the if */
-	if (job_find->current_page == job_find->start_page)
-		ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
-#endif
+	while (!EV_JOB (job)->cancelled && job->pages_reported < job->n_pages) {
+		gint page = ev_job_find_get_nth_page (job, job->pages_reported);
 
-	ev_page = ev_document_get_page (job->document, job_find->current_page);
-	matches = ev_document_find_find_text_with_options (find, ev_page, job_find->text,
-                                                           job_find->options);
-	g_object_unref (ev_page);
-	
-	ev_document_doc_mutex_unlock ();
+		/* Searched by another worker, but not yet this one */
+		if (!g_atomic_int_get (&job->searched[page]))
+			break;
 
-	if (!job_find->has_results)
-		job_find->has_results = (matches != NULL);
+		job->pages_reported++;
+		if (job->pages[page])
+			job->has_results = TRUE;
 
-	job_find->pages[job_find->current_page] = matches;
-	g_signal_emit (job_find, job_find_signals[FIND_UPDATED], 0, job_find->current_page);
-		       
-	job_find->current_page = (job_find->current_page + 1) % job_find->n_pages;
-	if (job_find->current_page == job_find->start_page) {
-		ev_job_succeeded (job);
+		job->current_page = page;
+		g_signal_emit (job, job_find_signals[FIND_UPDATED], 0, page);
+	}
+
+	return FALSE;
+}
+
+/* Pages searched each time the job is run. It then goes back to the
+ * scheduler queue, so that renders of the visible pages don't wait
+ * for the whole search. */
+#define FIND_PAGES_PER_RUN 8
+
+static void
+ev_job_find_search_page (EvJobFind *job_find,
+			 gint       page)
+{
+	EvDocument *document;
+	EvPage     *ev_page;
+
+	if (job_find->skip_pages && job_find->skip_pages[page])
+		return;
+
+	if (job_find->index && ev_text_index_is_ready (job_find->index)) {
+		job_find->pages[page] =
+			ev_text_index_find_text (job_find->index, page, job_find->text,
+						 job_find->options);
+		return;
+	}
+
+	/* The copy of the document for this worker when there is one,
+	 * so that the workers search at the same time */
+	document = ev_document_get_render_instance (EV_JOB (job_find)->document);
+	ev_document_lock (document);
+	ev_page = ev_document_get_page (document, page);
+	job_find->pages[page] =
+		ev_document_find_find_text_with_options (EV_DOCUMENT_FIND (document),
+							 ev_page, job_find->text,
+							 job_find->options);
+	g_object_unref (ev_page);
+	ev_document_unlock (document);
+	g_object_unref (document);
+}
 
+/* Searches the next pages not taken by another worker, and returns
+ * whether some are left. The worker searching the last page finishes
+ * @job_find. */
+static gboolean
+ev_job_find_search_chunk (EvJobFind *job_find)
+{
+	EvJob *job = EV_JOB (job_find);
+	gint   i, last;
+
+	i = g_atomic_int_add (&job_find->pages_claimed, FIND_PAGES_PER_RUN);
+	if (i >= job_find->n_pages)
 		return FALSE;
+
+	last = MIN (i + FIND_PAGES_PER_RUN, job_find->n_pages);
+	for (; i < last; i++) {
+		gint page = ev_job_find_get_nth_page (job_find, i);
+
+		if (g_cancellable_is_cancelled (job->cancellable))
+			return FALSE;
+
+		ev_job_find_search_page (job_find, page);
+
+		g_atomic_int_set (&job_find->searched[page], TRUE);
+		if (g_atomic_int_compare_and_exchange (&job_find->update_pending, FALSE, TRUE)) {
+			g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+					 (GSourceFunc)emit_find_updated,
+					 g_object_ref (job),
+					 (GDestroyNotify)g_object_unref);
+		}
+		if (g_atomic_int_add (&job_find->pages_searched, 1) == job_find->n_pages - 1)
+			ev_job_succeeded (job);
 	}
 
-	return TRUE;
+	return last < job_find->n_pages;
+}
+
+/* EvJobFindHelper: searches chunks of the pages of a find job on
+ * another worker. It shares the cancellable of the find job. */
+typedef struct _EvJobFindHelper {
+	EvJob      parent;
+
+	EvJobFind *find;
+} EvJobFindHelper;
+
+typedef struct _EvJobFindHelperClass {
+	EvJobClass parent_class;
+} EvJobFindHelperClass;
+
+static GType ev_job_find_helper_get_type (void) G_GNUC_CONST;
+
+G_DEFINE_TYPE (EvJobFindHelper, ev_job_find_helper, EV_TYPE_JOB)
+
+static void
+ev_job_find_helper_init (EvJobFindHelper *job)
+{
+	EV_JOB (job)->run_mode = EV_JOB_RUN_THREAD;
+}
+
+static void
+ev_job_find_helper_dispose (GObject *object)
+{
+	EvJobFindHelper *job = (EvJobFindHelper *) object;
+
+	g_clear_object (&job->find);
+
+	(* G_OBJECT_CLASS (ev_job_find_helper_parent_class)->dispose) (object);
+}
+
+static gboolean
+ev_job_find_helper_run (EvJob *job)
+{
+	return ev_job_find_search_chunk (((EvJobFindHelper *) job)->find);
+}
+
+static void
+ev_job_find_helper_class_init (EvJobFindHelperClass *class)
+{
+	EvJobClass   *job_class = EV_JOB_CLASS (class);
+	GObjectClass *gobject_class = G_OBJECT_CLASS (class);
+
+	job_class->run = ev_job_find_helper_run;
+	gobject_class->dispose = ev_job_find_helper_dispose;
+}
+
+/* Background jobs get all the workers but one, the find job included */
+static void
+ev_job_find_push_helpers (EvJobFind *job_find)
+{
+	guint n_threads = ev_job_scheduler_get_n_threads ();
+	guint i;
+
+	for (i = 2; i < n_threads; i++) {
+		EvJobFindHelper *helper;
+
+		helper = g_object_new (ev_job_find_helper_get_type (), NULL);
+		helper->find = g_object_ref (job_find);
+		g_object_unref (EV_JOB (helper)->cancellable);
+		EV_JOB (helper)->cancellable = g_object_ref (EV_JOB (job_find)->cancellable);
+
+		ev_job_scheduler_push_job (EV_JOB (helper), EV_JOB_PRIORITY_NONE);
+		g_object_unref (helper);
+	}
+}
+
+static gboolean
+ev_job_find_run (EvJob *job)
+{
+	EvJobFind *job_find = EV_JOB_FIND (job);
+
+	ev_debug_message (DEBUG_JOBS, NULL);
+	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
+
+	/* The pages are searched outwards from the start page, in
+	 * chunks taken by this job and its helpers in turn */
+	if (!job_find->helpers_pushed) {
+		job_find->helpers_pushed = TRUE;
+		ev_job_find_push_helpers (job_find);
+	}
+
+	return ev_job_find_search_chunk (job_find);
 }
 
 static void
@@ -1696,12 +2002,15 @@ ev_job_find_new (EvDocument  *document,
 	job->current_page = start_page;
 	job->n_pages = n_pages;
 	job->pages = g_new0 (GList *, n_pages);
+	job->searched = g_new0 (gint, n_pages);
 	job->text = g_strdup (text);
         /* Keep for compatibility */
 	job->case_sensitive = case_sensitive;
 	job->has_results = FALSE;
         if (case_sensitive)
                 job->options |= EV_FIND_CASE_SENSITIVE;
+	if (EV_IS_DOCUMENT_TEXT (document))
+		job->index = g_object_ref (ev_text_index_get_for_document (document));
 
 	return EV_JOB (job);
 }
@@ -1746,20 +2055,42 @@ ev_job_find_get_n_results (EvJobFind *job,
 gdouble
 ev_job_find_get_progress (EvJobFind *job)
 {
-	gint pages_done;
-
 	if (ev_job_is_finished (EV_JOB (job)))
 		return 1.0;
-	
-	if (job->current_page > job->start_page) {
-		pages_done = job->current_page - job->start_page + 1;
-	} else if (job->current_page == job->start_page) {
-		pages_done = job->n_pages;
-	} else {
-		pages_done = job->n_pages - job->start_page + job->current_page;
+
+	return job->pages_reported / (gdouble) job->n_pages;
+}
+
+/**
+ * ev_job_find_get_nth_page:
+ * @job: an #EvJobFind
+ * @n: a position in the search, less than the number of pages
+ *
+ * Pages are searched outwards from the start page: the start page,
+ * the next one, the previous one, and so on, so that the pages
+ * around the current page are searched first. #EvJobFind::updated
+ * is emitted for the pages in the same order.
+ *
+ * Returns: the page searched at position @n
+ */
+gint
+ev_job_find_get_nth_page (EvJobFind *job,
+			  gint       n)
+{
+	gint before = job->start_page;
+	gint after = job->n_pages - 1 - job->start_page;
+	gint distance;
+
+	/* Alternate while there are pages on both sides */
+	if (n <= 2 * MIN (before, after)) {
+		distance = (n + 1) / 2;
+
+		return n % 2 ? job->start_page + distance : job->start_page - distance;
 	}
 
-	return pages_done / (gdouble) job->n_pages;
+	distance = n - MIN (before, after);
+
+	return after > before ? job->start_page + distance : job->start_page - distance;
 }
 
 gboolean
@@ -1780,6 +2111,203 @@ ev_job_find_get_results (EvJobFind *job)
 	return job->pages;
 }
 
+/* Lowers the case of every character on its own, like the searches
+ * do. Unlike g_utf8_casefold() it never changes the length, so that
+ * a match of the text always contains a match of a substring of it:
+ * "ß" is folded to "ss" but a search for "ss" doesn't match "ß". */
+static gchar *
+find_text_to_lower (const gchar *text)
+{
+	GString     *lower;
+	const gchar *p;
+
+	lower = g_string_sized_new (strlen (text));
+	for (p = text; *p; p = g_utf8_next_char (p))
+		g_string_append_unichar (lower, g_unichar_tolower (g_utf8_get_char (p)));
+
+	return g_string_free (lower, FALSE);
+}
+
+/**
+ * ev_job_find_refine:
+ * @job: an #EvJobFind that hasn't been scheduled yet
+ * @previous: the #EvJobFind that @job replaces, finished or not
+ *
+ * When the text of @job contains the text of @previous and both
+ * have the same options, pages where @previous already found no
+ * matches can't match either, so @job skips them. This makes every
+ * new character typed in the find bar only search the previous
+ * hits. Whole words searches are never refined, since a longer
+ * word can match where a shorter one didn't.
+ *
+ * Returns: %TRUE if @job was refined
+ */
+gboolean
+ev_job_find_refine (EvJobFind *job,
+		    EvJobFind *previous)
+{
+	gchar   *text, *previous_text;
+	gboolean contained;
+	gint     i;
+
+	g_return_val_if_fail (EV_IS_JOB_FIND (job), FALSE);
+	g_return_val_if_fail (EV_IS_JOB_FIND (previous), FALSE);
+
+	if (EV_JOB (job)->document != EV_JOB (previous)->document ||
+	    job->n_pages != previous->n_pages ||
+	    job->options != previous->options ||
+	    (job->options & EV_FIND_WHOLE_WORDS_ONLY))
+		return FALSE;
+
+	if (job->options & EV_FIND_CASE_SENSITIVE) {
+		contained = strstr (job->text, previous->text) != NULL;
+	} else {
+		text = find_text_to_lower (job->text);
+		previous_text = find_text_to_lower (previous->text);
+		contained = strstr (text, previous_text) != NULL;
+		g_free (text);
+		g_free (previous_text);
+	}
+	if (!contained)
+		return FALSE;
+
+	/* Only the pages already reported by the previous job are
+	 * final, the others may still be searched by its thread
+	 */
+	job->skip_pages = g_new0 (guint8, job->n_pages);
+	for (i = 0; i < previous->pages_reported; i++) {
+		gint page = ev_job_find_get_nth_page (previous, i);
+
+		job->skip_pages[page] = previous->pages[page] == NULL;
+	}
+
+	return TRUE;
+}
+
+/* EvJobTextIndex */
+static void
+ev_job_text_index_init (EvJobTextIndex *job)
+{
+	EV_JOB (job)->run_mode = EV_JOB_RUN_THREAD;
+}
+
+static void
+ev_job_text_index_dispose (GObject *object)
+{
+	EvJobTextIndex *job = EV_JOB_TEXT_INDEX (object);
+
+	ev_debug_message (DEBUG_JOBS, NULL);
+
+	if (job->index) {
+		g_object_unref (job->index);
+		job->index = NULL;
+	}
+
+	(* G_OBJECT_CLASS (ev_job_text_index_parent_class)->dispose) (object);
+}
+
+/* Pages extracted each time the job is run, before it goes back to
+ * the scheduler queue like the find job does */
+#define TEXT_INDEX_PAGES_PER_RUN 16
+
+static gboolean
+ev_job_text_index_run (EvJob *job)
+{
+	EvJobTextIndex *job_index = EV_JOB_TEXT_INDEX (job);
+
+	ev_debug_message (DEBUG_JOBS, NULL);
+	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
+
+	if (ev_text_index_build (job_index->index, TEXT_INDEX_PAGES_PER_RUN,
+				 job->cancellable))
+		return TRUE;
+
+	if (!ev_text_index_is_ready (job_index->index)) {
+		if (!g_cancellable_is_cancelled (job->cancellable))
+			ev_job_failed (job, EV_DOCUMENT_ERROR, EV_DOCUMENT_ERROR_INVALID,
+				       _("Failed to index document text"));
+		return FALSE;
+	}
+
+	ev_job_succeeded (job);
+
+	return FALSE;
+}
+
+static void
+ev_job_text_index_class_init (EvJobTextIndexClass *class)
+{
+	EvJobClass   *job_class = EV_JOB_CLASS (class);
+	GObjectClass *gobject_class = G_OBJECT_CLASS (class);
+
+	job_class->run = ev_job_text_index_run;
+	gobject_class->dispose = ev_job_text_index_dispose;
+}
+
+EvJob *
+ev_job_text_index_new (EvDocument *document)
+{
+	EvJob *job;
+
+	ev_debug_message (DEBUG_JOBS, NULL);
+
+	job = g_object_new (EV_TYPE_JOB_TEXT_INDEX, NULL);
+	job->document = g_object_ref (document);
+	EV_JOB_TEXT_INDEX (job)->index = g_object_ref (ev_text_index_get_for_document (document));
+
+	return job;
+}
+
+/* EvJobRenderInstance */
+static void
+ev_job_render_instance_init (EvJobRenderInstance *job)
+{
+	EV_JOB (job)->run_mode = EV_JOB_RUN_THREAD;
+}
+
+static gboolean
+ev_job_render_instance_run (EvJob *job)
+{
+	ev_debug_message (DEBUG_JOBS, NULL);
+	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
+
+	ev_document_open_render_instance (job->document);
+	ev_job_succeeded (job);
+
+	return FALSE;
+}
+
+static void
+ev_job_render_instance_class_init (EvJobRenderInstanceClass *class)
+{
+	EvJobClass *job_class = EV_JOB_CLASS (class);
+
+	job_class->run = ev_job_render_instance_run;
+}
+
+/**
+ * ev_job_render_instance_new:
+ * @document: an #EvDocument
+ *
+ * Creates a job that opens a render instance of @document for the
+ * worker thread that runs it, so the first render job on that thread
+ * doesn't pay for opening it. See ev_document_open_render_instance().
+ *
+ * Returns: (transfer full): a new #EvJobRenderInstance
+ */
+EvJob *
+ev_job_render_instance_new (EvDocument *document)
+{
+	EvJob *job;
+
+	ev_debug_message (DEBUG_JOBS, NULL);
+
+	job = g_object_new (EV_TYPE_JOB_RENDER_INSTANCE, NULL);
+	job->document = g_object_ref (document);
+
+	return job;
+}
+
 /* EvJobLayers */
 static void
 ev_job_layers_init (EvJobLayers *job)
@@ -1812,9 +2340,9 @@ ev_job_layers_run (EvJob *job)
 	ev_debug_message (DEBUG_JOBS, NULL);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 	
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (job->document);
 	job_layers->model = ev_document_layers_get_layers (EV_DOCUMENT_LAYERS (job->document));
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (job->document);
 	
 	ev_job_succeeded (job);
 	
@@ -1880,7 +2408,7 @@ ev_job_export_run (EvJob *job)
 	ev_debug_message (DEBUG_JOBS, NULL);
 	ev_profiler_start (EV_PROFILE_JOBS, "%s (%p)", EV_GET_TYPE_NAME (job), job);
 	
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (job->document);
 	
 	ev_page = ev_document_get_page (job->document, job_export->page);
 	if (job_export->rc) {
@@ -1896,7 +2424,7 @@ ev_job_export_run (EvJob *job)
 	
 	ev_file_exporter_do_page (EV_FILE_EXPORTER (job->document), job_export->rc);
 	
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (job->document);
 	
 	ev_job_succeeded (job);
 	
@@ -1975,14 +2503,14 @@ ev_job_print_run (EvJob *job)
 	job->finished = FALSE;
 	g_clear_error (&job->error);
 
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (job->document);
 
 	ev_page = ev_document_get_page (job->document, job_print->page);
 	ev_document_print_print_page (EV_DOCUMENT_PRINT (job->document),
 				      ev_page, job_print->cr);
 	g_object_unref (ev_page);
 
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (job->document);
 
         if (g_cancellable_is_cancelled (job->cancellable))
                 return FALSE;
@@ -31,6 +31,8 @@
 
 #include <evince-document.h>
 
+#include "ev-text-index.h"
+
 G_BEGIN_DECLS
 
 typedef struct _EvJob EvJob;
@@ -72,6 +74,12 @@ typedef struct _EvJobSaveClass EvJobSaveClass;
 typedef struct _EvJobFind EvJobFind;
 typedef struct _EvJobFindClass EvJobFindClass;
 
+typedef struct _EvJobTextIndex EvJobTextIndex;
+typedef struct _EvJobTextIndexClass EvJobTextIndexClass;
+
+typedef struct _EvJobRenderInstance EvJobRenderInstance;
+typedef struct _EvJobRenderInstanceClass EvJobRenderInstanceClass;
+
 typedef struct _EvJobLayers EvJobLayers;
 typedef struct _EvJobLayersClass EvJobLayersClass;
 
@@ -173,6 +181,20 @@ typedef struct _EvJobPrintClass EvJobPrintClass;
 #define EV_IS_JOB_FIND_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), EV_TYPE_JOB_FIND))
 #define EV_JOB_FIND_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), EV_TYPE_JOB_FIND, EvJobFindClass))
 
+#define EV_TYPE_JOB_TEXT_INDEX            (ev_job_text_index_get_type())
+#define EV_JOB_TEXT_INDEX(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), EV_TYPE_JOB_TEXT_INDEX, EvJobTextIndex))
+#define EV_IS_JOB_TEXT_INDEX(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), EV_TYPE_JOB_TEXT_INDEX))
+#define EV_JOB_TEXT_INDEX_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), EV_TYPE_JOB_TEXT_INDEX, EvJobTextIndexClass))
+#define EV_IS_JOB_TEXT_INDEX_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), EV_TYPE_JOB_TEXT_INDEX))
+#define EV_JOB_TEXT_INDEX_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), EV_TYPE_JOB_TEXT_INDEX, EvJobTextIndexClass))
+
+#define EV_TYPE_JOB_RENDER_INSTANCE            (ev_job_render_instance_get_type())
+#define EV_JOB_RENDER_INSTANCE(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), EV_TYPE_JOB_RENDER_INSTANCE, EvJobRenderInstance))
+#define EV_IS_JOB_RENDER_INSTANCE(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), EV_TYPE_JOB_RENDER_INSTANCE))
+#define EV_JOB_RENDER_INSTANCE_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), EV_TYPE_JOB_RENDER_INSTANCE, EvJobRenderInstanceClass))
+#define EV_IS_JOB_RENDER_INSTANCE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), EV_TYPE_JOB_RENDER_INSTANCE))
+#define EV_JOB_RENDER_INSTANCE_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), EV_TYPE_JOB_RENDER_INSTANCE, EvJobRenderInstanceClass))
+
 #define EV_TYPE_JOB_LAYERS            (ev_job_layers_get_type())
 #define EV_JOB_LAYERS(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), EV_TYPE_JOB_LAYERS, EvJobLayers))
 #define EV_IS_JOB_LAYERS(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), EV_TYPE_JOB_LAYERS))
@@ -285,6 +307,11 @@ struct _EvJobRender
 	EvSelectionStyle selection_style;
 	GdkColor base;
 	GdkColor text;
+
+	/* Only this area of the page was rendered, surface holds just
+	 * that part */
+	gboolean include_clip;
+	cairo_rectangle_int_t clip;
 };
 
 struct _EvJobRenderClass
@@ -420,11 +447,19 @@ struct _EvJobSave
 
 	gchar *uri;
 	gchar *document_uri;
+
+	/* Progress of an incremental save, in thousandths */
+	gint progress;
+	gint update_pending;
 };
 
 struct _EvJobSaveClass
 {
 	EvJobClass parent_class;
+
+	/* Signals */
+	void (* updated) (EvJobSave *job,
+			  gdouble    progress);
 };
 
 struct _EvJobFind
@@ -439,6 +474,22 @@ struct _EvJobFind
 	gboolean case_sensitive;
 	gboolean has_results;
         EvFindOptions options;
+
+	/* Pages searched by the worker threads, in any order, and
+	 * reported in search order through the updated signal in the
+	 * main loop
+	 */
+	gint pages_claimed;
+	gint pages_searched;
+	gint *searched;
+	gint pages_reported;
+	gint update_pending;
+	gboolean helpers_pushed;
+
+	EvTextIndex *index;
+
+	/* Pages that can't match, known from a previous search */
+	guint8 *skip_pages;
 };
 
 struct _EvJobFindClass
@@ -450,6 +501,28 @@ struct _EvJobFindClass
 			   gint       page);
 };
 
+struct _EvJobTextIndex
+{
+	EvJob parent;
+
+	EvTextIndex *index;
+};
+
+struct _EvJobTextIndexClass
+{
+	EvJobClass parent_class;
+};
+
+struct _EvJobRenderInstance
+{
+	EvJob parent;
+};
+
+struct _EvJobRenderInstanceClass
+{
+	EvJobClass parent_class;
+};
+
 struct _EvJobLayers
 {
 	EvJob parent;
@@ -532,6 +605,8 @@ void     ev_job_render_set_selection_info (EvJobRender     *job,
 					   EvSelectionStyle selection_style,
 					   GdkColor        *text,
 					   GdkColor        *base);
+void     ev_job_render_set_clip           (EvJobRender     *job,
+					   cairo_rectangle_int_t *clip);
 /* EvJobPageData */
 GType           ev_job_page_data_get_type (void) G_GNUC_CONST;
 EvJob          *ev_job_page_data_new      (EvDocument      *document,
@@ -592,6 +667,7 @@ GType           ev_job_save_get_type      (void) G_GNUC_CONST;
 EvJob          *ev_job_save_new           (EvDocument      *document,
 					   const gchar     *uri,
 					   const gchar     *document_uri);
+gdouble         ev_job_save_get_progress  (EvJobSave       *job);
 /* EvJobFind */
 GType           ev_job_find_get_type      (void) G_GNUC_CONST;
 EvJob          *ev_job_find_new           (EvDocument      *document,
@@ -605,8 +681,20 @@ EvFindOptions   ev_job_find_get_options   (EvJobFind       *job);
 gint            ev_job_find_get_n_results (EvJobFind       *job,
 					   gint             pages);
 gdouble         ev_job_find_get_progress  (EvJobFind       *job);
+gint            ev_job_find_get_nth_page  (EvJobFind       *job,
+					   gint             n);
 gboolean        ev_job_find_has_results   (EvJobFind       *job);
 GList         **ev_job_find_get_results   (EvJobFind       *job);
+gboolean        ev_job_find_refine        (EvJobFind       *job,
+					   EvJobFind       *previous);
+
+/* EvJobTextIndex */
+GType           ev_job_text_index_get_type (void) G_GNUC_CONST;
+EvJob          *ev_job_text_index_new      (EvDocument     *document);
+
+/* EvJobRenderInstance */
+GType           ev_job_render_instance_get_type (void) G_GNUC_CONST;
+EvJob          *ev_job_render_instance_new      (EvDocument     *document);
 
 /* EvJobLayers */
 GType           ev_job_layers_get_type    (void) G_GNUC_CONST;
@@ -23,6 +23,7 @@
 #include "ev-jobs.h"
 #include "ev-job-scheduler.h"
 #include "ev-mapping-list.h"
+#include "ev-mapping-tree.h"
 #include "ev-selection.h"
 #include "ev-document-links.h"
 #include "ev-document-forms.h"
@@ -48,6 +49,7 @@ typedef struct _EvPageCacheData {
 	EvMappingList     *image_mapping;
 	EvMappingList     *form_field_mapping;
 	EvMappingList     *annot_mapping;
+	EvMappingTree     *mapping_index;
 	cairo_region_t    *text_mapping;
 	EvRectangle       *text_layout;
 	guint              text_layout_length;
@@ -84,6 +86,17 @@ struct _EvPageCacheClass {
 
 #define PRE_CACHE_SIZE 1
 
+#define EV_PAGE_DATA_INCLUDE_MAPPINGS (     \
+	EV_PAGE_DATA_INCLUDE_LINKS        | \
+	EV_PAGE_DATA_INCLUDE_IMAGES       | \
+	EV_PAGE_DATA_INCLUDE_FORMS        | \
+	EV_PAGE_DATA_INCLUDE_ANNOTS)
+
+/* The mapping index of a page stacks the mappings in bands, one per
+ * kind; within a band the z of a mapping follows its position in the
+ * mapping list */
+#define MAPPING_INDEX_Z(band, pos) (((guint)(band) << 24) | ((pos) & 0xffffff))
+
 static void job_page_data_finished_cb (EvJob       *job,
 				       EvPageCache *cache);
 static void job_page_data_cancelled_cb (EvJob       *job,
@@ -119,6 +132,8 @@ ev_page_cache_data_free (EvPageCacheData *data)
 		data->annot_mapping = NULL;
 	}
 
+	g_clear_pointer (&data->mapping_index, ev_mapping_tree_unref);
+
 	if (data->text_mapping) {
 		cairo_region_destroy (data->text_mapping);
 		data->text_mapping = NULL;
@@ -297,6 +312,8 @@ job_page_data_finished_cb (EvJob       *job,
 
 	data = &cache->page_list[job_data->page];
 
+	if (job_data->flags & EV_PAGE_DATA_INCLUDE_MAPPINGS)
+		g_clear_pointer (&data->mapping_index, ev_mapping_tree_unref);
 	if (job_data->flags & EV_PAGE_DATA_INCLUDE_LINKS)
 		data->link_mapping = job_data->link_mapping;
 	if (job_data->flags & EV_PAGE_DATA_INCLUDE_IMAGES)
@@ -430,6 +447,9 @@ ev_page_cache_mark_dirty (EvPageCache       *cache,
 	data = &cache->page_list[page];
 	data->dirty = TRUE;
 
+	if (flags & EV_PAGE_DATA_INCLUDE_MAPPINGS)
+		g_clear_pointer (&data->mapping_index, ev_mapping_tree_unref);
+
         if (flags & EV_PAGE_DATA_INCLUDE_LINKS)
                 g_clear_pointer (&data->link_mapping, ev_mapping_list_unref);
 
@@ -553,6 +573,221 @@ ev_page_cache_get_annot_mapping (EvPageCache *cache,
 	return data->annot_mapping;
 }
 
+static gboolean
+mapping_index_hit (gpointer item,
+		   gdouble  x,
+		   gdouble  y,
+		   gpointer data)
+{
+	EvMapping *mapping = item;
+
+	if (x < mapping->area.x1 || x > mapping->area.x2 ||
+	    y < mapping->area.y1 || y > mapping->area.y2)
+		return FALSE;
+
+	/* Ink annotations are only hit on their strokes */
+	if (EV_IS_ANNOTATION_INK (mapping->data))
+		return ev_annotation_ink_is_hit (EV_ANNOTATION_INK (mapping->data), x, y);
+
+	return TRUE;
+}
+
+static gint
+mapping_index_band (EvJobPageDataFlags kind)
+{
+	/* From the bottom to the top */
+	switch (kind) {
+	case EV_PAGE_DATA_INCLUDE_IMAGES:
+		return 0;
+	case EV_PAGE_DATA_INCLUDE_ANNOTS:
+		return 1;
+	case EV_PAGE_DATA_INCLUDE_FORMS:
+		return 2;
+	case EV_PAGE_DATA_INCLUDE_LINKS:
+		return 3;
+	default:
+		return -1;
+	}
+}
+
+static EvMappingList *
+ev_page_cache_get_mapping_list (EvPageCache       *cache,
+				gint               page,
+				EvJobPageDataFlags kind)
+{
+	switch (kind) {
+	case EV_PAGE_DATA_INCLUDE_LINKS:
+		return ev_page_cache_get_link_mapping (cache, page);
+	case EV_PAGE_DATA_INCLUDE_IMAGES:
+		return ev_page_cache_get_image_mapping (cache, page);
+	case EV_PAGE_DATA_INCLUDE_FORMS:
+		return ev_page_cache_get_form_field_mapping (cache, page);
+	case EV_PAGE_DATA_INCLUDE_ANNOTS:
+		return ev_page_cache_get_annot_mapping (cache, page);
+	default:
+		return NULL;
+	}
+}
+
+/* Annotations later in the list are drawn over the earlier ones; for
+ * the other kinds the first mapping found has always won */
+static guint
+mapping_index_position (EvJobPageDataFlags kind,
+			guint              i,
+			guint              n)
+{
+	return kind == EV_PAGE_DATA_INCLUDE_ANNOTS ? i : n - 1 - i;
+}
+
+static EvMappingTree *
+ev_page_cache_get_mapping_index (EvPageCache *cache,
+				 gint         page)
+{
+	EvPageCacheData   *data = &cache->page_list[page];
+	EvJobPageDataFlags kinds[] = {
+		EV_PAGE_DATA_INCLUDE_IMAGES,
+		EV_PAGE_DATA_INCLUDE_ANNOTS,
+		EV_PAGE_DATA_INCLUDE_FORMS,
+		EV_PAGE_DATA_INCLUDE_LINKS
+	};
+	GArray            *entries;
+	EvRectangle        extents = { 0, 0, 0, 0 };
+	guint              k;
+
+	if (data->mapping_index || !data->done)
+		return data->mapping_index;
+
+	entries = g_array_new (FALSE, FALSE, sizeof (EvMappingTreeEntry));
+
+	for (k = 0; k < G_N_ELEMENTS (kinds); k++) {
+		EvMappingList *mapping_list;
+		GList         *l;
+		guint          i, n;
+
+		mapping_list = ev_page_cache_get_mapping_list (cache, page, kinds[k]);
+		if (!mapping_list)
+			continue;
+
+		n = ev_mapping_list_length (mapping_list);
+		for (l = ev_mapping_list_get_list (mapping_list), i = 0; l; l = l->next, i++) {
+			EvMapping         *mapping = l->data;
+			EvMappingTreeEntry entry;
+
+			entry.item = mapping;
+			entry.extents = mapping->area;
+			entry.z = MAPPING_INDEX_Z (mapping_index_band (kinds[k]),
+						   mapping_index_position (kinds[k], i, n));
+
+			if (entries->len == 0) {
+				extents = mapping->area;
+			} else {
+				extents.x1 = MIN (extents.x1, mapping->area.x1);
+				extents.y1 = MIN (extents.y1, mapping->area.y1);
+				extents.x2 = MAX (extents.x2, mapping->area.x2);
+				extents.y2 = MAX (extents.y2, mapping->area.y2);
+			}
+			g_array_append_val (entries, entry);
+		}
+	}
+
+	if (entries->len > 0) {
+		/* Keep the extents from being empty */
+		extents.x1 -= 1;
+		extents.y1 -= 1;
+		extents.x2 += 1;
+		extents.y2 += 1;
+
+		data->mapping_index = ev_mapping_tree_new_bulk (page, extents,
+								(EvMappingTreeEntry *) entries->data,
+								entries->len,
+								mapping_index_hit, NULL,
+								NULL);
+	}
+	g_array_free (entries, TRUE);
+
+	return data->mapping_index;
+}
+
+/**
+ * ev_page_cache_mappings_changed:
+ * @cache: an #EvPageCache
+ * @page: the page index
+ *
+ * Tells @cache that a mapping list of @page was modified in place, so
+ * that its spatial index is built again.
+ */
+void
+ev_page_cache_mappings_changed (EvPageCache *cache,
+				gint         page)
+{
+	g_return_if_fail (EV_IS_PAGE_CACHE (cache));
+	g_return_if_fail (page >= 0 && page < cache->n_pages);
+
+	g_clear_pointer (&cache->page_list[page].mapping_index, ev_mapping_tree_unref);
+}
+
+/**
+ * ev_page_cache_get_mapping_at_location:
+ * @cache: an #EvPageCache
+ * @page: the page index
+ * @x: X coordinate, in document units
+ * @y: Y coordinate, in document units
+ * @kind: one of %EV_PAGE_DATA_INCLUDE_LINKS, %EV_PAGE_DATA_INCLUDE_IMAGES,
+ *   %EV_PAGE_DATA_INCLUDE_FORMS or %EV_PAGE_DATA_INCLUDE_ANNOTS
+ *
+ * Finds the topmost mapping of the given kind at (x, y). Ink
+ * annotations are only found on their strokes. Once the page data is
+ * cached, this is answered by a spatial index over all the mappings of
+ * the page, built on first use.
+ *
+ * Returns: (transfer none): an #EvMapping, or %NULL
+ */
+EvMapping *
+ev_page_cache_get_mapping_at_location (EvPageCache       *cache,
+				       gint               page,
+				       gdouble            x,
+				       gdouble            y,
+				       EvJobPageDataFlags kind)
+{
+	EvMappingTree *index;
+	EvMappingList *mapping_list;
+	EvMapping     *found = NULL;
+	GList         *l;
+	gint           band;
+
+	g_return_val_if_fail (EV_IS_PAGE_CACHE (cache), NULL);
+	g_return_val_if_fail (page >= 0 && page < cache->n_pages, NULL);
+
+	band = mapping_index_band (kind);
+	g_return_val_if_fail (band >= 0, NULL);
+
+	if (!(cache->flags & kind))
+		return NULL;
+
+	index = ev_page_cache_get_mapping_index (cache, page);
+	if (index)
+		return ev_mapping_tree_get_topmost (index, x, y,
+						    MAPPING_INDEX_Z (band, 0),
+						    MAPPING_INDEX_Z (band, 0xffffff));
+
+	/* The page data is still being loaded */
+	mapping_list = ev_page_cache_get_mapping_list (cache, page, kind);
+	if (!mapping_list)
+		return NULL;
+
+	for (l = ev_mapping_list_get_list (mapping_list); l; l = l->next) {
+		if (!mapping_index_hit (l->data, x, y, NULL))
+			continue;
+
+		found = l->data;
+		/* Only annotations are stacked over the earlier ones */
+		if (kind != EV_PAGE_DATA_INCLUDE_ANNOTS)
+			break;
+	}
+
+	return found;
+}
+
 cairo_region_t *
 ev_page_cache_get_text_mapping (EvPageCache *cache,
 				gint         page)
@@ -61,6 +61,13 @@ EvMappingList     *ev_page_cache_get_form_field_mapping (EvPageCache       *cach
 							 gint               page);
 EvMappingList     *ev_page_cache_get_annot_mapping      (EvPageCache       *cache,
 							 gint               page);
+void               ev_page_cache_mappings_changed       (EvPageCache       *cache,
+							 gint               page);
+EvMapping         *ev_page_cache_get_mapping_at_location (EvPageCache       *cache,
+							  gint               page,
+							  gdouble            x,
+							  gdouble            y,
+							  EvJobPageDataFlags kind);
 cairo_region_t    *ev_page_cache_get_text_mapping       (EvPageCache       *cache,
 							 gint               page);
 const gchar       *ev_page_cache_get_text               (EvPageCache       *cache,
@@ -1,4 +1,7 @@
 #include <config.h>
+
+#include <math.h>
+
 #include "ev-pixbuf-cache.h"
 #include "ev-job-scheduler.h"
 #include "ev-view-private.h"
@@ -16,12 +19,24 @@ typedef struct _CacheJobInfo
 	/* Region of the page that needs to be drawn */
 	cairo_region_t  *region;
 
+	/* Area of surface being rendered again by job, in pixels,
+	 * when it doesn't render the whole page */
+	gboolean              partial;
+	cairo_rectangle_int_t partial_clip;
+
 	/* Data we get from rendering */
 	cairo_surface_t *surface;
 
 	/* Device scale factor of target widget */
 	int device_scale;
 
+	/* When job was pushed, to learn how long the page takes */
+	gint64 push_time;
+
+	/* The page is too big to be kept whole. surface is a low
+	 * resolution copy, and the page is drawn from tiles. */
+	gboolean tiled;
+
 	/* Selection data. 
 	 * Selection_points are the coordinates encapsulated in selection.
 	 * target_points is the target selection size. */
@@ -60,11 +75,61 @@ struct _EvPixbufCache
 	int preload_cache_size;
 	guint job_list_len;
 
+	/* Preloaded pages wanted before and after the visible range,
+	 * at most preload_cache_size each.  Fast scrolling moves them
+	 * ahead of the visible range, in the direction of motion.
+	 */
+	int n_preload_prev;
+	int n_preload_next;
+
+	/* Scrolling speed in pages per second, and when the page
+	 * range last changed */
+	gdouble scroll_velocity;
+	gint64  range_time;
+	guint   velocity_timeout_id;
+
+	/* Time it took to get each page rendered, and its running
+	 * average, in microseconds */
+	gint64 *render_times;
+	gint64  average_render_time;
+
 	CacheJobInfo *prev_job;
 	CacheJobInfo *job_list;
 	CacheJobInfo *next_job;
+
+	/* Tiles of the tiled pages, most recently wanted first */
+	GHashTable *tiles;
+	GQueue      tiles_lru;
+	gsize       tiles_size;
+	gboolean    tiles_unsupported;
+
+	/* Jobs opening the render instances of the worker threads */
+	GList *instance_jobs;
 };
 
+typedef struct _CacheTile
+{
+	EvPixbufCache *pixbuf_cache;
+
+	/* Key */
+	gint    page;
+	gint    col;
+	gint    row;
+	gdouble scale;
+	gint    rotation;
+	gint    device_scale;
+
+	EvJob           *job;
+	cairo_surface_t *surface;
+
+	/* The page changed since surface was rendered */
+	gboolean stale;
+	/* Intersects the visible area or its margin */
+	gboolean wanted;
+
+	GList    lru_link;
+} CacheTile;
+
 struct _EvPixbufCacheClass
 {
 	GObjectClass parent_class;
@@ -87,6 +152,15 @@ static void          ev_pixbuf_cache_finalize   (GObject            *object);
 static void          ev_pixbuf_cache_dispose    (GObject            *object);
 static void          job_finished_cb            (EvJob              *job,
 						 EvPixbufCache      *pixbuf_cache);
+static void          tile_job_finished_cb       (EvJob              *job,
+						 CacheTile          *tile);
+static void          evict_tiles                (EvPixbufCache      *pixbuf_cache);
+static gboolean      get_region_page_rect       (EvPixbufCache      *pixbuf_cache,
+						 gint                page,
+						 cairo_region_t     *region,
+						 gint                width,
+						 gint                height,
+						 GdkRectangle       *rect);
 static CacheJobInfo *find_job_cache             (EvPixbufCache      *pixbuf_cache,
 						 int                 page);
 static gboolean      new_selection_surface_needed(EvPixbufCache      *pixbuf_cache,
@@ -104,14 +178,64 @@ static gboolean      new_selection_surface_needed(EvPixbufCache      *pixbuf_cac
 	((pixbuf_cache->end_page - pixbuf_cache->start_page) + 1)
 
 #define MAX_PRELOADED_PAGES 3
+/* Limit of the pages preloaded ahead of fast scrolling */
+#define MAX_PREDICTED_PAGES 12
+/* Below this speed, in pages per second, pages are preloaded
+ * evenly around the visible range */
+#define MIN_PREDICTION_VELOCITY 1.0
+/* The scrolling is considered stopped after this long, in seconds */
+#define VELOCITY_TIMEOUT 0.5
+
+/* Pages whose surface would take more than this are rendered in
+ * tiles, with a low resolution copy of this size shown underneath */
+#define TILED_PAGE_MIN_SIZE         (32 * 1024 * 1024)
+#define TILED_PAGE_PLACEHOLDER_SIZE (4 * 1024 * 1024)
+
+#define TILE_SIZE   EV_PIXBUF_CACHE_TILE_SIZE
+/* Tiles are rendered this far beyond the visible area */
+#define TILE_MARGIN TILE_SIZE
 
 G_DEFINE_TYPE (EvPixbufCache, ev_pixbuf_cache, G_TYPE_OBJECT)
 
+static guint
+cache_tile_hash (gconstpointer key)
+{
+	const CacheTile *tile = key;
+	guint            hash;
+
+	hash = tile->page;
+	hash = hash * 31 + tile->col;
+	hash = hash * 31 + tile->row;
+	hash = hash * 31 + tile->rotation;
+	hash = hash * 31 + tile->device_scale;
+	hash = hash * 31 + (guint) (tile->scale * 1000);
+
+	return hash;
+}
+
+static gboolean
+cache_tile_equal (gconstpointer a,
+		  gconstpointer b)
+{
+	const CacheTile *tile_a = a;
+	const CacheTile *tile_b = b;
+
+	return tile_a->page == tile_b->page &&
+		tile_a->col == tile_b->col &&
+		tile_a->row == tile_b->row &&
+		tile_a->scale == tile_b->scale &&
+		tile_a->rotation == tile_b->rotation &&
+		tile_a->device_scale == tile_b->device_scale;
+}
+
 static void
 ev_pixbuf_cache_init (EvPixbufCache *pixbuf_cache)
 {
 	pixbuf_cache->start_page = -1;
 	pixbuf_cache->end_page = -1;
+
+	pixbuf_cache->tiles = g_hash_table_new (cache_tile_hash, cache_tile_equal);
+	g_queue_init (&pixbuf_cache->tiles_lru);
 }
 
 static void
@@ -158,6 +282,9 @@ ev_pixbuf_cache_finalize (GObject *object)
 		pixbuf_cache->next_job = NULL;
 	}
 
+	g_hash_table_destroy (pixbuf_cache->tiles);
+	g_free (pixbuf_cache->render_times);
+
 	g_object_unref (pixbuf_cache->model);
 
 	G_OBJECT_CLASS (ev_pixbuf_cache_parent_class)->finalize (object);
@@ -205,10 +332,96 @@ dispose_cache_job_info (CacheJobInfo *job_info,
 	job_info->points_set = FALSE;
 }
 
+static gsize
+get_surface_size (cairo_surface_t *surface)
+{
+	return cairo_image_surface_get_stride (surface) *
+		cairo_image_surface_get_height (surface);
+}
+
+/* Page surfaces and tiles share max_size. Tiles covering the visible
+ * area or its margin can't be evicted, so the pages have to fit in
+ * what they leave. */
+static gsize
+get_wanted_tiles_size (EvPixbufCache *pixbuf_cache)
+{
+	GList *l;
+	gsize  size = 0;
+
+	for (l = pixbuf_cache->tiles_lru.head; l; l = l->next) {
+		CacheTile *tile = l->data;
+
+		if (tile->wanted && tile->surface)
+			size += get_surface_size (tile->surface);
+	}
+
+	return size;
+}
+
+static gsize
+get_job_info_surface_size (CacheJobInfo *job_info)
+{
+	return job_info->surface ? get_surface_size (job_info->surface) : 0;
+}
+
+static gsize
+get_pages_size (EvPixbufCache *pixbuf_cache)
+{
+	gsize size = 0;
+	gint  i;
+
+	for (i = 0; i < pixbuf_cache->preload_cache_size; i++) {
+		size += get_job_info_surface_size (pixbuf_cache->prev_job + i);
+		size += get_job_info_surface_size (pixbuf_cache->next_job + i);
+	}
+
+	for (i = 0; i < PAGE_CACHE_LEN (pixbuf_cache); i++)
+		size += get_job_info_surface_size (pixbuf_cache->job_list + i);
+
+	return size;
+}
+
+static void
+end_tile_job (CacheTile *tile)
+{
+	g_signal_handlers_disconnect_by_func (tile->job,
+					      G_CALLBACK (tile_job_finished_cb),
+					      tile);
+	ev_job_cancel (tile->job);
+	g_object_unref (tile->job);
+	tile->job = NULL;
+}
+
+static void
+drop_tile (EvPixbufCache *pixbuf_cache,
+	   CacheTile     *tile)
+{
+	g_hash_table_remove (pixbuf_cache->tiles, tile);
+	g_queue_unlink (&pixbuf_cache->tiles_lru, &tile->lru_link);
+
+	if (tile->job)
+		end_tile_job (tile);
+
+	if (tile->surface) {
+		pixbuf_cache->tiles_size -= get_surface_size (tile->surface);
+		cairo_surface_destroy (tile->surface);
+	}
+
+	g_slice_free (CacheTile, tile);
+}
+
+static void
+clear_tiles (EvPixbufCache *pixbuf_cache)
+{
+	while (pixbuf_cache->tiles_lru.head)
+		drop_tile (pixbuf_cache, pixbuf_cache->tiles_lru.head->data);
+}
+
 static void
 ev_pixbuf_cache_dispose (GObject *object)
 {
 	EvPixbufCache *pixbuf_cache;
+	GList *l;
 	int i;
 
 	pixbuf_cache = EV_PIXBUF_CACHE (object);
@@ -222,6 +435,18 @@ ev_pixbuf_cache_dispose (GObject *object)
 		dispose_cache_job_info (pixbuf_cache->job_list + i, pixbuf_cache);
 	}
 
+	clear_tiles (pixbuf_cache);
+
+	if (pixbuf_cache->velocity_timeout_id > 0) {
+		g_source_remove (pixbuf_cache->velocity_timeout_id);
+		pixbuf_cache->velocity_timeout_id = 0;
+	}
+
+	for (l = pixbuf_cache->instance_jobs; l; l = g_list_next (l))
+		ev_job_cancel (EV_JOB (l->data));
+	g_list_free_full (pixbuf_cache->instance_jobs, g_object_unref);
+	pixbuf_cache->instance_jobs = NULL;
+
 	G_OBJECT_CLASS (ev_pixbuf_cache_parent_class)->dispose (object);
 }
 
@@ -232,6 +457,7 @@ ev_pixbuf_cache_new (GtkWidget       *view,
 		     gsize            max_size)
 {
 	EvPixbufCache *pixbuf_cache;
+	guint i;
 
 	pixbuf_cache = (EvPixbufCache *) g_object_new (EV_TYPE_PIXBUF_CACHE, NULL);
 	/* This is a backlink, so we don't ref this */ 
@@ -240,6 +466,17 @@ ev_pixbuf_cache_new (GtkWidget       *view,
 	pixbuf_cache->document = ev_document_model_get_document (model);
 	pixbuf_cache->max_size = max_size;
 
+	/* Open the render instances while nothing else is running, one
+	 * job per worker at most; a worker that runs a second one just
+	 * finds its instance already open.
+	 */
+	for (i = 0; i < ev_job_scheduler_get_n_threads (); i++) {
+		EvJob *job = ev_job_render_instance_new (pixbuf_cache->document);
+
+		ev_job_scheduler_push_job (job, EV_JOB_PRIORITY_NONE);
+		pixbuf_cache->instance_jobs = g_list_prepend (pixbuf_cache->instance_jobs, job);
+	}
+
 	return pixbuf_cache;
 }
 
@@ -276,11 +513,57 @@ set_device_scale_on_surface (cairo_surface_t *surface,
 #endif
 }
 
+/* Paint the partial render of @job_render over the surface it was
+ * started from. Both are in device pixels, so the copy is done with
+ * the device scale of the surfaces factored out. */
+static void
+patch_job_info_surface (EvJobRender   *job_render,
+			CacheJobInfo  *job_info,
+			EvPixbufCache *pixbuf_cache)
+{
+	cairo_t *cr;
+	gdouble  device_scale = job_info->device_scale;
+
+	set_device_scale_on_surface (job_render->surface, job_info->device_scale);
+	if (pixbuf_cache->inverted_colors) {
+		ev_document_misc_invert_surface (job_render->surface);
+	}
+
+	cr = cairo_create (job_info->surface);
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface (cr, job_render->surface,
+				  job_render->clip.x / device_scale,
+				  job_render->clip.y / device_scale);
+	cairo_rectangle (cr,
+			 job_render->clip.x / device_scale,
+			 job_render->clip.y / device_scale,
+			 job_render->clip.width / device_scale,
+			 job_render->clip.height / device_scale);
+	cairo_fill (cr);
+	cairo_destroy (cr);
+
+	cairo_surface_mark_dirty (job_info->surface);
+}
+
 static void
 copy_job_to_job_info (EvJobRender   *job_render,
 		      CacheJobInfo  *job_info,
 		      EvPixbufCache *pixbuf_cache)
 {
+	if (job_render->include_clip) {
+		/* Nothing to patch if the surface was dropped meanwhile;
+		 * the page is rendered in full when it's needed again */
+		if (job_info->surface)
+			patch_job_info_surface (job_render, job_info, pixbuf_cache);
+
+		if (job_info->job)
+			end_job (job_info, pixbuf_cache);
+
+		job_info->page_ready = job_info->surface != NULL;
+
+		return;
+	}
+
 	if (job_info->surface) {
 		cairo_surface_destroy (job_info->surface);
 	}
@@ -321,6 +604,31 @@ copy_job_to_job_info (EvJobRender   *job_render,
 	job_info->page_ready = TRUE;
 }
 
+static void
+record_render_time (EvPixbufCache *pixbuf_cache,
+		    gint           page,
+		    gint64         render_time)
+{
+	if (!pixbuf_cache->render_times)
+		pixbuf_cache->render_times = g_new0 (gint64, ev_document_get_n_pages (pixbuf_cache->document));
+	pixbuf_cache->render_times[page] = render_time;
+
+	if (pixbuf_cache->average_render_time == 0)
+		pixbuf_cache->average_render_time = render_time;
+	else
+		pixbuf_cache->average_render_time = (3 * pixbuf_cache->average_render_time + render_time) / 4;
+}
+
+static gint64
+get_render_time (EvPixbufCache *pixbuf_cache,
+		 gint           page)
+{
+	if (pixbuf_cache->render_times && pixbuf_cache->render_times[page] > 0)
+		return pixbuf_cache->render_times[page];
+
+	return pixbuf_cache->average_render_time;
+}
+
 static void
 job_finished_cb (EvJob         *job,
 		 EvPixbufCache *pixbuf_cache)
@@ -337,13 +645,64 @@ job_finished_cb (EvJob         *job,
 
 	job_info = find_job_cache (pixbuf_cache, job_render->page);
 
+	if (!job_info->partial)
+		record_render_time (pixbuf_cache, job_render->page,
+				    g_get_monotonic_time () - job_info->push_time);
+
 	copy_job_to_job_info (job_render, job_info, pixbuf_cache);
+	evict_tiles (pixbuf_cache);
 	g_signal_emit (pixbuf_cache, signals[JOB_FINISHED], 0, job_info->region);
 }
 
 /* This checks a job to see if the job would generate the right sized pixbuf
  * given a scale.  If it won't, it removes the job and clears it to NULL.
  */
+static gboolean
+page_is_tiled (EvPixbufCache *pixbuf_cache,
+	       gint           page,
+	       gdouble        scale,
+	       gint           rotation)
+{
+	gint  width, height;
+	gint  device_scale;
+	gsize size;
+
+	if (pixbuf_cache->tiles_unsupported)
+		return FALSE;
+
+	device_scale = get_device_scale (pixbuf_cache);
+	_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
+					       page, scale, rotation,
+					       &width, &height);
+	size = (gsize) width * height * device_scale * device_scale * 4;
+
+	return size > TILED_PAGE_MIN_SIZE;
+}
+
+/* Scale at which the surface of @page is rendered: the view scale,
+ * or a smaller one for the placeholder of a tiled page */
+static gdouble
+get_page_surface_scale (EvPixbufCache *pixbuf_cache,
+			gint           page,
+			gdouble        scale,
+			gint           rotation)
+{
+	gint  width, height;
+	gint  device_scale;
+	gsize size;
+
+	if (!page_is_tiled (pixbuf_cache, page, scale, rotation))
+		return scale;
+
+	device_scale = get_device_scale (pixbuf_cache);
+	_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
+					       page, scale, rotation,
+					       &width, &height);
+	size = (gsize) width * height * device_scale * device_scale * 4;
+
+	return scale * sqrt ((gdouble) TILED_PAGE_PLACEHOLDER_SIZE / size);
+}
+
 static void
 check_job_size_and_unref (EvPixbufCache *pixbuf_cache,
 			  CacheJobInfo  *job_info,
@@ -359,10 +718,13 @@ check_job_size_and_unref (EvPixbufCache *pixbuf_cache,
 
         device_scale = get_device_scale (pixbuf_cache);
 	if (job_info->device_scale == device_scale) {
+		gint    page = EV_JOB_RENDER (job_info->job)->page;
+		gint    rotation = EV_JOB_RENDER (job_info->job)->rotation;
+		gdouble surface_scale;
+
+		surface_scale = get_page_surface_scale (pixbuf_cache, page, scale, rotation);
 		_get_page_size_for_scale_and_rotation (job_info->job->document,
-						       EV_JOB_RENDER (job_info->job)->page,
-						       scale,
-						       EV_JOB_RENDER (job_info->job)->rotation,
+						       page, surface_scale, rotation,
 						       &width, &height);
 		if (width * device_scale == EV_JOB_RENDER (job_info->job)->target_width &&
 		    height * device_scale == EV_JOB_RENDER (job_info->job)->target_height)
@@ -438,32 +800,27 @@ ev_pixbuf_cache_get_page_size (EvPixbufCache *pixbuf_cache,
 {
 	gint width, height;
 
+	scale = get_page_surface_scale (pixbuf_cache, page_index, scale, rotation);
 	_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
 					       page_index, scale, rotation,
 					       &width, &height);
 	return height * cairo_format_stride_for_width (CAIRO_FORMAT_RGB24, width);
 }
 
+/* Preloads pages evenly around the visible range, as long as they
+ * fit in max_size */
 static gint
-ev_pixbuf_cache_get_preload_size (EvPixbufCache *pixbuf_cache,
-				  gint           start_page,
-				  gint           end_page,
-				  gdouble        scale,
-				  gint           rotation)
+get_even_preload_size (EvPixbufCache *pixbuf_cache,
+		       gint           start_page,
+		       gint           end_page,
+		       gdouble        scale,
+		       gint           rotation,
+		       gsize          range_size)
 {
-	gsize range_size = 0;
 	gint  new_preload_cache_size = 0;
 	gint  i;
 	guint n_pages = ev_document_get_n_pages (pixbuf_cache->document);
 
-	/* Get the size of the current range */
-	for (i = start_page; i <= end_page; i++) {
-		range_size += ev_pixbuf_cache_get_page_size (pixbuf_cache, i, scale, rotation);
-	}
-
-	if (range_size >= pixbuf_cache->max_size)
-		return new_preload_cache_size;
-
 	i = 1;
 	while (((start_page - i > 0) || (end_page + i < n_pages)) &&
 	       new_preload_cache_size < MAX_PRELOADED_PAGES) {
@@ -499,6 +856,113 @@ ev_pixbuf_cache_get_preload_size (EvPixbufCache *pixbuf_cache,
 	return new_preload_cache_size;
 }
 
+/* Preloads the pages ahead of the scrolling that the view will reach
+ * before the renderer could get to them, and a single page behind in
+ * case the direction changes */
+static void
+get_predicted_preload_size (EvPixbufCache *pixbuf_cache,
+			    gint           start_page,
+			    gint           end_page,
+			    gdouble        scale,
+			    gint           rotation,
+			    gsize          range_size,
+			    gint          *n_ahead,
+			    gint          *n_behind)
+{
+	gdouble speed = fabs (pixbuf_cache->scroll_velocity);
+	gint    direction = pixbuf_cache->scroll_velocity > 0 ? 1 : -1;
+	gint    first_ahead = direction > 0 ? end_page : start_page;
+	gint    behind = direction > 0 ? start_page - 1 : end_page + 1;
+	gint64  render_time = 0;
+	gsize   page_size;
+	gint    n_pages = ev_document_get_n_pages (pixbuf_cache->document);
+	gint    i;
+
+	*n_ahead = 0;
+	*n_behind = 0;
+
+	for (i = 1; i <= MAX_PREDICTED_PAGES; i++) {
+		gint page = first_ahead + i * direction;
+
+		if (page < 0 || page >= n_pages)
+			break;
+
+		/* Past the usual preload, only the pages the view gets
+		 * to while the previous ones are still rendering */
+		render_time += get_render_time (pixbuf_cache, page);
+		if (i > MAX_PRELOADED_PAGES &&
+		    i > speed * render_time / G_USEC_PER_SEC)
+			break;
+
+		page_size = ev_pixbuf_cache_get_page_size (pixbuf_cache, page, scale, rotation);
+		if (page_size + range_size > pixbuf_cache->max_size)
+			break;
+
+		range_size += page_size;
+		(*n_ahead)++;
+	}
+
+	if (behind >= 0 && behind < n_pages) {
+		page_size = ev_pixbuf_cache_get_page_size (pixbuf_cache, behind, scale, rotation);
+		if (page_size + range_size <= pixbuf_cache->max_size)
+			*n_behind = 1;
+	}
+}
+
+static gint
+ev_pixbuf_cache_get_preload_size (EvPixbufCache *pixbuf_cache,
+				  gint           start_page,
+				  gint           end_page,
+				  gdouble        scale,
+				  gint           rotation,
+				  gint          *n_prev,
+				  gint          *n_next)
+{
+	gsize range_size;
+	gint  i;
+
+	*n_prev = 0;
+	*n_next = 0;
+
+	/* Get the size of the current range, and of the tiles in view */
+	range_size = get_wanted_tiles_size (pixbuf_cache);
+	for (i = start_page; i <= end_page; i++) {
+		range_size += ev_pixbuf_cache_get_page_size (pixbuf_cache, i, scale, rotation);
+	}
+
+	if (range_size >= pixbuf_cache->max_size)
+		return 0;
+
+	if (fabs (pixbuf_cache->scroll_velocity) < MIN_PREDICTION_VELOCITY) {
+		*n_prev = *n_next = get_even_preload_size (pixbuf_cache, start_page, end_page,
+							   scale, rotation, range_size);
+	} else if (pixbuf_cache->scroll_velocity > 0) {
+		get_predicted_preload_size (pixbuf_cache, start_page, end_page,
+					    scale, rotation, range_size,
+					    n_next, n_prev);
+	} else {
+		get_predicted_preload_size (pixbuf_cache, start_page, end_page,
+					    scale, rotation, range_size,
+					    n_prev, n_next);
+	}
+
+	return MAX (*n_prev, *n_next);
+}
+
+/* Drops the preloaded pages, and cancels their jobs, that are no
+ * longer wanted on the side of the visible range behind the motion */
+static void
+trim_preloaded_pages (EvPixbufCache *pixbuf_cache)
+{
+	int i;
+
+	for (i = 0; i < pixbuf_cache->preload_cache_size - pixbuf_cache->n_preload_prev; i++)
+		dispose_cache_job_info (pixbuf_cache->prev_job + i, pixbuf_cache);
+
+	for (i = pixbuf_cache->n_preload_next; i < pixbuf_cache->preload_cache_size; i++)
+		dispose_cache_job_info (pixbuf_cache->next_job + i, pixbuf_cache);
+}
+
 static void
 ev_pixbuf_cache_update_range (EvPixbufCache *pixbuf_cache,
 			      gint           start_page,
@@ -510,6 +974,7 @@ ev_pixbuf_cache_update_range (EvPixbufCache *pixbuf_cache,
 	CacheJobInfo *new_prev_job = NULL;
 	CacheJobInfo *new_next_job = NULL;
 	gint          new_preload_cache_size;
+	gint          n_preload_prev, n_preload_next;
 	guint         new_job_list_len;
 	int           i, page;
 
@@ -517,11 +982,20 @@ ev_pixbuf_cache_update_range (EvPixbufCache *pixbuf_cache,
 								   start_page,
 								   end_page,
 								   scale,
-								   rotation);
+								   rotation,
+								   &n_preload_prev,
+								   &n_preload_next);
 	if (pixbuf_cache->start_page == start_page &&
 	    pixbuf_cache->end_page == end_page &&
-	    pixbuf_cache->preload_cache_size == new_preload_cache_size)
+	    pixbuf_cache->preload_cache_size == new_preload_cache_size) {
+		if (pixbuf_cache->n_preload_prev != n_preload_prev ||
+		    pixbuf_cache->n_preload_next != n_preload_next) {
+			pixbuf_cache->n_preload_prev = n_preload_prev;
+			pixbuf_cache->n_preload_next = n_preload_next;
+			trim_preloaded_pages (pixbuf_cache);
+		}
 		return;
+	}
 
 	new_job_list_len = (end_page - start_page) + 1;
 	new_job_list = g_slice_alloc0 (sizeof (CacheJobInfo) * new_job_list_len);
@@ -593,6 +1067,10 @@ ev_pixbuf_cache_update_range (EvPixbufCache *pixbuf_cache,
 
 	pixbuf_cache->start_page = start_page;
 	pixbuf_cache->end_page = end_page;
+
+	pixbuf_cache->n_preload_prev = n_preload_prev;
+	pixbuf_cache->n_preload_next = n_preload_next;
+	trim_preloaded_pages (pixbuf_cache);
 }
 
 static CacheJobInfo *
@@ -670,6 +1148,7 @@ add_job (EvPixbufCache  *pixbuf_cache,
 	 gint            page,
 	 gint            rotation,
 	 gfloat          scale,
+	 cairo_rectangle_int_t *clip,
 	 EvJobPriority   priority)
 {
 	job_info->device_scale = get_device_scale (pixbuf_cache);
@@ -688,7 +1167,12 @@ add_job (EvPixbufCache  *pixbuf_cache,
 					   width * job_info->device_scale,
                                            height * job_info->device_scale);
 
-	if (new_selection_surface_needed (pixbuf_cache, job_info, page, scale)) {
+	job_info->partial = clip != NULL;
+	if (clip) {
+		job_info->partial_clip = *clip;
+		ev_job_render_set_clip (EV_JOB_RENDER (job_info->job), clip);
+	} else if (!job_info->tiled &&
+		   new_selection_surface_needed (pixbuf_cache, job_info, page, scale)) {
 		GdkColor text, base;
 
 		get_selection_colors (EV_VIEW (pixbuf_cache->view), &text, &base);
@@ -701,6 +1185,7 @@ add_job (EvPixbufCache  *pixbuf_cache,
 	g_signal_connect (job_info->job, "finished",
 			  G_CALLBACK (job_finished_cb),
 			  pixbuf_cache);
+	job_info->push_time = g_get_monotonic_time ();
 	ev_job_scheduler_push_job (job_info->job, priority);
 }
 
@@ -712,14 +1197,18 @@ add_job_if_needed (EvPixbufCache *pixbuf_cache,
 		   gfloat         scale,
 		   EvJobPriority  priority)
 {
-	gint device_scale = get_device_scale (pixbuf_cache);
-	gint width, height;
+	gint    device_scale = get_device_scale (pixbuf_cache);
+	gint    width, height;
+	gdouble surface_scale;
+
+	surface_scale = get_page_surface_scale (pixbuf_cache, page, scale, rotation);
+	job_info->tiled = surface_scale != scale;
 
 	if (job_info->job)
 		return;
 
 	_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
-					       page, scale, rotation,
+					       page, surface_scale, rotation,
 					       &width, &height);
 
 	if (job_info->surface &&
@@ -742,8 +1231,8 @@ add_job_if_needed (EvPixbufCache *pixbuf_cache,
 	}
 
 	add_job (pixbuf_cache, job_info, NULL,
-		 width, height, page, rotation, scale,
-		 priority);
+		 width, height, page, rotation, surface_scale,
+		 NULL, priority);
 }
 
 static void
@@ -753,9 +1242,12 @@ add_prev_jobs_if_needed (EvPixbufCache *pixbuf_cache,
 {
         CacheJobInfo *job_info;
         int page;
+        int first;
         int i;
 
-        for (i = pixbuf_cache->preload_cache_size - 1; i >= FIRST_VISIBLE_PREV(pixbuf_cache); i--) {
+        first = MAX (FIRST_VISIBLE_PREV (pixbuf_cache),
+                     pixbuf_cache->preload_cache_size - pixbuf_cache->n_preload_prev);
+        for (i = pixbuf_cache->preload_cache_size - 1; i >= first; i--) {
                 job_info = (pixbuf_cache->prev_job + i);
                 page = pixbuf_cache->start_page - pixbuf_cache->preload_cache_size + i;
 
@@ -772,9 +1264,11 @@ add_next_jobs_if_needed (EvPixbufCache *pixbuf_cache,
 {
         CacheJobInfo *job_info;
         int page;
+        int len;
         int i;
 
-        for (i = 0; i < VISIBLE_NEXT_LEN(pixbuf_cache); i++) {
+        len = MIN (VISIBLE_NEXT_LEN (pixbuf_cache), pixbuf_cache->n_preload_next);
+        for (i = 0; i < len; i++) {
                 job_info = (pixbuf_cache->next_job + i);
                 page = pixbuf_cache->end_page + 1 + i;
 
@@ -831,6 +1325,346 @@ ev_pixbuf_cache_get_scroll_direction (EvPixbufCache *pixbuf_cache,
         return pixbuf_cache->scroll_direction;
 }
 
+/* The scrolling stopped: preload evenly around the visible range
+ * again instead of ahead of the last motion */
+static gboolean
+velocity_timeout_cb (EvPixbufCache *pixbuf_cache)
+{
+        gdouble scale = ev_document_model_get_scale (pixbuf_cache->model);
+        gint    rotation = ev_document_model_get_rotation (pixbuf_cache->model);
+
+        pixbuf_cache->velocity_timeout_id = 0;
+        pixbuf_cache->scroll_velocity = 0;
+
+        if (pixbuf_cache->start_page != -1) {
+                ev_pixbuf_cache_update_range (pixbuf_cache,
+                                              pixbuf_cache->start_page,
+                                              pixbuf_cache->end_page,
+                                              rotation, scale);
+                ev_pixbuf_cache_add_jobs_if_needed (pixbuf_cache, rotation, scale);
+        }
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+ev_pixbuf_cache_update_velocity (EvPixbufCache *pixbuf_cache,
+                                 gint           start_page,
+                                 gint           end_page)
+{
+        gint64  now = g_get_monotonic_time ();
+        gdouble pages, seconds;
+
+        /* Otherwise the timeout set when it last changed is pending */
+        if (start_page == pixbuf_cache->start_page && end_page == pixbuf_cache->end_page) {
+                if ((gdouble) (now - pixbuf_cache->range_time) / G_USEC_PER_SEC > VELOCITY_TIMEOUT)
+                        pixbuf_cache->scroll_velocity = 0;
+                return;
+        }
+
+        if (pixbuf_cache->velocity_timeout_id > 0) {
+                g_source_remove (pixbuf_cache->velocity_timeout_id);
+                pixbuf_cache->velocity_timeout_id = 0;
+        }
+
+        pages = ((start_page + end_page) - (pixbuf_cache->start_page + pixbuf_cache->end_page)) / 2.0;
+        seconds = (gdouble) (now - pixbuf_cache->range_time) / G_USEC_PER_SEC;
+        pixbuf_cache->range_time = now;
+
+        /* Scrolling (re)starts, there's no speed to measure yet */
+        if (pixbuf_cache->start_page == -1 || seconds > VELOCITY_TIMEOUT) {
+                pixbuf_cache->scroll_velocity = 0;
+                return;
+        }
+
+        pixbuf_cache->scroll_velocity = (pixbuf_cache->scroll_velocity + pages / MAX (seconds, 0.001)) / 2;
+
+        /* Decays to 0 if the range doesn't change anymore */
+        pixbuf_cache->velocity_timeout_id =
+                g_timeout_add ((guint) (VELOCITY_TIMEOUT * 1000),
+                               (GSourceFunc) velocity_timeout_cb,
+                               pixbuf_cache);
+}
+
+/* Tiles */
+static void
+add_tile_job (EvPixbufCache *pixbuf_cache,
+	      CacheTile     *tile,
+	      EvJobPriority  priority)
+{
+	cairo_rectangle_int_t clip;
+	gint                  width, height;
+
+	if (tile->job)
+		end_tile_job (tile);
+
+	_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
+					       tile->page, tile->scale, tile->rotation,
+					       &width, &height);
+
+	clip.x = tile->col * TILE_SIZE;
+	clip.y = tile->row * TILE_SIZE;
+	clip.width = MIN (TILE_SIZE, width - clip.x) * tile->device_scale;
+	clip.height = MIN (TILE_SIZE, height - clip.y) * tile->device_scale;
+	clip.x *= tile->device_scale;
+	clip.y *= tile->device_scale;
+
+	tile->job = ev_job_render_new (pixbuf_cache->document,
+				       tile->page, tile->rotation,
+				       tile->scale * tile->device_scale,
+				       width * tile->device_scale,
+				       height * tile->device_scale);
+	ev_job_render_set_clip (EV_JOB_RENDER (tile->job), &clip);
+
+	g_signal_connect (tile->job, "finished",
+			  G_CALLBACK (tile_job_finished_cb),
+			  tile);
+	ev_job_scheduler_push_job (tile->job, priority);
+}
+
+static CacheTile *
+lookup_tile (EvPixbufCache *pixbuf_cache,
+	     gint           page,
+	     gint           col,
+	     gint           row,
+	     gdouble        scale,
+	     gint           rotation,
+	     gboolean       create)
+{
+	CacheTile  key = { NULL, };
+	CacheTile *tile;
+
+	key.page = page;
+	key.col = col;
+	key.row = row;
+	key.scale = scale;
+	key.rotation = rotation;
+	key.device_scale = get_device_scale (pixbuf_cache);
+
+	tile = g_hash_table_lookup (pixbuf_cache->tiles, &key);
+	if (tile || !create)
+		return tile;
+
+	tile = g_slice_new (CacheTile);
+	*tile = key;
+	tile->pixbuf_cache = pixbuf_cache;
+	tile->lru_link.data = tile;
+	g_hash_table_add (pixbuf_cache->tiles, tile);
+	g_queue_push_head_link (&pixbuf_cache->tiles_lru, &tile->lru_link);
+
+	return tile;
+}
+
+/* Drop least recently wanted tiles until they fit in max_size, along
+ * with the page surfaces. Tiles covering the visible area are kept
+ * regardless. */
+static void
+evict_tiles (EvPixbufCache *pixbuf_cache)
+{
+	gsize pages_size = get_pages_size (pixbuf_cache);
+
+	while (pixbuf_cache->tiles_size + pages_size > pixbuf_cache->max_size &&
+	       pixbuf_cache->tiles_lru.tail) {
+		CacheTile *tile = pixbuf_cache->tiles_lru.tail->data;
+
+		if (tile->wanted)
+			break;
+
+		drop_tile (pixbuf_cache, tile);
+	}
+}
+
+static void
+tile_job_finished_cb (EvJob     *job,
+		      CacheTile *tile)
+{
+	EvPixbufCache *pixbuf_cache = tile->pixbuf_cache;
+	EvJobRender   *job_render = EV_JOB_RENDER (job);
+
+	if (!job_render->include_clip) {
+		gdouble scale = ev_document_model_get_scale (pixbuf_cache->model);
+		gint    rotation = ev_document_model_get_rotation (pixbuf_cache->model);
+
+		/* The backend can't render part of a page, so render
+		 * whole pages again, however big */
+		pixbuf_cache->tiles_unsupported = TRUE;
+		clear_tiles (pixbuf_cache);
+		ev_pixbuf_cache_clear_job_sizes (pixbuf_cache, scale);
+		ev_pixbuf_cache_add_jobs_if_needed (pixbuf_cache, rotation, scale);
+
+		return;
+	}
+
+	/* The backend failed to render the tile: keep the previous
+	 * surface, if any, and try again when the tile is wanted */
+	if (!job_render->surface) {
+		end_tile_job (tile);
+		return;
+	}
+
+	if (tile->surface) {
+		pixbuf_cache->tiles_size -= get_surface_size (tile->surface);
+		cairo_surface_destroy (tile->surface);
+	}
+	tile->surface = cairo_surface_reference (job_render->surface);
+	set_device_scale_on_surface (tile->surface, tile->device_scale);
+	if (pixbuf_cache->inverted_colors)
+		ev_document_misc_invert_surface (tile->surface);
+	pixbuf_cache->tiles_size += get_surface_size (tile->surface);
+	tile->stale = FALSE;
+
+	end_tile_job (tile);
+	evict_tiles (pixbuf_cache);
+
+	g_signal_emit (pixbuf_cache, signals[JOB_FINISHED], 0, NULL);
+}
+
+/* Render the tiles of tiled pages that intersect the visible area or
+ * the margin around it, in that order, and stop rendering the rest */
+static void
+ev_pixbuf_cache_update_tiles (EvPixbufCache *pixbuf_cache,
+			      gint           rotation,
+			      gdouble        scale)
+{
+	EvView        *view = EV_VIEW (pixbuf_cache->view);
+	GtkAllocation  allocation;
+	GdkRectangle   visible, area;
+	GHashTableIter iter;
+	gpointer       key;
+	gint           page;
+
+	g_hash_table_iter_init (&iter, pixbuf_cache->tiles);
+	while (g_hash_table_iter_next (&iter, &key, NULL))
+		((CacheTile *) key)->wanted = FALSE;
+
+	gtk_widget_get_allocation (pixbuf_cache->view, &allocation);
+	visible.x = view->scroll_x;
+	visible.y = view->scroll_y;
+	visible.width = allocation.width;
+	visible.height = allocation.height;
+
+	area.x = visible.x - TILE_MARGIN;
+	area.y = visible.y - TILE_MARGIN;
+	area.width = visible.width + 2 * TILE_MARGIN;
+	area.height = visible.height + 2 * TILE_MARGIN;
+
+	for (page = pixbuf_cache->start_page; page <= pixbuf_cache->end_page; page++) {
+		CacheJobInfo *job_info = find_job_cache (pixbuf_cache, page);
+		GdkRectangle  page_area, page_rect, wanted;
+		GtkBorder     border;
+		gint          col, row;
+
+		if (!job_info || !job_info->tiled)
+			continue;
+
+		if (!ev_view_get_page_extents (view, page, &page_area, &border))
+			continue;
+
+		page_rect.x = page_area.x + border.left;
+		page_rect.y = page_area.y + border.top;
+		_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
+						       page, scale, rotation,
+						       &page_rect.width, &page_rect.height);
+
+		if (!gdk_rectangle_intersect (&area, &page_rect, &wanted))
+			continue;
+
+		for (row = (wanted.y - page_rect.y) / TILE_SIZE;
+		     row * TILE_SIZE < wanted.y + wanted.height - page_rect.y;
+		     row++) {
+			for (col = (wanted.x - page_rect.x) / TILE_SIZE;
+			     col * TILE_SIZE < wanted.x + wanted.width - page_rect.x;
+			     col++) {
+				GdkRectangle  tile_rect;
+				CacheTile    *tile;
+				EvJobPriority priority;
+
+				tile_rect.x = page_rect.x + col * TILE_SIZE;
+				tile_rect.y = page_rect.y + row * TILE_SIZE;
+				tile_rect.width = TILE_SIZE;
+				tile_rect.height = TILE_SIZE;
+				priority = gdk_rectangle_intersect (&visible, &tile_rect, NULL) ?
+					EV_JOB_PRIORITY_URGENT : EV_JOB_PRIORITY_LOW;
+
+				tile = lookup_tile (pixbuf_cache, page, col, row,
+						    scale, rotation, TRUE);
+				tile->wanted = TRUE;
+				g_queue_unlink (&pixbuf_cache->tiles_lru, &tile->lru_link);
+				g_queue_push_head_link (&pixbuf_cache->tiles_lru, &tile->lru_link);
+
+				if (tile->job)
+					ev_job_scheduler_update_job (tile->job, priority);
+				else if (!tile->surface || tile->stale)
+					add_tile_job (pixbuf_cache, tile, priority);
+			}
+		}
+	}
+
+	g_hash_table_iter_init (&iter, pixbuf_cache->tiles);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		CacheTile *tile = key;
+
+		if (tile->wanted || !tile->job)
+			continue;
+
+		end_tile_job (tile);
+		if (!tile->surface) {
+			g_hash_table_iter_remove (&iter);
+			g_queue_unlink (&pixbuf_cache->tiles_lru, &tile->lru_link);
+			g_slice_free (CacheTile, tile);
+		}
+	}
+
+	evict_tiles (pixbuf_cache);
+}
+
+/* The content of @page changed: render its tiles covering @region
+ * again, or all of them. Tiles at other scales are just marked. */
+static void
+reload_tiles (EvPixbufCache  *pixbuf_cache,
+	      gint            page,
+	      cairo_region_t *region,
+	      gint            rotation,
+	      gdouble         scale,
+	      EvJobPriority   priority)
+{
+	GdkRectangle dirty;
+	gint         device_scale = get_device_scale (pixbuf_cache);
+	gint         width, height;
+	GList       *l;
+
+	_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
+					       page, scale, rotation,
+					       &width, &height);
+	if (region && !get_region_page_rect (pixbuf_cache, page, region, width, height, &dirty))
+		region = NULL;
+
+	for (l = pixbuf_cache->tiles_lru.head; l; l = l->next) {
+		CacheTile   *tile = l->data;
+		GdkRectangle tile_rect;
+
+		if (tile->page != page)
+			continue;
+
+		if (tile->scale != scale || tile->rotation != rotation ||
+		    tile->device_scale != device_scale) {
+			tile->stale = TRUE;
+			continue;
+		}
+
+		tile_rect.x = tile->col * TILE_SIZE;
+		tile_rect.y = tile->row * TILE_SIZE;
+		tile_rect.width = TILE_SIZE;
+		tile_rect.height = TILE_SIZE;
+		if (region && !gdk_rectangle_intersect (&dirty, &tile_rect, NULL))
+			continue;
+
+		tile->stale = TRUE;
+		if (tile->wanted)
+			add_tile_job (pixbuf_cache, tile, priority);
+	}
+}
+
 void
 ev_pixbuf_cache_set_page_range (EvPixbufCache  *pixbuf_cache,
 				gint            start_page,
@@ -847,6 +1681,7 @@ ev_pixbuf_cache_set_page_range (EvPixbufCache  *pixbuf_cache,
 	g_return_if_fail (end_page >= start_page);
 
         pixbuf_cache->scroll_direction = ev_pixbuf_cache_get_scroll_direction (pixbuf_cache, start_page, end_page);
+        ev_pixbuf_cache_update_velocity (pixbuf_cache, start_page, end_page);
 
 	/* First, resize the page_range as needed.  We cull old pages
 	 * mercilessly. */
@@ -862,13 +1697,17 @@ ev_pixbuf_cache_set_page_range (EvPixbufCache  *pixbuf_cache,
 	/* Finally, we add the new jobs for all the sizes that don't have a
 	 * pixbuf */
 	ev_pixbuf_cache_add_jobs_if_needed (pixbuf_cache, rotation, scale);
+
+	/* and the tiles in view for the pages too big to render whole */
+	ev_pixbuf_cache_update_tiles (pixbuf_cache, rotation, scale);
 }
 
 void
 ev_pixbuf_cache_set_inverted_colors (EvPixbufCache *pixbuf_cache,
 				     gboolean       inverted_colors)
 {
-	gint i;
+	gint   i;
+	GList *l;
 
 	if (pixbuf_cache->inverted_colors == inverted_colors)
 		return;
@@ -894,6 +1733,13 @@ ev_pixbuf_cache_set_inverted_colors (EvPixbufCache *pixbuf_cache,
 		if (job_info && job_info->surface)
 			ev_document_misc_invert_surface (job_info->surface);
 	}
+
+	for (l = pixbuf_cache->tiles_lru.head; l; l = l->next) {
+		CacheTile *tile = l->data;
+
+		if (tile->surface)
+			ev_document_misc_invert_surface (tile->surface);
+	}
 }
 
 cairo_surface_t *
@@ -976,6 +1822,8 @@ ev_pixbuf_cache_clear (EvPixbufCache *pixbuf_cache)
 {
 	int i;
 
+	clear_tiles (pixbuf_cache);
+
 	if (!pixbuf_cache->job_list)
 		return;
 
@@ -1048,6 +1896,11 @@ ev_pixbuf_cache_get_selection_surface (EvPixbufCache   *pixbuf_cache,
 	if (!job_info->points_set)
 		return NULL;
 
+	/* A surface the size of a tiled page is what tiling avoids, the
+	 * selection region is drawn instead */
+	if (job_info->tiled)
+		return NULL;
+
 	/* If we have a running job, we just return what we have under the
 	 * assumption that it'll be updated later and we can scale it as need
 	 * be */
@@ -1060,7 +1913,7 @@ ev_pixbuf_cache_get_selection_surface (EvPixbufCache   *pixbuf_cache,
 
 	/* Finally, we see if the two scales are the same, and get a new pixbuf
 	 * if needed.  We do this synchronously for now.  At some point, we
-	 * _should_ be able to get rid of the doc_mutex, so the synchronicity
+	 * _should_ be able to get rid of the document lock, so the synchronicity
 	 * doesn't kill us.  Rendering a few glyphs should really be fast.
 	 */
 	if (ev_rect_cmp (&(job_info->target_points), &(job_info->selection_points))) {
@@ -1071,7 +1924,7 @@ ev_pixbuf_cache_get_selection_surface (EvPixbufCache   *pixbuf_cache,
 		gint width, height;
 
 		/* we need to get a new selection pixbuf */
-		ev_document_doc_mutex_lock ();
+		ev_document_lock (pixbuf_cache->document);
 		if (job_info->selection_points.x1 < 0) {
 			g_assert (job_info->selection == NULL);
 			old_points = NULL;
@@ -1101,7 +1954,7 @@ ev_pixbuf_cache_get_selection_surface (EvPixbufCache   *pixbuf_cache,
 		job_info->selection_points = job_info->target_points;
 		job_info->selection_scale = scale * job_info->device_scale;
 		g_object_unref (rc);
-		ev_document_doc_mutex_unlock ();
+		ev_document_unlock (pixbuf_cache->document);
 	}
 	return job_info->selection;
 }
@@ -1144,7 +1997,7 @@ ev_pixbuf_cache_get_selection_region (EvPixbufCache *pixbuf_cache,
 		EvPage *ev_page;
 		gint width, height;
 
-		ev_document_doc_mutex_lock ();
+		ev_document_lock (pixbuf_cache->document);
 		ev_page = ev_document_get_page (pixbuf_cache->document, page);
 
 		_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
@@ -1164,7 +2017,7 @@ ev_pixbuf_cache_get_selection_region (EvPixbufCache *pixbuf_cache,
 		job_info->selection_region_points = job_info->target_points;
 		job_info->selection_region_scale = scale;
 		g_object_unref (rc);
-		ev_document_doc_mutex_unlock ();
+		ev_document_unlock (pixbuf_cache->document);
 	}
 	return job_info->selection_region && !cairo_region_is_empty(job_info->selection_region) ?
                 job_info->selection_region : NULL;
@@ -1352,26 +2205,185 @@ ev_pixbuf_cache_get_selection_list (EvPixbufCache *pixbuf_cache)
 	return g_list_reverse (retval);
 }
 
+/* Translate @region, in widget coordinates, into the part of the
+ * @width x @height page it covers. FALSE if it misses the page. */
+static gboolean
+get_region_page_rect (EvPixbufCache  *pixbuf_cache,
+		      gint            page,
+		      cairo_region_t *region,
+		      gint            width,
+		      gint            height,
+		      GdkRectangle   *rect)
+{
+	EvView      *view = EV_VIEW (pixbuf_cache->view);
+	GdkRectangle page_area;
+	GdkRectangle page_rect = { 0, 0, width, height };
+	GtkBorder    border;
+
+	if (!ev_view_get_page_extents (view, page, &page_area, &border))
+		return FALSE;
+
+	cairo_region_get_extents (region, rect);
+	rect->x += view->scroll_x - page_area.x - border.left;
+	rect->y += view->scroll_y - page_area.y - border.top;
+
+	/* Leave room for antialiasing at the edges */
+	rect->x -= 1;
+	rect->y -= 1;
+	rect->width += 2;
+	rect->height += 2;
+
+	return gdk_rectangle_intersect (rect, &page_rect, rect);
+}
+
+/* The pixels of the page surface that have to be rendered again for
+ * @region. Returns FALSE when the whole page should be rendered
+ * instead: there is no surface that could be patched, or most of it
+ * is dirty anyway. */
+static gboolean
+get_region_clip (EvPixbufCache         *pixbuf_cache,
+		 CacheJobInfo          *job_info,
+		 gint                   page,
+		 cairo_region_t        *region,
+		 gint                   width,
+		 gint                   height,
+		 cairo_rectangle_int_t *clip)
+{
+	gint device_scale;
+
+	if (!region || !job_info->surface || job_info->tiled)
+		return FALSE;
+
+	device_scale = get_device_scale (pixbuf_cache);
+	if (job_info->device_scale != device_scale ||
+	    cairo_image_surface_get_width (job_info->surface) != width * device_scale ||
+	    cairo_image_surface_get_height (job_info->surface) != height * device_scale)
+		return FALSE;
+
+	if (!get_region_page_rect (pixbuf_cache, page, region, width, height, clip))
+		return FALSE;
+
+	if (clip->width * clip->height * 2 > width * height)
+		return FALSE;
+
+	clip->x *= device_scale;
+	clip->y *= device_scale;
+	clip->width *= device_scale;
+	clip->height *= device_scale;
+
+	return TRUE;
+}
+
 void
 ev_pixbuf_cache_reload_page (EvPixbufCache  *pixbuf_cache,
 			     cairo_region_t *region,
 			     gint            page,
 			     gint            rotation,
-			     gdouble         scale)
+			     gdouble         scale,
+			     EvJobPriority   priority)
 {
-	CacheJobInfo *job_info;
+	CacheJobInfo         *job_info;
+	cairo_rectangle_int_t clip;
+	cairo_region_t       *job_region = NULL;
+	gboolean              partial;
+	gdouble               surface_scale;
         gint width, height;
 
 	job_info = find_job_cache (pixbuf_cache, page);
 	if (job_info == NULL)
 		return;
 
+	surface_scale = get_page_surface_scale (pixbuf_cache, page, scale, rotation);
+	job_info->tiled = surface_scale != scale;
+	if (job_info->tiled)
+		reload_tiles (pixbuf_cache, page, region, rotation, scale, priority);
+
 	_get_page_size_for_scale_and_rotation (pixbuf_cache->document,
-					       page, scale, rotation,
+					       page, surface_scale, rotation,
 					       &width, &height);
+
+	partial = get_region_clip (pixbuf_cache, job_info, page, region,
+				   width, height, &clip);
+
+	/* The job being replaced must not lose what it was redrawing */
+	if (job_info->job) {
+		if (region && job_info->region) {
+			job_region = cairo_region_copy (job_info->region);
+			cairo_region_union (job_region, region);
+			region = job_region;
+		}
+		if (partial && job_info->partial)
+			gdk_rectangle_union (&clip, &job_info->partial_clip, &clip);
+		else
+			partial = FALSE;
+	}
+
         add_job (pixbuf_cache, job_info, region,
-		 width, height, page, rotation, scale,
-		 EV_JOB_PRIORITY_URGENT);
+		 width, height, page, rotation, surface_scale,
+		 partial ? &clip : NULL, priority);
+
+	if (job_region)
+		cairo_region_destroy (job_region);
+}
+
+/* Whether a render job for @page has been queued and not finished
+ * yet. Any surface returned for the page meanwhile predates the
+ * request that queued it. */
+gboolean
+ev_pixbuf_cache_is_page_pending (EvPixbufCache *pixbuf_cache,
+				 gint           page)
+{
+	CacheJobInfo *job_info;
+	GList        *l;
+
+	job_info = find_job_cache (pixbuf_cache, page);
+	if (job_info == NULL)
+		return FALSE;
+
+	if (job_info->job != NULL)
+		return TRUE;
+
+	for (l = pixbuf_cache->tiles_lru.head; l; l = l->next) {
+		CacheTile *tile = l->data;
+
+		if (tile->page == page && tile->job)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+gboolean
+ev_pixbuf_cache_page_is_tiled (EvPixbufCache *pixbuf_cache,
+			       gint           page)
+{
+	CacheJobInfo *job_info;
+
+	job_info = find_job_cache (pixbuf_cache, page);
+	if (job_info == NULL)
+		return FALSE;
+
+	return job_info->tiled;
+}
+
+/* The tile at @col, @row of a tiled page at the current scale, or
+ * NULL if it hasn't been rendered yet. Tiles are
+ * EV_PIXBUF_CACHE_TILE_SIZE view pixels wide and high, except at the
+ * right and bottom edges of the page. */
+cairo_surface_t *
+ev_pixbuf_cache_get_tile_surface (EvPixbufCache *pixbuf_cache,
+				  gint           page,
+				  gint           col,
+				  gint           row)
+{
+	CacheTile *tile;
+
+	tile = lookup_tile (pixbuf_cache, page, col, row,
+			    ev_document_model_get_scale (pixbuf_cache->model),
+			    ev_document_model_get_rotation (pixbuf_cache->model),
+			    FALSE);
+
+	return tile ? tile->surface : NULL;
 }
 
 
@@ -39,6 +39,9 @@ G_BEGIN_DECLS
 #define EV_PIXBUF_CACHE(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), EV_TYPE_PIXBUF_CACHE, EvPixbufCache))
 #define EV_IS_PIXBUF_CACHE(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), EV_TYPE_PIXBUF_CACHE))
 
+/* Size of the tiles big pages are rendered in, in view pixels */
+#define EV_PIXBUF_CACHE_TILE_SIZE       512
+
 
 
 /* The coordinates in the rect here are at scale == 1.0, so that we can ignore
@@ -74,7 +77,16 @@ void           ev_pixbuf_cache_reload_page 	    (EvPixbufCache  *pixbuf_cache,
 						     cairo_region_t *region,
                     				     gint            page,
 			                             gint            rotation,
-						     gdouble         scale);
+						     gdouble         scale,
+						     EvJobPriority   priority);
+gboolean       ev_pixbuf_cache_is_page_pending      (EvPixbufCache *pixbuf_cache,
+						     gint           page);
+gboolean       ev_pixbuf_cache_page_is_tiled        (EvPixbufCache *pixbuf_cache,
+						     gint           page);
+cairo_surface_t *ev_pixbuf_cache_get_tile_surface   (EvPixbufCache *pixbuf_cache,
+						     gint           page,
+						     gint           col,
+						     gint           row);
 void           ev_pixbuf_cache_set_inverted_colors  (EvPixbufCache *pixbuf_cache,
 						     gboolean       inverted_colors);
 /* Selection */
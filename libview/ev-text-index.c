@@ -0,0 +1,749 @@
+/* ev-text-index.c
+ *  this file is part of evince, a gnome document viewer
+ *
+ * Copyright (C) 2026 The Evince authors
+ *
+ * Evince is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Evince is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "ev-text-index.h"
+
+/* The index of a document is its page text and glyph areas, laid out
+ * the same way in memory and in the cache file:
+ *
+ *   IndexHeader
+ *   IndexPage[n_pages]
+ *   page text (nul terminated) and areas (8 bytes aligned)
+ *
+ * The cache file is named after the document URI and is only used
+ * while the header matches the modification time of the document.
+ * Documents with security are never cached, their text would end up
+ * in the clear on disk. Once the cache is over CACHE_MAX_SIZE the
+ * least recently used files are removed.
+ */
+#define EV_TEXT_INDEX_KEY     "ev-text-index"
+#define INDEX_MAGIC           "EVTI"
+#define INDEX_VERSION         1
+#define CACHE_MAX_SIZE        (256 * 1024 * 1024)
+
+typedef struct {
+	gchar   magic[4];
+	guint32 version;
+	gint64  mtime;
+	guint32 n_pages;
+	guint32 reserved;
+} IndexHeader;
+
+typedef struct {
+	guint64 text_offset;
+	guint64 areas_offset;
+	guint32 text_len;
+	guint32 n_areas;
+} IndexPage;
+
+typedef struct {
+	gchar  *filename;
+	gint64  mtime;
+	goffset size;
+} CacheFile;
+
+struct _EvTextIndex
+{
+	GObject parent;
+
+	EvDocument      *document;
+
+	GMutex           build_mutex;
+	GBytes          *data;
+	const IndexPage *pages;
+	gint             n_pages;
+	gint             ready;
+
+	/* Pages extracted so far, kept between the calls to
+	 * ev_text_index_build() until every page is done */
+	gchar          **texts;
+	EvRectangle    **areas;
+	guint           *n_areas;
+	gint             n_extracted;
+	gint64           mtime;
+};
+
+struct _EvTextIndexClass
+{
+	GObjectClass parent_class;
+};
+
+static GMutex ev_text_index_mutex;
+
+G_DEFINE_TYPE (EvTextIndex, ev_text_index, G_TYPE_OBJECT)
+
+static void
+ev_text_index_clear_extracted (EvTextIndex *index)
+{
+	gint i;
+
+	if (!index->texts)
+		return;
+
+	for (i = 0; i < index->n_pages; i++) {
+		g_free (index->texts[i]);
+		g_free (index->areas[i]);
+	}
+	g_clear_pointer (&index->texts, g_free);
+	g_clear_pointer (&index->areas, g_free);
+	g_clear_pointer (&index->n_areas, g_free);
+	index->n_extracted = 0;
+}
+
+static void
+ev_text_index_finalize (GObject *object)
+{
+	EvTextIndex *index = EV_TEXT_INDEX (object);
+
+	ev_text_index_clear_extracted (index);
+	if (index->data) {
+		g_bytes_unref (index->data);
+		index->data = NULL;
+	}
+	g_mutex_clear (&index->build_mutex);
+
+	G_OBJECT_CLASS (ev_text_index_parent_class)->finalize (object);
+}
+
+static void
+ev_text_index_init (EvTextIndex *index)
+{
+	g_mutex_init (&index->build_mutex);
+}
+
+static void
+ev_text_index_class_init (EvTextIndexClass *klass)
+{
+	GObjectClass *g_object_class = G_OBJECT_CLASS (klass);
+
+	g_object_class->finalize = ev_text_index_finalize;
+}
+
+/**
+ * ev_text_index_get_for_document:
+ * @document: an #EvDocument
+ *
+ * Returns the text index of @document, creating an empty one the
+ * first time. The index is not usable until ev_text_index_build()
+ * has completed, usually from an #EvJobTextIndex.
+ *
+ * Returns: (transfer none): the #EvTextIndex of @document
+ */
+EvTextIndex *
+ev_text_index_get_for_document (EvDocument *document)
+{
+	EvTextIndex *index;
+
+	g_return_val_if_fail (EV_IS_DOCUMENT (document), NULL);
+
+	g_mutex_lock (&ev_text_index_mutex);
+	index = g_object_get_data (G_OBJECT (document), EV_TEXT_INDEX_KEY);
+	if (!index) {
+		index = g_object_new (EV_TYPE_TEXT_INDEX, NULL);
+		/* The document owns the index */
+		index->document = document;
+		g_object_set_data_full (G_OBJECT (document), EV_TEXT_INDEX_KEY,
+					index, (GDestroyNotify)g_object_unref);
+	}
+	g_mutex_unlock (&ev_text_index_mutex);
+
+	return index;
+}
+
+static gint64
+get_document_mtime (EvDocument *document)
+{
+	GFile     *file;
+	GFileInfo *info;
+	gint64     mtime = -1;
+
+	file = g_file_new_for_uri (ev_document_get_uri (document));
+	info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+				  G_FILE_QUERY_INFO_NONE, NULL, NULL);
+	if (info) {
+		if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+			mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+		g_object_unref (info);
+	}
+	g_object_unref (file);
+
+	return mtime;
+}
+
+static gchar *
+get_cache_filename (EvDocument *document)
+{
+	gchar *checksum;
+	gchar *filename;
+
+	checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1,
+						  ev_document_get_uri (document), -1);
+	filename = g_build_filename (g_get_user_cache_dir (), "evince", "text-index",
+				     checksum, NULL);
+	g_free (checksum);
+
+	return filename;
+}
+
+static gboolean
+document_has_security (EvDocument *document)
+{
+	return EV_IS_DOCUMENT_SECURITY (document) &&
+		ev_document_security_has_document_security (EV_DOCUMENT_SECURITY (document));
+}
+
+static gint
+compare_cache_files (gconstpointer a,
+		     gconstpointer b)
+{
+	const CacheFile *file_a = (const CacheFile *)a;
+	const CacheFile *file_b = (const CacheFile *)b;
+
+	return file_a->mtime < file_b->mtime ? -1 : file_a->mtime > file_b->mtime;
+}
+
+/* Removes the least recently used cache files, loading a cache file
+ * updates its modification time */
+static void
+trim_cache (const gchar *dirname)
+{
+	GDir        *dir;
+	const gchar *name;
+	GArray      *files;
+	guint64      total_size = 0;
+	guint        i;
+
+	dir = g_dir_open (dirname, 0, NULL);
+	if (!dir)
+		return;
+
+	files = g_array_new (FALSE, FALSE, sizeof (CacheFile));
+	while ((name = g_dir_read_name (dir))) {
+		CacheFile file;
+		GStatBuf  st;
+
+		file.filename = g_build_filename (dirname, name, NULL);
+		if (g_stat (file.filename, &st) != 0 || !S_ISREG (st.st_mode)) {
+			g_free (file.filename);
+			continue;
+		}
+		file.mtime = st.st_mtime;
+		file.size = st.st_size;
+		total_size += st.st_size;
+		g_array_append_val (files, file);
+	}
+	g_dir_close (dir);
+
+	g_array_sort (files, compare_cache_files);
+	for (i = 0; i < files->len; i++) {
+		CacheFile *file = &g_array_index (files, CacheFile, i);
+
+		if (total_size > CACHE_MAX_SIZE && g_unlink (file->filename) == 0)
+			total_size -= file->size;
+		g_free (file->filename);
+	}
+	g_array_free (files, TRUE);
+}
+
+static const IndexPage *
+index_data_get_pages (GBytes *data,
+		      gint64  mtime,
+		      gint    n_pages)
+{
+	const IndexHeader *header;
+	const IndexPage   *pages;
+	const gchar       *base;
+	gsize              size;
+	gint               i;
+
+	base = g_bytes_get_data (data, &size);
+	if (size < sizeof (IndexHeader))
+		return NULL;
+
+	header = (const IndexHeader *)base;
+	if (memcmp (header->magic, INDEX_MAGIC, 4) != 0 ||
+	    header->version != INDEX_VERSION ||
+	    header->mtime != mtime ||
+	    header->n_pages != (guint32)n_pages)
+		return NULL;
+
+	if ((size - sizeof (IndexHeader)) / sizeof (IndexPage) < (gsize)n_pages)
+		return NULL;
+
+	pages = (const IndexPage *)(base + sizeof (IndexHeader));
+	for (i = 0; i < n_pages; i++) {
+		const IndexPage *p = &pages[i];
+
+		if (p->text_offset >= size || size - p->text_offset <= p->text_len ||
+		    base[p->text_offset + p->text_len] != '\0')
+			return NULL;
+		if (p->areas_offset % sizeof (gdouble) != 0 || p->areas_offset > size ||
+		    (size - p->areas_offset) / sizeof (EvRectangle) < p->n_areas)
+			return NULL;
+	}
+
+	return pages;
+}
+
+static gboolean
+ev_text_index_load (EvTextIndex *index,
+		    const gchar *filename,
+		    gint64       mtime)
+{
+	GMappedFile     *mapped_file;
+	GBytes          *data;
+	const IndexPage *pages;
+
+	mapped_file = g_mapped_file_new (filename, FALSE, NULL);
+	if (!mapped_file)
+		return FALSE;
+
+	data = g_mapped_file_get_bytes (mapped_file);
+	g_mapped_file_unref (mapped_file);
+
+	pages = index_data_get_pages (data, mtime, index->n_pages);
+	if (!pages) {
+		g_bytes_unref (data);
+		return FALSE;
+	}
+
+	index->data = data;
+	index->pages = pages;
+	g_utime (filename, NULL);
+
+	return TRUE;
+}
+
+static GBytes *
+serialize_index (gchar       **texts,
+		 EvRectangle **areas,
+		 guint        *n_areas,
+		 gint          n_pages,
+		 gint64        mtime)
+{
+	IndexHeader *header;
+	IndexPage   *pages;
+	gchar       *base;
+	gsize        size;
+	gint         i;
+
+	size = sizeof (IndexHeader) + n_pages * sizeof (IndexPage);
+	for (i = 0; i < n_pages; i++) {
+		size += texts[i] ? strlen (texts[i]) + 1 : 1;
+		size = (size + sizeof (gdouble) - 1) & ~(sizeof (gdouble) - 1);
+		size += n_areas[i] * sizeof (EvRectangle);
+	}
+
+	base = g_malloc0 (size);
+	header = (IndexHeader *)base;
+	memcpy (header->magic, INDEX_MAGIC, 4);
+	header->version = INDEX_VERSION;
+	header->mtime = mtime;
+	header->n_pages = n_pages;
+
+	pages = (IndexPage *)(base + sizeof (IndexHeader));
+	size = sizeof (IndexHeader) + n_pages * sizeof (IndexPage);
+	for (i = 0; i < n_pages; i++) {
+		IndexPage *p = &pages[i];
+
+		p->text_offset = size;
+		p->text_len = texts[i] ? strlen (texts[i]) : 0;
+		if (texts[i])
+			memcpy (base + size, texts[i], p->text_len);
+		size += p->text_len + 1;
+
+		size = (size + sizeof (gdouble) - 1) & ~(sizeof (gdouble) - 1);
+		p->areas_offset = size;
+		p->n_areas = n_areas[i];
+		if (n_areas[i] > 0)
+			memcpy (base + size, areas[i], n_areas[i] * sizeof (EvRectangle));
+		size += n_areas[i] * sizeof (EvRectangle);
+	}
+
+	return g_bytes_new_take (base, size);
+}
+
+/* Writes the cache and reads it back mapped, so that the pages can be
+ * dropped from memory when not used */
+static void
+ev_text_index_finish (EvTextIndex *index,
+		      const gchar *filename,
+		      gboolean     cache)
+{
+	GBytes *data;
+
+	data = serialize_index (index->texts, index->areas, index->n_areas,
+				index->n_pages, index->mtime);
+	ev_text_index_clear_extracted (index);
+
+	if (cache && g_bytes_get_size (data) <= CACHE_MAX_SIZE) {
+		gchar *dirname = g_path_get_dirname (filename);
+
+		if (g_mkdir_with_parents (dirname, 0700) == 0 &&
+		    g_file_set_contents (filename,
+					 g_bytes_get_data (data, NULL),
+					 g_bytes_get_size (data),
+					 NULL) &&
+		    ev_text_index_load (index, filename, index->mtime)) {
+			g_bytes_unref (data);
+			data = NULL;
+		}
+		trim_cache (dirname);
+		g_free (dirname);
+	}
+
+	if (data) {
+		index->data = data;
+		index->pages = index_data_get_pages (data, index->mtime, index->n_pages);
+	}
+	g_atomic_int_set (&index->ready, TRUE);
+}
+
+/**
+ * ev_text_index_build:
+ * @index: an #EvTextIndex
+ * @n_pages: the number of pages to extract in this call
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ *
+ * Builds @index a step at a time. The first call loads the cache
+ * file when it is up to date; otherwise each call extracts the text
+ * of the next @n_pages pages, keeping it in @index until every page
+ * is done. Newly built indexes are written to the cache, unless the
+ * document has security. This blocks, so it should be called from a
+ * thread job, which returns to the scheduler between the calls. The
+ * document is locked one page at a time.
+ *
+ * Returns: %TRUE if there are pages left to extract. Otherwise, use
+ *     ev_text_index_is_ready() to tell whether the index was built.
+ */
+gboolean
+ev_text_index_build (EvTextIndex  *index,
+		     gint          n_pages,
+		     GCancellable *cancellable)
+{
+	EvDocument *document;
+	gchar      *filename;
+	gboolean    cache;
+	gint        last;
+
+	g_return_val_if_fail (EV_IS_TEXT_INDEX (index), FALSE);
+	g_return_val_if_fail (n_pages > 0, FALSE);
+
+	document = index->document;
+	if (!EV_IS_DOCUMENT_TEXT (document))
+		return FALSE;
+
+	g_mutex_lock (&index->build_mutex);
+	if (ev_text_index_is_ready (index)) {
+		g_mutex_unlock (&index->build_mutex);
+		return FALSE;
+	}
+
+	if (!index->texts) {
+		index->n_pages = ev_document_get_n_pages (document);
+		index->mtime = get_document_mtime (document);
+	}
+	filename = get_cache_filename (document);
+	cache = index->mtime != -1 && !document_has_security (document);
+
+	if (!index->texts) {
+		/* Written before documents with security were left out */
+		if (!cache)
+			g_unlink (filename);
+
+		if (cache && ev_text_index_load (index, filename, index->mtime)) {
+			g_free (filename);
+			g_atomic_int_set (&index->ready, TRUE);
+			g_mutex_unlock (&index->build_mutex);
+			return FALSE;
+		}
+
+		index->texts = g_new0 (gchar *, index->n_pages);
+		index->areas = g_new0 (EvRectangle *, index->n_pages);
+		index->n_areas = g_new0 (guint, index->n_pages);
+	}
+
+	last = MIN (index->n_extracted + n_pages, index->n_pages);
+	while (index->n_extracted < last) {
+		gint    i = index->n_extracted;
+		EvPage *page;
+
+		if (g_cancellable_is_cancelled (cancellable))
+			break;
+
+		ev_document_lock (document);
+		page = ev_document_get_page (document, i);
+		index->texts[i] = ev_document_text_get_text (EV_DOCUMENT_TEXT (document), page);
+		if (!ev_document_text_get_text_layout (EV_DOCUMENT_TEXT (document), page,
+						       &index->areas[i], &index->n_areas[i])) {
+			index->areas[i] = NULL;
+			index->n_areas[i] = 0;
+		}
+		g_object_unref (page);
+		ev_document_unlock (document);
+
+		index->n_extracted++;
+	}
+
+	if (index->n_extracted == index->n_pages)
+		ev_text_index_finish (index, filename, cache);
+
+	g_free (filename);
+	g_mutex_unlock (&index->build_mutex);
+
+	return !ev_text_index_is_ready (index) &&
+		!g_cancellable_is_cancelled (cancellable);
+}
+
+/**
+ * ev_text_index_is_ready:
+ * @index: an #EvTextIndex
+ *
+ * Returns: %TRUE if @index can answer queries for every page
+ */
+gboolean
+ev_text_index_is_ready (EvTextIndex *index)
+{
+	g_return_val_if_fail (EV_IS_TEXT_INDEX (index), FALSE);
+
+	return g_atomic_int_get (&index->ready);
+}
+
+/**
+ * ev_text_index_get_text:
+ * @index: an #EvTextIndex
+ * @page: page index
+ *
+ * Returns: the text of @page, owned by @index, or %NULL if @index
+ *     is not ready
+ */
+const gchar *
+ev_text_index_get_text (EvTextIndex *index,
+			gint         page)
+{
+	g_return_val_if_fail (EV_IS_TEXT_INDEX (index), NULL);
+
+	if (!ev_text_index_is_ready (index))
+		return NULL;
+
+	g_return_val_if_fail (page >= 0 && page < index->n_pages, NULL);
+
+	return (const gchar *)g_bytes_get_data (index->data, NULL) + index->pages[page].text_offset;
+}
+
+/**
+ * ev_text_index_get_text_layout:
+ * @index: an #EvTextIndex
+ * @page: page index
+ * @areas: (out) (transfer none): return location for the glyph areas
+ * @n_areas: (out): return location for the number of areas
+ *
+ * Gets the area of every character of the text of @page, as
+ * ev_document_text_get_text_layout() does, without copying them.
+ *
+ * Returns: %TRUE if @index is ready
+ */
+gboolean
+ev_text_index_get_text_layout (EvTextIndex        *index,
+			       gint                page,
+			       const EvRectangle **areas,
+			       guint              *n_areas)
+{
+	g_return_val_if_fail (EV_IS_TEXT_INDEX (index), FALSE);
+
+	if (!ev_text_index_is_ready (index))
+		return FALSE;
+
+	g_return_val_if_fail (page >= 0 && page < index->n_pages, FALSE);
+
+	*areas = (const EvRectangle *)((const gchar *)g_bytes_get_data (index->data, NULL) +
+				       index->pages[page].areas_offset);
+	*n_areas = index->pages[page].n_areas;
+
+	return TRUE;
+}
+
+static gboolean
+is_word_char (gunichar c)
+{
+	return g_unichar_isalnum (c) || c == '_';
+}
+
+/* Returns the end of the match of @needle at @i in @haystack, or -1.
+ * Like the backends searching across lines, a space in @needle also
+ * matches a line break, and a word broken by a hyphen at the end of
+ * a line matches the whole word. */
+static glong
+match_at (const gunichar *haystack,
+	  glong           haystack_len,
+	  glong           i,
+	  const gunichar *needle,
+	  glong           needle_len,
+	  gboolean        case_sensitive)
+{
+	glong j = 0;
+
+	while (j < needle_len) {
+		gunichar c;
+
+		if (i >= haystack_len)
+			return -1;
+
+		c = haystack[i];
+		if (c == '\n' && g_unichar_isspace (needle[j])) {
+			i++;
+			j++;
+			continue;
+		}
+		if (c == '-' && j > 0 && needle[j] != '-' &&
+		    i + 1 < haystack_len && haystack[i + 1] == '\n') {
+			i += 2;
+			continue;
+		}
+
+		if (!case_sensitive)
+			c = g_unichar_tolower (c);
+		if (c != needle[j])
+			return -1;
+		i++;
+		j++;
+	}
+
+	return i;
+}
+
+static gboolean
+areas_on_same_line (const EvRectangle *a,
+		    const EvRectangle *b)
+{
+	return b->y1 < a->y2 && a->y1 < b->y2;
+}
+
+/* Adds the areas of the characters from @start to @end, one rectangle
+ * for each line they are on */
+static GList *
+prepend_match_rectangles (GList             *matches,
+			  const gunichar    *haystack,
+			  const EvRectangle *areas,
+			  glong              start,
+			  glong              end)
+{
+	EvRectangle *match = NULL;
+	glong        k;
+
+	for (k = start; k < end; k++) {
+		const EvRectangle *area = &areas[k];
+
+		if (haystack[k] == '\n') {
+			match = NULL;
+			continue;
+		}
+
+		if (match && !areas_on_same_line (match, area))
+			match = NULL;
+
+		if (!match) {
+			match = ev_rectangle_new ();
+			*match = *area;
+			matches = g_list_prepend (matches, match);
+			continue;
+		}
+
+		match->x1 = MIN (match->x1, area->x1);
+		match->y1 = MIN (match->y1, area->y1);
+		match->x2 = MAX (match->x2, area->x2);
+		match->y2 = MAX (match->y2, area->y2);
+	}
+
+	return matches;
+}
+
+/**
+ * ev_text_index_find_text:
+ * @index: an #EvTextIndex
+ * @page: page index
+ * @text: text to find
+ * @options: the #EvFindOptions
+ *
+ * Finds @text in @page. Matches can span lines, a space in @text
+ * matching a line break; each match gives a rectangle for every line
+ * it is on, bounding its characters there.
+ *
+ * Returns: (transfer full) (element-type EvRectangle): a list of the
+ *     matches, in page points
+ */
+GList *
+ev_text_index_find_text (EvTextIndex  *index,
+			 gint          page,
+			 const gchar  *text,
+			 EvFindOptions options)
+{
+	const gchar       *page_text;
+	const EvRectangle *areas;
+	guint              n_areas;
+	gunichar          *haystack, *needle;
+	glong              haystack_len, needle_len;
+	gboolean           case_sensitive;
+	GList             *matches = NULL;
+	glong              i;
+
+	if (!ev_text_index_get_text_layout (index, page, &areas, &n_areas))
+		return NULL;
+	page_text = ev_text_index_get_text (index, page);
+
+	case_sensitive = (options & EV_FIND_CASE_SENSITIVE) != 0;
+	haystack = g_utf8_to_ucs4_fast (page_text, -1, &haystack_len);
+	needle = g_utf8_to_ucs4_fast (text, -1, &needle_len);
+	if (!case_sensitive) {
+		for (i = 0; i < needle_len; i++)
+			needle[i] = g_unichar_tolower (needle[i]);
+	}
+
+	for (i = 0; needle_len > 0 && i + needle_len <= haystack_len; i++) {
+		glong end;
+
+		end = match_at (haystack, haystack_len, i, needle, needle_len, case_sensitive);
+		if (end < 0)
+			continue;
+
+		if ((options & EV_FIND_WHOLE_WORDS_ONLY) &&
+		    ((i > 0 && is_word_char (haystack[i - 1])) ||
+		     (end < haystack_len && is_word_char (haystack[end]))))
+			continue;
+
+		if (end > n_areas)
+			break;
+
+		matches = prepend_match_rectangles (matches, haystack, areas, i, end);
+
+		i = end - 1;
+	}
+
+	g_free (haystack);
+	g_free (needle);
+
+	return g_list_reverse (matches);
+}
@@ -0,0 +1,64 @@
+/* ev-text-index.h
+ *  this file is part of evince, a gnome document viewer
+ *
+ * Copyright (C) 2026 The Evince authors
+ *
+ * Evince is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Evince is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#if !defined (__EV_EVINCE_VIEW_H_INSIDE__) && !defined (EVINCE_COMPILATION)
+#error "Only <evince-view.h> can be included directly."
+#endif
+
+#ifndef EV_TEXT_INDEX_H
+#define EV_TEXT_INDEX_H
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include <evince-document.h>
+
+G_BEGIN_DECLS
+
+#define EV_TYPE_TEXT_INDEX            (ev_text_index_get_type ())
+#define EV_TEXT_INDEX(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), EV_TYPE_TEXT_INDEX, EvTextIndex))
+#define EV_IS_TEXT_INDEX(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), EV_TYPE_TEXT_INDEX))
+#define EV_TEXT_INDEX_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), EV_TYPE_TEXT_INDEX, EvTextIndexClass))
+#define EV_IS_TEXT_INDEX_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), EV_TYPE_TEXT_INDEX))
+#define EV_TEXT_INDEX_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), EV_TYPE_TEXT_INDEX, EvTextIndexClass))
+
+typedef struct _EvTextIndex      EvTextIndex;
+typedef struct _EvTextIndexClass EvTextIndexClass;
+
+GType        ev_text_index_get_type          (void) G_GNUC_CONST;
+EvTextIndex *ev_text_index_get_for_document  (EvDocument         *document);
+gboolean     ev_text_index_build             (EvTextIndex        *index,
+					      gint                n_pages,
+					      GCancellable       *cancellable);
+gboolean     ev_text_index_is_ready          (EvTextIndex        *index);
+const gchar *ev_text_index_get_text          (EvTextIndex        *index,
+					      gint                page);
+gboolean     ev_text_index_get_text_layout   (EvTextIndex        *index,
+					      gint                page,
+					      const EvRectangle **areas,
+					      guint              *n_areas);
+GList       *ev_text_index_find_text         (EvTextIndex        *index,
+					      gint                page,
+					      const gchar        *text,
+					      EvFindOptions       options);
+
+G_END_DECLS
+
+#endif /* EV_TEXT_INDEX_H */
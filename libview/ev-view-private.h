@@ -34,6 +34,7 @@
 #include "ev-form-field.h"
 #include "ev-selection.h"
 #include "ev-view-cursor.h"
+#include "ev-annotation-history.h"
 
 #define DRAG_HISTORY 10
 
@@ -99,6 +100,17 @@ typedef struct {
 	gboolean   moved;
 } EvViewWindowChild;
 
+/* Ink annotation drawn as vectors until its page is rendered again */
+typedef struct {
+	EvAnnotation *annot;
+	guint         page;
+
+	/* Cached path in page coordinates, built for scale and rotation */
+	cairo_path_t *path;
+	gdouble       scale;
+	gint          rotation;
+} EvViewInkOverlay;
+
 typedef enum {
 	SCROLL_TO_KEEP_POSITION,
 	SCROLL_TO_PAGE_POSITION,
@@ -217,9 +229,40 @@ struct _EvView {
             GdkColor    color;
             gdouble     width;
             EvAnnotationInkOperator ink_operator;
+
+            /* Retained layer: finished strokes and the already
+             * drawn part of the live stroke, rasterized once */
+            cairo_surface_t *surface;
+            guint       n_committed_paths;
+            guint       n_committed_points;
+            gdouble     surface_scale;
+            gint        surface_rotation;
+            gint        surface_scroll_x;
+            gint        surface_scroll_y;
+            gint        surface_width;
+            gint        surface_height;
         } ink;
     } drawing_data;
     EvAnnotation        *drawing_annot;
+    gdouble              ink_simplify_tolerance;
+
+    /* Ink annotations not in the page surfaces yet */
+    GList               *ink_overlay;     /* EvViewInkOverlay */
+
+    /* Erasing ink annotations */
+    gboolean             erasing_ink;
+    gdouble              eraser_radius;   /* device pixels */
+    GHashTable          *erased_annots;   /* set of EvAnnotation, not saved yet */
+    GHashTable          *erased_areas;    /* page to the EvRectangle erased since the last flush */
+    GHashTable          *erased_pages;    /* set of pages erased during the drag */
+    GHashTable          *erase_changed;   /* set of EvAnnotation changed during the drag */
+    guint                erase_flush_id;
+    gboolean             erase_in_action; /* an eraser drag is being recorded */
+
+    /* Undo and redo of annotation edits */
+    EvAnnotationHistory *annot_history;
+    EvAnnotation        *changing_annot;
+    EvAnnotationState   *changing_annot_state;
 
 	/* Focus */
 	EvMapping *focused_element;
@@ -267,6 +310,8 @@ struct _EvViewClass {
 				       EvAnnotation   *annot);
         void     (*annot_removed)     (EvView         *view,
 				       EvAnnotation   *annot);
+        void     (*annot_changed)     (EvView         *view,
+				       EvAnnotation   *annot);
         void     (*layers_changed)    (EvView         *view);
         gboolean (*move_cursor)       (EvView         *view,
 				       GtkMovementStep step,
@@ -54,6 +54,7 @@ enum {
 	SIGNAL_SYNC_SOURCE,
 	SIGNAL_ANNOT_ADDED,
 	SIGNAL_ANNOT_REMOVED,
+	SIGNAL_ANNOT_CHANGED,
 	SIGNAL_LAYERS_CHANGED,
 	SIGNAL_MOVE_CURSOR,
 	SIGNAL_CURSOR_MOVED,
@@ -75,7 +76,9 @@ enum {
 	PROP_HSCROLL_POLICY,
 	PROP_VSCROLL_POLICY,
 	PROP_CAN_ZOOM_IN,
-	PROP_CAN_ZOOM_OUT
+	PROP_CAN_ZOOM_OUT,
+	PROP_CAN_UNDO,
+	PROP_CAN_REDO
 };
 
 static guint signals[N_SIGNALS];
@@ -105,6 +108,15 @@ typedef struct {
 
 #define DEFAULT_PIXBUF_CACHE_SIZE 52428800 /* 50MB */
 
+#define DEFAULT_INK_SIMPLIFY_TOLERANCE 1.0 /* device pixels */
+#define ERASER_FLUSH_INTERVAL 50 /* ms */
+
+typedef enum {
+	ERASER_FLUSH_SAVE,    /* only write the changes to the document */
+	ERASER_FLUSH_PARTIAL, /* and render the erased areas again, during a drag */
+	ERASER_FLUSH_FULL     /* and render the erased pages again, once it's over */
+} EraserFlush;
+
 #define EV_STYLE_CLASS_DOCUMENT_PAGE "document-page"
 #define EV_STYLE_CLASS_INVERTED      "inverted"
 
@@ -119,6 +131,8 @@ static void       compute_border                             (EvView
 static void       get_page_y_offset                          (EvView             *view,
 							      int                 page,
 							      int                *y_offset);
+static gint       find_last_page_above                       (EvView             *view,
+							      gint                y);
 static void       find_page_at_location                      (EvView             *view,
 							      gdouble             x,
 							      gdouble             y,
@@ -194,6 +208,17 @@ static void       draw_one_page                              (EvView
 static void       ev_view_reload_page                        (EvView             *view,
 							      gint                page,
 							      cairo_region_t     *region);
+static void       ink_layer_invalidate                       (EvView             *view);
+static void       ink_eraser_flush                           (EvView             *view,
+							      EraserFlush         mode);
+static void       ink_overlay_add                            (EvView             *view,
+							      EvAnnotation       *annot);
+static void       ink_overlay_remove                         (EvView             *view,
+							      EvAnnotation       *annot);
+static void       ink_overlay_reset_path                     (EvView             *view,
+							      EvAnnotation       *annot);
+static void       ev_view_end_erase_action                   (EvView             *view);
+static void       ev_view_annotation_history_changed         (EvView             *view);
 /*** Callbacks ***/
 static void       ev_view_change_page                        (EvView             *view,
 							      gint                new_page);
@@ -690,7 +715,8 @@ view_update_range_and_current_page (EvView *view)
 		gboolean found = FALSE;
 		gint area_max = -1, area;
 		gint best_current_page = -1;
-		int i, j = 0;
+		gint first, last;
+		int i;
 
 		if (!(view->vadjustment && view->hadjustment))
 			return;
@@ -700,7 +726,15 @@ view_update_range_and_current_page (EvView *view)
 		current_area.y = gtk_adjustment_get_value (view->vadjustment);
 		current_area.height = gtk_adjustment_get_page_size (view->vadjustment);
 
-		for (i = 0; i < ev_document_get_n_pages (view->document); i++) {
+		/* Only the pages between the rows at the top and the bottom
+		 * of the visible area can intersect it.
+		 */
+		first = find_last_page_above (view, current_area.y);
+		last = find_last_page_above (view, current_area.y + current_area.height - 1);
+		if (is_dual_page (view, NULL))
+			first = MAX (first - 1, 0);
+
+		for (i = first; i <= last; i++) {
 
 			ev_view_get_page_extents (view, i, &page_area, &border);
 
@@ -719,16 +753,6 @@ view_update_range_and_current_page (EvView *view)
 				}
 
 				view->end_page = i;
-				j = 0;
-			} else if (found && view->current_page <= view->end_page) {
-				if (is_dual_page (view, NULL) && j < 1) {
-					/* In dual mode  we stop searching
-					 * after two consecutive non-visible pages.
-					 */
-					j++;
-					continue;
-				}
-				break;
 			}
 		}
 
@@ -906,11 +930,11 @@ compute_scroll_increment (EvView        *view,
 		doc_rect.x1 = doc_rect.x2 = rect.x + 0.5;
 		doc_rect.y1 = doc_rect.y2 = rect.y + 0.5;
 
-		ev_document_doc_mutex_lock ();
+		ev_document_lock (view->document);
 		sel_region = ev_selection_get_selection_region (EV_SELECTION (view->document),
 								rc, EV_SELECTION_STYLE_LINE,
 								&doc_rect);
-		ev_document_doc_mutex_unlock ();
+		ev_document_unlock (view->document);
 
 		g_object_unref (rc);
 
@@ -1207,6 +1231,31 @@ get_page_y_offset (EvView *view, int page, int *y_offset)
 	return;
 }
 
+/* Returns the last page whose top edge is at or above @y in continuous
+ * mode. Page offsets never decrease with the page index, so a binary
+ * search over them is enough.
+ */
+static gint
+find_last_page_above (EvView *view,
+		      gint    y)
+{
+	gint low = 0;
+	gint high = ev_document_get_n_pages (view->document) - 1;
+
+	while (low < high) {
+		gint mid = low + (high - low + 1) / 2;
+		gint offset;
+
+		get_page_y_offset (view, mid, &offset);
+		if (offset <= y)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	return low;
+}
+
 gboolean
 ev_view_get_page_extents (EvView       *view,
 			  gint          page,
@@ -1468,7 +1517,7 @@ find_page_at_location (EvView  *view,
 		       gint    *x_offset,
 		       gint    *y_offset)
 {
-	int i;
+	int i, first, last;
 
 	if (view->document == NULL)
 		return;
@@ -1477,7 +1526,16 @@ find_page_at_location (EvView  *view,
 	g_assert (x_offset);
 	g_assert (y_offset);
 
-	for (i = view->start_page; i >= 0 && i <= view->end_page; i++) {
+	if (view->continuous) {
+		/* The location can only be on the row starting above it */
+		last = find_last_page_above (view, y);
+		first = is_dual_page (view, NULL) ? MAX (last - 1, 0) : last;
+	} else {
+		first = view->start_page;
+		last = view->end_page;
+	}
+
+	for (i = first; i >= 0 && i <= last; i++) {
 		GdkRectangle page_area;
 		GtkBorder border;
 
@@ -1658,7 +1716,6 @@ get_link_mapping_at_location (EvView  *view,
 			      gint    *page)
 {
 	gint x_new = 0, y_new = 0;
-	EvMappingList *link_mapping;
 
 	if (!EV_IS_DOCUMENT_LINKS (view->document))
 		return NULL;
@@ -1666,11 +1723,8 @@ get_link_mapping_at_location (EvView  *view,
 	if (!get_doc_point_from_location (view, x, y, page, &x_new, &y_new))
 		return NULL;
 
-	link_mapping = ev_page_cache_get_link_mapping (view->page_cache, *page);
-	if (link_mapping)
-		return ev_mapping_list_get (link_mapping, x_new, y_new);
-
-	return NULL;
+	return ev_page_cache_get_mapping_at_location (view->page_cache, *page, x_new, y_new,
+						      EV_PAGE_DATA_INCLUDE_LINKS);
 }
 
 static EvLink *
@@ -2134,7 +2188,7 @@ ev_view_get_image_at_location (EvView  *view,
 {
 	gint page = -1;
 	gint x_new = 0, y_new = 0;
-	EvMappingList *image_mapping;
+	EvMapping *image_mapping;
 
 	if (!EV_IS_DOCUMENT_IMAGES (view->document))
 		return NULL;
@@ -2142,12 +2196,10 @@ ev_view_get_image_at_location (EvView  *view,
 	if (!get_doc_point_from_location (view, x, y, &page, &x_new, &y_new))
 		return NULL;
 
-	image_mapping = ev_page_cache_get_image_mapping (view->page_cache, page);
+	image_mapping = ev_page_cache_get_mapping_at_location (view->page_cache, page, x_new, y_new,
+							       EV_PAGE_DATA_INCLUDE_IMAGES);
 
-	if (image_mapping)
-		return ev_mapping_list_get_data (image_mapping, x_new, y_new);
-	else
-		return NULL;
+	return image_mapping ? image_mapping->data : NULL;
 }
 
 /*** Focus ***/
@@ -2217,7 +2269,6 @@ get_form_field_mapping_at_location (EvView  *view,
 				    gint    *page)
 {
 	gint x_new = 0, y_new = 0;
-	EvMappingList *forms_mapping;
 
 	if (!EV_IS_DOCUMENT_FORMS (view->document))
 		return NULL;
@@ -2225,12 +2276,8 @@ get_form_field_mapping_at_location (EvView  *view,
 	if (!get_doc_point_from_location (view, x, y, page, &x_new, &y_new))
 		return NULL;
 
-	forms_mapping = ev_page_cache_get_form_field_mapping (view->page_cache, *page);
-
-	if (forms_mapping)
-		return ev_mapping_list_get (forms_mapping, x_new, y_new);
-
-	return NULL;
+	return ev_page_cache_get_mapping_at_location (view->page_cache, *page, x_new, y_new,
+						      EV_PAGE_DATA_INCLUDE_FORMS);
 }
 
 static EvFormField *
@@ -2958,10 +3005,10 @@ ev_view_annotation_save_contents (EvView       *view,
 	if (!view->document)
 		return;
 
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (view->document);
 	ev_document_annotations_save_annotation (EV_DOCUMENT_ANNOTATIONS (view->document),
 						 annot, EV_ANNOTATIONS_SAVE_CONTENTS);
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (view->document);
 }
 
 static GtkWidget *
@@ -3077,7 +3124,6 @@ get_annotation_mapping_at_location (EvView *view,
 				    gint *page)
 {
 	gint x_new = 0, y_new = 0;
-	EvMappingList *annotations_mapping;
 
 	if (!EV_IS_DOCUMENT_ANNOTATIONS (view->document))
 		return NULL;
@@ -3085,60 +3131,10 @@ get_annotation_mapping_at_location (EvView *view,
 	if (!get_doc_point_from_location (view, x, y, page, &x_new, &y_new))
 		return NULL;
 
-	annotations_mapping = ev_page_cache_get_annot_mapping (view->page_cache, *page);
-
-	if (annotations_mapping) {
-        GList *annotation_list = ev_mapping_list_get_all(annotations_mapping, x_new, y_new);
-        GList *list = annotation_list;
-        EvMapping *mapping_found = NULL;
-        /** annotation-specific implementation to test the quadtree
-         *  
-         *  Quadtree should be used for *all* elements instead of just
-         *  Ink annotations
-         *
-         *  FIXME: should just build this into mapping_list,
-         *  instead of iterating over the loop twice
-         *
-         * **/
-        for ( ; list; list = list->next ) {
-            EvMapping *annotation_mapping = list->data;
-            EvAnnotation *annot = annotation_mapping->data;
-
-            if ( ! EV_IS_ANNOTATION_INK(annot) ) {
-                mapping_found = annotation_mapping;
-            }
-            else { // Determine if x,y lies on annotation drawing
-                // debug printf
-                //
-                if (FALSE) {
-                    EvAnnotationInk *ink = EV_ANNOTATION_INK(annot);
-                    fprintf(stderr, " Mouse (x,y) = (%i, %i)\n", x_new, y_new);
-                    fprintf(stderr, " Annotation segments:");
-                    
-                    GArray *paths;
-                    ev_annotation_ink_get_paths(ink, &paths);
-                    int i,j;
-                    for (i=0;i<paths->len; i++) {
-                        GArray *path = g_array_index(paths, GArray*, i);
-                        fprintf(stderr, "   Segment %i\n    ", i);
-                        for (j=0; j<path->len; j+=2)
-                            fprintf(stderr, "(%lf, %lf) ", g_array_index(path, gdouble, j), g_array_index(path, gdouble, j+1));
-                        fprintf(stderr, "\n");
-                    }
-                }
-                
-                if (ev_annotation_ink_is_hit( EV_ANNOTATION_INK(annot), x_new, y_new )) {
-                    mapping_found = annotation_mapping;
-                }
-            }
-        }
-        if (annotation_list)
-            g_list_free(annotation_list);
-
-        return mapping_found;
-    }
-
-	return NULL;
+	/* The topmost annotation; ink annotations are only hit on their
+	 * strokes */
+	return ev_page_cache_get_mapping_at_location (view->page_cache, *page, x_new, y_new,
+						      EV_PAGE_DATA_INCLUDE_ANNOTS);
 }
 
 static EvAnnotation *
@@ -3234,58 +3230,81 @@ create_ink_annotation (EvView           *view,
     // for path in paths
     //      for x,y in path
     //          convert x,y to page coordinates
-    //          add x,y to other path
-    GArray *fpaths = g_array_new(0, 0, sizeof(GArray*));
+    //          add x,y to the packed points
+    GArray *points = g_array_new(FALSE, FALSE, sizeof(EvPoint));
+    GArray *stroke_lengths = g_array_new(FALSE, FALSE, sizeof(guint));
     double min_x = 1e99, min_y = 1e99, max_x = -1e99, max_y = -1e99;
+    guint n_captured = 0, n_stored = 0;
+    gdouble tolerance;
+
+    /* Keep the simplification error below the tolerance in device
+     * pixels at the current zoom, and within half the stroke */
+    tolerance = view->ink_simplify_tolerance / view->scale;
+    if (view->drawing_data.ink.width > 0)
+        tolerance = MIN (tolerance, view->drawing_data.ink.width / 2);
 
 
     /* 
      * Input: vpaths, vpath (screen coordinates)
      * Output:
-     *  - fpaths, fpath (page coordinates)
+     *  - points, stroke_lengths (page coordinates)
      *  - rect -- bounding box. {min,max}_{x,y}
      *  - vpaths, vpath are free()-d
      * */
     {
         for (i=0; i<vpaths->len; i++) {
             GArray *vpath = g_array_index(vpaths, GArray*, i);
+            guint first = points->len;
+            guint n_points;
+
             if (vpath->len <= 2) {
+                g_array_free(vpath, TRUE);
                 continue;
             }
 
-            GArray *fpath = g_array_new(0, 0, sizeof(gdouble));
-
             for (j=0; j<vpath->len; j += 2) {
                 int x,y;
                 x = g_array_index(vpath, int, j);
                 y = g_array_index(vpath, int, j + 1);
 
                 // convert to doc coords
-                gdouble fx, fy;
+                EvPoint point;
                 gint dx, dy;
                 int doc_page;
 
                 get_doc_point_from_location(view, x, y, &doc_page, &dx, &dy);
-                fx = dx + 0.5;
-                fy = dy + 0.5;
-                min_x = MIN(min_x, fx);
-                min_y = MIN(min_y, fy);
-                max_x = MAX(max_x, fx);
-                max_y = MAX(max_y, fy);
-
-                g_array_append_val(fpath, fx);
-                g_array_append_val(fpath, fy);
+                point.x = dx + 0.5;
+                point.y = dy + 0.5;
+                min_x = MIN(min_x, point.x);
+                min_y = MIN(min_y, point.y);
+                max_x = MAX(max_x, point.x);
+                max_y = MAX(max_y, point.y);
+
+                g_array_append_val(points, point);
             }
+            n_points = ev_annotation_ink_simplify_path (&g_array_index (points, EvPoint, first),
+                                                        points->len - first,
+                                                        tolerance);
+            n_captured += points->len - first;
+            n_stored += n_points;
+            g_array_set_size (points, first + n_points);
+            g_array_append_val (stroke_lengths, n_points);
+
             g_array_free(vpath, TRUE);
-            g_array_append_val(fpaths, fpath);
         }
         g_array_free(vpaths, TRUE);
 
-        if (fpaths->len > 0) {
+        ev_debug_message (DEBUG_INK, "simplified %u points to %u (%.1f%%)",
+                          n_captured, n_stored,
+                          n_captured ? 100.0 * n_stored / n_captured : 100.0);
+
+        if (stroke_lengths->len > 0) {
             EvAnnotationInk *ink = EV_ANNOTATION_INK(ev_annotation_ink_new(page));
             ev_annotation_set_color (EV_ANNOTATION(ink), &view->drawing_data.ink.color);
             ev_annotation_ink_set_width (ink, view->drawing_data.ink.width);
-            ev_annotation_ink_set_paths(ink, fpaths);
+            ev_annotation_ink_set_points (ink,
+                                          (const EvPoint *) points->data, points->len,
+                                          (const guint *) stroke_lengths->data, stroke_lengths->len);
             ev_annotation_ink_set_operator(ink, view->drawing_data.ink.ink_operator);
 
             *r_ink = ink;
@@ -3298,19 +3317,10 @@ create_ink_annotation (EvView           *view,
         else {
             *r_ink = 0;
         }
-        // adjust bounding box to have 
     }
 
-    // Cleanup
-    // Input:   fpaths
-    // Output:  unref()-ed fpaths
-    {
-        for (i=0; i<fpaths->len; i++) {
-            GArray *fpath = g_array_index(fpaths, GArray*, i);
-            g_array_unref(fpath);
-        }
-        g_array_unref(fpaths);
-    }
+    g_array_free (points, TRUE);
+    g_array_free (stroke_lengths, TRUE);
 }
 
 
@@ -3338,7 +3348,7 @@ ev_view_create_annotation (EvView          *view,
 	doc_rect.x2 = doc_rect.x1 + 24;
 	doc_rect.y2 = doc_rect.y1 + 24;
 
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (view->document);
 	page = ev_document_get_page (view->document, view->current_page);
 	switch (annot_type) {
 	case EV_ANNOTATION_TYPE_TEXT:
@@ -3348,7 +3358,7 @@ ev_view_create_annotation (EvView          *view,
 	case EV_ANNOTATION_TYPE_ATTACHMENT:
 		/* TODO */
 		g_object_unref (page);
-		ev_document_doc_mutex_unlock ();
+		ev_document_unlock (view->document);
 		return;
     case EV_ANNOTATION_TYPE_INK: {
             EvAnnotationInk *ink;
@@ -3401,11 +3411,16 @@ ev_view_create_annotation (EvView          *view,
 
 	ev_document_annotations_add_annotation (EV_DOCUMENT_ANNOTATIONS (view->document),
 						annot, &doc_rect);
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (view->document);
+
+	ev_annotation_history_add_annot (view->annot_history, annot, &doc_rect);
+	ev_view_annotation_history_changed (view);
 
 	/* If the page didn't have annots, mark the cache as dirty */
 	if (!ev_page_cache_get_annot_mapping (view->page_cache, view->current_page))
 		ev_page_cache_mark_dirty (view->page_cache, view->current_page, EV_PAGE_DATA_INCLUDE_ANNOTS);
+	else
+		ev_page_cache_mappings_changed (view->page_cache, view->current_page);
 
     /* Show annotation window if there are markup, but not if 
      * they are drawing objects */
@@ -3424,7 +3439,20 @@ ev_view_create_annotation (EvView          *view,
 	view_rect.x -= view->scroll_x;
 	view_rect.y -= view->scroll_y;
 	region = cairo_region_create_rectangle (&view_rect);
-	ev_view_reload_page (view, view->current_page, region);
+	if (EV_IS_ANNOTATION_INK (annot)) {
+		/* Draw the new ink right away and let the page catch up
+		 * in the background */
+		ink_overlay_add (view, annot);
+		gdk_window_invalidate_region (gtk_widget_get_window (GTK_WIDGET (view)), region, TRUE);
+		ev_pixbuf_cache_reload_page (view->pixbuf_cache,
+					     region,
+					     view->current_page,
+					     view->rotation,
+					     view->scale,
+					     EV_JOB_PRIORITY_LOW);
+	} else {
+		ev_view_reload_page (view, view->current_page, region);
+	}
 	cairo_region_destroy (region);
 
 	g_signal_emit (view, signals[SIGNAL_ANNOT_ADDED], 0, annot);
@@ -3450,7 +3478,7 @@ ev_view_begin_add_ink_annotation (EvView          *view,
 {
     EvAnnotationType annot_type = EV_ANNOTATION_TYPE_INK;
 
-	if (view->adding_annot)
+	if (view->adding_annot || view->erasing_ink)
 		return;
 
 	view->adding_annot = TRUE;
@@ -3484,7 +3512,7 @@ ev_view_begin_add_annotation (EvView          *view,
 	if (annot_type == EV_ANNOTATION_TYPE_UNKNOWN)
 		return;
 
-	if (view->adding_annot)
+	if (view->adding_annot || view->erasing_ink)
 		return;
 
 	view->adding_annot = TRUE;
@@ -3525,6 +3553,7 @@ ev_view_cancel_add_annotation (EvView *view)
             gtk_widget_get_window (GTK_WIDGET(view)), TRUE );
             // Here, we actually *add* the ink annotation...
         ev_view_create_annotation(view, EV_ANNOTATION_TYPE_INK, 0, 0);
+        ink_layer_invalidate (view);
         break;
     default:
         break;
@@ -3536,23 +3565,113 @@ ev_view_cancel_add_annotation (EvView *view)
 	ev_view_handle_cursor_over_xy (view, x, y);
 }
 
+/**
+ * ev_view_begin_erase_ink:
+ * @view: an #EvView
+ * @radius: the radius of the eraser, in device pixels
+ *
+ * Starts the ink eraser: dragging with the first button removes the
+ * parts of the ink annotations it passes over, until
+ * ev_view_cancel_erase_ink() is called.
+ */
 void
-ev_view_remove_annotation (EvView       *view,
-                           EvAnnotation *annot)
+ev_view_begin_erase_ink (EvView  *view,
+                         gdouble  radius)
 {
-        guint page;
+	g_return_if_fail (EV_IS_VIEW (view));
 
-        g_return_if_fail (EV_IS_VIEW (view));
-        g_return_if_fail (EV_IS_ANNOTATION (annot));
+	if (view->adding_annot || view->erasing_ink)
+		return;
 
-	g_object_ref (annot);
+	view->erasing_ink = TRUE;
+	view->eraser_radius = MAX (radius, 1);
 
-        page = ev_annotation_get_page_index (annot);
+	gdk_window_set_event_compression (gtk_widget_get_window (GTK_WIDGET (view)), FALSE);
+	ev_view_set_cursor (view, EV_VIEW_CURSOR_ADD);
+}
+
+void
+ev_view_cancel_erase_ink (EvView *view)
+{
+	gint x, y;
+
+	g_return_if_fail (EV_IS_VIEW (view));
+
+	if (!view->erasing_ink)
+		return;
+
+	ink_eraser_flush (view, ERASER_FLUSH_FULL);
+	ev_view_end_erase_action (view);
+	view->erasing_ink = FALSE;
 
+	gdk_window_set_event_compression (gtk_widget_get_window (GTK_WIDGET (view)), TRUE);
+	ev_document_misc_get_pointer_position (GTK_WIDGET (view), &x, &y);
+	ev_view_handle_cursor_over_xy (view, x, y);
+}
+
+static void
+ev_view_annotation_history_changed (EvView *view)
+{
+	g_object_notify (G_OBJECT (view), "can-undo");
+	g_object_notify (G_OBJECT (view), "can-redo");
+}
+
+static void
+ev_view_clear_annotation_history (EvView *view)
+{
+	ev_annotation_history_clear (view->annot_history);
+	view->erase_in_action = FALSE;
+	g_clear_object (&view->changing_annot);
+	g_clear_pointer (&view->changing_annot_state, ev_annotation_state_free);
+
+	ev_view_annotation_history_changed (view);
+}
+
+/* The area of @annot on its page, as known to the page cache */
+static gboolean
+ev_view_get_annotation_area (EvView       *view,
+			     EvAnnotation *annot,
+			     EvRectangle  *area)
+{
+	EvMappingList *annots;
+	EvMapping     *mapping;
+
+	annots = ev_page_cache_get_annot_mapping (view->page_cache,
+						  ev_annotation_get_page_index (annot));
+	mapping = annots ? ev_mapping_list_find (annots, annot) : NULL;
+	if (!mapping)
+		return FALSE;
+
+	*area = mapping->area;
+
+	return TRUE;
+}
+
+/* Only the annotations the document can add back are undoable */
+static void
+ev_view_record_annotation_removal (EvView       *view,
+				   EvAnnotation *annot)
+{
+	EvRectangle area;
+
+	if (!EV_IS_ANNOTATION_TEXT (annot) && !EV_IS_ANNOTATION_INK (annot))
+		return;
+
+	if (ev_view_get_annotation_area (view, annot, &area))
+		ev_annotation_history_remove_annot (view->annot_history, annot, &area);
+}
+
+/* Drops what the view shows of @annot besides the page itself */
+static void
+ev_view_detach_annotation (EvView       *view,
+                           EvAnnotation *annot)
+{
         if (EV_IS_ANNOTATION_MARKUP (annot)) {
             EvViewWindowChild *child;
 
-            child = ev_view_find_window_child_for_annot (view, page, annot);
+            child = ev_view_find_window_child_for_annot (view,
+                                                         ev_annotation_get_page_index (annot),
+                                                         annot);
             if (child) {
                 view->window_children = g_list_remove (view->window_children, child);
                 gtk_widget_destroy (child->window);
@@ -3560,11 +3679,28 @@ ev_view_remove_annotation (EvView       *view,
             }
         }
         _ev_view_set_focused_element (view, NULL, -1);
+        ink_overlay_remove (view, annot);
+}
+
+void
+ev_view_remove_annotation (EvView       *view,
+                           EvAnnotation *annot)
+{
+        guint page;
+
+        g_return_if_fail (EV_IS_VIEW (view));
+        g_return_if_fail (EV_IS_ANNOTATION (annot));
+
+	g_object_ref (annot);
 
-        ev_document_doc_mutex_lock ();
+        page = ev_annotation_get_page_index (annot);
+        ev_view_record_annotation_removal (view, annot);
+        ev_view_detach_annotation (view, annot);
+
+        ev_document_lock (view->document);
         ev_document_annotations_remove_annotation (EV_DOCUMENT_ANNOTATIONS (view->document),
                                                    annot);
-        ev_document_doc_mutex_unlock ();
+        ev_document_unlock (view->document);
 
         ev_page_cache_mark_dirty (view->page_cache, page, EV_PAGE_DATA_INCLUDE_ANNOTS);
 
@@ -3573,6 +3709,346 @@ ev_view_remove_annotation (EvView       *view,
 
 	g_signal_emit (view, signals[SIGNAL_ANNOT_REMOVED], 0, annot);
 	g_object_unref (annot);
+
+	ev_view_annotation_history_changed (view);
+}
+
+/**
+ * ev_view_begin_annotation_change:
+ * @view: #EvView instance
+ * @annot: the #EvAnnotation about to be edited
+ *
+ * Remembers the properties of @annot before they are changed with the
+ * #EvAnnotation setters, so that ev_view_end_annotation_change() can
+ * add the change to the undo history.
+ */
+void
+ev_view_begin_annotation_change (EvView       *view,
+				 EvAnnotation *annot)
+{
+	g_return_if_fail (EV_IS_VIEW (view));
+	g_return_if_fail (EV_IS_ANNOTATION (annot));
+
+	g_clear_object (&view->changing_annot);
+	g_clear_pointer (&view->changing_annot_state, ev_annotation_state_free);
+
+	view->changing_annot = g_object_ref (annot);
+	view->changing_annot_state = ev_annotation_state_new (annot);
+}
+
+/**
+ * ev_view_end_annotation_change:
+ * @view: #EvView instance
+ * @annot: the #EvAnnotation passed to ev_view_begin_annotation_change()
+ * @mask: the properties of @annot that changed since then
+ *
+ * Saves the properties of @annot in @mask to the document, redraws
+ * the annotation and makes the change undoable.
+ */
+void
+ev_view_end_annotation_change (EvView               *view,
+			       EvAnnotation         *annot,
+			       EvAnnotationsSaveMask mask)
+{
+	EvRectangle     area;
+	GdkRectangle    view_rect;
+	cairo_region_t *region;
+	gint            page;
+
+	g_return_if_fail (EV_IS_VIEW (view));
+	g_return_if_fail (view->changing_annot == annot);
+
+	if (mask == EV_ANNOTATIONS_SAVE_NONE) {
+		g_clear_object (&view->changing_annot);
+		g_clear_pointer (&view->changing_annot_state, ev_annotation_state_free);
+		return;
+	}
+
+	ev_document_lock (view->document);
+	ev_document_annotations_save_annotation (EV_DOCUMENT_ANNOTATIONS (view->document),
+						 annot, mask);
+	ev_document_unlock (view->document);
+
+	page = ev_annotation_get_page_index (annot);
+	if (ev_view_get_annotation_area (view, annot, &area)) {
+		ev_annotation_history_change_properties (view->annot_history, annot, &area, mask,
+							 view->changing_annot_state,
+							 ev_annotation_state_new (annot));
+		view->changing_annot_state = NULL;
+
+		_ev_view_transform_doc_rect_to_view_rect (view, page, &area, &view_rect);
+		view_rect.x -= view->scroll_x;
+		view_rect.y -= view->scroll_y;
+		region = cairo_region_create_rectangle (&view_rect);
+		ev_view_reload_page (view, page, region);
+		cairo_region_destroy (region);
+	} else {
+		ev_view_reload_page (view, page, NULL);
+	}
+
+	g_clear_object (&view->changing_annot);
+	g_clear_pointer (&view->changing_annot_state, ev_annotation_state_free);
+
+	g_signal_emit (view, signals[SIGNAL_ANNOT_CHANGED], 0, annot);
+	ev_view_annotation_history_changed (view);
+}
+
+/* How an undo or redo left an annotation */
+enum {
+	ANNOT_WAS_PRESENT = 1 << 0,
+	ANNOT_IS_PRESENT  = 1 << 1,
+	ANNOT_INK_CHANGED = 1 << 2
+};
+
+typedef struct {
+	cairo_region_t *region;
+	gboolean        annots_changed;
+} EvViewHistoryPage;
+
+static void
+ev_view_history_page_free (EvViewHistoryPage *hpage)
+{
+	cairo_region_destroy (hpage->region);
+	g_free (hpage);
+}
+
+/* Applies the deltas of @action, or reverts them when @undo is %TRUE,
+ * in a single document transaction, then renders again only the areas
+ * the deltas changed */
+static void
+ev_view_apply_annotation_action (EvView    *view,
+				 GPtrArray *action,
+				 gboolean   undo)
+{
+	EvDocumentAnnotations *doc_annots = EV_DOCUMENT_ANNOTATIONS (view->document);
+	GHashTable            *pages;
+	GHashTable            *annots;
+	GHashTableIter         iter;
+	gpointer               key, value;
+	guint                  i;
+
+	/* Page index to EvViewHistoryPage */
+	pages = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+				       (GDestroyNotify)ev_view_history_page_free);
+	/* Annotation to its ANNOT_* flags */
+	annots = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+
+	ev_document_lock (view->document);
+	ev_document_annotations_begin_transaction (doc_annots);
+
+	for (i = 0; i < action->len; i++) {
+		EvAnnotationDelta    *delta;
+		EvAnnotationDeltaType type;
+		EvViewHistoryPage    *hpage;
+		GdkRectangle          view_rect;
+		guint                 flags;
+		gint                  page;
+
+		delta = g_ptr_array_index (action, undo ? action->len - 1 - i : i);
+		type = delta->type;
+		if (undo) {
+			switch (type) {
+			case EV_ANNOTATION_DELTA_ADD:
+				type = EV_ANNOTATION_DELTA_REMOVE;
+				break;
+			case EV_ANNOTATION_DELTA_REMOVE:
+				type = EV_ANNOTATION_DELTA_ADD;
+				break;
+			case EV_ANNOTATION_DELTA_STROKE_ADD:
+				type = EV_ANNOTATION_DELTA_STROKE_REMOVE;
+				break;
+			case EV_ANNOTATION_DELTA_STROKE_REMOVE:
+				type = EV_ANNOTATION_DELTA_STROKE_ADD;
+				break;
+			case EV_ANNOTATION_DELTA_PROPERTIES:
+				break;
+			}
+		}
+
+		if (g_hash_table_lookup_extended (annots, delta->annot, NULL, &value))
+			flags = GPOINTER_TO_UINT (value);
+		else if (type == EV_ANNOTATION_DELTA_ADD)
+			flags = 0;
+		else
+			flags = ANNOT_WAS_PRESENT | ANNOT_IS_PRESENT;
+
+		page = ev_annotation_get_page_index (delta->annot);
+		hpage = g_hash_table_lookup (pages, GINT_TO_POINTER (page));
+		if (!hpage) {
+			hpage = g_new0 (EvViewHistoryPage, 1);
+			hpage->region = cairo_region_create ();
+			g_hash_table_insert (pages, GINT_TO_POINTER (page), hpage);
+		}
+
+		switch (type) {
+		case EV_ANNOTATION_DELTA_ADD:
+			ev_document_annotations_add_annotation (doc_annots, delta->annot, &delta->area);
+			flags |= ANNOT_IS_PRESENT;
+			hpage->annots_changed = TRUE;
+			break;
+		case EV_ANNOTATION_DELTA_REMOVE:
+			ev_view_detach_annotation (view, delta->annot);
+			ev_document_annotations_remove_annotation (doc_annots, delta->annot);
+			flags &= ~ANNOT_IS_PRESENT;
+			hpage->annots_changed = TRUE;
+			break;
+		case EV_ANNOTATION_DELTA_STROKE_ADD: {
+			const EvPoint *points;
+			gsize          size;
+
+			points = g_bytes_get_data (delta->points, &size);
+			ev_annotation_ink_insert_path (EV_ANNOTATION_INK (delta->annot), delta->stroke_id,
+						       points, size / sizeof (EvPoint));
+			flags |= ANNOT_INK_CHANGED;
+			break;
+		}
+		case EV_ANNOTATION_DELTA_STROKE_REMOVE: {
+			gint stroke;
+
+			stroke = ev_annotation_ink_get_stroke_index (EV_ANNOTATION_INK (delta->annot),
+								     delta->stroke_id);
+			if (stroke >= 0)
+				ev_annotation_ink_remove_path (EV_ANNOTATION_INK (delta->annot), stroke);
+			flags |= ANNOT_INK_CHANGED;
+			break;
+		}
+		case EV_ANNOTATION_DELTA_PROPERTIES: {
+			EvAnnotationsSaveMask changed;
+
+			changed = ev_annotation_state_apply (undo ? delta->old_state : delta->new_state,
+							     delta->annot, delta->mask);
+			if (changed != EV_ANNOTATIONS_SAVE_NONE)
+				ev_document_annotations_save_annotation (doc_annots, delta->annot, changed);
+			break;
+		}
+		}
+
+		g_hash_table_insert (annots, g_object_ref (delta->annot), GUINT_TO_POINTER (flags));
+
+		_ev_view_transform_doc_rect_to_view_rect (view, page, &delta->area, &view_rect);
+		view_rect.x -= view->scroll_x;
+		view_rect.y -= view->scroll_y;
+		cairo_region_union_rectangle (hpage->region, &view_rect);
+	}
+
+	/* Write the strokes of each ink annotation once, whatever the
+	 * number of strokes the action changed in it */
+	g_hash_table_iter_init (&iter, annots);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		guint flags = GPOINTER_TO_UINT (value);
+
+		if ((flags & ANNOT_INK_CHANGED) && (flags & ANNOT_IS_PRESENT))
+			ev_document_annotations_save_annotation (doc_annots, EV_ANNOTATION (key),
+								 EV_ANNOTATIONS_SAVE_INK_PATHS);
+	}
+
+	ev_document_annotations_commit_transaction (doc_annots);
+	ev_document_unlock (view->document);
+
+	g_hash_table_iter_init (&iter, pages);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		EvViewHistoryPage *hpage = value;
+
+		if (hpage->annots_changed)
+			ev_page_cache_mark_dirty (view->page_cache, GPOINTER_TO_INT (key),
+						  EV_PAGE_DATA_INCLUDE_ANNOTS);
+		ev_view_reload_page (view, GPOINTER_TO_INT (key), hpage->region);
+	}
+	g_hash_table_destroy (pages);
+
+	g_hash_table_iter_init (&iter, annots);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		guint flags = GPOINTER_TO_UINT (value);
+
+		if (flags & ANNOT_INK_CHANGED)
+			ink_overlay_reset_path (view, EV_ANNOTATION (key));
+
+		if (!(flags & ANNOT_WAS_PRESENT) && (flags & ANNOT_IS_PRESENT))
+			g_signal_emit (view, signals[SIGNAL_ANNOT_ADDED], 0, key);
+		else if ((flags & ANNOT_WAS_PRESENT) && !(flags & ANNOT_IS_PRESENT))
+			g_signal_emit (view, signals[SIGNAL_ANNOT_REMOVED], 0, key);
+		else if (flags & ANNOT_IS_PRESENT)
+			g_signal_emit (view, signals[SIGNAL_ANNOT_CHANGED], 0, key);
+	}
+	g_hash_table_destroy (annots);
+}
+
+/**
+ * ev_view_can_undo:
+ * @view: #EvView instance
+ *
+ * Returns: whether there is an annotation edit to undo
+ */
+gboolean
+ev_view_can_undo (EvView *view)
+{
+	g_return_val_if_fail (EV_IS_VIEW (view), FALSE);
+
+	return ev_annotation_history_can_undo (view->annot_history);
+}
+
+/**
+ * ev_view_can_redo:
+ * @view: #EvView instance
+ *
+ * Returns: whether there is an undone annotation edit to redo
+ */
+gboolean
+ev_view_can_redo (EvView *view)
+{
+	g_return_val_if_fail (EV_IS_VIEW (view), FALSE);
+
+	return ev_annotation_history_can_redo (view->annot_history);
+}
+
+/**
+ * ev_view_undo:
+ * @view: #EvView instance
+ *
+ * Reverts the last annotation edit: an annotation added or removed,
+ * an eraser drag or a change of annotation properties.
+ */
+void
+ev_view_undo (EvView *view)
+{
+	GPtrArray *action;
+
+	g_return_if_fail (EV_IS_VIEW (view));
+
+	/* Not in the middle of an eraser drag */
+	if (!view->document || view->erase_in_action)
+		return;
+
+	action = ev_annotation_history_undo (view->annot_history);
+	if (!action)
+		return;
+
+	ev_view_apply_annotation_action (view, action, TRUE);
+	ev_view_annotation_history_changed (view);
+}
+
+/**
+ * ev_view_redo:
+ * @view: #EvView instance
+ *
+ * Applies again the last annotation edit reverted by ev_view_undo().
+ */
+void
+ev_view_redo (EvView *view)
+{
+	GPtrArray *action;
+
+	g_return_if_fail (EV_IS_VIEW (view));
+
+	if (!view->document || view->erase_in_action)
+		return;
+
+	action = ev_annotation_history_redo (view->annot_history);
+	if (!action)
+		return;
+
+	ev_view_apply_annotation_action (view, action, FALSE);
+	ev_view_annotation_history_changed (view);
 }
 
 static gboolean
@@ -4302,206 +4778,841 @@ ev_view_scroll_event (GtkWidget *widget, GdkEventScroll *event)
 		return TRUE;
 	}
 
-	return FALSE;
+	return FALSE;
+}
+
+static EvViewSelection *
+find_selection_for_page (EvView *view,
+			 gint    page)
+{
+	GList *list;
+
+	for (list = view->selection_info.selections; list != NULL; list = list->next) {
+		EvViewSelection *selection;
+
+		selection = (EvViewSelection *) list->data;
+
+		if (selection->page == page)
+			return selection;
+	}
+
+	return NULL;
+}
+
+static void
+ev_view_realize (GtkWidget *widget)
+{
+	GtkAllocation allocation;
+	GdkWindow *window;
+	GdkWindowAttr attributes;
+	gint attributes_mask;
+
+	gtk_widget_set_realized (widget, TRUE);
+
+	gtk_widget_get_allocation (widget, &allocation);
+
+	attributes.window_type = GDK_WINDOW_CHILD;
+	attributes.x = allocation.x;
+	attributes.y = allocation.y;
+	attributes.width = allocation.width;
+	attributes.height = allocation.height;
+	attributes.wclass = GDK_INPUT_OUTPUT;
+	attributes.visual = gtk_widget_get_visual (widget);
+	attributes.event_mask = gtk_widget_get_events (widget);
+
+	attributes_mask = GDK_WA_X | GDK_WA_Y | GDK_WA_VISUAL;
+
+	window = gdk_window_new (gtk_widget_get_parent_window (widget),
+				 &attributes, attributes_mask);
+	gtk_widget_set_window (widget, window);
+	gdk_window_set_user_data (window, widget);
+
+	gtk_style_context_set_background (gtk_widget_get_style_context (widget),
+					  window);
+}
+
+static void
+get_cursor_color (GtkStyleContext *context,
+		  GdkRGBA         *color)
+{
+	GdkColor *style_color;
+
+	gtk_style_context_get_style (context,
+				     "cursor-color",
+				     &style_color,
+				     NULL);
+
+	if (style_color) {
+		color->red = style_color->red / 65535.0;
+		color->green = style_color->green / 65535.0;
+		color->blue = style_color->blue / 65535.0;
+		color->alpha = 1;
+
+		gdk_color_free (style_color);
+	} else {
+		gtk_style_context_get_color (context, GTK_STATE_FLAG_NORMAL, color);
+	}
+}
+
+/* This is based on the deprecated function gtk_draw_insertion_cursor. */
+static void
+draw_caret_cursor (EvView  *view,
+		   cairo_t *cr)
+{
+	GdkRectangle view_rect;
+	GdkRGBA      cursor_color;
+
+	if (!get_caret_cursor_area (view, view->cursor_page, view->cursor_offset, &view_rect))
+		return;
+
+	get_cursor_color (gtk_widget_get_style_context (GTK_WIDGET (view)), &cursor_color);
+
+	cairo_save (cr);
+	gdk_cairo_set_source_rgba (cr, &cursor_color);
+	cairo_rectangle (cr, view_rect.x, view_rect.y, view_rect.width, view_rect.height);
+	cairo_fill (cr);
+	cairo_restore (cr);
+}
+
+static gboolean
+should_draw_caret_cursor (EvView  *view,
+			  gint     page)
+{
+	return (view->caret_enabled &&
+		view->cursor_page == page &&
+		view->cursor_visible &&
+		gtk_widget_has_focus (GTK_WIDGET (view)) &&
+		!ev_pixbuf_cache_get_selection_region (view->pixbuf_cache, page, view->scale));
+}
+
+static void
+redraw_ink_annot(EvView *view)
+{
+    GArray *paths = view->drawing_data.ink.paths;
+    GArray *path = g_array_index(paths, GArray*, paths->len - 1);
+
+    if (path->len >= 4) {
+        int stroke_width = (int)(ceil(view->drawing_data.ink.width * view->scale)); 
+        stroke_width = MAX(stroke_width * 2, 2);
+    
+        int x1, x2, y1, y2;
+        int x, y, width, height;
+        x1 = g_array_index(path, int, path->len - 4);
+        y1 = g_array_index(path, int, path->len - 3);
+        x2 = g_array_index(path, int, path->len - 2);
+        y2 = g_array_index(path, int, path->len - 1);
+        x = MIN(x1, x2) - stroke_width;
+        y = MIN(y1, y2) - stroke_width;
+        width = abs(x1 - x2) + 2 * stroke_width;
+        height = abs(y1 - y2) + 2 * stroke_width;
+        gtk_widget_queue_draw_area(GTK_WIDGET(view), x, y, width, height);
+    }
+}
+
+static gboolean
+drawing_ink_annot(EvView *view,
+                    GdkEventMotion *event)
+{
+    int x, y;
+    GdkModifierType state;
+
+    if (event->is_hint) {
+        gdk_window_get_device_position(event->window, event->device, &x, &y, &state);	    
+    } else {
+	    x = event->x;
+	    y = event->y;
+	}
+
+    GArray *paths = view->drawing_data.ink.paths;
+    GArray *path = g_array_index(paths, GArray*, paths->len - 1);
+
+    g_array_append_val(path, x);
+    g_array_append_val(path, y);
+
+    redraw_ink_annot(view);
+    return FALSE;
+}
+
+static void
+ink_layer_invalidate (EvView *view)
+{
+    if (view->drawing_data.ink.surface) {
+        cairo_surface_destroy (view->drawing_data.ink.surface);
+        view->drawing_data.ink.surface = NULL;
+    }
+    view->drawing_data.ink.n_committed_paths = 0;
+    view->drawing_data.ink.n_committed_points = 0;
+}
+
+/* The retained layer is rasterized in widget coordinates, so it
+ * has to be redone whenever the zoom, the rotation, the scroll
+ * position or the widget size changes */
+static gboolean
+ink_layer_is_valid (EvView *view,
+                    gint    width,
+                    gint    height)
+{
+    if (!view->drawing_data.ink.surface)
+        return FALSE;
+
+    return view->drawing_data.ink.surface_scale == view->scale &&
+        view->drawing_data.ink.surface_rotation == view->rotation &&
+        view->drawing_data.ink.surface_scroll_x == view->scroll_x &&
+        view->drawing_data.ink.surface_scroll_y == view->scroll_y &&
+        view->drawing_data.ink.surface_width == width &&
+        view->drawing_data.ink.surface_height == height;
+}
+
+/* Add the segments of @path starting at point @first to the
+ * current cairo path. The segment ending at @first is included so
+ * that consecutive updates join up. */
+static void
+ink_layer_append_path (cairo_t *cr,
+                       GArray  *path,
+                       guint    first)
+{
+    guint n_points = path->len / 2;
+    guint j;
+
+    if (first >= n_points)
+        return;
+
+    j = first > 0 ? first - 1 : 0;
+    cairo_move_to (cr,
+                   g_array_index (path, int, 2 * j),
+                   g_array_index (path, int, 2 * j + 1));
+    for (; j < n_points; j++) {
+        cairo_line_to (cr,
+                       g_array_index (path, int, 2 * j),
+                       g_array_index (path, int, 2 * j + 1));
+    }
+}
+
+/* Rasterize everything that has not been committed to the retained
+ * layer yet. Only the newest segments of the live stroke are
+ * normally left, so an update costs O(new points). */
+static void
+ink_layer_update (EvView *view)
+{
+    GtkWidget *widget = GTK_WIDGET (view);
+    GArray    *paths = view->drawing_data.ink.paths;
+    GdkColor   color = view->drawing_data.ink.color;
+    gint       width, height;
+    cairo_t   *cr;
+    guint      i;
+
+    width = gtk_widget_get_allocated_width (widget);
+    height = gtk_widget_get_allocated_height (widget);
+
+    if (!ink_layer_is_valid (view, width, height)) {
+        ink_layer_invalidate (view);
+
+        view->drawing_data.ink.surface =
+            gdk_window_create_similar_surface (gtk_widget_get_window (widget),
+                                               CAIRO_CONTENT_COLOR_ALPHA,
+                                               width, height);
+        view->drawing_data.ink.surface_scale = view->scale;
+        view->drawing_data.ink.surface_rotation = view->rotation;
+        view->drawing_data.ink.surface_scroll_x = view->scroll_x;
+        view->drawing_data.ink.surface_scroll_y = view->scroll_y;
+        view->drawing_data.ink.surface_width = width;
+        view->drawing_data.ink.surface_height = height;
+    }
+
+    if (paths->len == 0)
+        return;
+
+    cr = cairo_create (view->drawing_data.ink.surface);
+
+    /* Strokes are accumulated with OVER in the layer; the ink
+     * operator is applied once when the layer is composited.
+     * Round caps and joins make the piecewise strokes seamless. */
+    cairo_set_source_rgba (cr, color.red / 65535.0, color.green / 65535.0, color.blue / 65535.0, 1.0);
+    cairo_set_line_width (cr, view->drawing_data.ink.width * view->scale);
+    cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+
+    for (i = view->drawing_data.ink.n_committed_paths; i < paths->len; i++) {
+        GArray *path = g_array_index (paths, GArray*, i);
+
+        ink_layer_append_path (cr, path,
+                               i == view->drawing_data.ink.n_committed_paths ?
+                               view->drawing_data.ink.n_committed_points : 0);
+    }
+    cairo_stroke (cr);
+    cairo_destroy (cr);
+
+    /* The last path is still being drawn */
+    view->drawing_data.ink.n_committed_paths = paths->len - 1;
+    view->drawing_data.ink.n_committed_points =
+        g_array_index (paths, GArray*, paths->len - 1)->len / 2;
+}
+
+static void
+draw_partially_drawn_ink (EvView  *view,
+                          cairo_t *cr)
+{
+    ink_layer_update (view);
+
+    cairo_save (cr);
+    switch (view->drawing_data.ink.ink_operator) {
+        case EV_ANNOTATION_INK_OPERATOR_MULTIPLY:
+            cairo_set_operator (cr, CAIRO_OPERATOR_MULTIPLY);
+            break;
+        default:
+            cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+    }
+    // TODO: set dash, operator (non-compatible with PDF standard), variable width
+    cairo_set_source_surface (cr, view->drawing_data.ink.surface, 0, 0);
+    cairo_paint (cr);
+    cairo_restore (cr);
+}
+
+static void
+ink_overlay_free (EvViewInkOverlay *overlay)
+{
+    if (overlay->path)
+        cairo_path_destroy (overlay->path);
+    g_object_unref (overlay->annot);
+    g_free (overlay);
+}
+
+static void
+ink_overlay_clear (EvView *view)
+{
+    g_list_free_full (view->ink_overlay, (GDestroyNotify) ink_overlay_free);
+    view->ink_overlay = NULL;
+}
+
+/* Show @annot as vectors until its page has been rendered again, so
+ * adding ink doesn't have to wait for an urgent page render */
+static void
+ink_overlay_add (EvView       *view,
+                 EvAnnotation *annot)
+{
+    EvViewInkOverlay *overlay;
+
+    overlay = g_new0 (EvViewInkOverlay, 1);
+    overlay->annot = g_object_ref (annot);
+    overlay->page = ev_annotation_get_page_index (annot);
+    view->ink_overlay = g_list_prepend (view->ink_overlay, overlay);
+}
+
+static void
+ink_overlay_remove (EvView       *view,
+                    EvAnnotation *annot)
+{
+    GList *l = view->ink_overlay;
+
+    while (l) {
+        GList            *next = l->next;
+        EvViewInkOverlay *overlay = l->data;
+
+        if (overlay->annot == annot) {
+            ink_overlay_free (overlay);
+            view->ink_overlay = g_list_delete_link (view->ink_overlay, l);
+        }
+        l = next;
+    }
+}
+
+/* The strokes of @annot changed, rebuild its path on the next draw */
+static void
+ink_overlay_reset_path (EvView       *view,
+                        EvAnnotation *annot)
+{
+    GList *l;
+
+    for (l = view->ink_overlay; l; l = l->next) {
+        EvViewInkOverlay *overlay = l->data;
+
+        if (overlay->annot == annot && overlay->path) {
+            cairo_path_destroy (overlay->path);
+            overlay->path = NULL;
+        }
+    }
+}
+
+/* An entry is needed until a render of its page queued after the
+ * annotation was added has finished. Queuing a render ends the older
+ * one, so once nothing is pending for the page, whatever surface the
+ * cache has for it already contains the annotation. */
+static void
+ink_overlay_prune (EvView *view)
+{
+    GList *l = view->ink_overlay;
+
+    while (l) {
+        GList            *next = l->next;
+        EvViewInkOverlay *overlay = l->data;
+
+        if (!ev_pixbuf_cache_is_page_pending (view->pixbuf_cache, overlay->page)) {
+            ink_overlay_free (overlay);
+            view->ink_overlay = g_list_delete_link (view->ink_overlay, l);
+        }
+        l = next;
+    }
+}
+
+static void
+ink_overlay_doc_point_to_page_point (EvView        *view,
+                                     gint           page,
+                                     const EvPoint *doc_point,
+                                     gdouble       *x,
+                                     gdouble       *y)
+{
+    gdouble width, height;
+
+    get_doc_page_size (view, page, &width, &height);
+
+    switch (view->rotation) {
+    case 0:
+        *x = doc_point->x;
+        *y = doc_point->y;
+        break;
+    case 90:
+        *x = width - doc_point->y;
+        *y = doc_point->x;
+        break;
+    case 180:
+        *x = width - doc_point->x;
+        *y = height - doc_point->y;
+        break;
+    case 270:
+        *x = doc_point->y;
+        *y = height - doc_point->x;
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+
+    *x *= view->scale;
+    *y *= view->scale;
 }
 
-static EvViewSelection *
-find_selection_for_page (EvView *view,
-			 gint    page)
+static cairo_path_t *
+ink_overlay_build_path (EvView           *view,
+                        EvViewInkOverlay *overlay)
 {
-	GList *list;
+    EvAnnotationInk *ink = EV_ANNOTATION_INK (overlay->annot);
+    cairo_surface_t *surface;
+    cairo_t         *cr;
+    cairo_path_t    *path;
+    guint            n_strokes, i, j;
 
-	for (list = view->selection_info.selections; list != NULL; list = list->next) {
-		EvViewSelection *selection;
+    /* Paths can only be copied out of a context */
+    surface = cairo_image_surface_create (CAIRO_FORMAT_A8, 1, 1);
+    cr = cairo_create (surface);
 
-		selection = (EvViewSelection *) list->data;
+    n_strokes = ev_annotation_ink_get_n_strokes (ink);
+    for (i = 0; i < n_strokes; i++) {
+        const EvPoint *points;
+        guint          n_points;
 
-		if (selection->page == page)
-			return selection;
-	}
+        points = ev_annotation_ink_get_stroke (ink, i, &n_points);
+        for (j = 0; j < n_points; j++) {
+            gdouble x, y;
 
-	return NULL;
+            ink_overlay_doc_point_to_page_point (view, overlay->page, &points[j], &x, &y);
+            if (j == 0)
+                cairo_move_to (cr, x, y);
+            else
+                cairo_line_to (cr, x, y);
+        }
+    }
+
+    path = cairo_copy_path (cr);
+    cairo_destroy (cr);
+    cairo_surface_destroy (surface);
+
+    return path;
 }
 
+/* Stroke the overlay entries of @page the way their appearance
+ * stream will be rendered, so nothing shifts when the page surface
+ * catches up */
 static void
-ev_view_realize (GtkWidget *widget)
+draw_ink_overlay (EvView       *view,
+                  cairo_t      *cr,
+                  gint          page,
+                  GdkRectangle *page_area)
 {
-	GtkAllocation allocation;
-	GdkWindow *window;
-	GdkWindowAttr attributes;
-	gint attributes_mask;
+    GList *l;
 
-	gtk_widget_set_realized (widget, TRUE);
+    for (l = view->ink_overlay; l; l = l->next) {
+        EvViewInkOverlay       *overlay = l->data;
+        EvAnnotationInk        *ink;
+        EvAnnotationInkOperator ink_operator;
+        GdkColor                color;
+        gdouble                 width;
 
-	gtk_widget_get_allocation (widget, &allocation);
+        if (overlay->page != page)
+            continue;
 
-	attributes.window_type = GDK_WINDOW_CHILD;
-	attributes.x = allocation.x;
-	attributes.y = allocation.y;
-	attributes.width = allocation.width;
-	attributes.height = allocation.height;
-	attributes.wclass = GDK_INPUT_OUTPUT;
-	attributes.visual = gtk_widget_get_visual (widget);
-	attributes.event_mask = gtk_widget_get_events (widget);
+        if (overlay->path &&
+            (overlay->scale != view->scale || overlay->rotation != view->rotation)) {
+            cairo_path_destroy (overlay->path);
+            overlay->path = NULL;
+        }
 
-	attributes_mask = GDK_WA_X | GDK_WA_Y | GDK_WA_VISUAL;
+        if (!overlay->path) {
+            overlay->path = ink_overlay_build_path (view, overlay);
+            overlay->scale = view->scale;
+            overlay->rotation = view->rotation;
+        }
 
-	window = gdk_window_new (gtk_widget_get_parent_window (widget),
-				 &attributes, attributes_mask);
-	gtk_widget_set_window (widget, window);
-	gdk_window_set_user_data (window, widget);
+        ink = EV_ANNOTATION_INK (overlay->annot);
+        ev_annotation_get_color (overlay->annot, &color);
+        ev_annotation_ink_get_width (ink, &width);
+        ev_annotation_ink_get_operator (ink, &ink_operator);
 
-	gtk_style_context_set_background (gtk_widget_get_style_context (widget),
-					  window);
+        cairo_save (cr);
+        cairo_rectangle (cr, page_area->x, page_area->y, page_area->width, page_area->height);
+        cairo_clip (cr);
+        cairo_translate (cr, page_area->x, page_area->y);
+
+        switch (ink_operator) {
+            case EV_ANNOTATION_INK_OPERATOR_MULTIPLY:
+                cairo_set_operator (cr, CAIRO_OPERATOR_MULTIPLY);
+                break;
+            case EV_ANNOTATION_INK_OPERATOR_DARKEN:
+                cairo_set_operator (cr, CAIRO_OPERATOR_DARKEN);
+                break;
+            case EV_ANNOTATION_INK_OPERATOR_LIGHTEN:
+                cairo_set_operator (cr, CAIRO_OPERATOR_LIGHTEN);
+                break;
+            default:
+                cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+        }
+        cairo_set_source_rgb (cr, color.red / 65535.0, color.green / 65535.0, color.blue / 65535.0);
+        cairo_set_line_width (cr, width * view->scale);
+        cairo_set_line_cap (cr, CAIRO_LINE_CAP_BUTT);
+        cairo_set_line_join (cr, CAIRO_LINE_JOIN_MITER);
+        cairo_set_miter_limit (cr, 10);
+
+        cairo_append_path (cr, overlay->path);
+        cairo_stroke (cr);
+        cairo_restore (cr);
+    }
 }
 
+/* Erased ink annotations are written back to the document at most
+ * every ERASER_FLUSH_INTERVAL ms, not on every motion event. During
+ * the drag only the erased areas are rendered again, the pages are
+ * rendered whole once it's over. */
 static void
-get_cursor_color (GtkStyleContext *context,
-		  GdkRGBA         *color)
+ink_eraser_flush (EvView     *view,
+                  EraserFlush mode)
 {
-	GdkColor *style_color;
+    GHashTableIter iter;
+    gpointer       key;
+    GHashTable    *pages;
+    GList         *removed = NULL;
+    GList         *changed = NULL;
+    GList         *l;
 
-	gtk_style_context_get_style (context,
-				     "cursor-color",
-				     &style_color,
-				     NULL);
+    if (view->erase_flush_id) {
+        g_source_remove (view->erase_flush_id);
+        view->erase_flush_id = 0;
+    }
 
-	if (style_color) {
-		color->red = style_color->red / 65535.0;
-		color->green = style_color->green / 65535.0;
-		color->blue = style_color->blue / 65535.0;
-		color->alpha = 1;
+    /* Pages touched, mapped to whether annotations were removed from them */
+    pages = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-		gdk_color_free (style_color);
-	} else {
-		gtk_style_context_get_color (context, GTK_STATE_FLAG_NORMAL, color);
-	}
-}
+    if (mode == ERASER_FLUSH_FULL && view->erased_pages) {
+        g_hash_table_iter_init (&iter, view->erased_pages);
+        while (g_hash_table_iter_next (&iter, &key, NULL))
+            g_hash_table_insert (pages, key, GINT_TO_POINTER (FALSE));
+        g_hash_table_remove_all (view->erased_pages);
+    }
 
-/* This is based on the deprecated function gtk_draw_insertion_cursor. */
-static void
-draw_caret_cursor (EvView  *view,
-		   cairo_t *cr)
-{
-	GdkRectangle view_rect;
-	GdkRGBA      cursor_color;
+    if (!view->erased_annots || g_hash_table_size (view->erased_annots) == 0)
+        goto reload;
+
+    ev_document_lock (view->document);
+    ev_document_annotations_begin_transaction (EV_DOCUMENT_ANNOTATIONS (view->document));
+
+    g_hash_table_iter_init (&iter, view->erased_annots);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        EvAnnotation *annot = EV_ANNOTATION (key);
+        gpointer      page = GINT_TO_POINTER (ev_annotation_get_page_index (annot));
+
+        if (mode != ERASER_FLUSH_SAVE &&
+            ev_annotation_ink_get_n_strokes (EV_ANNOTATION_INK (annot)) == 0) {
+            ev_view_record_annotation_removal (view, annot);
+            ev_view_detach_annotation (view, annot);
+            ev_document_annotations_remove_annotation (EV_DOCUMENT_ANNOTATIONS (view->document),
+                                                       annot);
+            removed = g_list_prepend (removed, g_object_ref (annot));
+            g_hash_table_insert (pages, page, GINT_TO_POINTER (TRUE));
+            continue;
+        }
 
-	if (!get_caret_cursor_area (view, view->cursor_page, view->cursor_offset, &view_rect))
-		return;
+        ev_document_annotations_save_annotation (EV_DOCUMENT_ANNOTATIONS (view->document),
+                                                 annot, EV_ANNOTATIONS_SAVE_INK_PATHS);
+        changed = g_list_prepend (changed, g_object_ref (annot));
+        if (!g_hash_table_contains (pages, page))
+            g_hash_table_insert (pages, page, GINT_TO_POINTER (FALSE));
+    }
 
-	get_cursor_color (gtk_widget_get_style_context (GTK_WIDGET (view)), &cursor_color);
+    ev_document_annotations_commit_transaction (EV_DOCUMENT_ANNOTATIONS (view->document));
+    ev_document_unlock (view->document);
 
-	cairo_save (cr);
-	gdk_cairo_set_source_rgba (cr, &cursor_color);
-	cairo_rectangle (cr, view_rect.x, view_rect.y, view_rect.width, view_rect.height);
-	cairo_fill (cr);
-	cairo_restore (cr);
-}
+    g_hash_table_remove_all (view->erased_annots);
 
-static gboolean
-should_draw_caret_cursor (EvView  *view,
-			  gint     page)
-{
-	return (view->caret_enabled &&
-		view->cursor_page == page &&
-		view->cursor_visible &&
-		gtk_widget_has_focus (GTK_WIDGET (view)) &&
-		!ev_pixbuf_cache_get_selection_region (view->pixbuf_cache, page, view->scale));
+ reload:
+    if (mode != ERASER_FLUSH_SAVE) {
+        gpointer has_removed;
+
+        g_hash_table_iter_init (&iter, pages);
+        while (g_hash_table_iter_next (&iter, &key, &has_removed)) {
+            gint         page = GPOINTER_TO_INT (key);
+            EvRectangle *area = NULL;
+
+            if (GPOINTER_TO_INT (has_removed))
+                ev_page_cache_mark_dirty (view->page_cache, page,
+                                          EV_PAGE_DATA_INCLUDE_ANNOTS);
+
+            if (view->erased_areas)
+                area = g_hash_table_lookup (view->erased_areas, key);
+
+            if (mode == ERASER_FLUSH_PARTIAL && area && !GPOINTER_TO_INT (has_removed)) {
+                GdkRectangle    view_rect;
+                cairo_region_t *region;
+
+                _ev_view_transform_doc_rect_to_view_rect (view, page, area, &view_rect);
+                view_rect.x -= view->scroll_x;
+                view_rect.y -= view->scroll_y;
+                region = cairo_region_create_rectangle (&view_rect);
+                ev_view_reload_page (view, page, region);
+                cairo_region_destroy (region);
+            } else {
+                ev_view_reload_page (view, page, NULL);
+            }
+        }
+    }
+    if (view->erased_areas)
+        g_hash_table_remove_all (view->erased_areas);
+    g_hash_table_destroy (pages);
+
+    /* Changes are announced once the drag is over rather than on every
+     * flush, as each announcement copies the whole annotation */
+    for (l = removed; l && view->erase_changed; l = g_list_next (l))
+        g_hash_table_remove (view->erase_changed, l->data);
+    if (mode == ERASER_FLUSH_PARTIAL) {
+        if (!view->erase_changed)
+            view->erase_changed = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                         g_object_unref, NULL);
+        for (l = changed; l; l = g_list_next (l)) {
+            if (!g_hash_table_contains (view->erase_changed, l->data))
+                g_hash_table_add (view->erase_changed, g_object_ref (l->data));
+        }
+        g_list_free_full (changed, g_object_unref);
+        changed = NULL;
+    } else if (view->erase_changed) {
+        g_hash_table_iter_init (&iter, view->erase_changed);
+        while (g_hash_table_iter_next (&iter, &key, NULL)) {
+            if (!g_list_find (changed, key))
+                changed = g_list_prepend (changed, g_object_ref (key));
+        }
+        g_hash_table_remove_all (view->erase_changed);
+    }
+
+    for (l = removed; l; l = g_list_next (l))
+        g_signal_emit (view, signals[SIGNAL_ANNOT_REMOVED], 0, l->data);
+    for (l = changed; l; l = g_list_next (l))
+        g_signal_emit (view, signals[SIGNAL_ANNOT_CHANGED], 0, l->data);
+    g_list_free_full (removed, g_object_unref);
+    g_list_free_full (changed, g_object_unref);
 }
 
 static void
-redraw_ink_annot(EvView *view)
+ev_view_end_erase_action (EvView *view)
 {
-    GArray *paths = view->drawing_data.ink.paths;
-    GArray *path = g_array_index(paths, GArray*, paths->len - 1);
+    if (!view->erase_in_action)
+        return;
 
-    if (path->len >= 4) {
-        int stroke_width = (int)(ceil(view->drawing_data.ink.width * view->scale)); 
-        stroke_width = MAX(stroke_width * 2, 2);
-    
-        int x1, x2, y1, y2;
-        int x, y, width, height;
-        x1 = g_array_index(path, int, path->len - 4);
-        y1 = g_array_index(path, int, path->len - 3);
-        x2 = g_array_index(path, int, path->len - 2);
-        y2 = g_array_index(path, int, path->len - 1);
-        x = MIN(x1, x2) - stroke_width;
-        y = MIN(y1, y2) - stroke_width;
-        width = abs(x1 - x2) + 2 * stroke_width;
-        height = abs(y1 - y2) + 2 * stroke_width;
-        gtk_widget_queue_draw_area(GTK_WIDGET(view), x, y, width, height);
-    }
+    view->erase_in_action = FALSE;
+    ev_annotation_history_end_action (view->annot_history);
+    ev_view_annotation_history_changed (view);
 }
 
 static gboolean
-drawing_ink_annot(EvView *view,
-                    GdkEventMotion *event)
+ink_eraser_flush_timeout (EvView *view)
 {
-    int x, y;
-    GdkModifierType state;
+    view->erase_flush_id = 0;
+    ink_eraser_flush (view, ERASER_FLUSH_PARTIAL);
 
-    if (event->is_hint) {
-        gdk_window_get_device_position(event->window, event->device, &x, &y, &state);	    
-    } else {
-	    x = event->x;
-	    y = event->y;
-	}
+    return G_SOURCE_REMOVE;
+}
 
-    GArray *paths = view->drawing_data.ink.paths;
-    GArray *path = g_array_index(paths, GArray*, paths->len - 1);
+typedef struct {
+    EvView      *view;
+    EvRectangle  eraser;   /* the square around the eraser */
+    EvRectangle  erased;   /* the segments near it */
+    gboolean     has_erased;
+} InkEraseData;
 
-    g_array_append_val(path, x);
-    g_array_append_val(path, y);
+static void
+ink_erase_record_stroke (EvAnnotationInk *annot,
+                         guint            stroke_id,
+                         GBytes          *points,
+                         gboolean         added,
+                         InkEraseData    *data)
+{
+    const EvPoint *p;
+    gsize          n_points, j;
 
-    redraw_ink_annot(view);
-    return FALSE;
+    ev_annotation_history_change_stroke (data->view->annot_history, annot,
+                                         stroke_id, points, added);
+    if (added)
+        return;
+
+    /* The erased segments are among those whose bounding box meets
+     * the eraser */
+    p = g_bytes_get_data (points, &n_points);
+    n_points /= sizeof (EvPoint);
+    for (j = 1; j < n_points; j++) {
+        EvRectangle segment;
+
+        segment.x1 = MIN (p[j - 1].x, p[j].x);
+        segment.y1 = MIN (p[j - 1].y, p[j].y);
+        segment.x2 = MAX (p[j - 1].x, p[j].x);
+        segment.y2 = MAX (p[j - 1].y, p[j].y);
+        if (segment.x2 < data->eraser.x1 || segment.x1 > data->eraser.x2 ||
+            segment.y2 < data->eraser.y1 || segment.y1 > data->eraser.y2)
+            continue;
+
+        if (!data->has_erased) {
+            data->erased = segment;
+            data->has_erased = TRUE;
+            continue;
+        }
+        data->erased.x1 = MIN (data->erased.x1, segment.x1);
+        data->erased.y1 = MIN (data->erased.y1, segment.y1);
+        data->erased.x2 = MAX (data->erased.x2, segment.x2);
+        data->erased.y2 = MAX (data->erased.y2, segment.y2);
+    }
+}
+
+/* Adds the area of the erased segments to what the next flush renders */
+static void
+ink_erase_add_area (EvView          *view,
+                    gint             page,
+                    EvAnnotationInk *annot,
+                    EvRectangle     *erased)
+{
+    EvRectangle *area;
+    gdouble      width = 0;
+    gdouble      margin;
+
+    /* Room for the stroke width, and miter joins */
+    ev_annotation_ink_get_width (annot, &width);
+    margin = MAX (width, 1) * 5;
+
+    if (!view->erased_areas)
+        view->erased_areas = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                    NULL, g_free);
+    if (!view->erased_pages)
+        view->erased_pages = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_hash_table_add (view->erased_pages, GINT_TO_POINTER (page));
+
+    area = g_hash_table_lookup (view->erased_areas, GINT_TO_POINTER (page));
+    if (!area) {
+        area = g_new (EvRectangle, 1);
+        area->x1 = erased->x1 - margin;
+        area->y1 = erased->y1 - margin;
+        area->x2 = erased->x2 + margin;
+        area->y2 = erased->y2 + margin;
+        g_hash_table_insert (view->erased_areas, GINT_TO_POINTER (page), area);
+        return;
+    }
+
+    area->x1 = MIN (area->x1, erased->x1 - margin);
+    area->y1 = MIN (area->y1, erased->y1 - margin);
+    area->x2 = MAX (area->x2, erased->x2 + margin);
+    area->y2 = MAX (area->y2, erased->y2 + margin);
 }
 
 static void
-draw_partially_drawn_ink (EvView *view,
-                            cairo_t *cr,
-                            gint page)
+ink_erase_at_location (EvView *view,
+                       gint    x,
+                       gint    y)
 {
-    GArray *paths = (GArray*) view->drawing_data.ink.paths;
-    guint32 i, j;
+    EvMappingList *annots_mapping;
+    GList         *l;
+    gint           page, dx, dy;
+    gdouble        radius;
 
-    /* set up the drawing context */
-    cairo_save(cr);
+    if (!get_doc_point_from_location (view, x, y, &page, &dx, &dy))
+        return;
 
-    /* get the annotation color... */
-    GdkColor color = view->drawing_data.ink.color;
-    gdouble width = view->drawing_data.ink.width;
+    annots_mapping = ev_page_cache_get_annot_mapping (view->page_cache, page);
+    if (!annots_mapping)
+        return;
 
-    cairo_set_source_rgba(cr, color.red / 65535.0, color.green / 65535.0, color.blue / 65535.0, 1.0);
-    cairo_set_line_width(cr, width * view->scale);
-    switch (view->drawing_data.ink.ink_operator) {
-        case EV_ANNOTATION_INK_OPERATOR_MULTIPLY:
-            cairo_set_operator(cr, CAIRO_OPERATOR_MULTIPLY);
-            break;
-        default:
-            cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-    }
-    // TODO: set dash, operator (non-compatible with PDF standard), variable width 
+    radius = view->eraser_radius / view->scale;
 
-    for (i=0; i<paths->len; i++) {
-        GArray *path = (GArray*) g_array_index(paths, GArray*, i);
-        int x1, y1;
+    for (l = ev_mapping_list_get_list (annots_mapping); l; l = l->next) {
+        EvAnnotation *annot = ((EvMapping *) l->data)->data;
+        InkEraseData  data;
+        gdouble       reach, width = 0;
 
-        if (path->len >= 2) {
-            x1 = g_array_index(path, int, 0);   
-            y1 = g_array_index(path, int, 1);   
+        if (!EV_IS_ANNOTATION_INK (annot))
+            continue;
 
-            cairo_move_to(cr, x1, y1);
-        }
-        for (j=0; j < path->len; j += 2) {
-            x1 = g_array_index(path, int, j);   
-            y1 = g_array_index(path, int, j + 1);   
+        ev_annotation_ink_get_width (EV_ANNOTATION_INK (annot), &width);
+        reach = radius + width / 2;
+        data.view = view;
+        data.eraser.x1 = dx + 0.5 - reach;
+        data.eraser.y1 = dy + 0.5 - reach;
+        data.eraser.x2 = dx + 0.5 + reach;
+        data.eraser.y2 = dy + 0.5 + reach;
+        data.has_erased = FALSE;
+
+        if (!ev_annotation_ink_erase_full (EV_ANNOTATION_INK (annot), dx + 0.5, dy + 0.5, radius,
+                                           (EvAnnotationInkEraseFunc) ink_erase_record_stroke,
+                                           &data))
+            continue;
 
-            cairo_line_to(cr, x1, y1);
+        if (data.has_erased)
+            ink_erase_add_area (view, page, EV_ANNOTATION_INK (annot), &data.erased);
+
+        if (view->ink_overlay) {
+            ink_overlay_reset_path (view, annot);
+            gtk_widget_queue_draw (GTK_WIDGET (view));
         }
+
+        if (!view->erased_annots)
+            view->erased_annots = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                         g_object_unref, NULL);
+        if (!g_hash_table_contains (view->erased_annots, annot))
+            g_hash_table_add (view->erased_annots, g_object_ref (annot));
+
+        if (!view->erase_flush_id)
+            view->erase_flush_id = g_timeout_add (ERASER_FLUSH_INTERVAL,
+                                                  (GSourceFunc) ink_eraser_flush_timeout,
+                                                  view);
+    }
+}
+
+static gboolean
+erasing_ink_annot (EvView         *view,
+                   GdkEventMotion *event)
+{
+    int x, y;
+    GdkModifierType state;
+
+    if (event->is_hint) {
+        gdk_window_get_device_position (event->window, event->device, &x, &y, &state);
+    } else {
+        x = event->x;
+        y = event->y;
     }
-    cairo_stroke(cr);
-    cairo_restore(cr);
+
+    ink_erase_at_location (view, x, y);
+
+    return FALSE;
 }
 
 static void
@@ -4756,14 +5867,17 @@ ev_view_draw (GtkWidget *widget,
 			draw_focus (view, cr, i, &clip_rect);
 		if (page_ready && view->synctex_result)
 			highlight_forward_search_results (view, cr, i);
-        if (page_ready && view->adding_annot && view->adding_annot_type == EV_ANNOTATION_TYPE_INK)
-            draw_partially_drawn_ink(view, cr, i);
 #ifdef EV_ENABLE_DEBUG
 		if (page_ready)
 			draw_debug_borders (view, cr, i, &clip_rect);
 #endif
 	}
 
+	/* The ink being drawn is in widget coordinates and may span
+	 * several pages, so composite it once on top of all of them */
+	if (view->adding_annot && view->adding_annot_type == EV_ANNOTATION_TYPE_INK)
+		draw_partially_drawn_ink (view, cr);
+
         if (GTK_WIDGET_CLASS (ev_view_parent_class)->draw)
                 GTK_WIDGET_CLASS (ev_view_parent_class)->draw (widget, cr);
 
@@ -5152,6 +6266,18 @@ ev_view_button_press_event (GtkWidget      *widget,
 		return FALSE;
     }
 
+	if (view->erasing_ink) {
+		if (event->button == 1) {
+			/* The whole drag is undone at once */
+			if (!view->erase_in_action) {
+				ev_annotation_history_begin_action (view->annot_history);
+				view->erase_in_action = TRUE;
+			}
+			ink_erase_at_location (view, event->x, event->y);
+		}
+		return FALSE;
+	}
+
 	if (view->scroll_info.autoscrolling)
 		return TRUE;
 
@@ -5275,10 +6401,10 @@ ev_view_drag_data_get (GtkWidget        *widget,
 			if (view->image_dnd_info.image) {
 				GdkPixbuf *pixbuf;
 
-				ev_document_doc_mutex_lock ();
+				ev_document_lock (view->document);
 				pixbuf = ev_document_images_get_image (EV_DOCUMENT_IMAGES (view->document),
 								       view->image_dnd_info.image);
-				ev_document_doc_mutex_unlock ();
+				ev_document_unlock (view->document);
 				
 				gtk_selection_data_set_pixbuf (selection_data, pixbuf);
 				g_object_unref (pixbuf);
@@ -5290,10 +6416,10 @@ ev_view_drag_data_get (GtkWidget        *widget,
 				const gchar *tmp_uri;
 				gchar       *uris[2];
 
-				ev_document_doc_mutex_lock ();
+				ev_document_lock (view->document);
 				pixbuf = ev_document_images_get_image (EV_DOCUMENT_IMAGES (view->document),
 								       view->image_dnd_info.image);
-				ev_document_doc_mutex_unlock ();
+				ev_document_unlock (view->document);
 				
 				tmp_uri = ev_image_save_tmp (view->image_dnd_info.image, pixbuf);
 				g_object_unref (pixbuf);
@@ -5460,6 +6586,9 @@ ev_view_motion_notify_event (GtkWidget      *widget,
         }
     }
 
+    if (view->erasing_ink && view->pressed_button == 1)
+        return erasing_ink_annot (view, event);
+
 	if (gtk_gesture_is_recognized (view->zoom_gesture))
 		return TRUE;
 
@@ -5669,6 +6798,14 @@ ev_view_button_release_event (GtkWidget      *widget,
 		return FALSE;
 	}
 
+	if (view->erasing_ink && view->pressed_button == 1) {
+		view->pressed_button = -1;
+		ink_eraser_flush (view, ERASER_FLUSH_FULL);
+		ev_view_end_erase_action (view);
+
+		return FALSE;
+	}
+
 	if (view->pressed_button == 2) {
 		ev_view_handle_cursor_over_xy (view, event->x, event->y);
 	}
@@ -6621,6 +7758,45 @@ draw_selection_region (cairo_t        *cr,
 	cairo_restore (cr);
 }
 
+/* Tiled pages are drawn from the tiles that are ready, on top of the
+ * low resolution copy of the whole page */
+static void
+draw_page_tiles (EvView       *view,
+		 cairo_t      *cr,
+		 gint          page,
+		 GdkRectangle *page_area,
+		 GdkRectangle *area)
+{
+	gint first_col, last_col, first_row, last_row;
+	gint col, row;
+
+	first_col = (area->x - page_area->x) / EV_PIXBUF_CACHE_TILE_SIZE;
+	last_col = (area->x + area->width - 1 - page_area->x) / EV_PIXBUF_CACHE_TILE_SIZE;
+	first_row = (area->y - page_area->y) / EV_PIXBUF_CACHE_TILE_SIZE;
+	last_row = (area->y + area->height - 1 - page_area->y) / EV_PIXBUF_CACHE_TILE_SIZE;
+
+	cairo_save (cr);
+	gdk_cairo_rectangle (cr, area);
+	cairo_clip (cr);
+
+	for (row = first_row; row <= last_row; row++) {
+		for (col = first_col; col <= last_col; col++) {
+			cairo_surface_t *surface;
+
+			surface = ev_pixbuf_cache_get_tile_surface (view->pixbuf_cache, page, col, row);
+			if (!surface)
+				continue;
+
+			cairo_set_source_surface (cr, surface,
+						  page_area->x + col * EV_PIXBUF_CACHE_TILE_SIZE,
+						  page_area->y + row * EV_PIXBUF_CACHE_TILE_SIZE);
+			cairo_paint (cr);
+		}
+	}
+
+	cairo_restore (cr);
+}
+
 static void
 draw_one_page (EvView       *view,
 	       gint          page,
@@ -6691,6 +7867,12 @@ draw_one_page (EvView       *view,
 
 		draw_surface (cr, page_surface, overlap.x, overlap.y, offset_x, offset_y, width, height);
 
+		if (ev_pixbuf_cache_page_is_tiled (view->pixbuf_cache, page))
+			draw_page_tiles (view, cr, page, &real_page_area, &overlap);
+
+		if (view->ink_overlay)
+			draw_ink_overlay (view, cr, page, &real_page_area);
+
 		/* Get the selection pixbuf iff we have something to draw */
 		if (!find_selection_for_page (view, page))
 			return;
@@ -6712,15 +7894,21 @@ draw_one_page (EvView       *view,
 			GdkRGBA color;
 			double device_scale_x = 1, device_scale_y = 1;
 
-			scale_x = (gdouble)width / cairo_image_surface_get_width (page_surface);
-			scale_y = (gdouble)height / cairo_image_surface_get_height (page_surface);
+			if (ev_pixbuf_cache_page_is_tiled (view->pixbuf_cache, page)) {
+				/* The region is at the view scale, not at
+				 * the scale of the placeholder surface */
+				scale_x = scale_y = 1;
+			} else {
+				scale_x = (gdouble)width / cairo_image_surface_get_width (page_surface);
+				scale_y = (gdouble)height / cairo_image_surface_get_height (page_surface);
 
 #ifdef HAVE_HIDPI_SUPPORT
-			cairo_surface_get_device_scale (page_surface, &device_scale_x, &device_scale_y);
+				cairo_surface_get_device_scale (page_surface, &device_scale_x, &device_scale_y);
 #endif
 
-			scale_x *= device_scale_x;
-			scale_y *= device_scale_y;
+				scale_x *= device_scale_x;
+				scale_y *= device_scale_y;
+			}
 
 			_ev_view_get_selection_colors (view, &color, NULL);
 			draw_selection_region (cr, region, &color, real_page_area.x, real_page_area.y,
@@ -6753,6 +7941,8 @@ ev_view_finalize (GObject *object)
 
 	g_object_unref (view->zoom_gesture);
 
+	ev_annotation_history_free (view->annot_history);
+
 	G_OBJECT_CLASS (ev_view_parent_class)->finalize (object);
 }
 
@@ -6772,6 +7962,18 @@ ev_view_dispose (GObject *object)
 		view->pixbuf_cache = NULL;
 	}
 
+	if (view->erased_annots) {
+		if (view->document)
+			ink_eraser_flush (view, ERASER_FLUSH_SAVE);
+		g_hash_table_destroy (view->erased_annots);
+		view->erased_annots = NULL;
+	}
+	g_clear_pointer (&view->erased_areas, g_hash_table_destroy);
+	g_clear_pointer (&view->erased_pages, g_hash_table_destroy);
+	g_clear_pointer (&view->erase_changed, g_hash_table_destroy);
+
+	ev_view_clear_annotation_history (view);
+
 	if (view->document) {
 		g_object_unref (view->document);
 		view->document = NULL;
@@ -6784,6 +7986,9 @@ ev_view_dispose (GObject *object)
 
 	ev_view_find_cancel (view);
 
+	ink_layer_invalidate (view);
+	ink_overlay_clear (view);
+
 	ev_view_window_children_free (view);
 
 	if (view->selection_scroll_id) {
@@ -6847,6 +8052,12 @@ ev_view_get_property (GObject     *object,
 	case PROP_CAN_ZOOM_OUT:
 		g_value_set_boolean (value, view->can_zoom_out);
 		break;
+	case PROP_CAN_UNDO:
+		g_value_set_boolean (value, ev_view_can_undo (view));
+		break;
+	case PROP_CAN_REDO:
+		g_value_set_boolean (value, ev_view_can_redo (view));
+		break;
 	case PROP_HADJUSTMENT:
 		g_value_set_object (value, view->hadjustment);
 		break;
@@ -7339,6 +8550,32 @@ ev_view_class_init (EvViewClass *class)
 							       TRUE,
 							       G_PARAM_READABLE |
 							       G_PARAM_STATIC_STRINGS));
+	/**
+	 * EvView:can-undo:
+	 *
+	 * Whether there is an annotation edit to undo
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_CAN_UNDO,
+					 g_param_spec_boolean ("can-undo",
+							       "Can Undo",
+							       "Whether there is an annotation edit to undo",
+							       FALSE,
+							       G_PARAM_READABLE |
+							       G_PARAM_STATIC_STRINGS));
+	/**
+	 * EvView:can-redo:
+	 *
+	 * Whether there is an undone annotation edit to redo
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_CAN_REDO,
+					 g_param_spec_boolean ("can-redo",
+							       "Can Redo",
+							       "Whether there is an undone annotation edit to redo",
+							       FALSE,
+							       G_PARAM_READABLE |
+							       G_PARAM_STATIC_STRINGS));
 
 	/* Scrollable interface */
 	g_object_class_override_property (object_class, PROP_HADJUSTMENT, "hadjustment");
@@ -7411,6 +8648,14 @@ ev_view_class_init (EvViewClass *class)
 		         g_cclosure_marshal_VOID__OBJECT,
 		         G_TYPE_NONE, 1,
  		         EV_TYPE_ANNOTATION);
+	signals[SIGNAL_ANNOT_CHANGED] = g_signal_new ("annot-changed",
+	  	         G_TYPE_FROM_CLASS (object_class),
+		         G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+		         G_STRUCT_OFFSET (EvViewClass, annot_changed),
+		         NULL, NULL,
+		         g_cclosure_marshal_VOID__OBJECT,
+		         G_TYPE_NONE, 1,
+		         EV_TYPE_ANNOTATION);
 	signals[SIGNAL_LAYERS_CHANGED] = g_signal_new ("layers-changed",
 	  	         G_TYPE_FROM_CLASS (object_class),
 		         G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
@@ -7605,6 +8850,8 @@ ev_view_init (EvView *view)
 	view->caret_enabled = FALSE;
 	view->cursor_page = 0;
 	view->allow_links_change_zoom = TRUE;
+	view->ink_simplify_tolerance = DEFAULT_INK_SIMPLIFY_TOLERANCE;
+	view->annot_history = ev_annotation_history_new ();
 
 	g_signal_connect (view, "notify::scale-factor",
 			  G_CALLBACK (on_notify_scale_factor), NULL);
@@ -7643,6 +8890,9 @@ job_finished_cb (EvPixbufCache  *pixbuf_cache,
 		 cairo_region_t *region,
 		 EvView         *view)
 {
+	if (view->ink_overlay)
+		ink_overlay_prune (view);
+
 	if (region) {
 		gdk_window_invalidate_region (gtk_widget_get_window (GTK_WIDGET (view)), region, TRUE);
 	} else {
@@ -7759,6 +9009,8 @@ setup_caches (EvView *view)
 static void
 clear_caches (EvView *view)
 {
+	ink_overlay_clear (view);
+
 	if (view->pixbuf_cache) {
 		g_object_unref (view->pixbuf_cache);
 		view->pixbuf_cache = NULL;
@@ -7875,6 +9127,7 @@ ev_view_document_changed_cb (EvDocumentModel *model,
 
 		ev_view_remove_all (view);
 		clear_caches (view);
+		ev_view_clear_annotation_history (view);
 
 		if (view->document) {
 			g_object_unref (view->document);
@@ -8156,7 +9409,8 @@ ev_view_reload_page (EvView         *view,
 				     region,
 				     page,
 				     view->rotation,
-				     view->scale);
+				     view->scale,
+				     EV_JOB_PRIORITY_URGENT);
 }
 
 void
@@ -9089,7 +10343,7 @@ get_selected_text (EvView *view)
 
 	text = g_string_new (NULL);
 
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (view->document);
 
 	for (l = view->selection_info.selections; l != NULL; l = l->next) {
 		EvViewSelection *selection = (EvViewSelection *)l->data;
@@ -9105,7 +10359,7 @@ get_selected_text (EvView *view)
 		g_free (tmp);
 	}
 
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (view->document);
 	
 	normalized_text = g_utf8_normalize (text->str, text->len, G_NORMALIZE_NFKC);
 	g_string_free (text, TRUE);
@@ -9305,3 +10559,29 @@ ev_view_get_allow_links_change_zoom (EvView *view)
 
 	return view->allow_links_change_zoom;
 }
+
+/**
+ * ev_view_set_ink_simplify_tolerance:
+ * @view: a #EvView
+ * @tolerance: the maximum error in device pixels
+ *
+ * Sets how far a captured ink point may lie from the simplified
+ * stroke stored in the annotation. The error is also kept below half
+ * the stroke width. A @tolerance of 0 disables simplification.
+ */
+void
+ev_view_set_ink_simplify_tolerance (EvView *view,
+				    gdouble tolerance)
+{
+	g_return_if_fail (EV_IS_VIEW (view));
+
+	view->ink_simplify_tolerance = MAX (tolerance, 0);
+}
+
+gdouble
+ev_view_get_ink_simplify_tolerance (EvView *view)
+{
+	g_return_val_if_fail (EV_IS_VIEW (view), 0);
+
+	return view->ink_simplify_tolerance;
+}
@@ -59,6 +59,9 @@ void            ev_view_set_page_cache_size (EvView          *view,
 void            ev_view_set_allow_links_change_zoom (EvView  *view,
                                                      gboolean allowed);
 gboolean        ev_view_get_allow_links_change_zoom (EvView  *view);
+void            ev_view_set_ink_simplify_tolerance  (EvView  *view,
+                                                     gdouble  tolerance);
+gdouble         ev_view_get_ink_simplify_tolerance  (EvView  *view);
 
 /* Clipboard */
 void		ev_view_copy		  (EvView         *view);
@@ -127,8 +130,20 @@ void           ev_view_begin_add_ink_annotation (EvView          *view,
                           guint32               annot_width,
                           EvAnnotationInkOperator annot_ink_operator);
 void           ev_view_cancel_add_annotation (EvView          *view);
+void           ev_view_begin_erase_ink       (EvView          *view,
+					      gdouble          radius);
+void           ev_view_cancel_erase_ink      (EvView          *view);
 void           ev_view_remove_annotation     (EvView          *view,
 					      EvAnnotation    *annot);
+void           ev_view_begin_annotation_change (EvView               *view,
+						EvAnnotation         *annot);
+void           ev_view_end_annotation_change (EvView               *view,
+					      EvAnnotation         *annot,
+					      EvAnnotationsSaveMask mask);
+gboolean       ev_view_can_undo              (EvView          *view);
+gboolean       ev_view_can_redo              (EvView          *view);
+void           ev_view_undo                  (EvView          *view);
+void           ev_view_redo                  (EvView          *view);
 
 /* Caret navigation */
 gboolean       ev_view_supports_caret_navigation    (EvView  *view);
@@ -1052,6 +1052,8 @@ ev_application_startup (GApplication *gapplication)
           "win.save-copy",              "<Ctrl>S", NULL,
           "win.print",                  "<Ctrl>P", NULL,
           "win.copy",                   "<Ctrl>C", "<Ctrl>Insert", NULL,
+          "win.undo",                   "<Ctrl>Z", NULL,
+          "win.redo",                   "<Ctrl><Shift>Z", "<Ctrl>Y", NULL,
           "win.select-all",             "<Ctrl>A", NULL,
           "win.save-settings",          "<Ctrl>T", NULL,
           "win.add-bookmark",           "<Ctrl>D", NULL,
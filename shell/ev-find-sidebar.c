@@ -33,14 +33,35 @@ struct _EvFindSidebarPrivate {
         guint process_matches_idle_id;
 
         GtkTreePath *highlighted_result;
-        gint         first_match_page;
 
         EvJobFind *job;
-        gint       job_current_page;
-        gint       current_page;
-        gint       insert_position;
+        gint       pages_processed;
+        /* Rows added for each page, the job reports pages
+         * out of order */
+        guint     *page_rows;
+
+        /* Text of the pages with matches, kept while the
+         * search is being refined, and the same texts most
+         * recently used first
+         */
+        GHashTable *page_texts;
+        GQueue     *page_texts_lru;
 };
 
+/* Pages whose text is kept for the next searches */
+#define MAX_PAGE_TEXTS 128
+
+typedef struct {
+        gint          page;
+        gchar        *text;
+        EvRectangle  *areas;
+        guint         n_areas;
+        PangoLogAttr *log_attrs;
+        gulong        log_attrs_length;
+} PageText;
+
+static void page_text_free (PageText *page_text);
+
 enum {
         TEXT_COLUMN,
         PAGE_COLUMN,
@@ -68,6 +89,7 @@ ev_find_sidebar_cancel (EvFindSidebar *sidebar)
                 priv->process_matches_idle_id = 0;
         }
         g_clear_object (&priv->job);
+        g_clear_pointer (&priv->page_rows, g_free);
 }
 
 static void
@@ -77,6 +99,8 @@ ev_find_sidebar_dispose (GObject *object)
 
         ev_find_sidebar_cancel (sidebar);
         g_clear_pointer (&sidebar->priv->highlighted_result, (GDestroyNotify)gtk_tree_path_free);
+        g_clear_pointer (&sidebar->priv->page_texts, g_hash_table_destroy);
+        g_clear_pointer (&sidebar->priv->page_texts_lru, g_queue_free);
 
         G_OBJECT_CLASS (ev_find_sidebar_parent_class)->dispose (object);
 }
@@ -192,6 +216,10 @@ ev_find_sidebar_init (EvFindSidebar *sidebar)
         sidebar->priv = G_TYPE_INSTANCE_GET_PRIVATE (sidebar, EV_TYPE_FIND_SIDEBAR, EvFindSidebarPrivate);
         priv = sidebar->priv;
 
+        priv->page_texts = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                  NULL, (GDestroyNotify)page_text_free);
+        priv->page_texts_lru = g_queue_new ();
+
         swindow = gtk_scrolled_window_new (NULL, NULL);
         gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (swindow),
                                         GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
@@ -387,26 +415,97 @@ get_surrounding_text_markup (const gchar  *text,
         return markup;
 }
 
-static gchar *
-get_page_text (EvDocument   *document,
-               EvPage       *page,
-               EvRectangle **areas,
-               guint        *n_areas)
+static void
+page_text_free (PageText *page_text)
 {
-        gchar   *text;
-        gboolean success;
+        g_free (page_text->text);
+        g_free (page_text->areas);
+        g_free (page_text->log_attrs);
+        g_slice_free (PageText, page_text);
+}
 
-        ev_document_doc_mutex_lock ();
-        text = ev_document_text_get_text (EV_DOCUMENT_TEXT (document), page);
-        success = ev_document_text_get_text_layout (EV_DOCUMENT_TEXT (document), page, areas, n_areas);
-        ev_document_doc_mutex_unlock ();
+static PageText *
+get_page_text (EvFindSidebar *sidebar,
+               EvDocument    *document,
+               gint           page_index)
+{
+        EvFindSidebarPrivate *priv = sidebar->priv;
+        PageText             *page_text;
+        EvTextIndex          *index;
+        const EvRectangle    *index_areas;
+        EvPage               *page;
+        gchar                *text;
+        EvRectangle          *areas = NULL;
+        guint                 n_areas;
+        gboolean              success;
+
+        page_text = g_hash_table_lookup (priv->page_texts, GINT_TO_POINTER (page_index));
+        if (page_text) {
+                g_queue_remove (priv->page_texts_lru, page_text);
+                g_queue_push_head (priv->page_texts_lru, page_text);
+                return page_text;
+        }
 
-        if (!success) {
-                g_free (text);
-                return NULL;
+        index = ev_text_index_get_for_document (document);
+        if (ev_text_index_get_text_layout (index, page_index, &index_areas, &n_areas)) {
+                areas = g_memdup (index_areas, n_areas * sizeof (EvRectangle));
+                text = g_strdup (ev_text_index_get_text (index, page_index));
+        } else {
+                page = ev_document_get_page (document, page_index);
+                ev_document_lock (document);
+                text = ev_document_text_get_text (EV_DOCUMENT_TEXT (document), page);
+                success = ev_document_text_get_text_layout (EV_DOCUMENT_TEXT (document), page, &areas, &n_areas);
+                ev_document_unlock (document);
+                g_object_unref (page);
+
+                if (!success || !text) {
+                        g_free (text);
+                        return NULL;
+                }
+        }
+
+        page_text = g_slice_new (PageText);
+        page_text->page = page_index;
+        page_text->text = text;
+        page_text->areas = areas;
+        page_text->n_areas = n_areas;
+        page_text->log_attrs_length = g_utf8_strlen (text, -1);
+        page_text->log_attrs = g_new0 (PangoLogAttr, page_text->log_attrs_length + 1);
+        pango_get_log_attrs (text, -1, -1, NULL, page_text->log_attrs, page_text->log_attrs_length + 1);
+
+        g_hash_table_insert (priv->page_texts, GINT_TO_POINTER (page_index), page_text);
+        g_queue_push_head (priv->page_texts_lru, page_text);
+        while (g_queue_get_length (priv->page_texts_lru) > MAX_PAGE_TEXTS) {
+                PageText *last = g_queue_pop_tail (priv->page_texts_lru);
+
+                g_hash_table_remove (priv->page_texts, GINT_TO_POINTER (last->page));
         }
 
-        return text;
+        return page_text;
+}
+
+static gboolean
+page_text_has_no_matches (gpointer       key,
+                          PageText      *page_text,
+                          EvFindSidebar *sidebar)
+{
+        EvFindSidebarPrivate *priv = sidebar->priv;
+
+        if (priv->job->pages[page_text->page])
+                return FALSE;
+
+        g_queue_remove (priv->page_texts_lru, page_text);
+
+        return TRUE;
+}
+
+/* Once the search is over, the next one can only be a refinement of it */
+static void
+prune_page_texts (EvFindSidebar *sidebar)
+{
+        g_hash_table_foreach_remove (sidebar->priv->page_texts,
+                                     (GHRFunc)page_text_has_no_matches,
+                                     sidebar);
 }
 
 static gint
@@ -442,50 +541,44 @@ process_matches_idle (EvFindSidebar *sidebar)
 {
         EvFindSidebarPrivate *priv = sidebar->priv;
         GtkTreeModel         *model;
-        gint                  current_page;
         EvDocument           *document;
 
         priv->process_matches_idle_id = 0;
 
         if (!ev_job_find_has_results (priv->job)) {
-                if (ev_job_is_finished (EV_JOB (priv->job)))
-                        g_clear_object (&priv->job);
+                if (ev_job_is_finished (EV_JOB (priv->job))) {
+                        prune_page_texts (sidebar);
+                        ev_find_sidebar_cancel (sidebar);
+                }
                 return FALSE;
         }
 
         document = EV_JOB (priv->job)->document;
         model = gtk_tree_view_get_model (GTK_TREE_VIEW (priv->tree_view));
 
-        do {
+        while (priv->pages_processed < priv->job->pages_reported) {
                 GList        *matches, *l;
-                EvPage       *page;
                 gint          result;
-                gchar        *page_text;
-                EvRectangle  *areas = NULL;
-                guint         n_areas;
-                PangoLogAttr *text_log_attrs;
-                gulong        text_log_attrs_length;
+                PageText     *page_text;
                 gint          offset;
+                gint          current_page;
+                gint          position = 0;
+                gint          i;
 
-                current_page = priv->current_page;
-                priv->current_page = (priv->current_page + 1) % priv->job->n_pages;
+                current_page = ev_job_find_get_nth_page (priv->job, priv->pages_processed);
+                priv->pages_processed++;
 
                 matches = priv->job->pages[current_page];
                 if (!matches)
                         continue;
 
-                page = ev_document_get_page (document, current_page);
-                page_text = get_page_text (document, page, &areas, &n_areas);
-                g_object_unref (page);
+                page_text = get_page_text (sidebar, document, current_page);
                 if (!page_text)
                         continue;
 
-                text_log_attrs_length = g_utf8_strlen (page_text, -1);
-                text_log_attrs = g_new0 (PangoLogAttr, text_log_attrs_length + 1);
-                pango_get_log_attrs (page_text, -1, -1, NULL, text_log_attrs, text_log_attrs_length + 1);
-
-                if (priv->first_match_page == -1)
-                        priv->first_match_page = current_page;
+                /* Keep the rows sorted by page */
+                for (i = 0; i < current_page; i++)
+                        position += priv->page_rows[i];
 
                 offset = 0;
 
@@ -494,26 +587,21 @@ process_matches_idle (EvFindSidebar *sidebar)
                         gchar       *markup;
                         GtkTreeIter  iter;
 
-                        offset = get_match_offset (areas, n_areas, match, offset);
+                        offset = get_match_offset (page_text->areas, page_text->n_areas, match, offset);
                         if (offset == -1) {
                                 g_warning ("No offset found for match \"%s\" at page %d after processing %d results\n",
                                            priv->job->text, current_page, result);
                                 break;
                         }
 
-                        if (current_page >= priv->job->start_page) {
-                                gtk_list_store_append (GTK_LIST_STORE (model), &iter);
-                        } else {
-                                gtk_list_store_insert (GTK_LIST_STORE (model), &iter,
-                                                       priv->insert_position);
-                                priv->insert_position++;
-                        }
+                        gtk_list_store_insert (GTK_LIST_STORE (model), &iter, position++);
+                        priv->page_rows[current_page]++;
 
-                        markup = get_surrounding_text_markup (page_text,
+                        markup = get_surrounding_text_markup (page_text->text,
                                                               priv->job->text,
                                                               priv->job->case_sensitive,
-                                                              text_log_attrs,
-                                                              text_log_attrs_length,
+                                                              page_text->log_attrs,
+                                                              page_text->log_attrs_length,
                                                               offset);
                         gtk_list_store_set (GTK_LIST_STORE (model), &iter,
                                             TEXT_COLUMN, markup,
@@ -522,26 +610,16 @@ process_matches_idle (EvFindSidebar *sidebar)
                                             -1);
                         g_free (markup);
                 }
+        }
 
-                g_free (page_text);
-                g_free (text_log_attrs);
-                g_free (areas);
-        } while (current_page != priv->job_current_page);
-
-        if (ev_job_is_finished (EV_JOB (priv->job)) && priv->current_page == priv->job->start_page)
-                ev_find_sidebar_highlight_first_match_of_page (sidebar, priv->first_match_page);
+        if (ev_job_is_finished (EV_JOB (priv->job)) && priv->pages_processed == priv->job->n_pages) {
+                prune_page_texts (sidebar);
+                ev_find_sidebar_restart (sidebar, priv->job->start_page);
+        }
 
         return FALSE;
 }
 
-static void
-find_job_updated_cb (EvJobFind     *job,
-                     gint           page,
-                     EvFindSidebar *sidebar)
-{
-        sidebar->priv->job_current_page = page;
-}
-
 static void
 find_job_cancelled_cb (EvJob         *job,
                        EvFindSidebar *sidebar)
@@ -559,17 +637,17 @@ ev_find_sidebar_start (EvFindSidebar *sidebar,
                 return;
 
         ev_find_sidebar_clear (sidebar);
+        /* A refined search only matches pages the previous one did */
+        if (!job->skip_pages) {
+                g_hash_table_remove_all (priv->page_texts);
+                g_queue_clear (priv->page_texts_lru);
+        }
         priv->job = g_object_ref (job);
-        g_signal_connect_object (job, "updated",
-                                 G_CALLBACK (find_job_updated_cb),
-                                 sidebar, 0);
         g_signal_connect_object (job, "cancelled",
                                  G_CALLBACK (find_job_cancelled_cb),
                                  sidebar, 0);
-        priv->job_current_page = -1;
-        priv->first_match_page = -1;
-        priv->current_page = job->start_page;
-        priv->insert_position = 0;
+        priv->pages_processed = 0;
+        priv->page_rows = g_new0 (guint, job->n_pages);
 }
 
 void
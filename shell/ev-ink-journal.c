@@ -0,0 +1,1058 @@
+/* ev-ink-journal.c
+ *  this file is part of evince, a gnome document viewer
+ *
+ * Copyright (C) 2026 The Evince authors
+ *
+ * Evince is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Evince is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "ev-document-annotations.h"
+#include "ev-ink-journal.h"
+
+/* The ink drawn on a document since it was last saved, so that it can
+ * be restored after a crash. The journal is a file in the user cache,
+ * named after the document URI, mapped in memory and only appended to:
+ *
+ *   JournalHeader
+ *   JournalRecord, stroke lengths (8 bytes aligned), points
+ *   ...
+ *   zeros
+ *
+ * The header holds the size and modification time of the document
+ * file, and the records are only replayed while they match. Each
+ * record has a checksum, so a record left half written by a crash
+ * ends the journal.
+ *
+ * Each window holds a lock on its journal. Another window on the same
+ * document, as with "Open a Copy", uses the next free one of
+ * <name>.1, <name>.2, ..., so that they don't write over each other.
+ * The window that gets <name> takes over the records of the other
+ * journals no window holds anymore, as after a crash, and removes
+ * them. Journals no window used for JOURNAL_MAX_AGE are removed.
+ *
+ * Only the ink annotations added since the document was loaded are
+ * journaled, under ids given by the journal. Those that were already
+ * in the file can't be told apart once it's loaded again, as the
+ * backends make up names for the annotations that have none.
+ */
+#define JOURNAL_MAGIC         "EVINKJ01"
+#define JOURNAL_CHUNK_SIZE    (1024 * 1024)
+/* Journals for the same document */
+#define JOURNAL_MAX_INSTANCES 16
+/* Appended records are written to disk at most this often, in ms */
+#define JOURNAL_SYNC_INTERVAL 1000
+/* Unused journals are removed after this long, in seconds */
+#define JOURNAL_MAX_AGE       (30 * 24 * 60 * 60)
+
+typedef enum {
+	RECORD_ADD = 1,
+	RECORD_MODIFY,
+	RECORD_REMOVE
+} RecordType;
+
+typedef struct {
+	gchar   magic[8];
+	gint64  file_size;
+	gint64  file_mtime;
+	guint64 reserved;
+} JournalHeader;
+
+typedef struct {
+	guint32 size;
+	guint32 checksum;
+	guint32 id;
+	guint32 page;
+	guint8  type;
+	guint8  op;
+	guint16 red;
+	guint16 green;
+	guint16 blue;
+	gdouble width;
+	guint32 n_strokes;
+	guint32 n_points;
+} JournalRecord;
+
+struct _EvInkJournal
+{
+	GObject parent;
+
+	gchar   *uri;
+	gchar   *filename;
+	gchar   *document_filename;
+	int      fd;
+
+	/* Held to remap the file, and by the thread writing it to disk */
+	GMutex   mutex;
+	guint8  *map;
+	gsize    map_size;
+	gsize    write_offset;
+
+	guint32  next_id;
+	/* Lower ids are of ink saved to the file since */
+	guint32  first_id;
+
+	guint    sync_id;
+	gboolean dirty;
+	gboolean syncing;
+};
+
+struct _EvInkJournalClass
+{
+	GObjectClass parent_class;
+};
+
+static GQuark ev_ink_journal_id_quark;
+
+G_DEFINE_TYPE (EvInkJournal, ev_ink_journal, G_TYPE_OBJECT)
+
+#define RECORD_ALIGN(size) (((size) + 7) & ~((gsize) 7))
+
+static void
+ev_ink_journal_sync (EvInkJournal *journal)
+{
+	g_mutex_lock (&journal->mutex);
+	if (journal->map)
+		msync (journal->map, journal->map_size, MS_SYNC);
+	g_mutex_unlock (&journal->mutex);
+}
+
+static void
+ev_ink_journal_dispose (GObject *object)
+{
+	EvInkJournal *journal = EV_INK_JOURNAL (object);
+
+	if (journal->sync_id > 0) {
+		g_source_remove (journal->sync_id);
+		journal->sync_id = 0;
+	}
+	if (journal->dirty) {
+		journal->dirty = FALSE;
+		ev_ink_journal_sync (journal);
+	}
+
+	G_OBJECT_CLASS (ev_ink_journal_parent_class)->dispose (object);
+}
+
+static void
+ev_ink_journal_finalize (GObject *object)
+{
+	EvInkJournal *journal = EV_INK_JOURNAL (object);
+
+	if (journal->map)
+		munmap (journal->map, journal->map_size);
+	if (journal->fd != -1)
+		close (journal->fd);
+	g_mutex_clear (&journal->mutex);
+	g_free (journal->uri);
+	g_free (journal->filename);
+	g_free (journal->document_filename);
+
+	G_OBJECT_CLASS (ev_ink_journal_parent_class)->finalize (object);
+}
+
+static void
+ev_ink_journal_init (EvInkJournal *journal)
+{
+	journal->fd = -1;
+	journal->next_id = 1;
+	journal->first_id = 1;
+	g_mutex_init (&journal->mutex);
+}
+
+static void
+ev_ink_journal_class_init (EvInkJournalClass *klass)
+{
+	GObjectClass *g_object_class = G_OBJECT_CLASS (klass);
+
+	g_object_class->dispose = ev_ink_journal_dispose;
+	g_object_class->finalize = ev_ink_journal_finalize;
+
+	ev_ink_journal_id_quark = g_quark_from_static_string ("ev-ink-journal-id");
+}
+
+/* FNV-1a */
+static guint32
+record_checksum (const guint8 *data,
+		 gsize         length)
+{
+	guint32 hash = 2166136261u;
+	gsize   i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static gsize
+record_size (guint32 n_strokes,
+	     guint32 n_points)
+{
+	return RECORD_ALIGN (sizeof (JournalRecord) + n_strokes * sizeof (guint32)) +
+		n_points * sizeof (EvPoint);
+}
+
+static const guint32 *
+record_get_stroke_lengths (const JournalRecord *record)
+{
+	return (const guint32 *) (record + 1);
+}
+
+static const EvPoint *
+record_get_points (const JournalRecord *record)
+{
+	return (const EvPoint *) ((const guint8 *) record +
+				  RECORD_ALIGN (sizeof (JournalRecord) + record->n_strokes * sizeof (guint32)));
+}
+
+/* Returns the record at @offset of the journal in @map, or %NULL at
+ * the end of the journal */
+static const JournalRecord *
+get_record (const guint8 *map,
+	    gsize         map_size,
+	    gsize         offset)
+{
+	const JournalRecord *record;
+
+	if (offset + sizeof (JournalRecord) > map_size)
+		return NULL;
+
+	record = (const JournalRecord *) (map + offset);
+	if (record->size < sizeof (JournalRecord) ||
+	    record->size > map_size - offset ||
+	    record->size != record_size (record->n_strokes, record->n_points))
+		return NULL;
+
+	if (record->checksum != record_checksum ((const guint8 *) &record->id,
+						 record->size - G_STRUCT_OFFSET (JournalRecord, id)))
+		return NULL;
+
+	return record;
+}
+
+static const JournalRecord *
+ev_ink_journal_get_record (EvInkJournal *journal,
+			   gsize         offset)
+{
+	return get_record (journal->map, journal->map_size, offset);
+}
+
+static gboolean
+ev_ink_journal_map (EvInkJournal *journal,
+		    gsize         size)
+{
+	guint8 *map;
+
+	g_mutex_lock (&journal->mutex);
+
+	if (journal->map)
+		munmap (journal->map, journal->map_size);
+	journal->map = NULL;
+	journal->map_size = 0;
+
+	if (ftruncate (journal->fd, size) == -1) {
+		g_mutex_unlock (&journal->mutex);
+		return FALSE;
+	}
+
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+	if (map != MAP_FAILED) {
+		journal->map = map;
+		journal->map_size = size;
+	}
+
+	g_mutex_unlock (&journal->mutex);
+
+	return journal->map != NULL;
+}
+
+static gboolean
+get_file_stat (const gchar *filename,
+	       gint64      *size,
+	       gint64      *mtime)
+{
+	GStatBuf st;
+
+	if (g_stat (filename, &st) == -1)
+		return FALSE;
+
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+
+	return TRUE;
+}
+
+/* Whether the records of a journal were written for the document as
+ * it is in its file */
+static gboolean
+header_matches_document (const JournalHeader *header,
+			 const gchar         *document_filename)
+{
+	gint64 file_size, file_mtime;
+
+	return memcmp (header->magic, JOURNAL_MAGIC, sizeof (header->magic)) == 0 &&
+		get_file_stat (document_filename, &file_size, &file_mtime) &&
+		header->file_size == file_size &&
+		header->file_mtime == file_mtime;
+}
+
+static void
+ev_ink_journal_write_header (EvInkJournal *journal)
+{
+	JournalHeader *header = (JournalHeader *) journal->map;
+
+	memcpy (header->magic, JOURNAL_MAGIC, sizeof (header->magic));
+	if (!get_file_stat (journal->document_filename, &header->file_size, &header->file_mtime)) {
+		header->file_size = -1;
+		header->file_mtime = -1;
+	}
+	header->reserved = 0;
+}
+
+static gboolean
+ev_ink_journal_sync_timeout (EvInkJournal *journal);
+
+static void
+ev_ink_journal_schedule_sync (EvInkJournal *journal)
+{
+	journal->dirty = TRUE;
+	if (journal->sync_id > 0 || journal->syncing)
+		return;
+
+	journal->sync_id = g_timeout_add (JOURNAL_SYNC_INTERVAL,
+					  (GSourceFunc)ev_ink_journal_sync_timeout,
+					  journal);
+}
+
+static void
+ev_ink_journal_sync_thread (GTask        *task,
+			    EvInkJournal *journal,
+			    gpointer      task_data,
+			    GCancellable *cancellable)
+{
+	ev_ink_journal_sync (journal);
+	g_task_return_boolean (task, TRUE);
+}
+
+static void
+ev_ink_journal_sync_finished (EvInkJournal *journal,
+			      GAsyncResult *result,
+			      gpointer      user_data)
+{
+	journal->syncing = FALSE;
+	if (journal->dirty)
+		ev_ink_journal_schedule_sync (journal);
+}
+
+static gboolean
+ev_ink_journal_sync_timeout (EvInkJournal *journal)
+{
+	GTask *task;
+
+	journal->sync_id = 0;
+	journal->dirty = FALSE;
+	journal->syncing = TRUE;
+
+	task = g_task_new (journal, NULL,
+			   (GAsyncReadyCallback)ev_ink_journal_sync_finished,
+			   NULL);
+	g_task_run_in_thread (task, (GTaskThreadFunc)ev_ink_journal_sync_thread);
+	g_object_unref (task);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Finds the end of the records, and drops them all when the document
+ * changed since they were written */
+static void
+ev_ink_journal_open_records (EvInkJournal *journal)
+{
+	const JournalHeader *header = (const JournalHeader *) journal->map;
+	gsize                offset = sizeof (JournalHeader);
+
+	if (!header_matches_document (header, journal->document_filename)) {
+		memset (journal->map, 0, journal->map_size);
+		ev_ink_journal_write_header (journal);
+		journal->write_offset = sizeof (JournalHeader);
+		return;
+	}
+
+	while (TRUE) {
+		const JournalRecord *record = ev_ink_journal_get_record (journal, offset);
+
+		if (!record)
+			break;
+
+		journal->next_id = MAX (journal->next_id, record->id + 1);
+		offset += record->size;
+	}
+
+	/* Clear what a crash may have left half written */
+	memset (journal->map + offset, 0, journal->map_size - offset);
+	journal->write_offset = offset;
+}
+
+/* Opens and locks @filename, failing with EWOULDBLOCK when another
+ * window has it locked */
+static int
+open_locked (const gchar *filename)
+{
+	while (TRUE) {
+		GStatBuf st, fd_st;
+		int      fd;
+
+		fd = g_open (filename, O_RDWR | O_CREAT, 0600);
+		if (fd == -1)
+			return -1;
+
+		if (flock (fd, LOCK_EX | LOCK_NB) == -1) {
+			int errsv = errno;
+
+			close (fd);
+			errno = errsv;
+			return -1;
+		}
+
+		/* Unless the window that had it locked discarded it */
+		if (g_stat (filename, &st) == 0 && fstat (fd, &fd_st) == 0 &&
+		    st.st_dev == fd_st.st_dev && st.st_ino == fd_st.st_ino)
+			return fd;
+
+		close (fd);
+	}
+}
+
+static guint8 *ev_ink_journal_reserve (EvInkJournal *journal,
+				       gsize         size);
+
+/* Appends the records of the journal in @map, with their ids moved
+ * past those of @journal */
+static void
+ev_ink_journal_adopt_records (EvInkJournal *journal,
+			      const guint8 *map,
+			      gsize         map_size)
+{
+	const JournalRecord *record;
+	gsize                offset = sizeof (JournalHeader);
+	guint32              base = journal->next_id - 1;
+
+	if (map_size < sizeof (JournalHeader) ||
+	    !header_matches_document ((const JournalHeader *) map, journal->document_filename))
+		return;
+
+	while ((record = get_record (map, map_size, offset))) {
+		JournalRecord *copy;
+
+		offset += record->size;
+
+		copy = (JournalRecord *) ev_ink_journal_reserve (journal, record->size);
+		if (!copy)
+			break;
+
+		memcpy (&copy->id, &record->id, record->size - G_STRUCT_OFFSET (JournalRecord, id));
+		copy->id = base + record->id;
+		copy->checksum = record_checksum ((const guint8 *) &copy->id,
+						  record->size - G_STRUCT_OFFSET (JournalRecord, id));
+		copy->size = record->size;
+		journal->write_offset += record->size;
+		journal->next_id = MAX (journal->next_id, copy->id + 1);
+	}
+
+	ev_ink_journal_schedule_sync (journal);
+}
+
+/* Takes over the journals <@name>.N of the windows that are gone */
+static void
+ev_ink_journal_adopt_orphans (EvInkJournal *journal,
+			      const gchar  *dir,
+			      const gchar  *name)
+{
+	gint i;
+
+	for (i = 1; i < JOURNAL_MAX_INSTANCES; i++) {
+		gchar   *basename;
+		gchar   *filename;
+		GStatBuf st;
+		int      fd;
+
+		basename = g_strdup_printf ("%s.%d", name, i);
+		filename = g_build_filename (dir, basename, NULL);
+		g_free (basename);
+
+		/* Not created by open_locked() when missing */
+		fd = g_file_test (filename, G_FILE_TEST_IS_REGULAR) ? open_locked (filename) : -1;
+		if (fd != -1) {
+			if (fstat (fd, &st) == 0 && st.st_size > 0) {
+				gpointer map;
+
+				map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (map != MAP_FAILED) {
+					ev_ink_journal_adopt_records (journal, (const guint8 *) map,
+								      st.st_size);
+					munmap (map, st.st_size);
+				}
+			}
+			g_unlink (filename);
+			close (fd);
+		}
+		g_free (filename);
+	}
+}
+
+/* Removes the journals that no window has locked and that weren't
+ * written to for JOURNAL_MAX_AGE */
+static void
+trim_journals (const gchar *dirname)
+{
+	GDir        *dir;
+	const gchar *name;
+	gint64       now = g_get_real_time () / G_USEC_PER_SEC;
+
+	dir = g_dir_open (dirname, 0, NULL);
+	if (!dir)
+		return;
+
+	while ((name = g_dir_read_name (dir))) {
+		gchar   *filename;
+		GStatBuf st;
+		int      fd;
+
+		filename = g_build_filename (dirname, name, NULL);
+		if (g_stat (filename, &st) == 0 && S_ISREG (st.st_mode) &&
+		    now - st.st_mtime > JOURNAL_MAX_AGE) {
+			fd = g_open (filename, O_RDWR, 0);
+			if (fd != -1) {
+				if (flock (fd, LOCK_EX | LOCK_NB) == 0)
+					g_unlink (filename);
+				close (fd);
+			}
+		}
+		g_free (filename);
+	}
+	g_dir_close (dir);
+}
+
+/**
+ * ev_ink_journal_new:
+ * @uri: the URI of a local document
+ * @error: a #GError location to store an error, or %NULL
+ *
+ * Opens the journal of the document at @uri, creating it if needed.
+ * When another window has the document open, it gets a journal of
+ * its own. Otherwise, the journals left by other windows are merged
+ * into it.
+ *
+ * Returns: a new #EvInkJournal, or %NULL with @error filled in
+ */
+EvInkJournal *
+ev_ink_journal_new (const gchar *uri,
+		    GError     **error)
+{
+	EvInkJournal *journal;
+	gchar        *document_filename;
+	gchar        *checksum;
+	gchar        *dir;
+	GStatBuf      st;
+	gsize         size;
+	gint          i = 0;
+
+	document_filename = g_filename_from_uri (uri, NULL, NULL);
+	if (!document_filename) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "Only local documents have an ink journal");
+		return NULL;
+	}
+
+	journal = g_object_new (EV_TYPE_INK_JOURNAL, NULL);
+	journal->uri = g_strdup (uri);
+	journal->document_filename = document_filename;
+
+	checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, uri, -1);
+	dir = g_build_filename (g_get_user_cache_dir (), "evince", "ink-journal", NULL);
+	if (g_mkdir_with_parents (dir, 0700) == 0) {
+		for (i = 0; i < JOURNAL_MAX_INSTANCES; i++) {
+			gchar *name;
+
+			name = i == 0 ? g_strdup (checksum) : g_strdup_printf ("%s.%d", checksum, i);
+			g_free (journal->filename);
+			journal->filename = g_build_filename (dir, name, NULL);
+			g_free (name);
+
+			journal->fd = open_locked (journal->filename);
+			if (journal->fd != -1 || errno != EWOULDBLOCK)
+				break;
+		}
+	}
+
+	if (journal->fd == -1 || fstat (journal->fd, &st) == -1) {
+		int errsv = errno;
+
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     "Failed to open ink journal %s: %s",
+			     journal->filename ? journal->filename : dir, g_strerror (errsv));
+		g_free (checksum);
+		g_free (dir);
+		g_object_unref (journal);
+		return NULL;
+	}
+
+	size = MAX ((gsize) st.st_size, JOURNAL_CHUNK_SIZE);
+	size = (size + JOURNAL_CHUNK_SIZE - 1) / JOURNAL_CHUNK_SIZE * JOURNAL_CHUNK_SIZE;
+	if (!ev_ink_journal_map (journal, size)) {
+		int errsv = errno;
+
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     "Failed to map ink journal %s: %s",
+			     journal->filename, g_strerror (errsv));
+		g_free (checksum);
+		g_free (dir);
+		g_object_unref (journal);
+		return NULL;
+	}
+
+	ev_ink_journal_open_records (journal);
+	if (i == 0)
+		ev_ink_journal_adopt_orphans (journal, dir, checksum);
+	trim_journals (dir);
+
+	g_free (checksum);
+	g_free (dir);
+
+	return journal;
+}
+
+/**
+ * ev_ink_journal_get_uri:
+ * @journal: an #EvInkJournal
+ *
+ * Returns: the URI of the document of @journal
+ */
+const gchar *
+ev_ink_journal_get_uri (EvInkJournal *journal)
+{
+	g_return_val_if_fail (EV_IS_INK_JOURNAL (journal), NULL);
+
+	return journal->uri;
+}
+
+/* Makes room for @size bytes at the end of the journal */
+static guint8 *
+ev_ink_journal_reserve (EvInkJournal *journal,
+			gsize         size)
+{
+	gsize needed = journal->write_offset + size;
+
+	if (needed > journal->map_size) {
+		needed = (needed + JOURNAL_CHUNK_SIZE - 1) / JOURNAL_CHUNK_SIZE * JOURNAL_CHUNK_SIZE;
+		if (!ev_ink_journal_map (journal, needed)) {
+			g_warning ("Failed to grow ink journal %s: %s",
+				   journal->filename, g_strerror (errno));
+			return NULL;
+		}
+	}
+
+	return journal->map + journal->write_offset;
+}
+
+static void
+ev_ink_journal_append (EvInkJournal    *journal,
+		       RecordType       type,
+		       guint32          id,
+		       EvAnnotationInk *ink)
+{
+	JournalRecord           *record;
+	GdkColor                 color;
+	gdouble                  width = 0;
+	EvAnnotationInkOperator  op = EV_ANNOTATION_INK_OPERATOR_OVER;
+	const EvPoint           *points = NULL;
+	guint32                 *stroke_lengths;
+	guint                    n_points = 0;
+	guint                    n_strokes = 0;
+	guint                    i;
+
+	if (!journal->map)
+		return;
+
+	if (type != RECORD_REMOVE) {
+		points = ev_annotation_ink_get_points (ink, &n_points);
+		n_strokes = ev_annotation_ink_get_n_strokes (ink);
+	}
+
+	record = (JournalRecord *) ev_ink_journal_reserve (journal, record_size (n_strokes, n_points));
+	if (!record)
+		return;
+
+	record->id = id;
+	record->page = ev_annotation_get_page_index (EV_ANNOTATION (ink));
+	record->type = type;
+	record->n_strokes = n_strokes;
+	record->n_points = n_points;
+
+	if (type != RECORD_REMOVE) {
+		ev_annotation_get_color (EV_ANNOTATION (ink), &color);
+		ev_annotation_ink_get_width (ink, &width);
+		ev_annotation_ink_get_operator (ink, &op);
+
+		record->op = op;
+		record->red = color.red;
+		record->green = color.green;
+		record->blue = color.blue;
+		record->width = width;
+
+		stroke_lengths = (guint32 *) (record + 1);
+		for (i = 0; i < n_strokes; i++)
+			ev_annotation_ink_get_stroke (ink, i, &stroke_lengths[i]);
+		memcpy ((gpointer) record_get_points (record), points, n_points * sizeof (EvPoint));
+	}
+
+	/* The size goes last: it makes the record part of the journal */
+	record->checksum = record_checksum ((const guint8 *) &record->id,
+					    record_size (n_strokes, n_points) - G_STRUCT_OFFSET (JournalRecord, id));
+	record->size = record_size (n_strokes, n_points);
+	journal->write_offset += record->size;
+
+	ev_ink_journal_schedule_sync (journal);
+}
+
+static guint32
+get_annotation_id (EvAnnotationInk *ink)
+{
+	return GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (ink), ev_ink_journal_id_quark));
+}
+
+/**
+ * ev_ink_journal_add:
+ * @journal: an #EvInkJournal
+ * @ink: an #EvAnnotationInk just added to the document
+ *
+ * Records @ink. This only copies it to memory shared with the journal
+ * file, which is written to disk later from another thread.
+ */
+void
+ev_ink_journal_add (EvInkJournal    *journal,
+		    EvAnnotationInk *ink)
+{
+	guint32 id;
+
+	g_return_if_fail (EV_IS_INK_JOURNAL (journal));
+	g_return_if_fail (EV_IS_ANNOTATION_INK (ink));
+
+	id = journal->next_id++;
+	g_object_set_qdata (G_OBJECT (ink), ev_ink_journal_id_quark, GUINT_TO_POINTER (id));
+	ev_ink_journal_append (journal, RECORD_ADD, id, ink);
+}
+
+/**
+ * ev_ink_journal_restore:
+ * @journal: an #EvInkJournal
+ * @ink: an #EvAnnotationInk added back to the document, as when
+ *     undoing its removal
+ *
+ * Records @ink again, under the same id, if it was added with
+ * ev_ink_journal_add() and not saved since. Ink that was in the file
+ * isn't journaled: it would be added twice on recovery.
+ */
+void
+ev_ink_journal_restore (EvInkJournal    *journal,
+			EvAnnotationInk *ink)
+{
+	guint32 id;
+
+	g_return_if_fail (EV_IS_INK_JOURNAL (journal));
+	g_return_if_fail (EV_IS_ANNOTATION_INK (ink));
+
+	id = get_annotation_id (ink);
+	if (id > 0 && id >= journal->first_id)
+		ev_ink_journal_append (journal, RECORD_ADD, id, ink);
+}
+
+/**
+ * ev_ink_journal_modify:
+ * @journal: an #EvInkJournal
+ * @ink: an #EvAnnotationInk whose strokes or style changed
+ *
+ * Records the new state of @ink, if it was added with
+ * ev_ink_journal_add().
+ */
+void
+ev_ink_journal_modify (EvInkJournal    *journal,
+		       EvAnnotationInk *ink)
+{
+	guint32 id;
+
+	g_return_if_fail (EV_IS_INK_JOURNAL (journal));
+	g_return_if_fail (EV_IS_ANNOTATION_INK (ink));
+
+	id = get_annotation_id (ink);
+	if (id >= journal->first_id)
+		ev_ink_journal_append (journal, RECORD_MODIFY, id, ink);
+}
+
+/**
+ * ev_ink_journal_remove:
+ * @journal: an #EvInkJournal
+ * @ink: an #EvAnnotationInk removed from the document
+ *
+ * Records the removal of @ink, if it was added with
+ * ev_ink_journal_add().
+ */
+void
+ev_ink_journal_remove (EvInkJournal    *journal,
+		       EvAnnotationInk *ink)
+{
+	guint32 id;
+
+	g_return_if_fail (EV_IS_INK_JOURNAL (journal));
+	g_return_if_fail (EV_IS_ANNOTATION_INK (ink));
+
+	id = get_annotation_id (ink);
+	if (id >= journal->first_id)
+		ev_ink_journal_append (journal, RECORD_REMOVE, id, ink);
+}
+
+static EvAnnotationInk *
+annotation_from_record (const JournalRecord *record,
+			EvDocument          *document)
+{
+	EvAnnotation *annot;
+	EvPage       *page;
+	EvRectangle   rect;
+	GdkColor      color;
+	const EvPoint *points = record_get_points (record);
+	guint         i;
+
+	page = ev_document_get_page (document, record->page);
+	annot = ev_annotation_ink_new (page);
+	g_object_unref (page);
+
+	color.pixel = 0;
+	color.red = record->red;
+	color.green = record->green;
+	color.blue = record->blue;
+	ev_annotation_set_color (annot, &color);
+	ev_annotation_ink_set_width (EV_ANNOTATION_INK (annot), record->width);
+	ev_annotation_ink_set_operator (EV_ANNOTATION_INK (annot), record->op);
+	ev_annotation_ink_set_points (EV_ANNOTATION_INK (annot),
+				      points, record->n_points,
+				      record_get_stroke_lengths (record), record->n_strokes);
+	g_object_set (annot,
+		      "label", g_get_real_name (),
+		      "opacity", 1.0,
+		      NULL);
+
+	rect.x1 = rect.y1 = G_MAXDOUBLE;
+	rect.x2 = rect.y2 = -G_MAXDOUBLE;
+	for (i = 0; i < record->n_points; i++) {
+		rect.x1 = MIN (rect.x1, points[i].x - record->width);
+		rect.y1 = MIN (rect.y1, points[i].y - record->width);
+		rect.x2 = MAX (rect.x2, points[i].x + record->width);
+		rect.y2 = MAX (rect.y2, points[i].y + record->width);
+	}
+
+	ev_document_annotations_add_annotation (EV_DOCUMENT_ANNOTATIONS (document),
+						annot, &rect);
+
+	return EV_ANNOTATION_INK (annot);
+}
+
+static gint
+compare_ids (gconstpointer a,
+	     gconstpointer b)
+{
+	guint id_a = GPOINTER_TO_UINT (a);
+	guint id_b = GPOINTER_TO_UINT (b);
+
+	return id_a < id_b ? -1 : id_a > id_b;
+}
+
+/**
+ * ev_ink_journal_replay:
+ * @journal: an #EvInkJournal
+ * @document: the document of @journal, just loaded
+ *
+ * Adds the ink in @journal to @document, in its last recorded state,
+ * and compacts the journal to one record per annotation. It has to be
+ * called before @document is shown.
+ *
+ * Returns: the number of annotations added
+ */
+guint
+ev_ink_journal_replay (EvInkJournal *journal,
+		       EvDocument   *document)
+{
+	GHashTable          *states;
+	GList               *ids, *l;
+	GPtrArray           *annots;
+	const JournalRecord *record;
+	gsize                offset = sizeof (JournalHeader);
+	gint                 n_pages;
+	guint                i;
+
+	g_return_val_if_fail (EV_IS_INK_JOURNAL (journal), 0);
+	g_return_val_if_fail (EV_IS_DOCUMENT_ANNOTATIONS (document), 0);
+
+	if (journal->write_offset == sizeof (JournalHeader))
+		return 0;
+
+	/* Only the last state of each annotation matters */
+	states = g_hash_table_new (g_direct_hash, g_direct_equal);
+	n_pages = ev_document_get_n_pages (document);
+	while ((record = ev_ink_journal_get_record (journal, offset))) {
+		offset += record->size;
+
+		if (record->type == RECORD_REMOVE || record->page >= (guint32) n_pages)
+			g_hash_table_remove (states, GUINT_TO_POINTER (record->id));
+		else
+			g_hash_table_insert (states, GUINT_TO_POINTER (record->id), (gpointer) record);
+	}
+
+	ids = g_list_sort (g_hash_table_get_keys (states), compare_ids);
+	annots = g_ptr_array_new_with_free_func (g_object_unref);
+
+	ev_document_lock (document);
+	ev_document_annotations_begin_transaction (EV_DOCUMENT_ANNOTATIONS (document));
+	for (l = ids; l; l = g_list_next (l)) {
+		record = g_hash_table_lookup (states, l->data);
+		g_ptr_array_add (annots, annotation_from_record (record, document));
+	}
+	ev_document_annotations_commit_transaction (EV_DOCUMENT_ANNOTATIONS (document));
+	ev_document_unlock (document);
+
+	g_list_free (ids);
+	g_hash_table_destroy (states);
+
+	/* The records point into the journal, rewritten from here */
+	memset (journal->map + sizeof (JournalHeader), 0,
+		journal->write_offset - sizeof (JournalHeader));
+	journal->write_offset = sizeof (JournalHeader);
+	journal->next_id = 1;
+	journal->first_id = 1;
+	ev_ink_journal_write_header (journal);
+	for (i = 0; i < annots->len; i++)
+		ev_ink_journal_add (journal, g_ptr_array_index (annots, i));
+
+	i = annots->len;
+	g_ptr_array_free (annots, TRUE);
+
+	return i;
+}
+
+/**
+ * ev_ink_journal_get_mark:
+ * @journal: an #EvInkJournal
+ *
+ * Gets the end of the records of @journal, to be passed to
+ * ev_ink_journal_reset() once the document is saved.
+ *
+ * Returns: a mark of the records up to now
+ */
+guint64
+ev_ink_journal_get_mark (EvInkJournal *journal)
+{
+	g_return_val_if_fail (EV_IS_INK_JOURNAL (journal), 0);
+
+	return journal->write_offset;
+}
+
+/**
+ * ev_ink_journal_reset:
+ * @journal: an #EvInkJournal
+ * @mark: a mark from ev_ink_journal_get_mark()
+ *
+ * Drops the records up to @mark, once the document has been saved
+ * with them. The ink they added is then in the file, so the records
+ * after @mark that change it are dropped too, and so are its later
+ * changes.
+ */
+void
+ev_ink_journal_reset (EvInkJournal *journal,
+		      guint64       mark)
+{
+	const JournalRecord *record;
+	GByteArray          *kept;
+	guint32              first_id;
+	gsize                offset = sizeof (JournalHeader);
+
+	g_return_if_fail (EV_IS_INK_JOURNAL (journal));
+
+	if (!journal->map)
+		return;
+
+	/* The mark is lost when the journal was replayed since */
+	while (offset < mark && (record = ev_ink_journal_get_record (journal, offset)))
+		offset += record->size;
+	if (offset != mark)
+		return;
+
+	/* The ids of the ink added after @mark start with the first one */
+	first_id = journal->next_id;
+	for (; (record = ev_ink_journal_get_record (journal, offset)); offset += record->size) {
+		if (record->type == RECORD_ADD) {
+			first_id = record->id;
+			break;
+		}
+	}
+
+	kept = g_byte_array_new ();
+	for (offset = mark; (record = ev_ink_journal_get_record (journal, offset)); offset += record->size) {
+		if (record->id >= first_id)
+			g_byte_array_append (kept, (const guint8 *) record, record->size);
+	}
+
+	memcpy (journal->map + sizeof (JournalHeader), kept->data, kept->len);
+	memset (journal->map + sizeof (JournalHeader) + kept->len, 0,
+		journal->write_offset - sizeof (JournalHeader) - kept->len);
+	journal->write_offset = sizeof (JournalHeader) + kept->len;
+	journal->first_id = first_id;
+	g_byte_array_free (kept, TRUE);
+	ev_ink_journal_write_header (journal);
+
+	ev_ink_journal_schedule_sync (journal);
+}
+
+/**
+ * ev_ink_journal_discard:
+ * @journal: an #EvInkJournal
+ *
+ * Removes the journal file of @journal, when its document is closed
+ * normally. The journals of other windows on the same document are
+ * left alone.
+ */
+void
+ev_ink_journal_discard (EvInkJournal *journal)
+{
+	g_return_if_fail (EV_IS_INK_JOURNAL (journal));
+
+	if (journal->sync_id > 0) {
+		g_source_remove (journal->sync_id);
+		journal->sync_id = 0;
+	}
+	journal->dirty = FALSE;
+
+	g_unlink (journal->filename);
+}
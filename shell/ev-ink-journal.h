@@ -0,0 +1,62 @@
+/* ev-ink-journal.h
+ *  this file is part of evince, a gnome document viewer
+ *
+ * Copyright (C) 2026 The Evince authors
+ *
+ * Evince is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Evince is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef EV_INK_JOURNAL_H
+#define EV_INK_JOURNAL_H
+
+#include <glib-object.h>
+
+#include "ev-document.h"
+#include "ev-annotation.h"
+
+G_BEGIN_DECLS
+
+typedef struct _EvInkJournal      EvInkJournal;
+typedef struct _EvInkJournalClass EvInkJournalClass;
+
+#define EV_TYPE_INK_JOURNAL            (ev_ink_journal_get_type ())
+#define EV_INK_JOURNAL(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), EV_TYPE_INK_JOURNAL, EvInkJournal))
+#define EV_IS_INK_JOURNAL(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), EV_TYPE_INK_JOURNAL))
+#define EV_INK_JOURNAL_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), EV_TYPE_INK_JOURNAL, EvInkJournalClass))
+#define EV_IS_INK_JOURNAL_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), EV_TYPE_INK_JOURNAL))
+#define EV_INK_JOURNAL_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), EV_TYPE_INK_JOURNAL, EvInkJournalClass))
+
+GType         ev_ink_journal_get_type (void) G_GNUC_CONST;
+EvInkJournal *ev_ink_journal_new      (const gchar     *uri,
+				       GError         **error);
+const gchar  *ev_ink_journal_get_uri  (EvInkJournal    *journal);
+guint         ev_ink_journal_replay   (EvInkJournal    *journal,
+				       EvDocument      *document);
+void          ev_ink_journal_add      (EvInkJournal    *journal,
+				       EvAnnotationInk *ink);
+void          ev_ink_journal_restore  (EvInkJournal    *journal,
+				       EvAnnotationInk *ink);
+void          ev_ink_journal_modify   (EvInkJournal    *journal,
+				       EvAnnotationInk *ink);
+void          ev_ink_journal_remove   (EvInkJournal    *journal,
+				       EvAnnotationInk *ink);
+guint64       ev_ink_journal_get_mark (EvInkJournal    *journal);
+void          ev_ink_journal_reset    (EvInkJournal    *journal,
+				       guint64          mark);
+void          ev_ink_journal_discard  (EvInkJournal    *journal);
+
+G_END_DECLS
+
+#endif /* EV_INK_JOURNAL_H */
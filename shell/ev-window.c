@@ -57,6 +57,7 @@
 #include "ev-file-monitor.h"
 #include "ev-history.h"
 #include "ev-image.h"
+#include "ev-ink-journal.h"
 #include "ev-job-scheduler.h"
 #include "ev-jobs.h"
 #include "ev-loading-message.h"
@@ -212,6 +213,12 @@ struct _EvWindowPrivate {
 	EvJob            *thumbnail_job;
 	EvJob            *save_job;
 	EvJob            *find_job;
+	EvJob            *text_index_job;
+
+	/* Unsaved ink, kept for crash recovery */
+	EvInkJournal     *ink_journal;
+	guint64           save_journal_mark;
+	gboolean          applying_history; /* in an undo or redo */
 
 	/* Printing */
 	GQueue           *print_queue;
@@ -256,6 +263,7 @@ struct _EvWindowPrivate {
 #define GS_LAST_DOCUMENT_DIRECTORY "document-directory"
 #define GS_LAST_PICTURES_DIRECTORY "pictures-directory"
 #define GS_ALLOW_LINKS_CHANGE_ZOOM "allow-links-change-zoom"
+#define GS_RENDER_THREADS        "render-threads"
 
 #define SIDEBAR_DEFAULT_SIZE    132
 #define LINKS_SIDEBAR_ID "links"
@@ -374,6 +382,7 @@ static void     ev_window_show_find_bar                 (EvWindow         *ev_wi
 							 gboolean          restart);
 static void     ev_window_close_find_bar                (EvWindow         *ev_window);
 static void     ev_window_clear_find_job                (EvWindow         *ev_window);
+static void     ev_window_clear_text_index_job          (EvWindow         *ev_window);
 static void     ev_window_destroy_recent_view           (EvWindow         *ev_window);
 static void     recent_view_item_activated_cb           (EvRecentView     *recent_view,
                                                          const char       *uri,
@@ -498,6 +507,10 @@ ev_window_update_actions_sensitivity (EvWindow *ev_window)
 				      has_document && !recent_view_mode);
 
         /* Edit menu */
+	ev_window_set_action_enabled (ev_window, "undo", has_pages &&
+				      ev_view_can_undo (view) && !recent_view_mode);
+	ev_window_set_action_enabled (ev_window, "redo", has_pages &&
+				      ev_view_can_redo (view) && !recent_view_mode);
 	ev_window_set_action_enabled (ev_window, "select-all", has_pages &&
 				      can_get_text && !recent_view_mode);
 	ev_window_set_action_enabled (ev_window, "find", can_find &&
@@ -923,6 +936,24 @@ view_selection_changed_cb (EvView   *view,
 					ev_view_get_has_selection (view));
 }
 
+static void
+view_can_undo_changed_cb (EvView     *view,
+			  GParamSpec *pspec,
+			  EvWindow   *window)
+{
+	ev_window_set_action_enabled (window, "undo",
+				      window->priv->document && ev_view_can_undo (view));
+}
+
+static void
+view_can_redo_changed_cb (EvView     *view,
+			  GParamSpec *pspec,
+			  EvWindow   *window)
+{
+	ev_window_set_action_enabled (window, "redo",
+				      window->priv->document && ev_view_can_redo (view));
+}
+
 static void
 view_layers_changed_cb (EvView   *view,
 			EvWindow *window)
@@ -1381,6 +1412,14 @@ allow_links_change_zoom_changed (GSettings *settings,
 	ev_view_set_allow_links_change_zoom (EV_VIEW (ev_window->priv->view), allow_links_change_zoom);
 }
 
+static void
+render_threads_changed (GSettings *settings,
+			gchar     *key,
+			EvWindow  *ev_window)
+{
+	ev_job_scheduler_set_n_threads (g_settings_get_uint (settings, GS_RENDER_THREADS));
+}
+
 static void
 ev_window_setup_default (EvWindow *ev_window)
 {
@@ -1502,6 +1541,10 @@ ev_window_ensure_settings (EvWindow *ev_window)
 			  "changed::"GS_ALLOW_LINKS_CHANGE_ZOOM,
 			  G_CALLBACK (allow_links_change_zoom_changed),
 			  ev_window);
+        g_signal_connect (priv->settings,
+			  "changed::"GS_RENDER_THREADS,
+			  G_CALLBACK (render_threads_changed),
+			  ev_window);
 
         return priv->settings;
 }
@@ -1561,6 +1604,16 @@ ev_window_setup_document (EvWindow *ev_window)
 		g_clear_pointer (&ev_window->priv->search_string, g_free);
 	}
 
+	/* Index the text in the background, so that find doesn't
+	 * need to extract it from the document every time
+	 */
+	ev_window_clear_text_index_job (ev_window);
+	if (EV_IS_DOCUMENT_TEXT (document) &&
+	    !ev_text_index_is_ready (ev_text_index_get_for_document (document))) {
+		ev_window->priv->text_index_job = ev_job_text_index_new (document);
+		ev_job_scheduler_push_job (ev_window->priv->text_index_job, EV_JOB_PRIORITY_NONE);
+	}
+
 	if (EV_WINDOW_IS_PRESENTATION (ev_window))
 		gtk_widget_grab_focus (ev_window->priv->presentation_view);
 	else if (!gtk_widget_get_visible (ev_window->priv->find_bar))
@@ -1710,6 +1763,54 @@ ev_window_handle_link (EvWindow *ev_window,
 	}
 }
 
+/* Adds to @document the ink left unsaved by a previous session of
+ * the document, before it's shown. Returns the number of annotations
+ * restored. */
+static guint
+ev_window_replay_ink_journal (EvWindow   *ev_window,
+			      EvDocument *document)
+{
+	EvWindowPrivate *priv = ev_window->priv;
+	GError          *error = NULL;
+
+	if (priv->ink_journal &&
+	    g_strcmp0 (ev_ink_journal_get_uri (priv->ink_journal), priv->uri) != 0) {
+		ev_ink_journal_discard (priv->ink_journal);
+		g_clear_object (&priv->ink_journal);
+	}
+
+	if (!EV_IS_DOCUMENT_ANNOTATIONS (document) ||
+	    !ev_document_annotations_can_add_annotation (EV_DOCUMENT_ANNOTATIONS (document)))
+		return 0;
+
+	if (!priv->ink_journal) {
+		priv->ink_journal = ev_ink_journal_new (priv->uri, &error);
+		if (!priv->ink_journal) {
+			if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+				g_warning ("%s", error->message);
+			g_error_free (error);
+
+			return 0;
+		}
+	}
+
+	return ev_ink_journal_replay (priv->ink_journal, document);
+}
+
+static void
+ev_window_ink_journal_restored (EvWindow *ev_window,
+				guint     n_annots)
+{
+	if (n_annots == 0)
+		return;
+
+	ev_window_warning_message (ev_window,
+				   ngettext ("%u unsaved ink annotation has been restored",
+					     "%u unsaved ink annotations have been restored",
+					     n_annots),
+				   n_annots);
+}
+
 /* This callback will executed when load job will be finished.
  *
  * Since the flow of the error dialog is very confusing, we assume that both
@@ -1734,7 +1835,11 @@ ev_window_load_job_cb (EvJob *job,
 
 	/* Success! */
 	if (!ev_job_is_failed (job)) {
+		guint n_restored;
+
+		n_restored = ev_window_replay_ink_journal (ev_window, document);
 		ev_document_model_set_document (ev_window->priv->model, document);
+		ev_window_ink_journal_restored (ev_window, n_restored);
 
 #ifdef ENABLE_DBUS
 		ev_window_emit_doc_loaded (ev_window);
@@ -1832,6 +1937,8 @@ static void
 ev_window_reload_job_cb (EvJob    *job,
 			 EvWindow *ev_window)
 {
+	guint n_restored;
+
 	if (ev_job_is_failed (job)) {
 		ev_window_clear_reload_job (ev_window);
 		ev_window->priv->in_reload = FALSE;
@@ -1843,8 +1950,10 @@ ev_window_reload_job_cb (EvJob    *job,
 		return;
 	}
 
+	n_restored = ev_window_replay_ink_journal (ev_window, job->document);
 	ev_document_model_set_document (ev_window->priv->model,
 					job->document);
+	ev_window_ink_journal_restored (ev_window, n_restored);
 	if (ev_window->priv->dest) {
 		ev_window_handle_link (ev_window, ev_window->priv->dest);
 		g_clear_object (&ev_window->priv->dest);
@@ -2848,6 +2957,13 @@ ev_window_save_job_cb (EvJob     *job,
 					 EV_JOB_SAVE (job)->uri);
 	} else {
 		ev_window_add_recent (window, EV_JOB_SAVE (job)->uri);
+
+		/* The ink journaled before the save started is in the
+		 * file now, not what was drawn while it ran */
+		if (window->priv->ink_journal &&
+		    g_strcmp0 (EV_JOB_SAVE (job)->uri, window->priv->uri) == 0)
+			ev_ink_journal_reset (window->priv->ink_journal,
+					      window->priv->save_journal_mark);
 	}
 
 	ev_window_clear_save_job (window);
@@ -2880,6 +2996,9 @@ file_save_dialog_response_cb (GtkWidget *fc,
 	g_signal_connect (ev_window->priv->save_job, "finished",
 			  G_CALLBACK (ev_window_save_job_cb),
 			  ev_window);
+	if (ev_window->priv->ink_journal)
+		ev_window->priv->save_journal_mark =
+			ev_ink_journal_get_mark (ev_window->priv->ink_journal);
 	/* The priority doesn't matter for this job */
 	ev_job_scheduler_push_job (ev_window->priv->save_job, EV_JOB_PRIORITY_NONE);
 
@@ -3879,6 +3998,30 @@ ev_window_cmd_view_zoom (GSimpleAction *action,
 				     zoom * get_screen_dpi (ev_window) / 72.0);
 }
 
+static void
+ev_window_cmd_edit_undo (GSimpleAction *action,
+			 GVariant      *parameter,
+			 gpointer       user_data)
+{
+	EvWindow *ev_window = user_data;
+
+	ev_window->priv->applying_history = TRUE;
+	ev_view_undo (EV_VIEW (ev_window->priv->view));
+	ev_window->priv->applying_history = FALSE;
+}
+
+static void
+ev_window_cmd_edit_redo (GSimpleAction *action,
+			 GVariant      *parameter,
+			 gpointer       user_data)
+{
+	EvWindow *ev_window = user_data;
+
+	ev_window->priv->applying_history = TRUE;
+	ev_view_redo (EV_VIEW (ev_window->priv->view));
+	ev_window->priv->applying_history = FALSE;
+}
+
 static void
 ev_window_cmd_edit_select_all (GSimpleAction *action,
 			       GVariant      *parameter,
@@ -5227,7 +5370,9 @@ ev_window_find_job_finished_cb (EvJobFind *job,
 static inline gboolean
 find_check_refresh_rate (EvJobFind *job, gint page_rate)
 {
-	return ((job->current_page % (gint)((job->n_pages / page_rate) + 1)) == 0);
+	/* Pages are searched out of order, count the reported ones */
+	return ((job->pages_reported % (gint)((job->n_pages / page_rate) + 1)) == 0 ||
+		job->pages_reported == job->n_pages);
 }
 
 static void
@@ -5265,6 +5410,18 @@ ev_window_clear_find_job (EvWindow *ev_window)
 	}
 }
 
+static void
+ev_window_clear_text_index_job (EvWindow *ev_window)
+{
+	if (ev_window->priv->text_index_job != NULL) {
+		if (!ev_job_is_finished (ev_window->priv->text_index_job))
+			ev_job_cancel (ev_window->priv->text_index_job);
+
+		g_object_unref (ev_window->priv->text_index_job);
+		ev_window->priv->text_index_job = NULL;
+	}
+}
+
 static void
 find_bar_previous_cb (EggFindBar *find_bar,
 		      EvWindow   *ev_window)
@@ -5291,12 +5448,15 @@ ev_window_search_start (EvWindow *ev_window)
 {
 	EggFindBar *find_bar = EGG_FIND_BAR (ev_window->priv->find_bar);
 	const char *search_string;
+	EvJob      *previous_job;
 
 	if (!ev_window->priv->document || !EV_IS_DOCUMENT_FIND (ev_window->priv->document))
 		return;
 
 	search_string = egg_find_bar_get_search_string (find_bar);
 
+	/* Keep the results of the previous search to refine them */
+	previous_job = ev_window->priv->find_job ? g_object_ref (ev_window->priv->find_job) : NULL;
 	ev_window_clear_find_job (ev_window);
 	if (search_string && search_string[0]) {
 		EvFindOptions options = EV_FIND_DEFAULT;
@@ -5312,6 +5472,9 @@ ev_window_search_start (EvWindow *ev_window)
 		if (egg_find_bar_get_whole_words_only (find_bar))
 			options |= EV_FIND_WHOLE_WORDS_ONLY;
 		ev_job_find_set_options (EV_JOB_FIND (ev_window->priv->find_job), options);
+		if (previous_job)
+			ev_job_find_refine (EV_JOB_FIND (ev_window->priv->find_job),
+					    EV_JOB_FIND (previous_job));
 
 		ev_view_find_started (EV_VIEW (ev_window->priv->view), EV_JOB_FIND (ev_window->priv->find_job));
 		ev_find_sidebar_start (EV_FIND_SIDEBAR (ev_window->priv->find_sidebar),
@@ -5330,6 +5493,9 @@ ev_window_search_start (EvWindow *ev_window)
 		ev_find_sidebar_clear (EV_FIND_SIDEBAR (ev_window->priv->find_sidebar));
 		gtk_widget_queue_draw (GTK_WIDGET (ev_window->priv->view));
 	}
+
+	if (previous_job)
+		g_object_unref (previous_job);
 }
 
 static void
@@ -5593,6 +5759,11 @@ ev_window_dispose (GObject *object)
 		g_object_unref (priv->monitor);
 		priv->monitor = NULL;
 	}
+
+	if (priv->ink_journal) {
+		ev_ink_journal_discard (priv->ink_journal);
+		g_clear_object (&priv->ink_journal);
+	}
 	
 	if (priv->title) {
 		ev_window_title_free (priv->title);
@@ -5665,6 +5836,10 @@ ev_window_dispose (GObject *object)
 	if (priv->find_job) {
 		ev_window_clear_find_job (window);
 	}
+
+	if (priv->text_index_job) {
+		ev_window_clear_text_index_job (window);
+	}
 	
 	if (priv->local_uri) {
 		ev_window_clear_local_uri (window);
@@ -5803,6 +5978,8 @@ static const GActionEntry actions[] = {
 	{ "print", ev_window_cmd_file_print },
 	{ "show-properties", ev_window_cmd_file_properties },
 	{ "copy", ev_window_cmd_edit_copy },
+	{ "undo", ev_window_cmd_edit_undo },
+	{ "redo", ev_window_cmd_edit_redo },
 	{ "select-all", ev_window_cmd_edit_select_all },
 	{ "save-settings", ev_window_cmd_edit_save_settings },
 	{ "go-previous-page", ev_window_cmd_go_previous_page },
@@ -5917,6 +6094,16 @@ view_annot_added (EvView       *view,
 {
 	ev_sidebar_annotations_annot_added (EV_SIDEBAR_ANNOTATIONS (window->priv->sidebar_annots),
 					    annot);
+
+	if (!window->priv->ink_journal || !EV_IS_ANNOTATION_INK (annot))
+		return;
+
+	/* Only the ink drawn in this session is new, undo and redo add
+	 * back ink that may have been loaded from the file */
+	if (window->priv->applying_history)
+		ev_ink_journal_restore (window->priv->ink_journal, EV_ANNOTATION_INK (annot));
+	else
+		ev_ink_journal_add (window->priv->ink_journal, EV_ANNOTATION_INK (annot));
 }
 
 static void
@@ -5925,6 +6112,18 @@ view_annot_removed (EvView       *view,
 		    EvWindow     *window)
 {
 	ev_sidebar_annotations_annot_removed (EV_SIDEBAR_ANNOTATIONS (window->priv->sidebar_annots));
+
+	if (window->priv->ink_journal && EV_IS_ANNOTATION_INK (annot))
+		ev_ink_journal_remove (window->priv->ink_journal, EV_ANNOTATION_INK (annot));
+}
+
+static void
+view_annot_changed (EvView       *view,
+		    EvAnnotation *annot,
+		    EvWindow     *window)
+{
+	if (window->priv->ink_journal && EV_IS_ANNOTATION_INK (annot))
+		ev_ink_journal_modify (window->priv->ink_journal, EV_ANNOTATION_INK (annot));
 }
 
 static void
@@ -6346,10 +6545,10 @@ image_save_dialog_response_cb (GtkWidget *fc,
                         goto has_error;
 	}
 
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (ev_window->priv->document);
 	pixbuf = ev_document_images_get_image (EV_DOCUMENT_IMAGES (ev_window->priv->document),
 					       ev_window->priv->image);
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (ev_window->priv->document);
 
 	file_format = gdk_pixbuf_format_get_name (format);
 	gdk_pixbuf_save (pixbuf, filename, file_format, &error, NULL);
@@ -6437,10 +6636,10 @@ ev_window_popup_cmd_copy_image (GSimpleAction *action,
 	
 	clipboard = gtk_widget_get_clipboard (GTK_WIDGET (window),
 					      GDK_SELECTION_CLIPBOARD);
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (window->priv->document);
 	pixbuf = ev_document_images_get_image (EV_DOCUMENT_IMAGES (window->priv->document),
 					       window->priv->image);
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (window->priv->document);
 	
 	gtk_clipboard_set_image (clipboard, pixbuf);
 	g_object_unref (pixbuf);
@@ -6472,6 +6671,8 @@ ev_window_popup_cmd_annot_properties (GSimpleAction *action,
 	}
 
 	/* Set annotations changes */
+	ev_view_begin_annotation_change (EV_VIEW (window->priv->view), annot);
+
 	author = ev_annotation_properties_dialog_get_author (dialog);
 	if (ev_annotation_markup_set_label (EV_ANNOTATION_MARKUP (annot), author))
 		mask |= EV_ANNOTATIONS_SAVE_LABEL;
@@ -6504,16 +6705,8 @@ ev_window_popup_cmd_annot_properties (GSimpleAction *action,
 			mask |= EV_ANNOTATIONS_SAVE_TEXT_MARKUP_TYPE;
 	}
 
-	if (mask != EV_ANNOTATIONS_SAVE_NONE) {
-		ev_document_doc_mutex_lock ();
-		ev_document_annotations_save_annotation (EV_DOCUMENT_ANNOTATIONS (window->priv->document),
-							 window->priv->annot,
-							 mask);
-		ev_document_doc_mutex_unlock ();
-
-		/* FIXME: update annot region only */
-		ev_view_reload (EV_VIEW (window->priv->view));
-	}
+	/* Saves the changes and makes them undoable */
+	ev_view_end_annotation_change (EV_VIEW (window->priv->view), annot, mask);
 
 	gtk_widget_destroy (GTK_WIDGET (dialog));
 }
@@ -7076,6 +7269,8 @@ ev_window_init (EvWindow *ev_window)
 				     GS_ALLOW_LINKS_CHANGE_ZOOM);
 	ev_view_set_allow_links_change_zoom (EV_VIEW (ev_window->priv->view),
 				     allow_links_change_zoom);
+	ev_job_scheduler_set_n_threads (g_settings_get_uint (ev_window_ensure_settings (ev_window),
+							     GS_RENDER_THREADS));
 	ev_view_set_model (EV_VIEW (ev_window->priv->view), ev_window->priv->model);
 
 	ev_window->priv->password_view = ev_password_view_new (GTK_WINDOW (ev_window));
@@ -7104,6 +7299,15 @@ ev_window_init (EvWindow *ev_window)
 	g_signal_connect_object (ev_window->priv->view, "annot-removed",
 				 G_CALLBACK (view_annot_removed),
 				 ev_window, 0);
+	g_signal_connect_object (ev_window->priv->view, "annot-changed",
+				 G_CALLBACK (view_annot_changed),
+				 ev_window, 0);
+	g_signal_connect_object (ev_window->priv->view, "notify::can-undo",
+				 G_CALLBACK (view_can_undo_changed_cb),
+				 ev_window, 0);
+	g_signal_connect_object (ev_window->priv->view, "notify::can-redo",
+				 G_CALLBACK (view_can_redo_changed_cb),
+				 ev_window, 0);
 	g_signal_connect_object (ev_window->priv->view, "layers-changed",
 				 G_CALLBACK (view_layers_changed_cb),
 				 ev_window, 0);
@@ -197,11 +197,11 @@ evince_thumbnail_pngenc_get (EvDocument *document, const char *thumbnail, int si
 static gpointer
 evince_thumbnail_pngenc_get_async (struct AsyncData *data)
 {
-	ev_document_doc_mutex_lock ();
+	ev_document_lock (data->document);
 	data->success = evince_thumbnail_pngenc_get (data->document,
 						     data->output,
 						     data->size);
-	ev_document_doc_mutex_unlock ();
+	ev_document_unlock (data->document);
 	
 	g_idle_add ((GSourceFunc)gtk_main_quit, NULL);
 	